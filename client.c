@@ -110,6 +110,41 @@ print_pbar(void* p)
 }
 
 
+/*
+ * Upload the file in a session over UPLOAD_STRIPES connections. Reconnect 
+ * and continue from where the server is if the connection is lost.
+ */
+static int
+resume_upload(const char *file_path, int64_t flen, enum ACCESS_LEVEL alv)
+{
+	char sid[SESSION_ID_LEN] = {'\0', };
+	int result = -1;
+
+	for (int retry = 0; retry < UPLOAD_RETRY_MAX; retry++) {
+		struct trans_stat rate = { 0, 0 };
+		pthread_t pbar_worker = 0;
+		pthread_create(&pbar_worker, NULL, print_pbar, (void *)&rate);
+
+		g_client_status.ltx = TX_SUCCESSED;
+		result = client_striped_upload_service(g_servsock, &g_client_status.sa, file_path, flen, 
+				alv, UPLOAD_STRIPES, sid, &rate);
+
+		pthread_join(pbar_worker, NULL);
+
+		if (0 == result || '\0' == sid[0])
+			break;
+		// Session is still alive on the server.
+		if (TX_FAILED == g_client_status.ltx) {
+			disconnect();
+			if (connect_server() < 0)
+				break;
+		}
+		usleep(1000 * 1000);
+	}
+
+	return result;
+}
+
 static void
 upload_service()
 {
@@ -139,13 +174,28 @@ upload_service()
 	
 	// Send request.
 	int64_t flen = sizeof_file(file_path);
-	struct trans_stat rate = { 0, 0 };
-	pthread_t pbar_worker = 0;
-	pthread_create(&pbar_worker, NULL, print_pbar, (void *)&rate);
+	int result = 0;
+	if (flen < RESUMABLE_UPLOAD_MIN) {
+		struct trans_stat rate = { 0, 0 };
+		pthread_t pbar_worker = 0;
+		pthread_create(&pbar_worker, NULL, print_pbar, (void *)&rate);
 
-	int result = client_upload_service(g_servsock, file_path, flen, alv, &rate);
+		result = client_upload_service(g_servsock, file_path, flen, alv, &rate);
 
-	pthread_join(pbar_worker, NULL);
+		pthread_join(pbar_worker, NULL);
+	} else {
+		result = resume_upload(file_path, flen, alv);
+	}
+	// Replace the existing file by sending only the changes.
+	if (result < 0 && RESP_DUPLICATED == svc_errcode()) {
+		struct trans_stat rate = { 0, 0 };
+		pthread_t pbar_worker = 0;
+		pthread_create(&pbar_worker, NULL, print_pbar, (void *)&rate);
+
+		result = client_delta_upload_service(g_servsock, file_path, flen, &rate);
+
+		pthread_join(pbar_worker, NULL);
+	}
 
 	if (result < 0) {
 		set_status_msg(STAT_BAR_HIGHLIGHT, svc_errstr());
@@ -164,7 +214,12 @@ download_service(struct inven_item *item)
 	pthread_t pbar_worker = 0;
 	pthread_create(&pbar_worker, NULL, print_pbar, (void *)&rate);
 
-	int result = client_download_service(g_servsock, item, &rate);
+	int result = 0;
+	if (ITEM_STAT_MODIFYING == atoi(item->status))
+		result = client_follow_download_service(g_servsock, item, &rate);
+	else
+		result = client_parallel_download_service(g_servsock, &g_client_status.sa, item, 
+				DOWNLOAD_STREAMS, &rate);
 
 	pthread_join(pbar_worker, NULL);
 
@@ -297,10 +352,10 @@ init_sighandler()
 static int
 check_usage(int argc, const char *argv[])
 {
-	char usage[64] = {0, };
-	snprintf(usage, 64, "Usage: %s [server ip] [port number]\n", argv[0]);
+	char usage[96] = {0, };
+	snprintf(usage, 96, "Usage: %s [server ip] [port number] [compression]\n", argv[0]);
 
-	if (3 != argc) {
+	if (3 != argc && 4 != argc) {
 		fputs(usage, stdout);
 		return -1;
 	}
@@ -320,6 +375,10 @@ main(int argc, const char* argv[])
 		return 1;
 #endif // _TEST_
 
+	// 0: none, 1: fast, 2: high ratio
+	if (argc > 3)
+		set_svc_compression(atoi(argv[3]));
+
 	// Connect to the server
 	init_serveraddr(argv);
 	if (connect_server() < 0) {
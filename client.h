@@ -19,6 +19,16 @@
 #define LOGO_ROW_NUM				4
 #define DOWNLOAD_HOME_LEN			10
 #define DOWNLOAD_HOME_STR			"Downloads"
+#define PART_SUFFIX_STR				".part"		// Partially downloaded file.
+#define PART_SUFFIX_LEN				5
+#define MAP_SUFFIX_STR				".map"		// Ranges of a parallel download.
+#define MAP_SUFFIX_LEN				4
+#define RESUMABLE_UPLOAD_MIN		(16 * 1024 * 1024)	// Bigger files are uploaded in a session.
+#define UPLOAD_RETRY_MAX			5
+#define UPLOAD_STRIPES				4		// Connections per resumable upload.
+#define DOWNLOAD_STREAMS			4		// Connections per download.
+#define UPLOAD_DURABILITY			DURABILITY_DEFAULT	// Let the server decide.
+#define TRANSFER_COMPRESSION		COMPRESS_FAST		// Data that doesn't compress is sent as is.
 
 typedef unsigned int nnum;		// Natural number.
 
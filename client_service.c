@@ -3,6 +3,8 @@
 #include "module/timeutil.h"
 #include "module/hashmap.h"
 #include "module/queue.h"
+#include "module/delta.h"
+#include "module/sha256.h"
 
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -13,34 +15,76 @@
 #include <sys/mman.h>
 
 #define SERVER_RESP_TIMEOUT		5
+#define UPLOAD_CHUNK_SIZE		(64 * 1024 * 1024)
+#define UPLOAD_PROGRESS_STEP	(1024 * 1024)
+#define DOWNLOAD_BUF_SIZE		(64 * 1024)
+#define MAX_STRIPES_LIMIT		16
+#define MAX_STREAMS_LIMIT		16
+#define DOWNLOAD_PROGRESS_STEP	(1024 * 1024)
+#define DOWNLOAD_RANGE_MIN		(8 * 1024 * 1024)	// Smaller files are not split.
+#define LIST_PAGE_SIZE			256		// Items per SVC_LIST request.
+#define CHANGE_PAGE_SIZE		512		// Changes per SVC_CHANGES request.
 
 extern struct client_status g_client_status;
 extern struct inven_item *g_items;
 char svc_errinfo[ERRSTR_LEN];
+static int svc_respcode = 0;		// Response code of the last refusal.
+static enum COMPRESS_TYPE svc_compression = TRANSFER_COMPRESSION;
+// Inventory version of g_items. 0: g_items is not synced.
+static unsigned long long inven_version = 0;
+static size_t inven_capacity = 0;
+static struct list_filter inven_filter;
+static int inven_filtered = 0;
 
-static int
-send_svc_req(int sockfd, const char *path, int64_t flen,  enum ACCESS_LEVEL alv, enum SERVICE_TYPE type)
+static void
+set_svc_req(struct svc_req *req, const char *path, int64_t flen,  enum ACCESS_LEVEL alv, enum SERVICE_TYPE type)
 {
-	struct svc_req req;
-	memset(&req, 0x00, sizeof(struct svc_req));
+	memset(req, 0x00, sizeof(struct svc_req));
+	svc_respcode = 0;
 
-	if (SVC_INQUIRY == type)
+	if (SVC_INQUIRY == type || SVC_LIST == type || SVC_CHANGES == type || SVC_SUBSCRIBE == type)
 		goto inquiry_req;
 
-	int64_t slen = 0;
-	char *fname = strrchr(path, '/');
+	const char *fname = strrchr(path, '/');
 	if (NULL == fname)
 		fname = path;
 	else
 		fname += sizeof(char);
 
-	strncpy(req.fname, fname, FILE_NAME_LEN);
-	snprintf(req.flen, REQ_FLEN_LEN, "%ld", flen);
-	snprintf(req.alv, REQ_ALV_LEN, "%d", alv);
+	strncpy(req->fname, fname, FILE_NAME_LEN);
+	snprintf(req->flen, REQ_FLEN_LEN, "%ld", flen);
+	snprintf(req->alv, REQ_ALV_LEN, "%d", alv);
+	snprintf(req->durability, REQ_DURABILITY_LEN, "%d", UPLOAD_DURABILITY);
 inquiry_req:
-	snprintf(req.type, SVC_TYPE_LEN, "%d", type);
+	snprintf(req->type, SVC_TYPE_LEN, "%d", type);
+	snprintf(req->compress, REQ_COMPRESS_LEN, "%d", svc_compression);
+	if (inven_filtered && SVC_INQUIRY != type)
+		snprintf(req->filter, REQ_FILTER_LEN, "%d", 1);
+}
+
+/*
+ * Send a request of the inventory with the filter if it has one.
+ */
+static int64_t
+send_inven_req(int sockfd, struct svc_req *req)
+{
+	char msg[sizeof(struct svc_req) + sizeof(struct list_filter)];
+	size_t len = sizeof(struct svc_req);
+	memcpy(msg, req, sizeof(struct svc_req));
+	if (1 == atoi(req->filter)) {
+		memcpy(msg + len, &inven_filter, sizeof(struct list_filter));
+		len += sizeof(struct list_filter);
+	}
+	return send_stream(sockfd, msg, len);
+}
+
+static int
+send_svc_req(int sockfd, const char *path, int64_t flen,  enum ACCESS_LEVEL alv, enum SERVICE_TYPE type)
+{
+	struct svc_req req;
+	set_svc_req(&req, path, flen, alv, type);
 
-	slen = send_stream(sockfd, &req, sizeof(struct svc_req));
+	int64_t slen = send_stream(sockfd, &req, sizeof(struct svc_req));
 	 if (slen < 0) {
 		 strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
 		 return -1;
@@ -48,41 +92,129 @@ inquiry_req:
 	 return 0;
 }
 
+/*
+ * @param timeout - Seconds to wait for the response. 0 waits forever.
+ */
 static int
-send_file(int sockfd, const char *path, int64_t flen, struct trans_stat *rate)
+recv_svc_resp(int sockfd, struct svc_resp *resp, int timeout)
 {
-	int64_t dlen = 0;// Size of data to send in bytes.
-	int64_t slen = 0;// Size of data sent in bytes.
+	if (set_socket_timeout(sockfd, timeout) < 0) {
+		strncpy(svc_errinfo, "[set_socket_timeout]", ERRSTR_LEN);
+		return -1;
+	}
+	if (recv(sockfd, resp, sizeof(struct svc_resp), MSG_WAITALL) != sizeof(struct svc_resp)) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno) 
+			strncpy(svc_errinfo, "Server is busy.", ERRSTR_LEN);
+		else
+			strncpy(svc_errinfo, "[recv]", ERRSTR_LEN);
+		return -1;
+	}
+	return 0;
+}
 
-	void *data = malloc(flen);
-	if (NULL == data) {
-		 strncpy(svc_errinfo, "[malloc]", ERRSTR_LEN);
-		 return -1;
+static void
+set_resp_errstr(int resp_code)
+{
+	svc_respcode = resp_code;
+	if (RESP_DUPLICATED == resp_code)
+		strncpy(svc_errinfo, "File name already exists.", ERRSTR_LEN);
+	else if (RESP_OUT_OF_DISK == resp_code)
+		strncpy(svc_errinfo, "Server out of disk space.", ERRSTR_LEN);
+	else if (RESP_OUT_OF_MEMORY == resp_code)
+		strncpy(svc_errinfo, "Server out of memory.", ERRSTR_LEN);
+	else if (RESP_INVENTORY_FULL == resp_code)
+		strncpy(svc_errinfo, "Server inventory is full", ERRSTR_LEN);
+	else if (RESP_NO_SUCH_SESSION == resp_code)
+		strncpy(svc_errinfo, "Upload session expired.", ERRSTR_LEN);
+	else if (RESP_MODIFYING == resp_code)
+		strncpy(svc_errinfo, "Upload session is busy. Try again later.", ERRSTR_LEN);
+	else if (RESP_CHECKSUM_MISMATCH == resp_code)
+		strncpy(svc_errinfo, "The file was corrupted in transit.", ERRSTR_LEN);
+	else if (RESP_VERSION_EXPIRED == resp_code)
+		strncpy(svc_errinfo, "File inventory is out of date.", ERRSTR_LEN);
+	else if (RESP_TOO_MANY_SUBSCRIBERS == resp_code)
+		strncpy(svc_errinfo, "Too many subscribers.", ERRSTR_LEN);
+	else
+		snprintf(svc_errinfo, ERRSTR_LEN, "Unknown error(%d).", resp_code);
+}
+
+/*
+ * @return - Compression the server chose for the data of the transfer.
+ */
+static enum COMPRESS_TYPE
+resp_compression(struct svc_resp *resp)
+{
+	int type = atoi(resp->compress);
+	return (type > COMPRESS_NONE && type < COMPRESS_NUM) ? type : COMPRESS_NONE;
+}
+
+/*
+ * Send [offset, offset + dlen) of the file, compressed if enc is given.
+ *
+ * @param buf - CZ_STREAM_BUF_SIZE bytes if enc is given.
+ */
+static int64_t
+send_file_range(int sockfd, int fd, int64_t offset, int64_t dlen, struct cz_encoder *enc, 
+		void *buf, struct trans_stat *rate)
+{
+	if (NULL != enc)
+		return send_compressed_stream(sockfd, fd, offset, dlen, enc, buf, rate);
+	return sendfile_stream(sockfd, fd, offset, dlen, rate);
+}
+
+/*
+ * Create the encoder and the buffer of a compressed transfer.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+static int
+open_encoder(enum COMPRESS_TYPE type, struct cz_encoder *enc, void **buf)
+{
+	*buf = malloc(CZ_STREAM_BUF_SIZE);
+	if (NULL == *buf || init_cz_encoder(enc, type) < 0) {
+		free(*buf);
+		*buf = NULL;
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		return -1;
 	}
+	return 0;
+}
 
-	dlen = read_file(path, data, flen);
-	if (dlen < 0) {
-		strncpy(svc_errinfo, "[read_file]", ERRSTR_LEN);
-		goto futil_err;
+static void
+close_encoder(struct cz_encoder *enc, void *buf)
+{
+	if (NULL == buf)
+		return;
+	destruct_cz_encoder(enc);
+	free(buf);
+}
+
+static int
+send_file(int sockfd, const char *path, int64_t flen, enum COMPRESS_TYPE compress, 
+		struct trans_stat *rate)
+{
+	struct cz_encoder enc;
+	void *buf = NULL;
+	int fd = open_file_fd(path);
+	if (fd < 0) {
+		strncpy(svc_errinfo, futil_errstr(fd), ERRSTR_LEN);
+		return -1;
+	}
+	// The server waits for the data. Failing here breaks the connection.
+	if (COMPRESS_NONE != compress && open_encoder(compress, &enc, &buf) < 0) {
+		close(fd);
+		return -1;
 	}
 
-	slen = send_stream_nblock(sockfd, data, flen, rate);
+	int64_t slen = send_file_range(sockfd, fd, 0, flen, (NULL != buf) ? &enc : NULL, buf, rate);
+	close_encoder(&enc, buf);
+	close(fd);
 	if (slen < 0) {
 		strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
-		goto sockutil_err;
+		return -1;
 	}
 
-	free(data);
-
 	return 0;
-
-futil_err:
-	free(data);
-	return -1;
-
-sockutil_err:
-	free(data);
-	return -1;
 }
 
 char *
@@ -91,6 +223,34 @@ svc_errstr()
 	return svc_errinfo; 
 }
 
+/*
+ * @return - enum RESPONSE_CODE of the last refused request, 0 if none.
+ */
+int
+svc_errcode(void)
+{
+	return svc_respcode;
+}
+
+/*
+ * Compression asked for the following transfers. The server may refuse it.
+ */
+void
+set_svc_compression(enum COMPRESS_TYPE type)
+{
+	svc_compression = (type >= COMPRESS_NONE && type < COMPRESS_NUM) ? type : COMPRESS_NONE;
+}
+
+void
+set_inven_filter(const struct list_filter *filter)
+{
+	inven_filtered = (NULL != filter);
+	if (NULL != filter)
+		inven_filter = *filter;
+	// The items of the old filter can't be updated by the changes.
+	inven_version = 0;
+}
+
 int 
 client_upload_service(int sockfd, const char *path, 
 		int64_t flen, enum ACCESS_LEVEL alv, 
@@ -121,6 +281,7 @@ client_upload_service(int sockfd, const char *path,
 	}
 
 	int resp_code = atoi(resp.code);
+	svc_respcode = resp_code;
 	if (RESP_DUPLICATED == resp_code) {
 		strncpy(svc_errinfo, "File name already exists.", ERRSTR_LEN);
 		goto request_refused;
@@ -140,7 +301,7 @@ client_upload_service(int sockfd, const char *path,
 		goto request_refused;
 	}
 
-	if (send_file(sockfd, path, flen, rate) < 0)
+	if (send_file(sockfd, path, flen, resp_compression(&resp), rate) < 0)
 		goto tx_failed;
 
 	/*
@@ -193,152 +354,1316 @@ request_refused:
 	return -1;
 }
 
+struct delta_sender {
+	int sockfd;
+	struct trans_stat *rate;
+	int64_t literal;			// Bytes of the literal data sent.
+	int64_t done;				// Bytes of the new version encoded.
+	size_t block_size;
+	int64_t base_len;
+};
+
+static int
+send_delta_op(void *arg, const struct delta_op *op, const uint8_t *data)
+{
+	struct delta_sender *s = (struct delta_sender *)arg;
+	struct delta_op nop = *op;
+	delta_op_hton(&nop);
+	if (send_stream(s->sockfd, &nop, sizeof(nop)) < 0)
+		return -1;
+	if (DELTA_OP_DATA == op->type) {
+		if (send_stream(s->sockfd, (void *)data, op->arg) < 0)
+			return -1;
+		s->literal += op->arg;
+		s->done += op->arg;
+	} else if (DELTA_OP_COPY == op->type) {
+		int64_t end = (int64_t)(op->arg + op->count) * s->block_size;
+		s->done += ((end < s->base_len) ? end : s->base_len) - (int64_t)op->arg * s->block_size;
+	}
+	if (NULL != s->rate)
+		s->rate->transmitted = s->done;
+	return 0;
+}
+
+static void
+set_delta_errstr(int resp_code)
+{
+	svc_respcode = resp_code;
+	if (RESP_NO_SUCH_FILE == resp_code || RESP_DELETED == resp_code)
+		strncpy(svc_errinfo, "The file could not be found.", ERRSTR_LEN);
+	else if (RESP_ACCESS_DENIED == resp_code)
+		strncpy(svc_errinfo, "The file belongs to another client.", ERRSTR_LEN);
+	else if (RESP_MODIFYING == resp_code)
+		strncpy(svc_errinfo, "The file is being modified.", ERRSTR_LEN);
+	else if (RESP_INVALID_OFFSET == resp_code)
+		strncpy(svc_errinfo, "The server refused the delta.", ERRSTR_LEN);
+	else
+		set_resp_errstr(resp_code);
+}
+
+/*
+ * Receive the signatures of the server's version of the file.
+ *
+ * @return - Success: signatures(free by the caller), Fail: NULL
+ */
+static struct delta_sig *
+recv_delta_signatures(int sockfd, size_t nsigs)
+{
+	struct delta_sig *sigs = (struct delta_sig *) malloc((nsigs > 0 ? nsigs : 1) * sizeof(struct delta_sig));
+	if (NULL == sigs) {
+		strncpy(svc_errinfo, "[malloc] Out of memory", ERRSTR_LEN);
+		return NULL;
+	}
+	size_t total = nsigs * sizeof(struct delta_sig);
+	size_t rlen = 0;
+	while (rlen < total) {
+		ssize_t n = recv(sockfd, (char *)sigs + rlen, total - rlen, 0);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0) {
+			strncpy(svc_errinfo, "[recv] signatures", ERRSTR_LEN);
+			free(sigs);
+			return NULL;
+		}
+		rlen += n;
+	}
+	for (size_t i = 0; i < nsigs; i++)
+		delta_sig_ntoh(&sigs[i]);
+	return sigs;
+}
+
+/*
+ * Replace the file on the server with the local version. Only the data the
+ * server's version doesn't have is sent. The file must be uploaded by this
+ * client.
+ */
 int
-client_inquiry_service(int sockfd, struct trans_stat *rate)
+client_delta_upload_service(int sockfd, const char *path, int64_t flen, struct trans_stat *rate)
 {
-	int result = 0;
-	int64_t dlen = 0;
+	struct svc_resp resp;
+	struct delta_index idx;
+	struct delta_sig *sigs = NULL;
+	char hex[SHA256_HEX_LEN];
+	uint8_t *data = NULL;
+	int result = -1;
 
-	// Send svc_req.
-	if (send_svc_req(sockfd, NULL, 0, 0, SVC_INQUIRY) < 0) {
-		strncpy(svc_errinfo, "[send_svc_req]", ERRSTR_LEN);
+	int fd = open_file_fd(path);
+	if (fd < 0) {
+		strncpy(svc_errinfo, futil_errstr(fd), ERRSTR_LEN);
+		goto request_refused;
+	}
+	if (flen > 0) {
+		data = (uint8_t *) mmap(NULL, flen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == data) {
+			strncpy(svc_errinfo, "[mmap]", ERRSTR_LEN);
+			close(fd);
+			goto request_refused;
+		}
+		madvise(data, flen, MADV_SEQUENTIAL);
+	}
+	if (sha256_fd(fd, flen, hex) < 0) {
+		strncpy(svc_errinfo, "[sha256_fd]", ERRSTR_LEN);
+		goto close_file;
+	}
+
+	if (send_svc_req(sockfd, path, flen, PUBLIC_ACCES, SVC_UPLOAD_DELTA) < 0)
+		goto tx_failed;
+	printf("\033[2K\033[GWait...");
+	fflush(stdout);
+	// The server reads its version to make the signatures.
+	if (recv_svc_resp(sockfd, &resp, 0) < 0)
 		goto tx_failed;
+	int resp_code = atoi(resp.code);
+	if (RESP_OK != resp_code) {
+		set_delta_errstr(resp_code);
+		goto close_file;
 	}
 
-	if (set_socket_timeout(sockfd, SERVER_RESP_TIMEOUT) < 0) {
-		strncpy(svc_errinfo, "[set_socket_timeout]", ERRSTR_LEN);
+	struct delta_sender s = { sockfd, rate, 0, 0, 0, 0 };
+	s.base_len = strtoll(resp.flen, NULL, 10);
+	s.block_size = strtoll(resp.offset, NULL, 10);
+	if (s.base_len < 0 || s.block_size < DELTA_BLOCK_MIN || s.block_size > DELTA_BLOCK_MAX) {
+		strncpy(svc_errinfo, "[delta_upload_service] Invalid block size.", ERRSTR_LEN);
+		goto tx_failed;
+	}
+	size_t nsigs = (s.base_len + s.block_size - 1) / s.block_size;
+	sigs = recv_delta_signatures(sockfd, nsigs);
+	if (NULL == sigs)
+		goto tx_failed;
+	if (init_delta_index(&idx, sigs, nsigs, s.block_size, s.base_len) < 0) {
+		strncpy(svc_errinfo, "[malloc] Out of memory", ERRSTR_LEN);
 		goto tx_failed;
 	}
 
-	// Receive svc_resp
-	struct svc_resp resp;
-	if (recv(sockfd, &resp, sizeof(struct svc_resp), 0) < 0) {
-		if (EAGAIN == errno || EWOULDBLOCK == errno) 
-			strncpy(svc_errinfo, "Server is busy.", ERRSTR_LEN);
-		else
-			strncpy(svc_errinfo, "[recv]", ERRSTR_LEN);
+	if (NULL != rate) {
+		rate->total = flen;
+		rate->transmitted = 0;
+	}
+	struct delta_op end = { DELTA_OP_END, 0, (uint64_t)flen };
+	int encoded = delta_encode(&idx, data, flen, send_delta_op, &s);
+	destruct_delta_index(&idx);
+	if (encoded < 0 || send_delta_op(&s, &end, NULL) < 0
+			|| send_stream(sockfd, hex, SHA256_HEX_LEN - 1) < 0) {
+		strncpy(svc_errinfo, "[send] delta", ERRSTR_LEN);
 		goto tx_failed;
 	}
 
-	dlen = strtoll(resp.code, NULL, 10);
-	if (NULL == g_items) {
-		g_items = (struct inven_item *) malloc(dlen);
-		if (NULL == g_items){
-			strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+	printf("\033[2K\033[GServer processing...");
+	fflush(stdout);
+	if (recv_svc_resp(sockfd, &resp, 0) < 0)
+		goto tx_failed;
+	resp_code = atoi(resp.code);
+	if (RESP_OK != resp_code) {
+		set_delta_errstr(resp_code);
+		goto close_file;
+	}
+	if (NULL != rate)
+		rate->transmitted = flen;
+	result = 0;
+	goto close_file;
+
+tx_failed:
+	g_client_status.ltx = TX_FAILED;
+close_file:
+	free(sigs);
+	if (NULL != data)
+		munmap(data, flen);
+	close(fd);
+request_refused:
+	if (result < 0 && NULL != rate)
+		rate->transmitted = -1;
+	return result;
+}
+
+/*
+ * Open a new session(sid is empty) or query the stripe of the session
+ * containing offset.
+ *
+ * @return - Success: resp code, resp is set. Fail: -1(connection lost)
+ */
+static int
+request_upload_session(int sockfd, const char *path, int64_t flen, enum ACCESS_LEVEL alv, 
+		const char *sid, int nstripes, int64_t offset, struct svc_resp *resp)
+{
+	struct svc_req req;
+	set_svc_req(&req, path, flen, alv, SVC_UPLOAD_SESSION);
+	strncpy(req.sid, sid, SESSION_ID_LEN);
+	snprintf(req.stripes, REQ_STRIPES_LEN, "%d", nstripes);
+	snprintf(req.offset, REQ_FLEN_LEN, "%ld", offset);
+	if (send_stream(sockfd, &req, sizeof(struct svc_req)) < 0) {
+		strncpy(svc_errinfo, "[send_svc_req]", ERRSTR_LEN);
+		return -1;
+	}
+	if (recv_svc_resp(sockfd, resp, SERVER_RESP_TIMEOUT) < 0)
+		return -1;
+	return atoi(resp->code);
+}
+
+/*
+ * Send [offset, end) of the file in the session, UPLOAD_CHUNK_SIZE bytes per 
+ * SVC_UPLOAD_CHUNK request. rate->transmitted is shared by the stripes.
+ *
+ * @return - Success: 0, Fail: -1(g_client_status.ltx is TX_FAILED if the 
+ * 			 connection is lost)
+ */
+static int
+send_upload_chunks(int sockfd, int fd, const char *path, enum ACCESS_LEVEL alv,
+		const char *sid, int64_t offset, int64_t end, struct trans_stat *rate)
+{
+	struct svc_req req;
+	struct svc_resp resp;
+	struct cz_encoder enc;
+	void *buf = NULL;
+	int resp_code = 0;
+
+	while (offset < end) {
+		int64_t clen = (end - offset < UPLOAD_CHUNK_SIZE) ? end - offset : UPLOAD_CHUNK_SIZE;
+		set_svc_req(&req, path, clen, alv, SVC_UPLOAD_CHUNK);
+		strncpy(req.sid, sid, SESSION_ID_LEN);
+		if (snprintf(req.offset, REQ_FLEN_LEN, "%ld", offset) >= REQ_FLEN_LEN) {
+			strncpy(svc_errinfo, "Invalid offset.", ERRSTR_LEN);
+			goto refused;
+		}
+		if (send_stream(sockfd, &req, sizeof(struct svc_req)) < 0) {
+			strncpy(svc_errinfo, "[send_svc_req]", ERRSTR_LEN);
+			goto tx_failed;
+		}
+		if (recv_svc_resp(sockfd, &resp, SERVER_RESP_TIMEOUT) < 0)
 			goto tx_failed;
+		resp_code = atoi(resp.code);
+		if (RESP_INVALID_OFFSET == resp_code) {
+			// Continue from where the server is.
+			int64_t resume = strtoll(resp.offset, NULL, 10);
+			if (NULL != rate)
+				__sync_fetch_and_add(&rate->transmitted, resume - offset);
+			offset = resume;
+			continue;
+		} else if (RESP_OK != resp_code) {
+			set_resp_errstr(resp_code);
+			goto refused;
 		}
-	} else 
-		memset(g_items, 0x00, g_client_status.dcontent.item_num * sizeof(struct inven_item));
 
-	printf("\033[2K\033[GDownloading file inventory...");
+		enum COMPRESS_TYPE compress = resp_compression(&resp);
+		if (COMPRESS_NONE != compress && NULL == buf && open_encoder(compress, &enc, &buf) < 0)
+			goto tx_failed;
+		for (int64_t sent = 0; sent < clen; ) {
+			int64_t step = (clen - sent < UPLOAD_PROGRESS_STEP) ? clen - sent : UPLOAD_PROGRESS_STEP;
+			int64_t slen = send_file_range(sockfd, fd, offset + sent, step, 
+					(COMPRESS_NONE != compress) ? &enc : NULL, buf, NULL);
+			if (slen < 0) {
+				strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
+				goto tx_failed;
+			}
+			sent += step;
+			if (NULL != rate)
+				__sync_fetch_and_add(&rate->transmitted, step);
+		}
+
+		// The server acknowledges the chunk after writing it.
+		if (recv_svc_resp(sockfd, &resp, 0) < 0)
+			goto tx_failed;
+		resp_code = atoi(resp.code);
+		if (RESP_OK != resp_code) {
+			set_resp_errstr(resp_code);
+			goto refused;
+		}
+		offset += clen;
+	}
+	close_encoder(&enc, buf);
+	return 0;
+
+refused:
+	close_encoder(&enc, buf);
+	return -1;
+
+tx_failed:
+	g_client_status.ltx = TX_FAILED;
+	close_encoder(&enc, buf);
+	return -1;
+}
+
+/*
+ * Resumable upload. Open a new session if sid is empty. Otherwise ask the
+ * server how much of the file it already has and send only the rest.
+ *
+ * @param sid - SESSION_ID_LEN bytes. The session id is stored so that the
+ * 				caller can resume the upload after reconnecting.
+ */
+int
+client_resume_upload_service(int sockfd, const char *path, 
+		int64_t flen, enum ACCESS_LEVEL alv, char *sid,
+		struct trans_stat *rate)
+{
+	struct svc_resp resp;
+	int fd = -1;
+
+	printf("\033[2K\033[GWait...");
+	fflush(stdout);
+
+	// Open or query the session.
+	int resp_code = request_upload_session(sockfd, path, flen, alv, sid, 1, 0, &resp);
+	if (resp_code < 0)
+		goto tx_failed;
+	if (RESP_NO_SUCH_SESSION == resp_code)
+		sid[0] = '\0';
+	if (RESP_OK != resp_code) {
+		set_resp_errstr(resp_code);
+		goto request_refused;
+	}
+	strncpy(sid, resp.sid, SESSION_ID_LEN);
+	int64_t offset = strtoll(resp.offset, NULL, 10);
+
+	fd = open_file_fd(path);
+	if (fd < 0) {
+		strncpy(svc_errinfo, futil_errstr(fd), ERRSTR_LEN);
+		goto request_refused;
+	}
+	if (NULL != rate) {
+		rate->total = flen;
+		rate->transmitted = offset;
+	}
+
+	if (send_upload_chunks(sockfd, fd, path, alv, sid, offset, flen, rate) < 0)
+		goto request_refused;
+
+	close(fd);
+	return 0;
+
+tx_failed:
+	g_client_status.ltx = TX_FAILED;
+request_refused:
+	if (-1 != fd)
+		close(fd);
+	if (NULL != rate)
+		rate->transmitted = -1;
+	return -1;
+}
+
+struct stripe_worker {
+	pthread_t tid;
+	int sockfd;		// -1: Connect to sa.
+	const struct sockaddr_in *sa;
+	const char *path;
+	int64_t flen;
+	enum ACCESS_LEVEL alv;
+	const char *sid;
+	int64_t start;
+	int64_t len;
+	struct trans_stat *rate;
+	int result;
+};
+
+/*
+ * Upload a stripe over its own connection. Ask the server where the stripe
+ * is and send the rest of it.
+ */
+static void *
+upload_stripe(void *arg)
+{
+	struct stripe_worker *w = (struct stripe_worker *)arg;
+	struct svc_resp resp;
+	int sockfd = w->sockfd;
+	int fd = -1;
+	w->result = -1;
+
+	if (-1 == sockfd) {
+		sockfd = create_tcpsock();
+		if (sockfd < 0 || 0 != connect(sockfd, (struct sockaddr *)w->sa, sizeof(struct sockaddr_in))) {
+			strncpy(svc_errinfo, "[connect]", ERRSTR_LEN);
+			g_client_status.ltx = TX_FAILED;
+			goto cleanup;
+		}
+	}
+
+	int resp_code = request_upload_session(sockfd, w->path, w->flen, w->alv, w->sid, 0, w->start, &resp);
+	if (resp_code < 0) {
+		g_client_status.ltx = TX_FAILED;
+		goto cleanup;
+	} else if (RESP_OK != resp_code) {
+		set_resp_errstr(resp_code);
+		goto cleanup;
+	}
+	int64_t offset = strtoll(resp.offset, NULL, 10);
+	if (NULL != w->rate)
+		__sync_fetch_and_add(&w->rate->transmitted, offset - w->start);
+
+	fd = open_file_fd(w->path);
+	if (fd < 0) {
+		strncpy(svc_errinfo, futil_errstr(fd), ERRSTR_LEN);
+		goto cleanup;
+	}
+	w->result = send_upload_chunks(sockfd, fd, w->path, w->alv, w->sid, 
+			offset, w->start + w->len, w->rate);
+
+cleanup:
+	if (-1 != fd)
+		close(fd);
+	if (-1 == w->sockfd && sockfd >= 0)
+		close(sockfd);
+	return NULL;
+}
+
+/*
+ * Resumable upload over several connections. The session splits the file 
+ * into nstripes stripes(the server may lower it) and each stripe is sent over
+ * its own connection to sa in parallel. The first stripe uses sockfd.
+ * A failed upload can be resumed with sid like client_resume_upload_service.
+ */
+int
+client_striped_upload_service(int sockfd, const struct sockaddr_in *sa,
+		const char *path, int64_t flen, enum ACCESS_LEVEL alv, int nstripes,
+		char *sid, struct trans_stat *rate)
+{
+	struct stripe_worker workers[MAX_STRIPES_LIMIT];
+	struct svc_resp resp;
+	int result = 0;
+
+	printf("\033[2K\033[GWait...");
 	fflush(stdout);
 
-	if (recv_stream_nblock(sockfd, g_items, dlen, rate) < 0) {
+	if (nstripes < 1)
+		nstripes = 1;
+	else if (nstripes > MAX_STRIPES_LIMIT)
+		nstripes = MAX_STRIPES_LIMIT;
+
+	// Open or query the session.
+	int resp_code = request_upload_session(sockfd, path, flen, alv, sid, nstripes, 0, &resp);
+	if (resp_code < 0) {
+		g_client_status.ltx = TX_FAILED;
+		goto request_refused;
+	}
+	if (RESP_NO_SUCH_SESSION == resp_code)
+		sid[0] = '\0';
+	if (RESP_OK != resp_code) {
+		set_resp_errstr(resp_code);
+		goto request_refused;
+	}
+	strncpy(sid, resp.sid, SESSION_ID_LEN);
+	nstripes = atoi(resp.stripes);
+	if (nstripes < 1 || nstripes > MAX_STRIPES_LIMIT) {
+		strncpy(svc_errinfo, "Invalid stripe count.", ERRSTR_LEN);
+		goto request_refused;
+	}
+
+	if (NULL != rate) {
+		rate->total = flen;
+		rate->transmitted = 0;
+	}
+
+	memset(workers, 0x00, sizeof(workers));
+	for (int i = 0; i < nstripes; i++) {
+		struct stripe_worker *w = &workers[i];
+		w->sockfd = (0 == i) ? sockfd : -1;
+		w->sa = sa;
+		w->path = path;
+		w->flen = flen;
+		w->alv = alv;
+		w->sid = sid;
+		w->rate = rate;
+		stripe_range(flen, nstripes, i, &w->start, &w->len);
+		if (0 == w->len) {
+			w->result = 0;
+			continue;
+		}
+		if (0 != pthread_create(&w->tid, NULL, upload_stripe, w)) {
+			w->tid = 0;
+			strncpy(svc_errinfo, "[pthread_create]", ERRSTR_LEN);
+			w->result = -1;
+		}
+	}
+	for (int i = 0; i < nstripes; i++) {
+		if (0 != workers[i].tid)
+			pthread_join(workers[i].tid, NULL);
+		if (workers[i].result < 0)
+			result = -1;
+	}
+
+	if (result < 0)
+		goto request_refused;
+	return 0;
+
+request_refused:
+	if (NULL != rate)
+		rate->transmitted = -1;
+	return -1;
+}
+
+/*
+ * Receive a page of at most limit items after cursor into items. cursor is
+ * updated to the next page, and is empty after the last page.
+ *
+ * @param buf - CZ_FRAME_MAX bytes.
+ * @param version - Inventory version before the page will be set.
+ * @return - Success: number of items, Fail: -1
+ */
+static int64_t
+recv_list_page(int sockfd, char *cursor, size_t limit, struct inven_item *items, void *buf,
+		unsigned long long *version)
+{
+	struct svc_req req;
+	struct svc_resp resp;
+	set_svc_req(&req, NULL, 0, 0, SVC_LIST);
+	snprintf(req.flen, REQ_FLEN_LEN, "%zu", limit);
+	snprintf(req.cursor, LIST_CURSOR_LEN, "%s", cursor);
+	int64_t result = send_inven_req(sockfd, &req);
+	if (result < 0) {
 		strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		return -1;
+	}
+	if (recv_svc_resp(sockfd, &resp, SERVER_RESP_TIMEOUT) < 0)
+		return -1;
+	if (RESP_OK != atoi(resp.code)) {
+		set_resp_errstr(atoi(resp.code));
+		return -1;
+	}
+
+	int64_t n = strtoll(resp.flen, NULL, 10);
+	if (n < 0 || (size_t)n > limit) {
+		strncpy(svc_errinfo, "Invalid response.", ERRSTR_LEN);
+		return -1;
+	}
+	int64_t dlen = n * sizeof(struct inven_item);
+	if (dlen > 0 && COMPRESS_NONE != resp_compression(&resp))
+		result = recv_compressed_data(sockfd, items, dlen, buf, NULL);
+	else if (dlen > 0)
+		result = recv_stream_nblock(sockfd, items, dlen, NULL);
+	if (result < 0) {
+		strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		return -1;
+	}
+	snprintf(cursor, LIST_CURSOR_LEN, "%s", resp.cursor);
+	*version = strtoull(resp.offset, NULL, 10);
+	return n;
+}
+
+static int
+reserve_items(size_t nitems)
+{
+	if (nitems <= inven_capacity)
+		return 0;
+	struct inven_item *items = (struct inven_item *) realloc(g_items,
+			(inven_capacity + LIST_PAGE_SIZE) * sizeof(struct inven_item));
+	if (NULL == items) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		return -1;
+	}
+	g_items = items;
+	inven_capacity += LIST_PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Apply a change to g_items. Items are matched by name, since a name is
+ * unique among the live items.
+ */
+static int
+apply_change(struct inven_change *c, size_t *nitems)
+{
+	size_t i = 0;
+	while (i < *nitems && strncmp(g_items[i].fname, c->item.fname, FILE_NAME_LEN))
+		i++;
+	int status = atoi(c->item.status);
+	if (CHANGE_REMOVE == atoi(c->type) 
+			|| (ITEM_STAT_AVAILABLE != status && ITEM_STAT_MODIFYING != status)) {
+		if (i < *nitems) {
+			memmove(&g_items[i], &g_items[i + 1], (*nitems - i - 1) * sizeof(struct inven_item));
+			(*nitems)--;
+		}
+		return 0;
+	}
+	if (i == *nitems) {
+		// Like the full list, the items beyond OPT_ITEM_MAX are not shown.
+		if (*nitems >= OPT_ITEM_MAX)
+			return 0;
+		if (reserve_items(*nitems + 1) < 0)
+			return -1;
+		(*nitems)++;
+	}
+	g_items[i] = c->item;
+	return 0;
+}
+
+/*
+ * Receive the changes after inven_version and apply them to g_items.
+ *
+ * @param buf - CZ_FRAME_MAX bytes.
+ * @return - Success: 0, Expired version: RESP_VERSION_EXPIRED, Fail: -1
+ */
+static int
+sync_inventory_changes(int sockfd, void *buf, struct trans_stat *rate)
+{
+	struct svc_req req;
+	struct svc_resp resp;
+	size_t nitems = g_client_status.dcontent.item_num;
+	struct inven_change *changes = (struct inven_change *) malloc(CHANGE_PAGE_SIZE * sizeof(struct inven_change));
+	int64_t pages = 0;
+	int64_t n = 0;
+	int result = -1;
+	if (NULL == changes) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		return -1;
+	}
+
+	do {
+		set_svc_req(&req, NULL, 0, 0, SVC_CHANGES);
+		snprintf(req.flen, REQ_FLEN_LEN, "%d", CHANGE_PAGE_SIZE);
+		snprintf(req.offset, REQ_FLEN_LEN, "%llu", inven_version);
+		if (NULL != rate)
+			rate->total = pages + 1;
+		int64_t slen = send_inven_req(sockfd, &req);
+		if (slen < 0) {
+			strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
+			goto out;
+		}
+		if (recv_svc_resp(sockfd, &resp, SERVER_RESP_TIMEOUT) < 0)
+			goto out;
+		if (RESP_VERSION_EXPIRED == atoi(resp.code)) {
+			result = RESP_VERSION_EXPIRED;
+			goto out;
+		}
+		if (RESP_OK != atoi(resp.code)) {
+			set_resp_errstr(atoi(resp.code));
+			goto out;
+		}
+		n = strtoll(resp.flen, NULL, 10);
+		if (n < 0 || n > CHANGE_PAGE_SIZE) {
+			strncpy(svc_errinfo, "Invalid response.", ERRSTR_LEN);
+			goto out;
+		}
+		int64_t dlen = n * sizeof(struct inven_change);
+		if (dlen > 0 && COMPRESS_NONE != resp_compression(&resp))
+			slen = recv_compressed_data(sockfd, changes, dlen, buf, NULL);
+		else if (dlen > 0)
+			slen = recv_stream_nblock(sockfd, changes, dlen, NULL);
+		if (slen < 0) {
+			strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
+			goto out;
+		}
+		for (int64_t i = 0; i < n; i++) {
+			if (apply_change(&changes[i], &nitems) < 0)
+				goto out;
+		}
+		inven_version = strtoull(resp.offset, NULL, 10);
+		if (NULL != rate)
+			rate->transmitted = ++pages;
+	} while (CHANGE_PAGE_SIZE == n);
+	result = 0;
+
+out:
+	g_client_status.dcontent.item_num = nitems;
+	free(changes);
+	return result;
+}
+
+/*
+ * Follow the changes pushed by the server, from the version of g_items if
+ * it is synced, and keep g_items up to date. handler is called after each
+ * change is applied, and the subscription ends when it returns -1. The
+ * connection can't serve other requests afterwards.
+ *
+ * @return - Success: 0(stopped by handler), Fail: -1. The caller should
+ * 			 fetch the inventory again and subscribe if svc_errcode() is
+ * 			 RESP_VERSION_EXPIRED.
+ */
+int
+client_subscribe_service(int sockfd, int (*handler)(const struct inven_change *, void *), void *arg)
+{
+	struct svc_req req;
+	struct svc_resp resp;
+	size_t nitems = g_client_status.dcontent.item_num;
+	int result = -1;
+	struct inven_change *changes = (struct inven_change *) malloc(CHANGE_PAGE_SIZE * sizeof(struct inven_change));
+	if (NULL == changes) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		return -1;
+	}
+
+	set_svc_req(&req, NULL, 0, 0, SVC_SUBSCRIBE);
+	if (0 != inven_version && snprintf(req.offset, REQ_FLEN_LEN, "%llu", inven_version) >= REQ_FLEN_LEN) {
+		strncpy(svc_errinfo, "Invalid version.", ERRSTR_LEN);
+		inven_version = 0;
+		goto out;
+	}
+	int64_t slen = send_inven_req(sockfd, &req);
+	if (slen < 0) {
+		strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
+		goto out;
+	}
+
+	// The first response has no changes. A frame may have more changes than
+	// CHANGE_PAGE_SIZE, so they are received in parts.
+	while (1) {
+		if (recv_svc_resp(sockfd, &resp, 0) < 0)
+			goto out;
+		if (RESP_OK != atoi(resp.code)) {
+			if (RESP_VERSION_EXPIRED == atoi(resp.code))
+				inven_version = 0;
+			set_resp_errstr(atoi(resp.code));
+			goto out;
+		}
+		int64_t n = strtoll(resp.flen, NULL, 10);
+		for (int64_t done = 0; done < n; ) {
+			int64_t k = (n - done < CHANGE_PAGE_SIZE) ? n - done : CHANGE_PAGE_SIZE;
+			if ((slen = recv_stream_nblock(sockfd, changes, k * sizeof(struct inven_change), NULL)) < 0) {
+				strncpy(svc_errinfo, sockutil_errstr(slen), ERRSTR_LEN);
+				goto out;
+			}
+			for (int64_t i = 0; i < k; i++) {
+				if (apply_change(&changes[i], &nitems) < 0)
+					goto out;
+				g_client_status.dcontent.item_num = nitems;
+				if (NULL != handler && handler(&changes[i], arg) < 0) {
+					result = 0;
+					goto out;
+				}
+			}
+			done += k;
+		}
+		inven_version = strtoull(resp.offset, NULL, 10);
+	}
+
+out:
+	g_client_status.dcontent.item_num = nitems;
+	free(changes);
+	return result;
+}
+
+/*
+ * Update g_items with the changes since the last fetch, or fetch the live
+ * items page by page if the server doesn't keep the changes anymore. The
+ * progress is counted in pages.
+ */
+int
+client_inquiry_service(int sockfd, struct trans_stat *rate)
+{
+	char cursor[LIST_CURSOR_LEN] = "";
+	size_t nitems = 0;
+	int64_t pages = 0;
+	unsigned long long version = 0;
+
+	void *buf = malloc(CZ_FRAME_MAX);
+	if (NULL == buf) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
 		goto tx_failed;
 	}
+	printf("\033[2K\033[GDownloading file inventory...");
+	fflush(stdout);
 
-	g_client_status.dcontent.item_num = dlen / sizeof(struct inven_item);
+	if (0 != inven_version) {
+		int result = sync_inventory_changes(sockfd, buf, rate);
+		if (0 == result) {
+			free(buf);
+			return 0;
+		}
+		if (RESP_VERSION_EXPIRED != result)
+			goto tx_failed;
+	}
 
+	// The screen can't show more than OPT_ITEM_MAX items.
+	inven_version = 0;
+	do {
+		size_t limit = (OPT_ITEM_MAX - nitems < LIST_PAGE_SIZE) ? OPT_ITEM_MAX - nitems : LIST_PAGE_SIZE;
+		if (reserve_items(nitems + limit) < 0)
+			goto tx_failed;
+		if (NULL != rate)
+			rate->total = pages + 1;
+		int64_t n = recv_list_page(sockfd, cursor, limit, g_items + nitems, buf, &version);
+		if (n < 0)
+			goto tx_failed;
+		// The changes during the fetch are applied again by the next sync.
+		if (0 == pages)
+			inven_version = version;
+		nitems += n;
+		if (NULL != rate)
+			rate->transmitted = ++pages;
+	} while ('\0' != cursor[0] && nitems < OPT_ITEM_MAX);
+
+	free(buf);
+	g_client_status.dcontent.item_num = nitems;
 	return 0;
 
 tx_failed:
+	free(buf);
 	if (NULL != rate)
 		rate->transmitted = -1;
 	g_client_status.ltx = TX_FAILED;
 	return -1;
 }
 
+/*
+ * Request [offset, offset + dlen) of the file. Negative dlen means up to the
+ * end of the file.
+ *
+ * @return - Success: resp code, resp is set. Fail: -1(connection lost)
+ */
+static int
+request_download(int sockfd, const char *fname, int64_t offset, int64_t dlen, struct svc_resp *resp)
+{
+	struct svc_req req;
+	memset(&req, 0x00, sizeof(struct svc_req));
+	snprintf(req.type, SVC_TYPE_LEN, "%d", SVC_DOWNLOAD);
+	strncpy(req.fname, fname, FILE_NAME_LEN);
+	snprintf(req.offset, REQ_FLEN_LEN, "%ld", offset);
+	if (dlen >= 0)
+		snprintf(req.flen, REQ_FLEN_LEN, "%ld", dlen);
+	snprintf(req.compress, REQ_COMPRESS_LEN, "%d", svc_compression);
+	int64_t result = send_stream(sockfd, &req, sizeof(struct svc_req));
+	if (result < 0) {
+		strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		return -1;
+	}
+	if (recv_svc_resp(sockfd, resp, SERVER_RESP_TIMEOUT) < 0)
+		return -1;
+	return atoi(resp->code);
+}
+
+static void
+set_download_errstr(int resp_code)
+{
+	if (RESP_NO_SUCH_FILE == resp_code || RESP_DELETED == resp_code)
+		strncpy(svc_errinfo, "The file could not be found.", ERRSTR_LEN);
+	else if (RESP_ACCESS_DENIED == resp_code)
+		strncpy(svc_errinfo, "Access denied.", ERRSTR_LEN);
+	else if (RESP_MODIFYING == resp_code)
+		strncpy(svc_errinfo, "The file is being uploaded.", ERRSTR_LEN);
+	else
+		snprintf(svc_errinfo, ERRSTR_LEN, "[download_service] Unknown error(%d).", resp_code);
+}
 
+struct range_record {
+	int64_t start;
+	int64_t len;
+	int64_t done;	// [start, start + done) is written.
+};
+
+struct range_worker {
+	pthread_t tid;
+	int idx;
+	int sockfd;		// -1: Connect to sa and request the range.
+	const struct sockaddr_in *sa;
+	const char *fname;
+	int fd;
+	int mapfd;		// Progress of the ranges. -1: None.
+	int64_t flen;	// Length of the whole file.
+	int compressed;	// The range is sent in compressed frames.
+	struct range_record rec;
+	struct trans_stat *rate;
+	int result;
+};
+
+/*
+ * A parallel download leaves holes in the partial file until every range is
+ * complete. The ranges are recorded in "[fname].part.map" so that a download
+ * killed in the middle can be cut back to its contiguous prefix.
+ */
+static int
+create_range_map(const char *mappath, struct range_worker *workers, int n)
+{
+	int mapfd = open(mappath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (mapfd < 0)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		workers[i].mapfd = mapfd;
+		if (pwrite(mapfd, &workers[i].rec, sizeof(struct range_record), 
+					i * sizeof(struct range_record)) != sizeof(struct range_record)) {
+			close(mapfd);
+			delete_file(mappath);
+			return -1;
+		}
+	}
+	return mapfd;
+}
+
+/*
+ * @return - Length of the valid prefix of the partial file, or -1 if the
+ * 			 range map doesn't exist.
+ */
+static int64_t
+read_range_map(const char *mappath)
+{
+	struct range_record rec;
+	int64_t prefix = -1;
+	int mapfd = open(mappath, O_RDONLY);
+	if (mapfd < 0)
+		return -1;
+	while (read(mapfd, &rec, sizeof(struct range_record)) == sizeof(struct range_record)) {
+		if (-1 == prefix)
+			prefix = rec.start;
+		if (rec.start != prefix)
+			break;
+		prefix += rec.done;
+		if (rec.done < rec.len)
+			break;
+	}
+	close(mapfd);
+	return (-1 == prefix) ? 0 : prefix;
+}
+
+/*
+ * Receive a range of the file and write it at its offset of the destination.
+ * rate->transmitted is shared by the ranges.
+ */
+static void *
+download_range(void *arg)
+{
+	struct range_worker *w = (struct range_worker *)arg;
+	struct svc_resp resp;
+	int sockfd = w->sockfd;
+	void *buf = NULL;
+	w->result = -1;
+
+	if (-1 == sockfd) {
+		sockfd = create_tcpsock();
+		if (sockfd < 0 || 0 != connect(sockfd, (struct sockaddr *)w->sa, sizeof(struct sockaddr_in))) {
+			strncpy(svc_errinfo, "[connect]", ERRSTR_LEN);
+			goto cleanup;
+		}
+		int resp_code = request_download(sockfd, w->fname, w->rec.start, w->rec.len, &resp);
+		if (resp_code < 0) {
+			goto cleanup;
+		} else if (RESP_OK != resp_code) {
+			set_download_errstr(resp_code);
+			goto cleanup;
+		} else if (strtoll(resp.flen, NULL, 10) != w->flen) {
+			strncpy(svc_errinfo, "The file has been changed.", ERRSTR_LEN);
+			goto cleanup;
+		}
+		w->compressed = (COMPRESS_NONE != resp_compression(&resp));
+	}
+
+	if (set_socket_timeout(sockfd, 0) < 0) {
+		strncpy(svc_errinfo, "[set_socket_timeout]", ERRSTR_LEN);
+		goto cleanup;
+	}
+	buf = malloc(w->compressed ? CZ_STREAM_BUF_SIZE : DOWNLOAD_BUF_SIZE);
+	if (NULL == buf) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		goto cleanup;
+	}
+
+	struct range_record *rec = &w->rec;
+	while (rec->done < rec->len) {
+		int64_t step = (rec->len - rec->done < DOWNLOAD_PROGRESS_STEP) ? rec->len - rec->done : DOWNLOAD_PROGRESS_STEP;
+		int64_t result = w->compressed
+			? recv_compressed_stream(sockfd, w->fd, rec->start + rec->done, step, buf, NULL)
+			: recv_stream_to_fd(sockfd, w->fd, rec->start + rec->done, step, buf, DOWNLOAD_BUF_SIZE, NULL);
+		if (result < 0) {
+			strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+			goto cleanup;
+		}
+		rec->done += step;
+		// Record the progress after the data is written.
+		if (-1 != w->mapfd)
+			pwrite(w->mapfd, rec, sizeof(struct range_record), w->idx * sizeof(struct range_record));
+		if (NULL != w->rate)
+			__sync_fetch_and_add(&w->rate->transmitted, step);
+	}
+	w->result = 0;
+
+cleanup:
+	if (NULL != buf)
+		free(buf);
+	if (-1 == w->sockfd && sockfd >= 0)
+		close(sockfd);
+	return NULL;
+}
+
+/*
+ * Download the file to DOWNLOAD_HOME_STR. The data is written to
+ * "[fname].part" which is renamed to fname when complete. If the partial file
+ * already exists, only the missing tail is requested.
+ */
 int 
 client_download_service(int sockfd, struct inven_item *item, 
 		struct trans_stat *rate)
 {
-	struct svc_req req;
+	return client_parallel_download_service(sockfd, NULL, item, 1, rate);
+}
+
+/*
+ * Download the file like client_download_service, splitting the missing tail
+ * into up to nstreams ranges(at least DOWNLOAD_RANGE_MIN bytes each) that are
+ * fetched in parallel. The first range uses sockfd and the others open their
+ * own connection to sa. Each range is written at its offset of the partial 
+ * file. On failure the partial file is cut to the contiguous prefix so that
+ * the download can be resumed.
+ */
+int 
+client_parallel_download_service(int sockfd, const struct sockaddr_in *sa,
+		struct inven_item *item, int nstreams, struct trans_stat *rate)
+{
+	struct range_worker workers[MAX_STREAMS_LIMIT];
 	struct svc_resp resp;
-	int result = 0;
-	int64_t flen = 0;
+	int64_t flen = strtoll(item->flen, NULL, 10);
+	int64_t offset = 0;
 	int fd = -1;
-	void *map = NULL;
+	int mapfd = -1;
+	int retried = 0;
+	int resp_code = 0;
 	char downloadpath[FILE_NAME_LEN + DOWNLOAD_HOME_LEN];
-	
-	// Send download request.
-	snprintf(req.type, SVC_TYPE_LEN, "%d", SVC_DOWNLOAD);
-	strncpy(req.fname, item->fname, FILE_NAME_LEN);
-	result = send_stream(sockfd, &req, sizeof(struct svc_req));
+	char partpath[FILE_NAME_LEN + DOWNLOAD_HOME_LEN + PART_SUFFIX_LEN];
+	char mappath[FILE_NAME_LEN + DOWNLOAD_HOME_LEN + PART_SUFFIX_LEN + MAP_SUFFIX_LEN];
 
-	if (set_socket_timeout(sockfd, SERVER_RESP_TIMEOUT) < 0) {
-		strncpy(svc_errinfo, "[set_socket_timeout]", ERRSTR_LEN);
+	snprintf(downloadpath, sizeof(downloadpath), "%s/%s", DOWNLOAD_HOME_STR, item->fname);
+	snprintf(partpath, sizeof(partpath), "%s%s", downloadpath, PART_SUFFIX_STR);
+	snprintf(mappath, sizeof(mappath), "%s%s", partpath, MAP_SUFFIX_STR);
+
+	fd = open(partpath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		strncpy(svc_errinfo, "Failed to create a new file(1).", ERRSTR_LEN);
 		goto tx_failed;
 	}
+	// Continue from the end of the partial file. A parallel download that
+	// didn't finish may have left holes beyond its contiguous prefix.
+	offset = read_range_map(mappath);
+	if (offset >= 0) {
+		if (ftruncate(fd, offset) < 0) {
+			strncpy(svc_errinfo, "Failed to create a new file(2).", ERRSTR_LEN);
+			goto tx_failed;
+		}
+		delete_file(mappath);
+	}
+	offset = lseek(fd, 0, SEEK_END);
+	if (offset < 0 || offset > flen) {
+		if (ftruncate(fd, 0) < 0) {
+			strncpy(svc_errinfo, "Failed to create a new file(2).", ERRSTR_LEN);
+			goto tx_failed;
+		}
+		offset = 0;
+	}
 
-	// Receive response
-	if (recv(sockfd, &resp, sizeof(struct svc_resp), 0) < 0) {
-		if (EAGAIN == errno || EWOULDBLOCK == errno) 
-			strncpy(svc_errinfo, "Server is busy.", ERRSTR_LEN);
-		else
-			strncpy(svc_errinfo, "[recv]", ERRSTR_LEN);
-		goto tx_failed;
+send_request:
+	if (NULL == sa || nstreams < 1)
+		nstreams = 1;
+	else if (nstreams > MAX_STREAMS_LIMIT)
+		nstreams = MAX_STREAMS_LIMIT;
+	if (nstreams > (flen - offset) / DOWNLOAD_RANGE_MIN)
+		nstreams = ((flen - offset) / DOWNLOAD_RANGE_MIN > 1) ? (flen - offset) / DOWNLOAD_RANGE_MIN : 1;
+
+	// The first range. A single stream takes the rest of the file.
+	memset(workers, 0x00, sizeof(workers));
+	for (int i = 0; i < nstreams; i++) {
+		struct range_worker *w = &workers[i];
+		w->idx = i;
+		w->sockfd = (0 == i) ? sockfd : -1;
+		w->sa = sa;
+		w->fname = item->fname;
+		w->fd = fd;
+		w->mapfd = -1;
+		w->flen = flen;
+		w->rate = rate;
+		stripe_range(flen - offset, nstreams, i, &w->rec.start, &w->rec.len);
+		w->rec.start += offset;
 	}
-	
-	if (RESP_OK == atoi(resp.code)) {
-		flen = strtoll(item->flen, NULL, 10);
+	resp_code = request_download(sockfd, item->fname, offset, (1 == nstreams) ? -1 : workers[0].rec.len, &resp);
+	if (resp_code < 0)
+		goto tx_failed;
 
-		if (set_socket_timeout(sockfd, 0) < 0) {
-			strncpy(svc_errinfo, "[set_socket_timeout]", ERRSTR_LEN);
+	if (RESP_OK == resp_code) {
+		workers[0].compressed = (COMPRESS_NONE != resp_compression(&resp));
+		if (1 == nstreams) {
+			flen = strtoll(resp.flen, NULL, 10);
+			workers[0].flen = flen;
+			workers[0].rec.len = flen - offset;
+		} else if (strtoll(resp.flen, NULL, 10) != flen) {
+			// The ranges of the other streams would be wrong.
+			strncpy(svc_errinfo, "The file has been changed.", ERRSTR_LEN);
 			goto tx_failed;
+		} else {
+			mapfd = create_range_map(mappath, workers, nstreams);
+			if (mapfd < 0) {
+				strncpy(svc_errinfo, "Failed to create a new file(4).", ERRSTR_LEN);
+				goto tx_failed;
+			}
+		}
+		if (NULL != rate) {
+			rate->total = flen - offset;
+			rate->transmitted = 0;
 		}
 
-		// Create file size flen.
-		snprintf(downloadpath, DOWNLOAD_HOME_LEN + FILE_NAME_LEN + 1, 
-				"%s/%s", DOWNLOAD_HOME_STR, item->fname);
-		fd = open(downloadpath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-		if (fd < 0) {
-			strncpy(svc_errinfo, "Failed to create a new file(1).", ERRSTR_LEN);
-			goto tx_failed;
+		for (int i = 1; i < nstreams; i++) {
+			if (0 != pthread_create(&workers[i].tid, NULL, download_range, &workers[i])) {
+				workers[i].tid = 0;
+				workers[i].result = -1;
+				strncpy(svc_errinfo, "[pthread_create]", ERRSTR_LEN);
+			}
 		}
-		if (ftruncate(fd, flen) < 0) {
-			strncpy(svc_errinfo, "Failed to create a new file(2).", ERRSTR_LEN);
-			goto tx_failed;
+		download_range(&workers[0]);
+		for (int i = 1; i < nstreams; i++) {
+			if (0 != workers[i].tid)
+				pthread_join(workers[i].tid, NULL);
+		}
+
+		if (-1 != mapfd) {
+			close(mapfd);
+			mapfd = -1;
+		}
+		for (int i = 0; i < nstreams; i++) {
+			if (workers[i].result < 0) {
+				// Keep only the contiguous prefix of the partial file.
+				if (0 == ftruncate(fd, workers[i].rec.start + workers[i].rec.done))
+					delete_file(mappath);
+				if (workers[0].result < 0)
+					goto tx_failed;
+				goto svc_refused;
+			}
 		}
-		// Map the file to the buffer.
-		map = mmap(NULL, flen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (MAP_FAILED == map) {
+		delete_file(mappath);
+
+		if (close(fd) < 0 || rename_file(partpath, downloadpath) < 0) {
+			fd = -1;
 			strncpy(svc_errinfo, "Failed to create a new file(3).", ERRSTR_LEN);
 			goto tx_failed;
 		}
 
-		// Receive the file data.
-		result = recv_stream_nblock(sockfd, map, flen, rate);
-		if (result < 0) {
-			strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		return 0;
+	} else if (RESP_INVALID_OFFSET == resp_code && !retried) {
+		// The partial file is longer than the file on the server.
+		retried = 1;
+		offset = 0;
+		if (ftruncate(fd, 0) < 0) {
+			strncpy(svc_errinfo, "Failed to create a new file(2).", ERRSTR_LEN);
 			goto tx_failed;
 		}
+		goto send_request;
+	} else {
+		set_download_errstr(resp_code);
+		goto svc_refused;
+	}
+
+tx_failed:
+	g_client_status.ltx = TX_FAILED;
+svc_refused:
+	// The partial file is kept to resume the download.
+	if (-1 != fd) {
+		if (0 == lseek(fd, 0, SEEK_END))
+			delete_file(partpath);
+		close(fd);
+	}
+	if (NULL != rate)
+		rate->transmitted = -1;
+	return -1;
+}
+
+/*
+ * Download the file while it is being uploaded(SVC_DOWNLOAD_FOLLOW). The data
+ * is written to "[fname].part" as it lands on the server, and the partial file
+ * is renamed to fname when the upload is committed. It is removed if the
+ * upload is rolled back. An available file is downloaded at once.
+ */
+int
+client_follow_download_service(int sockfd, struct inven_item *item, struct trans_stat *rate)
+{
+	struct svc_req req;
+	struct svc_resp resp;
+	void *buf = NULL;
+	int64_t flen = 0;
+	char downloadpath[FILE_NAME_LEN + DOWNLOAD_HOME_LEN];
+	char partpath[FILE_NAME_LEN + DOWNLOAD_HOME_LEN + PART_SUFFIX_LEN];
+
+	snprintf(downloadpath, sizeof(downloadpath), "%s/%s", DOWNLOAD_HOME_STR, item->fname);
+	snprintf(partpath, sizeof(partpath), "%s%s", downloadpath, PART_SUFFIX_STR);
 
-		if (munmap(map, flen) < 0) {
-			strncpy(svc_errinfo, "Failed to create a new file(4).", ERRSTR_LEN);
+	int fd = open(partpath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		strncpy(svc_errinfo, "Failed to create a new file(1).", ERRSTR_LEN);
+		goto tx_failed;
+	}
+
+	memset(&req, 0x00, sizeof(struct svc_req));
+	snprintf(req.type, SVC_TYPE_LEN, "%d", SVC_DOWNLOAD_FOLLOW);
+	strncpy(req.fname, item->fname, FILE_NAME_LEN);
+	snprintf(req.offset, REQ_FLEN_LEN, "%d", 0);
+	int64_t result = send_stream(sockfd, &req, sizeof(struct svc_req));
+	if (result < 0) {
+		strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		goto tx_failed;
+	}
+	if (recv_svc_resp(sockfd, &resp, SERVER_RESP_TIMEOUT) < 0)
+		goto tx_failed;
+	int resp_code = atoi(resp.code);
+	if (RESP_OK != resp_code) {
+		if (RESP_MODIFYING == resp_code)
+			strncpy(svc_errinfo, "The file can't be followed now.", ERRSTR_LEN);
+		else
+			set_download_errstr(resp_code);
+		goto svc_refused;
+	}
+	flen = strtoll(resp.flen, NULL, 10);
+	if (NULL != rate) {
+		rate->total = flen;
+		rate->transmitted = 0;
+	}
+
+	buf = malloc(DOWNLOAD_BUF_SIZE);
+	if (NULL == buf) {
+		strncpy(svc_errinfo, "Out of memory.", ERRSTR_LEN);
+		goto svc_refused;
+	}
+	// Frames arrive as the upload goes on. Wait for them without a timeout.
+	while (1) {
+		if (recv_svc_resp(sockfd, &resp, 0) < 0)
+			goto tx_failed;
+		int64_t offset = strtoll(resp.offset, NULL, 10);
+		int64_t len = strtoll(resp.flen, NULL, 10);
+		if (0 == len)
+			break;
+		if (offset < 0 || len < 0 || offset + len > flen) {
+			strncpy(svc_errinfo, "[follow] Invalid frame.", ERRSTR_LEN);
+			goto tx_failed;
+		}
+		result = recv_stream_to_fd(sockfd, fd, offset, len, buf, DOWNLOAD_BUF_SIZE, NULL);
+		if (result < 0) {
+			strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
 			goto tx_failed;
 		}
+		if (NULL != rate)
+			rate->transmitted = offset + len;
+	}
+	free(buf);
+	buf = NULL;
 
-		return 0;
-	} else if (RESP_NO_SUCH_FILE == atoi(resp.code)) {
-			strncpy(svc_errinfo, "The file could not be found.", ERRSTR_LEN);
-			goto svc_refused;
-	} else if (RESP_ACCESS_DENIED == atoi(resp.code)) {
-			strncpy(svc_errinfo, "Access denied.", ERRSTR_LEN);
-			goto svc_refused;
+	if (RESP_OK != atoi(resp.code)) {
+		strncpy(svc_errinfo, "The upload was cancelled.", ERRSTR_LEN);
+		close(fd);
+		delete_file(partpath);
+		fd = -1;
+		goto svc_refused;
+	}
+	if (close(fd) < 0 || rename_file(partpath, downloadpath) < 0) {
+		fd = -1;
+		strncpy(svc_errinfo, "Failed to create a new file(3).", ERRSTR_LEN);
+		goto svc_refused;
 	}
+	return 0;
 
 tx_failed:
 	g_client_status.ltx = TX_FAILED;
 svc_refused:
-	if (NULL != map) {
-		msync(map, flen, MS_INVALIDATE);
-		munmap(map, flen);
-	}
-	if (-1 != fd)
+	// The received prefix is kept so that a download can resume it.
+	if (NULL != buf)
+		free(buf);
+	if (-1 != fd) {
+		if (0 == lseek(fd, 0, SEEK_END))
+			delete_file(partpath);
 		close(fd);
+	}
 	if (NULL != rate)
 		rate->transmitted = -1;
 	return -1;
 }
+
+/*
+ * Send a rename or delete request and check the response.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+static int
+request_item_update(int sockfd, struct svc_req *req)
+{
+	struct svc_resp resp;
+	int64_t result = send_stream(sockfd, req, sizeof(struct svc_req));
+	if (result < 0) {
+		strncpy(svc_errinfo, sockutil_errstr(result), ERRSTR_LEN);
+		g_client_status.ltx = TX_FAILED;
+		return -1;
+	}
+	if (recv_svc_resp(sockfd, &resp, SERVER_RESP_TIMEOUT) < 0) {
+		g_client_status.ltx = TX_FAILED;
+		return -1;
+	}
+
+	int resp_code = atoi(resp.code);
+	if (RESP_OK == resp_code)
+		return 0;
+	if (RESP_DUPLICATED == resp_code)
+		set_resp_errstr(resp_code);
+	else if (RESP_INVALID_NAME == resp_code)
+		strncpy(svc_errinfo, "Invalid file name.", ERRSTR_LEN);
+	else if (RESP_MODIFYING == resp_code)
+		strncpy(svc_errinfo, "The file is being modified.", ERRSTR_LEN);
+	else
+		set_download_errstr(resp_code);
+	return -1;
+}
+
+int
+client_rename_service(int sockfd, const char *fname, const char *new_fname)
+{
+	struct svc_req req;
+	memset(&req, 0x00, sizeof(struct svc_req));
+	snprintf(req.type, SVC_TYPE_LEN, "%d", SVC_RENAME);
+	strncpy(req.fname, fname, FILE_NAME_LEN);
+	strncpy(req.new_fname, new_fname, FILE_NAME_LEN);
+	return request_item_update(sockfd, &req);
+}
+
+int
+client_delete_service(int sockfd, const char *fname)
+{
+	struct svc_req req;
+	memset(&req, 0x00, sizeof(struct svc_req));
+	snprintf(req.type, SVC_TYPE_LEN, "%d", SVC_DELETE);
+	strncpy(req.fname, fname, FILE_NAME_LEN);
+	return request_item_update(sockfd, &req);
+}
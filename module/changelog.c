@@ -0,0 +1,180 @@
+#include "changelog.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+init_change_log(struct change_log *log, size_t capacity, size_t esz, uint64_t first_version)
+{
+	memset(log, 0x00, sizeof(struct change_log));
+	if (0 == capacity)
+		return -1;
+	log->entries = calloc(capacity, esz);
+	if (NULL == log->entries)
+		return -1;
+	log->esz = esz;
+	log->capacity = capacity;
+	log->version = first_version;
+	log->first_version = first_version;
+	return 0;
+}
+
+void
+destruct_change_log(struct change_log *log)
+{
+	free(log->entries);
+	log->entries = NULL;
+}
+
+static void *
+entry_of(const struct change_log *log, uint64_t version)
+{
+	return (char *)log->entries + (version % log->capacity) * log->esz;
+}
+
+void *
+log_change(struct change_log *log)
+{
+	return entry_of(log, ++log->version);
+}
+
+int
+change_log_expired(const struct change_log *log, uint64_t from)
+{
+	return from < log->first_version || from > log->version
+		|| log->version - from > log->capacity;
+}
+
+void *
+change_at(const struct change_log *log, uint64_t version)
+{
+	if (version <= log->first_version || version > log->version
+			|| log->version - version >= log->capacity)
+		return NULL;
+	return entry_of(log, version);
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+
+#define TEST_FIRST_VERSION		((uint64_t)1700000000 << 20)
+
+/*
+ * Same as copy_changes() of the server, without the filters.
+ */
+static size_t
+copy_versions(const struct change_log *log, uint64_t *version, uint64_t *page, size_t limit)
+{
+	size_t n = 0;
+	for (; n < limit && *version < log->version; (*version)++) {
+		uint64_t *e = (uint64_t *)change_at(log, *version + 1);
+		if (NULL == e)
+			break;
+		page[n++] = *e;
+	}
+	return n;
+}
+
+/*
+ * Every version which is not expired gets all the changes after it, across
+ * the wraparounds of the ring.
+ */
+static int
+test_wraparound_of(size_t capacity, int c)
+{
+	struct change_log log;
+	uint64_t *page = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+	if (NULL == page || init_change_log(&log, capacity, sizeof(uint64_t), TEST_FIRST_VERSION) < 0) {
+		free(page);
+		return ERR;
+	}
+
+	int result = PASSED;
+	for (size_t i = 0; i < capacity * 3 + c && PASSED == result; i++) {
+		uint64_t *e = (uint64_t *)log_change(&log);
+		*e = log.version;
+
+		uint64_t logged = log.version - log.first_version;
+		uint64_t oldest = (logged > capacity) ? log.version - capacity : log.first_version;
+		for (uint64_t from = log.first_version - 2; from <= log.version + 2; from++) {
+			int expired = (from < oldest || from > log.version);
+			if (expired != change_log_expired(&log, from)) {
+				result = FAILED;
+				break;
+			}
+			if (expired)
+				continue;
+			// Paged by 3, as the clients do.
+			uint64_t to = from;
+			size_t n;
+			while ((n = copy_versions(&log, &to, page, 3)) > 0)
+				for (size_t k = 0; k < n; k++)
+					if (page[k] != to - n + 1 + k)
+						result = FAILED;
+			if (to != log.version)
+				result = FAILED;
+		}
+		// Overwritten and future changes are not returned.
+		if (NULL != change_at(&log, oldest) || NULL != change_at(&log, log.version + 1))
+			result = FAILED;
+	}
+	destruct_change_log(&log);
+	free(page);
+	return result;
+}
+
+int
+test_wraparound(int c)
+{
+	int result = test_wraparound_of(16, c);
+	// A capacity which doesn't divide 2^64.
+	if (PASSED == result)
+		result = test_wraparound_of(7, c);
+	if (PASSED == result)
+		result = test_wraparound_of(1, c);
+	return result;
+}
+
+/*
+ * The versions of an earlier run are expired.
+ */
+int
+test_restart(int c)
+{
+	struct change_log old, log;
+	if (init_change_log(&old, 16, sizeof(uint64_t), TEST_FIRST_VERSION) < 0)
+		return ERR;
+	for (int i = 0; i < c; i++)
+		log_change(&old);
+	if (init_change_log(&log, 16, sizeof(uint64_t), TEST_FIRST_VERSION + (1 << 20)) < 0) {
+		destruct_change_log(&old);
+		return ERR;
+	}
+
+	int result = PASSED;
+	// Nothing is logged yet, and only the current version is valid.
+	if (!change_log_expired(&log, old.version) || change_log_expired(&log, log.version)
+			|| NULL != change_at(&log, log.version))
+		result = FAILED;
+	struct change_log empty;
+	if (init_change_log(&empty, 0, sizeof(uint64_t), 0) >= 0)
+		result = FAILED;
+	destruct_change_log(&old);
+	destruct_change_log(&log);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	UNIT_TEST("wraparound", test_wraparound, c);
+	UNIT_TEST("restart", test_restart, c);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
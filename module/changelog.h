@@ -0,0 +1,50 @@
+/*
+ * A ring of the last changes. The change to version v is kept in
+ * entries[v % capacity] until capacity more changes are logged. The caller
+ * serializes the calls.
+ */
+
+#ifndef _CHANGELOG_H_
+#define _CHANGELOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct change_log {
+	void *entries;
+	size_t esz;					// Entry's size.
+	size_t capacity;
+	uint64_t version;			// Version of the last change.
+	uint64_t first_version;		// Version at the start. Older ones are of another run.
+};
+
+/**
+ * @brief Initialize an empty log whose last version is first_version.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+int init_change_log(struct change_log *log, size_t capacity, size_t esz, uint64_t first_version);
+void destruct_change_log(struct change_log *log);
+
+/**
+ * @brief Advance the version. The oldest change is overwritten when the log
+ * is full.
+ *
+ * @return - The entry of the new version, to be filled by the caller.
+ */
+void *log_change(struct change_log *log);
+
+/**
+ * @brief The version is expired when its next change is overwritten, or it
+ * is not of this run.
+ *
+ * @return - Expired: 1, Not expired: 0
+ */
+int change_log_expired(const struct change_log *log, uint64_t from);
+
+/**
+ * @return - The entry of the change to version, NULL if it is not kept.
+ */
+void *change_at(const struct change_log *log, uint64_t version);
+
+#endif // _CHANGELOG_H_
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+#include "chunkstore.h"
+#include "fileutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define MANIFEST_GROW_STEP		1024
+#define CHUNK_PATH_LEN			(CS_HOME_LEN + SHA256_HEX_LEN + 16)
+
+const char *
+cs_errstr(enum ERR_CHUNKSTORE err)
+{
+	if (ERR_CHUNKSTORE_MALLOC == err)
+		return "[chunkstore] Failed to allocate memory";
+	else if (ERR_CHUNKSTORE_WRITE == err)
+		return "[chunkstore] Failed to write the file";
+	else if (ERR_CHUNKSTORE_SYNC == err)
+		return "[chunkstore] Failed to flush the chunks";
+	else
+		return "[chunkstore] Undefined error";
+}
+
+int
+init_chunk_store(struct chunk_store *cs, const char *home, size_t capacity)
+{
+	size_t n = 16;
+	while (n < capacity)
+		n <<= 1;
+	cs->table = (struct cs_entry *) calloc(n, sizeof(struct cs_entry));
+	if (NULL == cs->table)
+		return ERR_CHUNKSTORE_MALLOC;
+	strncpy(cs->home, home, CS_HOME_LEN - 1);
+	cs->home[CS_HOME_LEN - 1] = '\0';
+	cs->capacity = n;
+	cs->nchunks = 0;
+	cs->stored = 0;
+	cs->referenced = 0;
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_cond_init(&cs->written, NULL);
+	return 0;
+}
+
+/*
+ * The digest is uniformly distributed, so its first bytes are the hash.
+ */
+static size_t
+home_slot(size_t capacity, const uint8_t *digest)
+{
+	uint64_t h = 0;
+	memcpy(&h, digest, sizeof(h));
+	return h & (capacity - 1);
+}
+
+/*
+ * @return - The entry of digest, or the free slot for it.
+ */
+static struct cs_entry *
+lookup(struct cs_entry *table, size_t capacity, const uint8_t *digest)
+{
+	size_t i = home_slot(capacity, digest);
+	while (table[i].refcnt > 0 && memcmp(table[i].digest, digest, SHA256_DIGEST_LEN))
+		i = (i + 1) & (capacity - 1);
+	return &table[i];
+}
+
+static int
+grow_table(struct chunk_store *cs)
+{
+	size_t capacity = cs->capacity * 2;
+	struct cs_entry *table = (struct cs_entry *) calloc(capacity, sizeof(struct cs_entry));
+	if (NULL == table)
+		return ERR_CHUNKSTORE_MALLOC;
+	for (size_t i = 0; i < cs->capacity; i++)
+		if (cs->table[i].refcnt > 0)
+			*lookup(table, capacity, cs->table[i].digest) = cs->table[i];
+	free(cs->table);
+	cs->table = table;
+	cs->capacity = capacity;
+	return 0;
+}
+
+/*
+ * Free the slot and shift the following entries back, so that the probing
+ * sequences don't need tombstones.
+ */
+static void
+remove_entry(struct chunk_store *cs, struct cs_entry *e)
+{
+	size_t mask = cs->capacity - 1;
+	size_t i = e - cs->table;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (0 == cs->table[j].refcnt)
+			break;
+		// Entry j may move to i unless its home slot is in (i, j].
+		size_t home = home_slot(cs->capacity, cs->table[j].digest);
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			cs->table[i] = cs->table[j];
+			i = j;
+		}
+	}
+	memset(&cs->table[i], 0x00, sizeof(struct cs_entry));
+}
+
+static void
+digest_hex(const uint8_t *digest, char *hex)
+{
+	static const char xdigits[] = "0123456789abcdef";
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+		hex[i * 2] = xdigits[digest[i] >> 4];
+		hex[i * 2 + 1] = xdigits[digest[i] & 0x0f];
+	}
+	hex[SHA256_DIGEST_LEN * 2] = '\0';
+}
+
+void
+cs_chunk_path(struct chunk_store *cs, const uint8_t digest[SHA256_DIGEST_LEN],
+		char *path, size_t pathlen)
+{
+	char hex[SHA256_HEX_LEN];
+	digest_hex(digest, hex);
+	snprintf(path, pathlen, "%s/%s", cs->home, hex);
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	size_t wlen = 0;
+	while (wlen < len) {
+		ssize_t n = write(fd, (const char *)buf + wlen, len - wlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return ERR_CHUNKSTORE_WRITE;
+		wlen += n;
+	}
+	return 0;
+}
+
+/*
+ * Write a new chunk. A chunk file is published complete, so a file named by
+ * a digest always has the content of the digest.
+ */
+static int
+write_chunk(struct chunk_store *cs, const uint8_t *digest, const uint8_t *data, size_t len)
+{
+	char hex[SHA256_HEX_LEN];
+	char path[CHUNK_PATH_LEN];
+	char tmppath[CHUNK_PATH_LEN];
+
+	digest_hex(digest, hex);
+	snprintf(path, sizeof(path), "%s/%s", cs->home, hex);
+	int fd = create_temp_file_fd(cs->home, hex, tmppath, sizeof(tmppath));
+	if (fd < 0)
+		return ERR_CHUNKSTORE_WRITE;
+	if (write_all(fd, data, len) < 0 || publish_file(fd, tmppath, path) < 0) {
+		discard_temp_file(fd, tmppath);
+		return ERR_CHUNKSTORE_WRITE;
+	}
+	if (close_file_fd(fd) < 0) {
+		unlink(path);
+		return ERR_CHUNKSTORE_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * A new chunk is reserved in the table and written without the lock, so
+ * the writes of different chunks don't wait for each other. Others who
+ * need the chunk meanwhile wait until it is published, so a chunk they get
+ * is always on the disk. The entry may move while the lock is released.
+ */
+static int
+ref_chunk(struct chunk_store *cs, const uint8_t *digest, const uint8_t *data, size_t len)
+{
+	int result = 0;
+	struct cs_entry *e = NULL;
+	pthread_mutex_lock(&cs->lock);
+	while (1) {
+		// Keep the load factor under 3/4.
+		if (4 * (cs->nchunks + 1) > 3 * cs->capacity && (result = grow_table(cs)) < 0)
+			goto out;
+		e = lookup(cs->table, cs->capacity, digest);
+		if (0 == e->refcnt)
+			break;
+		if (!e->writing) {
+			e->refcnt++;
+			cs->referenced += len;
+			goto out;
+		}
+		// The writer may give up. Look again after it's done.
+		pthread_cond_wait(&cs->written, &cs->lock);
+	}
+
+	// Our reference keeps the slot while the file is written.
+	memcpy(e->digest, digest, SHA256_DIGEST_LEN);
+	e->len = (uint32_t)len;
+	e->refcnt = 1;
+	e->writing = 1;
+	cs->nchunks++;
+	pthread_mutex_unlock(&cs->lock);
+
+	result = write_chunk(cs, digest, data, len);
+
+	pthread_mutex_lock(&cs->lock);
+	e = lookup(cs->table, cs->capacity, digest);
+	if (result < 0) {
+		cs->nchunks--;
+		remove_entry(cs, e);
+	} else {
+		e->writing = 0;
+		cs->stored += len;
+		cs->referenced += len;
+	}
+	pthread_cond_broadcast(&cs->written);
+out:
+	pthread_mutex_unlock(&cs->lock);
+	return result;
+}
+
+/*
+ * The lock must be held.
+ */
+static void
+unref_chunk(struct chunk_store *cs, const uint8_t *digest)
+{
+	char path[CHUNK_PATH_LEN];
+	struct cs_entry *e = lookup(cs->table, cs->capacity, digest);
+	if (0 == e->refcnt)
+		return;
+	cs->referenced -= e->len;
+	if (--e->refcnt > 0)
+		return;
+	cs_chunk_path(cs, digest, path, sizeof(path));
+	unlink(path);
+	cs->stored -= e->len;
+	cs->nchunks--;
+	remove_entry(cs, e);
+}
+
+static void
+free_manifest(struct chunk_manifest *m)
+{
+	free(m->chunks);
+	free(m->offsets);
+	free(m);
+}
+
+static int
+append_chunk(struct chunk_manifest *m, size_t *cap, const uint8_t *digest, uint32_t len)
+{
+	if (m->nchunks == *cap) {
+		size_t ncap = *cap + MANIFEST_GROW_STEP;
+		struct chunk_ref *chunks = realloc(m->chunks, ncap * sizeof(struct chunk_ref));
+		if (NULL == chunks)
+			return ERR_CHUNKSTORE_MALLOC;
+		m->chunks = chunks;
+		int64_t *offsets = realloc(m->offsets, ncap * sizeof(int64_t));
+		if (NULL == offsets)
+			return ERR_CHUNKSTORE_MALLOC;
+		m->offsets = offsets;
+		*cap = ncap;
+	}
+	struct chunk_ref *ref = &m->chunks[m->nchunks];
+	memcpy(ref->digest, digest, SHA256_DIGEST_LEN);
+	ref->len = len;
+	ref->reserved = 0;
+	m->offsets[m->nchunks] = m->flen;
+	m->nchunks++;
+	m->flen += len;
+	return 0;
+}
+
+/*
+ * Chunks are hashed and written without the lock. Only the lookups are
+ * serialized.
+ */
+int
+cs_store_data(struct chunk_store *cs, const struct fastcdc *cdc, const uint8_t *data,
+		int64_t flen, struct chunk_manifest **pm)
+{
+	struct chunk_manifest *m = (struct chunk_manifest *) calloc(1, sizeof(struct chunk_manifest));
+	if (NULL == m)
+		return ERR_CHUNKSTORE_MALLOC;
+	m->refcnt = 1;
+
+	int result = 0;
+	size_t cap = 0;
+	struct sha256_ctx ctx;
+	uint8_t digest[SHA256_DIGEST_LEN];
+	int64_t offset = 0;
+	while (offset < flen) {
+		size_t len = fastcdc_cut(cdc, data + offset, flen - offset);
+		sha256_init(&ctx);
+		sha256_update(&ctx, data + offset, len);
+		sha256_final(&ctx, digest);
+		result = ref_chunk(cs, digest, data + offset, len);
+		if (result < 0)
+			break;
+		result = append_chunk(m, &cap, digest, (uint32_t)len);
+		if (result < 0) {
+			pthread_mutex_lock(&cs->lock);
+			unref_chunk(cs, digest);
+			pthread_mutex_unlock(&cs->lock);
+			break;
+		}
+		offset += len;
+	}
+	if (result < 0) {
+		cs_put_manifest(cs, m);
+		return result;
+	}
+	*pm = m;
+	return 0;
+}
+
+int
+cs_write_manifest(const struct chunk_manifest *m, int fd)
+{
+	struct manifest_header hdr;
+	memset(&hdr, 0x00, sizeof(struct manifest_header));
+	memcpy(hdr.magic, CS_MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.flen = m->flen;
+	hdr.nchunks = (int64_t)m->nchunks;
+	if (write_all(fd, &hdr, sizeof(struct manifest_header)) < 0)
+		return ERR_CHUNKSTORE_WRITE;
+	return write_all(fd, m->chunks, m->nchunks * sizeof(struct chunk_ref));
+}
+
+/*
+ * The chunk files are written without flushes. syncfs flushes all of them
+ * and the directory at once.
+ */
+int
+cs_sync(struct chunk_store *cs)
+{
+	int dirfd = open_directory_fd(cs->home);
+	if (dirfd < 0)
+		return ERR_CHUNKSTORE_SYNC;
+	int result = syncfs(dirfd);
+	close(dirfd);
+	return (0 == result) ? 0 : ERR_CHUNKSTORE_SYNC;
+}
+
+struct chunk_manifest *
+cs_get_manifest(struct chunk_store *cs, struct chunk_manifest **slot)
+{
+	pthread_mutex_lock(&cs->lock);
+	struct chunk_manifest *m = *slot;
+	if (NULL != m)
+		m->refcnt++;
+	pthread_mutex_unlock(&cs->lock);
+	return m;
+}
+
+void
+cs_put_manifest(struct chunk_store *cs, struct chunk_manifest *m)
+{
+	if (NULL == m)
+		return;
+	pthread_mutex_lock(&cs->lock);
+	int last = (0 == --m->refcnt);
+	if (last)
+		for (size_t i = 0; i < m->nchunks; i++)
+			unref_chunk(cs, m->chunks[i].digest);
+	pthread_mutex_unlock(&cs->lock);
+	if (last)
+		free_manifest(m);
+}
+
+void
+cs_attach_manifest(struct chunk_store *cs, struct chunk_manifest **slot,
+		struct chunk_manifest *m)
+{
+	pthread_mutex_lock(&cs->lock);
+	struct chunk_manifest *old = *slot;
+	*slot = m;
+	pthread_mutex_unlock(&cs->lock);
+	cs_put_manifest(cs, old);
+}
+
+void
+cs_detach_manifest(struct chunk_store *cs, struct chunk_manifest **slot)
+{
+	pthread_mutex_lock(&cs->lock);
+	struct chunk_manifest *m = *slot;
+	*slot = NULL;
+	pthread_mutex_unlock(&cs->lock);
+	cs_put_manifest(cs, m);
+}
+
+size_t
+cs_find_chunk(const struct chunk_manifest *m, int64_t offset)
+{
+	size_t lo = 0;
+	size_t hi = m->nchunks;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (m->offsets[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+cs_stat(struct chunk_store *cs, size_t *nchunks, int64_t *stored, int64_t *referenced)
+{
+	pthread_mutex_lock(&cs->lock);
+	*nchunks = cs->nchunks;
+	*stored = cs->stored;
+	*referenced = cs->referenced;
+	pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * No manifest may be in use. The chunk files are kept.
+ */
+void
+destruct_chunk_store(struct chunk_store *cs)
+{
+	free(cs->table);
+	pthread_cond_destroy(&cs->written);
+	pthread_mutex_destroy(&cs->lock);
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+#include "fileutil.c"
+#include "fastcdc.c"
+#include "sha256.c"
+
+#define TEST_CAPACITY		16
+#define TEST_DATA_LEN		(1024 * 1024)
+#define TEST_THREADS		8
+
+static char g_home[] = "/tmp/chunkstore_test.XXXXXX";
+static uint8_t *g_data = NULL;
+static struct fastcdc g_cdc;
+
+/*
+ * A random digest whose home slot is slot.
+ */
+static void
+make_digest(uint8_t *digest, size_t capacity, size_t slot)
+{
+	uint64_t h = 0;
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++)
+		digest[i] = rand() & 0xff;
+	memcpy(&h, digest, sizeof(h));
+	h = (h & ~(uint64_t)(capacity - 1)) | slot;
+	memcpy(digest, &h, sizeof(h));
+}
+
+/*
+ * Every entry must be reachable from its home slot without a free slot
+ * in between.
+ */
+static int
+table_consistent(struct chunk_store *cs, size_t nentries)
+{
+	size_t used = 0;
+	for (size_t j = 0; j < cs->capacity; j++) {
+		if (0 == cs->table[j].refcnt)
+			continue;
+		used++;
+		size_t i = home_slot(cs->capacity, cs->table[j].digest);
+		for (; i != j; i = (i + 1) & (cs->capacity - 1))
+			if (0 == cs->table[i].refcnt)
+				return 0;
+	}
+	return used == nentries;
+}
+
+static int
+chunk_on_disk(struct chunk_store *cs, const uint8_t *digest)
+{
+	char path[CHUNK_PATH_LEN];
+	cs_chunk_path(cs, digest, path, sizeof(path));
+	return 0 == access(path, F_OK);
+}
+
+/*
+ * Colliding keys around the end of the table are removed in random orders.
+ */
+static int
+test_remove_entry(int c)
+{
+	const size_t homes[] = { 13, 14, 15, 0, 1 };
+	const int n = 11;	// Stays under the load factor of TEST_CAPACITY.
+	uint8_t digests[11][SHA256_DIGEST_LEN];
+	struct chunk_store cs;
+
+	for (int round = 0; round < c; round++) {
+		if (init_chunk_store(&cs, g_home, TEST_CAPACITY) < 0)
+			return ERR;
+		for (int i = 0; i < n; i++) {
+			make_digest(digests[i], TEST_CAPACITY, homes[rand() % 5]);
+			if (ref_chunk(&cs, digests[i], g_data, 16) < 0)
+				goto failed;
+		}
+		if (TEST_CAPACITY != cs.capacity || !table_consistent(&cs, n))
+			goto failed;
+
+		int order[11];
+		for (int i = 0; i < n; i++)
+			order[i] = i;
+		for (int i = n - 1; i > 0; i--) {
+			int j = rand() % (i + 1);
+			int t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+		for (int k = 0; k < n; k++) {
+			unref_chunk(&cs, digests[order[k]]);
+			if (!table_consistent(&cs, n - k - 1) || chunk_on_disk(&cs, digests[order[k]]))
+				goto failed;
+			for (int r = k + 1; r < n; r++) {
+				struct cs_entry *e = lookup(cs.table, cs.capacity, digests[order[r]]);
+				if (1 != e->refcnt)
+					goto failed;
+			}
+		}
+		destruct_chunk_store(&cs);
+	}
+	return PASSED;
+
+failed:
+	destruct_chunk_store(&cs);
+	return FAILED;
+}
+
+/*
+ * A chunk stays while a manifest refers to it.
+ */
+static int
+test_refcnt(int c)
+{
+	struct chunk_store cs;
+	struct chunk_manifest *m1 = NULL;
+	struct chunk_manifest *m2 = NULL;
+	size_t nchunks = 0;
+	int64_t stored = 0;
+	int64_t referenced = 0;
+
+	if (init_chunk_store(&cs, g_home, TEST_CAPACITY) < 0)
+		return ERR;
+	if (cs_store_data(&cs, &g_cdc, g_data, TEST_DATA_LEN, &m1) < 0
+			|| cs_store_data(&cs, &g_cdc, g_data, TEST_DATA_LEN, &m2) < 0)
+		goto failed;
+	cs_stat(&cs, &nchunks, &stored, &referenced);
+	if (nchunks != m1->nchunks || TEST_DATA_LEN != stored || 2 * TEST_DATA_LEN != referenced
+			|| m1->flen != TEST_DATA_LEN || m1->nchunks != m2->nchunks)
+		goto failed;
+	for (size_t i = 0; i < m1->nchunks; i++) {
+		struct cs_entry *e = lookup(cs.table, cs.capacity, m1->chunks[i].digest);
+		if (2 != e->refcnt || e->writing || !chunk_on_disk(&cs, e->digest))
+			goto failed;
+		if (cs_find_chunk(m1, m1->offsets[i] + m1->chunks[i].len - 1) != i)
+			goto failed;
+	}
+
+	// A reader keeps the chunks of a released file.
+	struct chunk_manifest *slot = m1;
+	struct chunk_manifest *reader = cs_get_manifest(&cs, &slot);
+	cs_detach_manifest(&cs, &slot);
+	cs_put_manifest(&cs, m2);
+	cs_stat(&cs, &nchunks, &stored, &referenced);
+	if (nchunks != reader->nchunks || TEST_DATA_LEN != referenced)
+		goto failed;
+	uint8_t first[SHA256_DIGEST_LEN];
+	memcpy(first, reader->chunks[0].digest, SHA256_DIGEST_LEN);
+	cs_put_manifest(&cs, reader);
+
+	cs_stat(&cs, &nchunks, &stored, &referenced);
+	if (0 != nchunks || 0 != stored || 0 != referenced || chunk_on_disk(&cs, first))
+		goto failed;
+	destruct_chunk_store(&cs);
+	return PASSED;
+
+failed:
+	destruct_chunk_store(&cs);
+	return FAILED;
+}
+
+static struct chunk_store g_shared;
+
+static void *
+store_routine(void *arg)
+{
+	struct chunk_manifest *m = NULL;
+	if (cs_store_data(&g_shared, &g_cdc, g_data, TEST_DATA_LEN, &m) < 0)
+		return NULL;
+	return m;
+}
+
+/*
+ * Concurrent stores of the same data write each chunk once and share it.
+ */
+static int
+test_concurrent_store(int c)
+{
+	pthread_t tids[TEST_THREADS];
+	struct chunk_manifest *ms[TEST_THREADS];
+	size_t nchunks = 0;
+	int64_t stored = 0;
+	int64_t referenced = 0;
+	int result = PASSED;
+
+	if (init_chunk_store(&g_shared, g_home, TEST_CAPACITY) < 0)
+		return ERR;
+	for (int i = 0; i < TEST_THREADS; i++)
+		pthread_create(&tids[i], NULL, store_routine, NULL);
+	for (int i = 0; i < TEST_THREADS; i++)
+		pthread_join(tids[i], (void **)&ms[i]);
+
+	for (int i = 0; i < TEST_THREADS; i++)
+		if (NULL == ms[i])
+			result = FAILED;
+	cs_stat(&g_shared, &nchunks, &stored, &referenced);
+	if (PASSED == result && (nchunks != ms[0]->nchunks || TEST_DATA_LEN != stored 
+				|| (int64_t)TEST_THREADS * TEST_DATA_LEN != referenced))
+		result = FAILED;
+	for (size_t i = 0; PASSED == result && i < ms[0]->nchunks; i++) {
+		struct cs_entry *e = lookup(g_shared.table, g_shared.capacity, ms[0]->chunks[i].digest);
+		if (TEST_THREADS != e->refcnt || e->writing)
+			result = FAILED;
+	}
+	for (int i = 0; i < TEST_THREADS; i++)
+		cs_put_manifest(&g_shared, ms[i]);
+	cs_stat(&g_shared, &nchunks, &stored, &referenced);
+	if (0 != nchunks || 0 != stored)
+		result = FAILED;
+	destruct_chunk_store(&g_shared);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	srand(c);
+	if (NULL == mkdtemp(g_home))
+		return 1;
+	g_data = (uint8_t *) malloc(TEST_DATA_LEN);
+	if (NULL == g_data)
+		return 1;
+	for (int i = 0; i < TEST_DATA_LEN; i++)
+		g_data[i] = rand() & 0xff;
+	init_fastcdc(&g_cdc, 16 * 1024);
+
+	UNIT_TEST("remove_entry", test_remove_entry, c);
+	UNIT_TEST("refcnt", test_refcnt, c);
+	UNIT_TEST("concurrent store", test_concurrent_store, c);
+
+	free(g_data);
+	rmdir(g_home);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
@@ -0,0 +1,138 @@
+/*
+ * Store of the file chunks keyed by their SHA-256. Each unique chunk is kept
+ * once in a file named by its digest and reference counted by the manifests
+ * of the files using it. A chunk file is removed with its last reference.
+ *
+ * A manifest lists the chunks of a file in order. It is reference counted
+ * by its readers, so the chunks of a removed file stay until the readers
+ * finish.
+ */
+
+#ifndef _CHUNKSTORE_H_
+#define _CHUNKSTORE_H_
+
+#include "fastcdc.h"
+#include "sha256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define CS_HOME_LEN			64
+#define CS_MANIFEST_MAGIC	"TSCHUNK1"
+
+enum ERR_CHUNKSTORE {
+	ERR_CHUNKSTORE_MALLOC = -1,
+	ERR_CHUNKSTORE_WRITE = -2,
+	ERR_CHUNKSTORE_SYNC = -3
+};
+
+struct cs_entry {
+	uint8_t digest[SHA256_DIGEST_LEN];
+	uint32_t len;
+	uint32_t refcnt;				// 0 if the slot is free.
+	uint32_t writing;				// 1 until the chunk file is published.
+};
+
+struct chunk_store {
+	pthread_mutex_t lock;
+	pthread_cond_t written;			// A chunk file is published or given up.
+	char home[CS_HOME_LEN];			// Directory of the chunk files.
+	size_t capacity;				// Slots of the table. Power of 2.
+	size_t nchunks;
+	struct cs_entry *table;			// Open addressing with linear probing.
+	// Statistics
+	int64_t stored;					// Bytes of the unique chunks.
+	int64_t referenced;				// Bytes of the files made of the chunks.
+};
+
+struct chunk_ref {
+	uint8_t digest[SHA256_DIGEST_LEN];
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct manifest_header {
+	char magic[8];
+	int64_t flen;
+	int64_t nchunks;
+};
+
+struct chunk_manifest {
+	int refcnt;						// Readers and the owner.
+	int64_t flen;
+	size_t nchunks;
+	struct chunk_ref *chunks;
+	int64_t *offsets;				// Offset of each chunk in the file.
+};
+
+const char *cs_errstr(enum ERR_CHUNKSTORE err);
+
+/**
+ * @brief Initialize an empty store. The directory must exist.
+ *
+ * @param capacity - Initial slots of the index. Grows as needed.
+ * @return - Success: 0, Fail: ERR_CHUNKSTORE_MALLOC
+ */
+int init_chunk_store(struct chunk_store *cs, const char *home, size_t capacity);
+
+/**
+ * @brief Split data into chunks and take a reference to each of them. New
+ * chunks are written to the store.
+ *
+ * @param pm - The manifest of data will be set. Owned by the caller.
+ * @return - Success: 0, Fail: enum ERR_CHUNKSTORE
+ */
+int cs_store_data(struct chunk_store *cs, const struct fastcdc *cdc, const uint8_t *data,
+		int64_t flen, struct chunk_manifest **pm);
+
+/**
+ * @brief Write the manifest to fd.
+ *
+ * @return - Success: 0, Fail: ERR_CHUNKSTORE_WRITE
+ */
+int cs_write_manifest(const struct chunk_manifest *m, int fd);
+
+/**
+ * @brief Flush the chunk files to the disk.
+ *
+ * @return - Success: 0, Fail: ERR_CHUNKSTORE_SYNC
+ */
+int cs_sync(struct chunk_store *cs);
+
+/**
+ * @brief Take a reference to the manifest held in *slot.
+ *
+ * @return - The manifest, NULL if the slot is empty.
+ */
+struct chunk_manifest *cs_get_manifest(struct chunk_store *cs, struct chunk_manifest **slot);
+
+/**
+ * @brief Put the manifest in *slot. The reference of the caller moves to the
+ * slot. The previous manifest in the slot is released.
+ */
+void cs_attach_manifest(struct chunk_store *cs, struct chunk_manifest **slot,
+		struct chunk_manifest *m);
+
+/**
+ * @brief Release a reference to the manifest. The chunks are released with
+ * the last reference.
+ */
+void cs_put_manifest(struct chunk_store *cs, struct chunk_manifest *m);
+
+/**
+ * @brief Empty the slot and release the reference it owned.
+ */
+void cs_detach_manifest(struct chunk_store *cs, struct chunk_manifest **slot);
+
+/**
+ * @brief Index of the chunk containing offset.
+ */
+size_t cs_find_chunk(const struct chunk_manifest *m, int64_t offset);
+
+void cs_chunk_path(struct chunk_store *cs, const uint8_t digest[SHA256_DIGEST_LEN],
+		char *path, size_t pathlen);
+void cs_stat(struct chunk_store *cs, size_t *nchunks, int64_t *stored, int64_t *referenced);
+void destruct_chunk_store(struct chunk_store *cs);
+
+#endif // _CHUNKSTORE_H_
@@ -0,0 +1,571 @@
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define MINMATCH				4
+#define LASTLITERALS			5		// The last bytes of a block are literals.
+#define MFLIMIT					12		// No match starts in the last bytes.
+#define MAX_DISTANCE			65535
+#define FAST_HASH_BITS			12
+#define HIGH_HASH_BITS			15
+#define HIGH_SEARCH_DEPTH		64
+#define CZ_MIN_SAVING			16		// A block must shrink by 1/16 to be compressed.
+#define CZ_SKIP_MAX				64
+
+#define CZ_INLINE		static inline __attribute__((always_inline))
+
+CZ_INLINE uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+CZ_INLINE uint32_t
+hash4(uint32_t v, int bits)
+{
+	return (v * 2654435761u) >> (32 - bits);
+}
+
+CZ_INLINE uint8_t *
+put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/*
+ * Length of the common prefix of p and m, compared 8 bytes at a time.
+ */
+CZ_INLINE const uint8_t *
+extend_match(const uint8_t *p, const uint8_t *m, const uint8_t *limit)
+{
+	while (p + 8 <= limit) {
+		uint64_t a, b;
+		memcpy(&a, p, 8);
+		memcpy(&b, m, 8);
+		if (a != b)
+			return p + (__builtin_ctzll(a ^ b) >> 3);
+		p += 8;
+		m += 8;
+	}
+	while (p < limit && *p == *m) {
+		p++;
+		m++;
+	}
+	return p;
+}
+
+/*
+ * @return - The end of the sequence, NULL if it doesn't fit in oend.
+ */
+CZ_INLINE uint8_t *
+put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t litlen, size_t offset, size_t mlen)
+{
+	size_t ml = mlen - MINMATCH;
+	if (op + litlen + litlen / 255 + ml / 255 + 8 > oend)
+		return NULL;
+	uint8_t *token = op++;
+	*token = (uint8_t)(((litlen < 15) ? litlen : 15) << 4);
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	*token |= (uint8_t)((ml < 15) ? ml : 15);
+	if (ml >= 15)
+		op = put_length(op, ml - 15);
+	return op;
+}
+
+CZ_INLINE uint8_t *
+put_literals(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t litlen)
+{
+	if (op + litlen + litlen / 255 + 2 > oend)
+		return NULL;
+	*op++ = (uint8_t)(((litlen < 15) ? litlen : 15) << 4);
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	return op + litlen;
+}
+
+/*
+ * The step grows while nothing matches, so that incompressible data is
+ * passed quickly.
+ *
+ * @return - Compressed length, 0 if it exceeds cap.
+ */
+__attribute__((optimize("O2")))
+static size_t
+compress_fast(int32_t *head, const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + cap;
+
+	if (len > MFLIMIT) {
+		const uint8_t *mflimit = end - MFLIMIT;
+		const uint8_t *matchlimit = end - LASTLITERALS;
+		unsigned searched = 0;
+		memset(head, 0xff, sizeof(int32_t) << FAST_HASH_BITS);
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq, FAST_HASH_BITS);
+			int32_t ref = head[h];
+			head[h] = (int32_t)(ip - src);
+			if (ref < 0 || ip - src - ref > MAX_DISTANCE || read32(src + ref) != seq) {
+				ip += 1 + (searched++ >> 6);
+				continue;
+			}
+			searched = 0;
+			const uint8_t *match = src + ref;
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+			const uint8_t *p = extend_match(ip + MINMATCH, match + MINMATCH, matchlimit);
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - match, p - ip);
+			if (NULL == op)
+				return 0;
+			ip = p;
+			anchor = p;
+			if (ip < mflimit)
+				head[hash4(read32(ip - 2), FAST_HASH_BITS)] = (int32_t)(ip - 2 - src);
+		}
+	}
+	op = put_literals(op, oend, anchor, end - anchor);
+	return (NULL == op) ? 0 : (size_t)(op - dst);
+}
+
+/*
+ * Every position is chained to the previous one of the same hash, and the
+ * longest match among HIGH_SEARCH_DEPTH candidates is taken.
+ */
+__attribute__((optimize("O2")))
+static size_t
+compress_high(int32_t *head, int32_t *chain, const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + cap;
+
+	if (len > MFLIMIT) {
+		const uint8_t *mflimit = end - MFLIMIT;
+		const uint8_t *matchlimit = end - LASTLITERALS;
+		int32_t inserted = 0;
+		memset(head, 0xff, sizeof(int32_t) << HIGH_HASH_BITS);
+		while (ip < mflimit) {
+			int32_t pos = (int32_t)(ip - src);
+			for (; inserted < pos; inserted++) {
+				uint32_t h = hash4(read32(src + inserted), HIGH_HASH_BITS);
+				chain[inserted] = head[h];
+				head[h] = inserted;
+			}
+			uint32_t seq = read32(ip);
+			size_t best = 0;
+			const uint8_t *best_match = NULL;
+			int32_t ref = head[hash4(seq, HIGH_HASH_BITS)];
+			for (int depth = 0; ref >= 0 && depth < HIGH_SEARCH_DEPTH && pos - ref <= MAX_DISTANCE;
+					depth++, ref = chain[ref]) {
+				const uint8_t *m = src + ref;
+				if ((best > 0 && m[best] != ip[best]) || read32(m) != seq)
+					continue;
+				const uint8_t *p = extend_match(ip + MINMATCH, m + MINMATCH, matchlimit);
+				if ((size_t)(p - ip) > best) {
+					best = p - ip;
+					best_match = src + ref;
+				}
+			}
+			if (0 == best) {
+				ip++;
+				continue;
+			}
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - best_match, best);
+			if (NULL == op)
+				return 0;
+			ip += best;
+			anchor = ip;
+		}
+	}
+	op = put_literals(op, oend, anchor, end - anchor);
+	return (NULL == op) ? 0 : (size_t)(op - dst);
+}
+
+int
+init_cz_encoder(struct cz_encoder *enc, enum COMPRESS_TYPE type)
+{
+	memset(enc, 0x00, sizeof(struct cz_encoder));
+	enc->type = type;
+	if (COMPRESS_FAST == type) {
+		enc->head = (int32_t *) malloc(sizeof(int32_t) << FAST_HASH_BITS);
+		return (NULL == enc->head) ? -1 : 0;
+	} else if (COMPRESS_HIGH == type) {
+		enc->head = (int32_t *) malloc(sizeof(int32_t) << HIGH_HASH_BITS);
+		enc->chain = (int32_t *) malloc(sizeof(int32_t) * CZ_BLOCK_SIZE);
+		if (NULL == enc->head || NULL == enc->chain) {
+			destruct_cz_encoder(enc);
+			return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+void
+destruct_cz_encoder(struct cz_encoder *enc)
+{
+	free(enc->head);
+	free(enc->chain);
+	enc->head = NULL;
+	enc->chain = NULL;
+}
+
+size_t
+cz_encode(struct cz_encoder *enc, const uint8_t *src, size_t len, uint8_t *frame)
+{
+	struct cz_frame *f = (struct cz_frame *)frame;
+	uint8_t *payload = frame + sizeof(struct cz_frame);
+	size_t cap = len - len / CZ_MIN_SAVING;
+	size_t zlen = 0;
+
+	if (enc->skip > 0) {
+		enc->skip--;
+	} else {
+		if (COMPRESS_FAST == enc->type)
+			zlen = compress_fast(enc->head, src, len, payload, cap);
+		else
+			zlen = compress_high(enc->head, enc->chain, src, len, payload, cap);
+		// Back off exponentially on incompressible data.
+		if (0 == zlen) {
+			enc->misses++;
+			enc->skip = (enc->misses < 7) ? (1 << enc->misses) - 1 : CZ_SKIP_MAX;
+		} else {
+			enc->misses = 0;
+		}
+	}
+	if (0 == zlen)
+		memcpy(payload, src, len);
+	f->rawlen = htonl((uint32_t)len);
+	f->zlen = htonl((uint32_t)zlen);
+
+	size_t flen = sizeof(struct cz_frame) + ((0 == zlen) ? len : zlen);
+	enc->raw += len;
+	enc->wire += flen;
+	return flen;
+}
+
+int
+cz_frame_ntoh(struct cz_frame *frame)
+{
+	frame->rawlen = ntohl(frame->rawlen);
+	frame->zlen = ntohl(frame->zlen);
+	if (0 == frame->rawlen || frame->rawlen > CZ_BLOCK_SIZE || frame->zlen > CZ_BOUND(frame->rawlen))
+		return -1;
+	return 0;
+}
+
+CZ_INLINE int
+get_length(const uint8_t **pip, const uint8_t *iend, size_t *len)
+{
+	const uint8_t *ip = *pip;
+	unsigned b = 255;
+	while (255 == b) {
+		if (ip >= iend)
+			return -1;
+		b = *ip++;
+		*len += b;
+	}
+	*pip = ip;
+	return 0;
+}
+
+__attribute__((optimize("O2")))
+int64_t
+cz_decode(const uint8_t *src, size_t zlen, uint8_t *dst, size_t rawlen)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + zlen;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + rawlen;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t litlen = token >> 4;
+		if (15 == litlen && get_length(&ip, iend, &litlen) < 0)
+			return -1;
+		if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		// The last sequence has no match.
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (0 == offset || offset > (size_t)(op - dst))
+			return -1;
+		size_t mlen = token & 15;
+		if (15 == mlen && get_length(&ip, iend, &mlen) < 0)
+			return -1;
+		mlen += MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+		// An overlapping match repeats the pattern. The copied part doubles
+		// in each step.
+		for (size_t dist = offset; mlen > 0; ) {
+			size_t n = (mlen < dist) ? mlen : dist;
+			memcpy(op, op - dist, n);
+			op += n;
+			mlen -= n;
+			dist += n;
+		}
+	}
+	return (op == oend) ? (int64_t)rawlen : -1;
+}
+
+// The test of packfile.c includes this file.
+#if defined(_UNIT_TEST_) && !defined(_PACKFILE_H_)
+
+#include "../test/mk_ctest.h"
+
+static uint32_t g_seed = 2463534242u;
+
+static uint32_t
+next_random(void)
+{
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 17;
+	g_seed ^= g_seed << 5;
+	return g_seed;
+}
+
+/*
+ * Words, runs of a byte and short repeated patterns, so that the matches
+ * are long, short and overlapping.
+ */
+static void
+fill_text(uint8_t *p, size_t len)
+{
+	static const char *words[] = { "inventory ", "snapshot ", "chunk ", "frame ", "a ", "\n" };
+	size_t i = 0;
+	while (i < len) {
+		uint32_t r = next_random();
+		size_t n = 0;
+		switch (r % 4) {
+		case 0:		// Run
+			n = 1 + (r >> 8) % 300;
+			for (size_t k = 0; k < n && i + k < len; k++)
+				p[i + k] = (uint8_t)(r >> 24);
+			break;
+		case 1:		// Pattern
+			n = 2 + (r >> 8) % 40;
+			for (size_t k = 0; k < n && i + k < len; k++)
+				p[i + k] = "xyz"[k % (1 + (r >> 16) % 3)];
+			break;
+		case 2:		// Noise
+			n = 1 + (r >> 8) % 8;
+			for (size_t k = 0; k < n && i + k < len; k++)
+				p[i + k] = (uint8_t)next_random();
+			break;
+		default:
+			n = strlen(words[(r >> 8) % 6]);
+			for (size_t k = 0; k < n && i + k < len; k++)
+				p[i + k] = words[(r >> 8) % 6][k];
+			break;
+		}
+		i += n;
+	}
+}
+
+static void
+fill_random(uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		p[i] = (uint8_t)next_random();
+}
+
+/*
+ * Sends src through a frame the way the transfers do.
+ *
+ * @return - zlen of the frame, -1 if src is not restored.
+ */
+static int64_t
+round_trip(struct cz_encoder *enc, const uint8_t *src, size_t len)
+{
+	static uint8_t frame[CZ_FRAME_MAX];
+	static uint8_t out[CZ_BLOCK_SIZE];
+	size_t flen = cz_encode(enc, src, len, frame);
+	struct cz_frame f;
+	memcpy(&f, frame, sizeof(f));
+	if (flen > CZ_FRAME_MAX || cz_frame_ntoh(&f) < 0 || f.rawlen != len)
+		return -1;
+	if (flen != sizeof(f) + ((0 == f.zlen) ? len : f.zlen))
+		return -1;
+
+	const uint8_t *payload = frame + sizeof(f);
+	if (0 == f.zlen)
+		memcpy(out, payload, len);
+	else if (cz_decode(payload, f.zlen, out, len) != (int64_t)len)
+		return -1;
+	return (0 == memcmp(out, src, len)) ? (int64_t)f.zlen : -1;
+}
+
+static int
+test_round_trip(enum COMPRESS_TYPE type, int c)
+{
+	struct cz_encoder enc;
+	uint8_t *src = (uint8_t *) malloc(CZ_BLOCK_SIZE);
+	if (NULL == src || init_cz_encoder(&enc, type) < 0) {
+		free(src);
+		return ERR;
+	}
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		size_t len = (0 == i) ? CZ_BLOCK_SIZE : 1 + next_random() % CZ_BLOCK_SIZE;
+		fill_text(src, len);
+		int tried = (0 == enc.skip);
+		int64_t zlen = round_trip(&enc, src, len);
+		// Long text blocks always shrink, unless a short one started the back-off.
+		if (zlen < 0 || (tried && len >= 1024 && 0 == zlen))
+			result = FAILED;
+	}
+	destruct_cz_encoder(&enc);
+	free(src);
+	return result;
+}
+
+int
+test_fast(int c)
+{
+	return test_round_trip(COMPRESS_FAST, c);
+}
+
+int
+test_high(int c)
+{
+	return test_round_trip(COMPRESS_HIGH, c);
+}
+
+/*
+ * Incompressible blocks are stored, and the encoder tries again after the
+ * back-off.
+ */
+int
+test_stored(int c)
+{
+	struct cz_encoder enc;
+	uint8_t *src = (uint8_t *) malloc(CZ_BLOCK_SIZE);
+	if (NULL == src || init_cz_encoder(&enc, COMPRESS_FAST) < 0) {
+		free(src);
+		return ERR;
+	}
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		fill_random(src, CZ_BLOCK_SIZE);
+		if (0 != round_trip(&enc, src, CZ_BLOCK_SIZE))
+			result = FAILED;
+	}
+	int compressed = 0;
+	for (int i = 0; i <= CZ_SKIP_MAX && PASSED == result && !compressed; i++) {
+		fill_text(src, CZ_BLOCK_SIZE);
+		int64_t zlen = round_trip(&enc, src, CZ_BLOCK_SIZE);
+		if (zlen < 0)
+			result = FAILED;
+		compressed = (zlen > 0);
+	}
+	if (!compressed || enc.raw <= 0 || enc.wire <= 0)
+		result = FAILED;
+	destruct_cz_encoder(&enc);
+	free(src);
+	return result;
+}
+
+/*
+ * Truncated or damaged payloads are rejected without writing out of dst.
+ */
+int
+test_corrupted(int c)
+{
+	struct cz_encoder enc;
+	uint8_t *src = (uint8_t *) malloc(CZ_BLOCK_SIZE);
+	uint8_t *frame = (uint8_t *) malloc(CZ_FRAME_MAX);
+	uint8_t *out = (uint8_t *) malloc(CZ_BLOCK_SIZE);
+	int result = PASSED;
+	if (NULL == src || NULL == frame || NULL == out || init_cz_encoder(&enc, COMPRESS_HIGH) < 0) {
+		result = ERR;
+		goto out;
+	}
+
+	for (int i = 0; i < c && PASSED == result; i++) {
+		size_t len = 1024 + next_random() % (CZ_BLOCK_SIZE - 1024);
+		fill_text(src, len);
+		cz_encode(&enc, src, len, frame);
+		struct cz_frame f;
+		memcpy(&f, frame, sizeof(f));
+		if (cz_frame_ntoh(&f) < 0 || 0 == f.zlen) {
+			result = FAILED;
+			break;
+		}
+		uint8_t *payload = frame + sizeof(f);
+		// Truncated
+		if (cz_decode(payload, f.zlen - 1 - next_random() % (f.zlen - 1), out, len) >= 0)
+			result = FAILED;
+		// A shorter destination
+		if (cz_decode(payload, f.zlen, out, len - 1) >= 0)
+			result = FAILED;
+		// A random byte, which may happen to decode but must stay in bounds.
+		payload[next_random() % f.zlen] ^= (uint8_t)(1 + next_random() % 255);
+		cz_decode(payload, f.zlen, out, len);
+	}
+
+	// Invalid headers
+	struct cz_frame f = { htonl(0), htonl(0) };
+	if (0 == cz_frame_ntoh(&f))
+		result = FAILED;
+	f.rawlen = htonl(CZ_BLOCK_SIZE + 1);
+	f.zlen = htonl(0);
+	if (0 == cz_frame_ntoh(&f))
+		result = FAILED;
+	f.rawlen = htonl(100);
+	f.zlen = htonl(CZ_BOUND(100) + 1);
+	if (0 == cz_frame_ntoh(&f))
+		result = FAILED;
+	destruct_cz_encoder(&enc);
+
+out:
+	free(src);
+	free(frame);
+	free(out);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	UNIT_TEST("fast", test_fast, c);
+	UNIT_TEST("high", test_high, c);
+	UNIT_TEST("stored", test_stored, c);
+	UNIT_TEST("corrupted", test_corrupted, c);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
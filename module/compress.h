@@ -0,0 +1,76 @@
+/*
+ * Compression of the transfers. The data is cut into blocks of CZ_BLOCK_SIZE
+ * bytes and each block is sent as a frame, compressed independently in the
+ * LZ4 block format. The receiver doesn't need to know the compression type.
+ *
+ * COMPRESS_FAST takes the first match of a small hash table. COMPRESS_HIGH
+ * searches the hash chains for the longest match. Blocks which don't shrink
+ * are stored, and the encoder stops trying for a while after such blocks.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CZ_BLOCK_SIZE		(64 * 1024)
+#define CZ_BOUND(n)			((n) + (n) / 255 + 16)
+#define CZ_FRAME_MAX		(sizeof(struct cz_frame) + CZ_BOUND(CZ_BLOCK_SIZE))
+#define CZ_STREAM_BUF_SIZE	(CZ_BLOCK_SIZE + CZ_FRAME_MAX)	// Buffer of the file streams.
+
+enum COMPRESS_TYPE {
+	COMPRESS_NONE = 0,
+	COMPRESS_FAST,			// For speed.
+	COMPRESS_HIGH,			// For ratio.
+	COMPRESS_NUM
+};
+
+// Sent in network byte order before the payload.
+struct cz_frame {
+	uint32_t rawlen;		// Bytes of the block.
+	uint32_t zlen;			// Bytes of the payload. 0: The block is stored(rawlen bytes).
+};
+
+struct cz_encoder {
+	enum COMPRESS_TYPE type;
+	int32_t *head;			// Last position of each hash.
+	int32_t *chain;			// Previous position of the same hash. COMPRESS_HIGH only.
+	int misses;				// Blocks in a row which didn't shrink.
+	int skip;				// Blocks to store without trying.
+	// Statistics
+	int64_t raw;
+	int64_t wire;			// Bytes of the frames.
+};
+
+/**
+ * @brief Initialize an encoder of type(COMPRESS_FAST or COMPRESS_HIGH).
+ *
+ * @return - Success: 0, Fail: -1
+ */
+int init_cz_encoder(struct cz_encoder *enc, enum COMPRESS_TYPE type);
+void destruct_cz_encoder(struct cz_encoder *enc);
+
+/**
+ * @brief Encode a block of at most CZ_BLOCK_SIZE bytes as a frame.
+ *
+ * @param frame - At least CZ_FRAME_MAX bytes.
+ * @return - Bytes of the frame including the header.
+ */
+size_t cz_encode(struct cz_encoder *enc, const uint8_t *src, size_t len, uint8_t *frame);
+
+/**
+ * @brief Convert the header to the host byte order and check it.
+ *
+ * @return - Valid: 0, Invalid: -1
+ */
+int cz_frame_ntoh(struct cz_frame *frame);
+
+/**
+ * @brief Decode the payload of a compressed frame.
+ *
+ * @return - Success: rawlen, Fail(corrupted): -1
+ */
+int64_t cz_decode(const uint8_t *src, size_t zlen, uint8_t *dst, size_t rawlen);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,520 @@
+#include "contcache.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+int
+init_content_cache(struct content_cache *c, int64_t budget, int64_t max_object,
+		size_t capacity, size_t nkeys)
+{
+	c->budget = budget;
+	c->max_object = max_object;
+	c->used = 0;
+	c->capacity = capacity;
+	c->nkeys = nkeys;
+	c->hand = 0;
+	c->hits = 0;
+	c->misses = 0;
+	c->shared = 0;
+	c->index = (int *) malloc(nkeys * sizeof(int));
+	c->entries = (struct cc_entry *) calloc(capacity, sizeof(struct cc_entry));
+	if (NULL == c->index || NULL == c->entries) {
+		free(c->index);
+		free(c->entries);
+		return -1;
+	}
+	for (size_t i = 0; i < nkeys; i++)
+		c->index[i] = -1;
+	for (size_t i = 0; i < capacity; i++)
+		c->entries[i].key = -1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->loaded, NULL);
+	return 0;
+}
+
+static int
+cc_admissible(struct content_cache *c, int64_t flen)
+{
+	return c->budget > 0 && c->capacity > 0 && flen <= c->max_object && flen <= c->budget;
+}
+
+static void
+free_entry(struct content_cache *c, struct cc_entry *e)
+{
+	c->used -= e->len;
+	free(e->data);
+	e->data = NULL;
+	e->len = 0;
+	e->key = -1;
+	e->stale = 0;
+	e->referenced = 0;
+	e->loading = 0;
+}
+
+static void
+release_entry(struct content_cache *c, struct cc_entry *e)
+{
+	e->refcnt--;
+	if (e->stale && 0 == e->refcnt)
+		free_entry(c, e);
+}
+
+/*
+ * Sweep the CLOCK hand until flen more bytes fit in the budget and an entry
+ * is free. Entries in use are skipped, so this gives up after two rounds.
+ *
+ * @return - Index of a free entry, -1 if the room can't be made.
+ */
+static int
+make_room(struct content_cache *c, int64_t flen)
+{
+	int slot = -1;
+	for (size_t i = 0; i < c->capacity; i++) {
+		if (-1 == c->entries[i].key && 0 == c->entries[i].refcnt) {
+			slot = (int)i;
+			break;
+		}
+	}
+
+	size_t steps = 2 * c->capacity;
+	while ((slot < 0 || c->used + flen > c->budget) && steps-- > 0) {
+		size_t i = c->hand;
+		struct cc_entry *e = &c->entries[i];
+		c->hand = (c->hand + 1) % c->capacity;
+		// Free, stale or in use
+		if (e->key < 0 || e->refcnt > 0)
+			continue;
+		if (e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		c->index[e->key] = -1;
+		free_entry(c, e);
+		if (slot < 0)
+			slot = (int)i;
+	}
+	if (slot < 0 || c->used + flen > c->budget)
+		return -1;
+	return slot;
+}
+
+const char *
+cc_get(struct content_cache *c, int key, int64_t flen, int64_t *len, int *pslot)
+{
+	*pslot = -1;
+	if (key < 0 || (size_t)key >= c->nkeys)
+		return NULL;
+
+	pthread_mutex_lock(&c->lock);
+	int idx = c->index[key];
+	if (idx >= 0) {
+		struct cc_entry *e = &c->entries[idx];
+		e->refcnt++;
+		e->referenced = 1;
+		if (e->loading) {
+			c->shared++;
+			while (e->loading)
+				pthread_cond_wait(&c->loaded, &c->lock);
+		} else {
+			c->hits++;
+		}
+		// The load failed.
+		if (NULL == e->data) {
+			release_entry(c, e);
+			pthread_mutex_unlock(&c->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&c->lock);
+		*len = e->len;
+		*pslot = idx;
+		return e->data;
+	}
+
+	c->misses++;
+	int slot = cc_admissible(c, flen) ? make_room(c, flen) : -1;
+	if (slot >= 0) {
+		// The caller loads the data. Users of the key wait for it meanwhile.
+		struct cc_entry *e = &c->entries[slot];
+		e->key = key;
+		e->data = NULL;
+		e->len = flen;
+		e->refcnt = 1;
+		e->stale = 0;
+		e->referenced = 1;
+		e->loading = 1;
+		c->used += flen;
+		c->index[key] = slot;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	*pslot = slot;
+	return NULL;
+}
+
+static int
+read_fd(void *arg, char *buf, int64_t flen)
+{
+	int fd = *(int *)arg;
+	int64_t rlen = 0;
+	while (rlen < flen) {
+		ssize_t n = pread(fd, buf + rlen, flen - rlen, rlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return -1;
+		rlen += n;
+	}
+	return 0;
+}
+
+const char *
+cc_fill(struct content_cache *c, int slot, int fd)
+{
+	return cc_fill_with(c, slot, read_fd, &fd);
+}
+
+/*
+ * The file is read without the lock. The slot can't be reused meanwhile
+ * because the caller holds it.
+ */
+const char *
+cc_fill_with(struct content_cache *c, int slot, cc_read_fn readfn, void *arg)
+{
+	struct cc_entry *e = &c->entries[slot];
+	char *data = (char *) malloc(e->len > 0 ? e->len : 1);
+	if (NULL != data && readfn(arg, data, e->len) < 0) {
+		free(data);
+		data = NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	e->data = data;
+	e->loading = 0;
+	// Detach the failed entry. It is freed on the last release.
+	if (NULL == data && !e->stale) {
+		c->index[e->key] = -1;
+		e->key = -1;
+		e->stale = 1;
+	}
+	pthread_cond_broadcast(&c->loaded);
+	pthread_mutex_unlock(&c->lock);
+	return data;
+}
+
+void
+cc_put(struct content_cache *c, int slot)
+{
+	if (slot < 0)
+		return;
+	pthread_mutex_lock(&c->lock);
+	release_entry(c, &c->entries[slot]);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+cc_invalidate(struct content_cache *c, int key)
+{
+	if (key < 0 || (size_t)key >= c->nkeys)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	int idx = c->index[key];
+	if (idx >= 0) {
+		struct cc_entry *e = &c->entries[idx];
+		c->index[key] = -1;
+		e->key = -1;
+		if (0 == e->refcnt)
+			free_entry(c, e);
+		else
+			e->stale = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+cc_stat(struct content_cache *c, unsigned long *hits, unsigned long *misses,
+		unsigned long *shared, int64_t *used)
+{
+	pthread_mutex_lock(&c->lock);
+	*hits = c->hits;
+	*misses = c->misses;
+	*shared = c->shared;
+	*used = c->used;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * No data may be in use.
+ */
+void
+destruct_content_cache(struct content_cache *c)
+{
+	for (size_t i = 0; i < c->capacity; i++)
+		free(c->entries[i].data);
+	free(c->entries);
+	free(c->index);
+	pthread_cond_destroy(&c->loaded);
+	pthread_mutex_destroy(&c->lock);
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+#include <string.h>
+
+#define TEST_OBJECT_LEN		1000
+#define TEST_CAPACITY		8
+
+struct test_source {
+	char fill;
+	int nread;
+};
+
+static int
+read_source(void *arg, char *buf, int64_t len)
+{
+	struct test_source *src = (struct test_source *)arg;
+	__atomic_add_fetch(&src->nread, 1, __ATOMIC_RELAXED);
+	memset(buf, src->fill, len);
+	return 0;
+}
+
+static int
+filled_with(const char *data, int64_t len, char fill)
+{
+	for (int64_t i = 0; i < len; i++)
+		if (fill != data[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * @return - The data of key, loaded from src on a miss. NULL if not cached.
+ */
+static const char *
+get_or_load(struct content_cache *c, int key, struct test_source *src, int *pslot)
+{
+	int64_t len = 0;
+	const char *data = cc_get(c, key, TEST_OBJECT_LEN, &len, pslot);
+	if (NULL == data && *pslot >= 0)
+		data = cc_fill_with(c, *pslot, read_source, src);
+	return data;
+}
+
+static int
+test_hit(int c)
+{
+	struct content_cache cache;
+	struct test_source src = { 'a', 0 };
+	int slot = -1;
+	if (init_content_cache(&cache, TEST_CAPACITY * TEST_OBJECT_LEN, TEST_OBJECT_LEN, 
+				TEST_CAPACITY, c) < 0)
+		return ERR;
+
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		const char *data = get_or_load(&cache, 0, &src, &slot);
+		if (NULL == data || !filled_with(data, TEST_OBJECT_LEN, 'a') || 1 != src.nread)
+			result = FAILED;
+		cc_put(&cache, slot);
+	}
+	// Too big to be admitted.
+	int64_t len = 0;
+	if (NULL != cc_get(&cache, 1, TEST_OBJECT_LEN + 1, &len, &slot) || -1 != slot)
+		result = FAILED;
+	destruct_content_cache(&cache);
+	return result;
+}
+
+/*
+ * The budget holds while the keys cycle, and entries in use are kept.
+ */
+static int
+test_eviction(int c)
+{
+	struct content_cache cache;
+	struct test_source src = { 'b', 0 };
+	int held = -1;
+	int slot = -1;
+	if (init_content_cache(&cache, TEST_CAPACITY * TEST_OBJECT_LEN, TEST_OBJECT_LEN, 
+				TEST_CAPACITY, c + 1) < 0)
+		return ERR;
+
+	int result = PASSED;
+	const char *kept = get_or_load(&cache, c, &src, &held);
+	for (int key = 0; key < c && PASSED == result; key++) {
+		if (NULL == get_or_load(&cache, key, &src, &slot))
+			result = FAILED;
+		cc_put(&cache, slot);
+		if (cache.used > cache.budget || c != cache.entries[held].key)
+			result = FAILED;
+	}
+	if (NULL == kept || !filled_with(kept, TEST_OBJECT_LEN, 'b'))
+		result = FAILED;
+	cc_put(&cache, held);
+	destruct_content_cache(&cache);
+	return result;
+}
+
+/*
+ * An invalidated entry stays readable for its user and the next user loads
+ * the new version.
+ */
+static int
+test_deferred_invalidation(int c)
+{
+	struct content_cache cache;
+	struct test_source old_src = { 'o', 0 };
+	struct test_source new_src = { 'n', 0 };
+	int old_slot = -1;
+	int new_slot = -1;
+	if (init_content_cache(&cache, TEST_CAPACITY * TEST_OBJECT_LEN, TEST_OBJECT_LEN, 
+				TEST_CAPACITY, c) < 0)
+		return ERR;
+
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		const char *old_data = get_or_load(&cache, 0, &old_src, &old_slot);
+		cc_invalidate(&cache, 0);
+		const char *new_data = get_or_load(&cache, 0, &new_src, &new_slot);
+		if (NULL == old_data || NULL == new_data || old_slot == new_slot
+				|| 2 * TEST_OBJECT_LEN != cache.used)
+			result = FAILED;
+		else if (!filled_with(old_data, TEST_OBJECT_LEN, 'o')
+				|| !filled_with(new_data, TEST_OBJECT_LEN, 'n'))
+			result = FAILED;
+		cc_put(&cache, old_slot);
+		if (TEST_OBJECT_LEN != cache.used || -1 != cache.entries[old_slot].key)
+			result = FAILED;
+		cc_put(&cache, new_slot);
+		cc_invalidate(&cache, 0);
+		if (0 != cache.used)
+			result = FAILED;
+	}
+	destruct_content_cache(&cache);
+	return result;
+}
+
+#define TEST_THREADS		8
+#define TEST_LOAD_USEC		20000
+
+static struct content_cache g_shared;
+static pthread_barrier_t g_start;
+
+/*
+ * A slow source. The load fails if fill is 0.
+ */
+static int
+read_slowly(void *arg, char *buf, int64_t len)
+{
+	struct test_source *src = (struct test_source *)arg;
+	__atomic_add_fetch(&src->nread, 1, __ATOMIC_RELAXED);
+	usleep(TEST_LOAD_USEC);
+	if (0 == src->fill)
+		return -1;
+	memset(buf, src->fill, len);
+	return 0;
+}
+
+static void *
+get_routine(void *arg)
+{
+	struct test_source *src = (struct test_source *)arg;
+	int64_t len = 0;
+	int slot = -1;
+	pthread_barrier_wait(&g_start);
+	const char *data = cc_get(&g_shared, 0, TEST_OBJECT_LEN, &len, &slot);
+	if (NULL == data && slot >= 0)
+		data = cc_fill_with(&g_shared, slot, read_slowly, src);
+	int ok = (NULL != data) ? filled_with(data, TEST_OBJECT_LEN, src->fill) : 0 == src->fill;
+	cc_put(&g_shared, slot);
+	return ok ? arg : NULL;
+}
+
+/*
+ * @return - 1 if all the users got the expected result.
+ */
+static int
+run_users(struct test_source *src)
+{
+	pthread_t tids[TEST_THREADS];
+	void *rets[TEST_THREADS];
+	pthread_barrier_init(&g_start, NULL, TEST_THREADS);
+	for (int i = 0; i < TEST_THREADS; i++)
+		pthread_create(&tids[i], NULL, get_routine, src);
+	int ok = 1;
+	for (int i = 0; i < TEST_THREADS; i++) {
+		pthread_join(tids[i], &rets[i]);
+		ok &= (NULL != rets[i]);
+	}
+	pthread_barrier_destroy(&g_start);
+	return ok;
+}
+
+/*
+ * Concurrent misses of a key read the file once and share the data.
+ */
+static int
+test_single_flight(int c)
+{
+	int result = PASSED;
+	if (init_content_cache(&g_shared, TEST_CAPACITY * TEST_OBJECT_LEN, TEST_OBJECT_LEN, 
+				TEST_CAPACITY, 1) < 0)
+		return ERR;
+
+	for (int i = 0; i < 10 && PASSED == result; i++) {
+		struct test_source src = { 's', 0 };
+		unsigned long hits = 0, misses = 0, shared = 0;
+		int64_t used = 0;
+		cc_invalidate(&g_shared, 0);
+		cc_stat(&g_shared, &hits, &misses, &shared, &used);
+		unsigned long hits0 = hits, misses0 = misses, shared0 = shared;
+		if (!run_users(&src) || 1 != src.nread)
+			result = FAILED;
+		cc_stat(&g_shared, &hits, &misses, &shared, &used);
+		if (1 != misses - misses0 || TEST_THREADS - 1 != (hits - hits0) + (shared - shared0))
+			result = FAILED;
+	}
+	destruct_content_cache(&g_shared);
+	return result;
+}
+
+/*
+ * The waiters of a failed load get nothing, and the key isn't cached.
+ */
+static int
+test_failed_load(int c)
+{
+	struct test_source bad = { 0, 0 };
+	struct test_source good = { 'g', 0 };
+	int result = PASSED;
+	if (init_content_cache(&g_shared, TEST_CAPACITY * TEST_OBJECT_LEN, TEST_OBJECT_LEN, 
+				TEST_CAPACITY, 1) < 0)
+		return ERR;
+
+	if (!run_users(&bad) || 0 != g_shared.used || -1 != g_shared.index[0])
+		result = FAILED;
+	if (!run_users(&good) || 1 != good.nread)
+		result = FAILED;
+	destruct_content_cache(&g_shared);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	UNIT_TEST("hit", test_hit, c);
+	UNIT_TEST("eviction", test_eviction, c);
+	UNIT_TEST("deferred invalidation", test_deferred_invalidation, c);
+	UNIT_TEST("single flight", test_single_flight, c);
+	UNIT_TEST("failed load", test_failed_load, c);
+
+	return 0;
+}
+
+#endif // _UNIT_TEST_
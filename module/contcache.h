@@ -0,0 +1,104 @@
+/*
+ * Byte-budgeted in-memory cache of small files keyed by a small integer id.
+ * Entries are evicted with the CLOCK algorithm. An entry in use is never
+ * freed. Eviction and invalidation of a busy entry are deferred until its
+ * last user releases it.
+ *
+ * Loads are single-flight. The first user missing a key loads the file, and
+ * concurrent users of the key wait for it and share the data.
+ */
+
+#ifndef _CONTCACHE_H_
+#define _CONTCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct cc_entry {
+	int key;						// -1 if the entry is free.
+	char *data;
+	int64_t len;
+	int refcnt;						// Users reading data.
+	int stale;						// Detached. Freed on the last release.
+	int referenced;					// CLOCK reference bit.
+	int loading;					// The first user is reading the file.
+};
+
+struct content_cache {
+	pthread_mutex_t lock;
+	int64_t budget;					// Max bytes of data. 0 disables the cache.
+	int64_t max_object;				// Bigger files are never admitted.
+	int64_t used;					// Bytes of all the entries, including stale ones.
+	size_t capacity;				// Number of entries.
+	size_t nkeys;
+	int *index;						// key -> entries[] index, -1 if not cached.
+	struct cc_entry *entries;
+	pthread_cond_t loaded;			// A load is finished.
+	size_t hand;					// CLOCK hand.
+	// Statistics
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long shared;			// Users that waited for a load of another user.
+};
+
+/**
+ * @brief Initialize the cache.
+ *
+ * @param budget - Max bytes cached. 0 disables the cache.
+ * @param max_object - Max size of a cached file.
+ * @param capacity - Max number of cached files.
+ * @param nkeys - Keys are in [0, nkeys).
+ * @return - Success: 0, Fail: -1
+ */
+int init_content_cache(struct content_cache *c, int64_t budget, int64_t max_object,
+		size_t capacity, size_t nkeys);
+
+/**
+ * @brief Look up the cached data of key. If key is being loaded, wait for it.
+ * On a miss, the caller becomes the loader of key if a file of flen bytes
+ * can be cached, and must call cc_fill() with the slot.
+ *
+ * @param len - Length of the data will be set on a hit.
+ * @param pslot - Hit: handle for cc_put(), Miss: slot to fill or -1 if the
+ * 				  caller must read the file by itself.
+ * @return - Hit: data(read-only), Miss: NULL
+ */
+const char *cc_get(struct content_cache *c, int key, int64_t flen, int64_t *len, int *pslot);
+
+/**
+ * @brief Read the data of the slot from fd and wake up the waiting users.
+ * The slot must be released with cc_put() even if this fails.
+ *
+ * @return - Success: data(read-only), Fail: NULL
+ */
+const char *cc_fill(struct content_cache *c, int slot, int fd);
+
+/**
+ * @brief Read all len bytes of the file into buf.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+typedef int (*cc_read_fn)(void *arg, char *buf, int64_t len);
+
+/**
+ * @brief cc_fill() for the files which are not read as they are stored.
+ */
+const char *cc_fill_with(struct content_cache *c, int slot, cc_read_fn readfn, void *arg);
+
+/**
+ * @brief Release the slot returned by cc_get().
+ */
+void cc_put(struct content_cache *c, int slot);
+
+/**
+ * @brief Drop the cached data of key. Must be called after the file of key
+ * is replaced, renamed or removed.
+ */
+void cc_invalidate(struct content_cache *c, int key);
+
+void cc_stat(struct content_cache *c, unsigned long *hits, unsigned long *misses,
+		unsigned long *shared, int64_t *used);
+void destruct_content_cache(struct content_cache *c);
+
+#endif // _CONTCACHE_H_
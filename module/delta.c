@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include "delta.h"
+#include "sha256.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#define DELTA_BUCKET_RATIO		8
+
+struct encoder {
+	delta_emit_fn emit;
+	void *arg;
+	int64_t copy_start;			// First block of the pending run, -1 if none.
+	uint32_t copy_count;
+};
+
+size_t
+delta_block_size(int64_t flen)
+{
+	size_t bs = DELTA_BLOCK_MIN;
+	while (bs < DELTA_BLOCK_MAX && (int64_t)(bs * bs) < flen)
+		bs <<= 1;
+	return bs;
+}
+
+/*
+ * a: sum of the bytes, b: sum of the bytes weighted by the distance from
+ * the end of the block. Both can be rolled by a byte in O(1).
+ */
+__attribute__((optimize("O2")))
+static void
+weak_sums(const uint8_t *p, size_t len, uint32_t *a, uint32_t *b)
+{
+	uint32_t s1 = 0, s2 = 0;
+	for (size_t i = 0; i < len; i++) {
+		s1 += p[i];
+		s2 += (uint32_t)(len - i) * p[i];
+	}
+	*a = s1;
+	*b = s2;
+}
+
+static uint32_t
+weak_of(uint32_t a, uint32_t b)
+{
+	return (a & 0xffff) | (b << 16);
+}
+
+static void
+strong_of(const uint8_t *p, size_t len, uint8_t *strong)
+{
+	struct sha256_ctx ctx;
+	uint8_t digest[SHA256_DIGEST_LEN];
+	sha256_init(&ctx);
+	sha256_update(&ctx, p, len);
+	sha256_final(&ctx, digest);
+	memcpy(strong, digest, DELTA_STRONG_LEN);
+}
+
+void
+delta_signature(const uint8_t *block, size_t len, struct delta_sig *sig)
+{
+	uint32_t a = 0, b = 0;
+	weak_sums(block, len, &a, &b);
+	sig->weak = weak_of(a, b);
+	strong_of(block, len, sig->strong);
+}
+
+void
+delta_sig_hton(struct delta_sig *sig)
+{
+	sig->weak = htonl(sig->weak);
+}
+
+void
+delta_sig_ntoh(struct delta_sig *sig)
+{
+	sig->weak = ntohl(sig->weak);
+}
+
+void
+delta_op_hton(struct delta_op *op)
+{
+	op->type = htonl(op->type);
+	op->count = htonl(op->count);
+	op->arg = htobe64(op->arg);
+}
+
+void
+delta_op_ntoh(struct delta_op *op)
+{
+	op->type = ntohl(op->type);
+	op->count = ntohl(op->count);
+	op->arg = be64toh(op->arg);
+}
+
+static size_t
+bucket_of(const struct delta_index *idx, uint32_t weak)
+{
+	return (weak * 0x9e3779b1u) >> (32 - idx->bits);
+}
+
+int
+init_delta_index(struct delta_index *idx, const struct delta_sig *sigs, size_t nsigs,
+		size_t block_size, int64_t base_len)
+{
+	idx->sigs = sigs;
+	idx->nsigs = nsigs;
+	idx->block_size = block_size;
+	idx->base_len = base_len;
+	// Sparse buckets let most of the rolled positions fail at the head.
+	idx->bits = 4;
+	while (idx->bits < 31 && ((size_t)1 << idx->bits) < nsigs * DELTA_BUCKET_RATIO)
+		idx->bits++;
+
+	size_t nbuckets = (size_t)1 << idx->bits;
+	idx->heads = (int32_t *) malloc(nbuckets * sizeof(int32_t));
+	idx->next = (int32_t *) malloc((nsigs > 0 ? nsigs : 1) * sizeof(int32_t));
+	if (NULL == idx->heads || NULL == idx->next) {
+		free(idx->heads);
+		free(idx->next);
+		return -1;
+	}
+	for (size_t i = 0; i < nbuckets; i++)
+		idx->heads[i] = -1;
+	// Inserted backwards, so that the earlier blocks are found first.
+	for (size_t i = nsigs; i > 0; i--) {
+		size_t h = bucket_of(idx, sigs[i - 1].weak);
+		idx->next[i - 1] = idx->heads[h];
+		idx->heads[h] = (int32_t)(i - 1);
+	}
+	return 0;
+}
+
+void
+destruct_delta_index(struct delta_index *idx)
+{
+	free(idx->heads);
+	free(idx->next);
+}
+
+static size_t
+block_len(const struct delta_index *idx, size_t i)
+{
+	int64_t rest = idx->base_len - (int64_t)(i * idx->block_size);
+	return (rest < (int64_t)idx->block_size) ? (size_t)rest : idx->block_size;
+}
+
+static int
+sig_matches(const struct delta_index *idx, size_t i, uint32_t weak, size_t len,
+		const uint8_t *strong)
+{
+	return idx->sigs[i].weak == weak && block_len(idx, i) == len
+		&& 0 == memcmp(idx->sigs[i].strong, strong, DELTA_STRONG_LEN);
+}
+
+/*
+ * The block following the previous match is preferred to continue the run.
+ * The strong hash is computed only if a weak sum matches.
+ *
+ * @return - Index of the block of p, -1 if none.
+ */
+__attribute__((optimize("O2")))
+static int64_t
+find_block(const struct delta_index *idx, uint32_t weak, const uint8_t *p, size_t len,
+		int64_t prefer)
+{
+	int32_t i = idx->heads[bucket_of(idx, weak)];
+	while (i >= 0 && (idx->sigs[i].weak != weak || block_len(idx, i) != len))
+		i = idx->next[i];
+	if (i < 0)
+		return -1;
+
+	uint8_t strong[DELTA_STRONG_LEN];
+	strong_of(p, len, strong);
+	if (prefer >= 0 && (size_t)prefer < idx->nsigs && sig_matches(idx, prefer, weak, len, strong))
+		return prefer;
+	for (; i >= 0; i = idx->next[i])
+		if (sig_matches(idx, i, weak, len, strong))
+			return i;
+	return -1;
+}
+
+static int
+flush_copy(struct encoder *enc)
+{
+	if (enc->copy_start < 0)
+		return 0;
+	struct delta_op op = { DELTA_OP_COPY, enc->copy_count, (uint64_t)enc->copy_start };
+	enc->copy_start = -1;
+	enc->copy_count = 0;
+	return enc->emit(enc->arg, &op, NULL);
+}
+
+static int
+emit_data(struct encoder *enc, const uint8_t *data, int64_t len)
+{
+	int result = 0;
+	if (len > 0 && (result = flush_copy(enc)) < 0)
+		return result;
+	while (len > 0) {
+		int64_t n = (len < DELTA_DATA_MAX) ? len : DELTA_DATA_MAX;
+		struct delta_op op = { DELTA_OP_DATA, 0, (uint64_t)n };
+		if ((result = enc->emit(enc->arg, &op, data)) < 0)
+			return result;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+add_copy(struct encoder *enc, int64_t block)
+{
+	if (enc->copy_start >= 0 && enc->copy_start + enc->copy_count == block
+			&& enc->copy_count < UINT32_MAX) {
+		enc->copy_count++;
+		return 0;
+	}
+	int result = flush_copy(enc);
+	enc->copy_start = block;
+	enc->copy_count = 1;
+	return result;
+}
+
+/*
+ * Literal data is not copied. [lit, pos) of data is emitted when a block
+ * is found at pos or the end is reached.
+ */
+__attribute__((optimize("O2")))
+int
+delta_encode(const struct delta_index *idx, const uint8_t *data, int64_t len,
+		delta_emit_fn emit, void *arg)
+{
+	struct encoder enc = { emit, arg, -1, 0 };
+	size_t bs = idx->block_size;
+	int64_t pos = 0;
+	int64_t lit = 0;
+	uint32_t a = 0, b = 0;
+	int fresh = 1;
+	int result = 0;
+	int shift = 32 - idx->bits;
+
+	while (idx->nsigs > 0 && len - pos >= (int64_t)bs) {
+		if (fresh) {
+			weak_sums(data + pos, bs, &a, &b);
+			fresh = 0;
+		}
+		uint32_t weak = (a & 0xffff) | (b << 16);
+		int64_t block = -1;
+		// Most of the rolled positions stop at an empty bucket.
+		if (idx->heads[(weak * 0x9e3779b1u) >> shift] >= 0) {
+			int64_t prefer = (enc.copy_start >= 0) ? enc.copy_start + enc.copy_count : -1;
+			block = find_block(idx, weak, data + pos, bs, prefer);
+		}
+		if (block >= 0) {
+			if ((result = emit_data(&enc, data + lit, pos - lit)) < 0)
+				return result;
+			if ((result = add_copy(&enc, block)) < 0)
+				return result;
+			pos += bs;
+			lit = pos;
+			fresh = 1;
+			continue;
+		}
+		if (pos + (int64_t)bs >= len)
+			break;
+		// Roll the window by a byte.
+		uint32_t out = data[pos];
+		a += data[pos + bs] - out;
+		b += a - (uint32_t)bs * out;
+		pos++;
+	}
+
+	// The short last block of the base can only match the end of data.
+	if (idx->nsigs > 0) {
+		size_t last = idx->nsigs - 1;
+		size_t tail = block_len(idx, last);
+		if (tail < bs && len - (int64_t)tail >= lit) {
+			uint32_t ta = 0, tb = 0;
+			weak_sums(data + len - tail, tail, &ta, &tb);
+			int64_t prefer = (enc.copy_start >= 0) ? enc.copy_start + enc.copy_count : -1;
+			if (find_block(idx, weak_of(ta, tb), data + len - tail, tail, prefer) == (int64_t)last) {
+				if ((result = emit_data(&enc, data + lit, len - tail - lit)) < 0)
+					return result;
+				if ((result = add_copy(&enc, last)) < 0)
+					return result;
+				lit = len;
+			}
+		}
+	}
+	if ((result = emit_data(&enc, data + lit, len - lit)) < 0)
+		return result;
+	return flush_copy(&enc);
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+#include "sha256.c"
+
+#define TEST_BASE_LEN		100003		// Not a multiple of the block size.
+#define TEST_INSERT_MAX		100
+
+struct patch {
+	const uint8_t *base;
+	int64_t base_len;
+	size_t block_size;
+	size_t nblocks;
+	uint8_t *out;
+	int64_t len;
+	int64_t cap;
+	int64_t literal;			// Bytes sent as DATA.
+};
+
+static uint32_t g_seed = 2463534242u;
+
+static uint32_t
+next_random(void)
+{
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 17;
+	g_seed ^= g_seed << 5;
+	return g_seed;
+}
+
+static void
+fill_random(uint8_t *p, int64_t len)
+{
+	for (int64_t i = 0; i < len; i++)
+		p[i] = (uint8_t)next_random();
+}
+
+/*
+ * Applies op the way the server does, after a trip through the wire order.
+ */
+static int
+apply_op(void *arg, const struct delta_op *op, const uint8_t *data)
+{
+	struct patch *p = (struct patch *)arg;
+	struct delta_op o = *op;
+	delta_op_hton(&o);
+	delta_op_ntoh(&o);
+	if (0 != memcmp(&o, op, sizeof(o)))
+		return -1;
+
+	if (DELTA_OP_COPY == o.type) {
+		if (0 == o.count || o.arg + o.count > p->nblocks)
+			return -1;
+		for (uint64_t b = o.arg; b < o.arg + o.count; b++) {
+			int64_t off = (int64_t)(b * p->block_size);
+			int64_t n = p->base_len - off;
+			if (n > (int64_t)p->block_size)
+				n = p->block_size;
+			if (p->len + n > p->cap)
+				return -1;
+			memcpy(p->out + p->len, p->base + off, n);
+			p->len += n;
+		}
+	} else if (DELTA_OP_DATA == o.type) {
+		if (0 == o.arg || o.arg > DELTA_DATA_MAX || p->len + (int64_t)o.arg > p->cap)
+			return -1;
+		memcpy(p->out + p->len, data, o.arg);
+		p->len += o.arg;
+		p->literal += o.arg;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Encodes data against base and rebuilds it from the ops.
+ *
+ * @return - Bytes sent as DATA, -1 if data is not rebuilt.
+ */
+static int64_t
+round_trip(const uint8_t *base, int64_t base_len, const uint8_t *data, int64_t len)
+{
+	struct patch p = { base, base_len, delta_block_size(base_len), 0, NULL, 0, len, 0 };
+	p.nblocks = (base_len + p.block_size - 1) / p.block_size;
+	struct delta_sig *sigs = (struct delta_sig *) malloc((p.nblocks + 1) * sizeof(*sigs));
+	p.out = (uint8_t *) malloc(len + 1);
+	struct delta_index idx;
+	int64_t result = -1;
+	if (NULL == sigs || NULL == p.out)
+		goto out;
+
+	for (size_t i = 0; i < p.nblocks; i++) {
+		int64_t off = (int64_t)(i * p.block_size);
+		size_t n = (base_len - off < (int64_t)p.block_size) ? (size_t)(base_len - off) : p.block_size;
+		delta_signature(base + off, n, &sigs[i]);
+		// Signatures also go through the wire order.
+		delta_sig_hton(&sigs[i]);
+		delta_sig_ntoh(&sigs[i]);
+	}
+	if (init_delta_index(&idx, sigs, p.nblocks, p.block_size, base_len) < 0)
+		goto out;
+	if (0 == delta_encode(&idx, data, len, apply_op, &p)
+			&& p.len == len && 0 == memcmp(p.out, data, len))
+		result = p.literal;
+	destruct_delta_index(&idx);
+
+out:
+	free(sigs);
+	free(p.out);
+	return result;
+}
+
+int
+test_identical(int c)
+{
+	uint8_t *base = (uint8_t *) malloc(TEST_BASE_LEN);
+	if (NULL == base)
+		return ERR;
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int64_t len = 1 + next_random() % TEST_BASE_LEN;
+		fill_random(base, len);
+		if (0 != round_trip(base, len, base, len))
+			result = FAILED;
+	}
+	free(base);
+	return result;
+}
+
+/*
+ * Only the blocks around each edit are sent as DATA.
+ */
+int
+test_edits(int c)
+{
+	int64_t cap = TEST_BASE_LEN + 4 * TEST_INSERT_MAX;
+	uint8_t *base = (uint8_t *) malloc(TEST_BASE_LEN);
+	uint8_t *data = (uint8_t *) malloc(cap);
+	uint8_t *tmp = (uint8_t *) malloc(cap);
+	int result = PASSED;
+	if (NULL == base || NULL == data || NULL == tmp) {
+		result = ERR;
+		goto out;
+	}
+
+	fill_random(base, TEST_BASE_LEN);
+	int64_t bs = delta_block_size(TEST_BASE_LEN);
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int64_t len = TEST_BASE_LEN;
+		memcpy(data, base, len);
+		int nedits = 1 + next_random() % 3;
+		for (int e = 0; e < nedits; e++) {
+			int64_t at = next_random() % len;
+			int64_t n = 1 + next_random() % TEST_INSERT_MAX;
+			switch (next_random() % 3) {
+			case 0:		// Insert
+				memcpy(tmp, data + at, len - at);
+				fill_random(data + at, n);
+				memcpy(data + at + n, tmp, len - at);
+				len += n;
+				break;
+			case 1:		// Delete
+				n = (n < len - at) ? n : len - at;
+				memmove(data + at, data + at + n, len - at - n);
+				len -= n;
+				break;
+			default:	// Overwrite
+				n = (n < len - at) ? n : len - at;
+				fill_random(data + at, n);
+				break;
+			}
+		}
+		int64_t literal = round_trip(base, TEST_BASE_LEN, data, len);
+		if (literal < 0 || literal > nedits * (2 * bs + TEST_INSERT_MAX))
+			result = FAILED;
+	}
+
+out:
+	free(base);
+	free(data);
+	free(tmp);
+	return result;
+}
+
+/*
+ * The short last block of the base is matched at the end of data.
+ */
+int
+test_short_tail(int c)
+{
+	uint8_t *data = (uint8_t *) malloc(TEST_BASE_LEN + TEST_INSERT_MAX);
+	if (NULL == data)
+		return ERR;
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int64_t n = 1 + next_random() % TEST_INSERT_MAX;
+		fill_random(data, TEST_BASE_LEN + n);
+		// data is n random bytes followed by the base.
+		if (n != round_trip(data + n, TEST_BASE_LEN, data, TEST_BASE_LEN + n))
+			result = FAILED;
+	}
+	free(data);
+	return result;
+}
+
+int
+test_unrelated(int c)
+{
+	uint8_t *base = (uint8_t *) malloc(TEST_BASE_LEN);
+	uint8_t *data = (uint8_t *) malloc(TEST_BASE_LEN);
+	int result = PASSED;
+	if (NULL == base || NULL == data) {
+		result = ERR;
+		goto out;
+	}
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int64_t len = 1 + next_random() % TEST_BASE_LEN;
+		fill_random(base, TEST_BASE_LEN);
+		fill_random(data, len);
+		if (len != round_trip(base, TEST_BASE_LEN, data, len))
+			result = FAILED;
+	}
+
+out:
+	free(base);
+	free(data);
+	return result;
+}
+
+int
+test_empty(int c)
+{
+	uint8_t data[DELTA_BLOCK_MIN * 3];
+	fill_random(data, sizeof(data));
+	(void)c;
+	// Nothing to copy from, and nothing to send.
+	if ((int64_t)sizeof(data) != round_trip(data, 0, data, sizeof(data)))
+		return FAILED;
+	if (0 != round_trip(data, sizeof(data), data, 0))
+		return FAILED;
+	if (0 != round_trip(data, 0, data, 0))
+		return FAILED;
+	// Shorter than a block.
+	if (0 != round_trip(data, 10, data, 10))
+		return FAILED;
+	return PASSED;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	UNIT_TEST("identical", test_identical, c);
+	UNIT_TEST("edits", test_edits, c);
+	UNIT_TEST("short tail", test_short_tail, c);
+	UNIT_TEST("unrelated", test_unrelated, c);
+	UNIT_TEST("empty", test_empty, c);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
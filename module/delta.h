@@ -0,0 +1,90 @@
+/*
+ * rsync-style delta encoding. The receiver sends the signatures of the
+ * blocks of its version(base) of a file. The sender finds the blocks in its
+ * version with a rolling checksum, and sends only the data the receiver
+ * doesn't have along with references to the blocks it has.
+ *
+ * Signatures and ops are sent in network byte order.
+ */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_STRONG_LEN	16					// Truncated SHA-256.
+#define DELTA_BLOCK_MIN		2048
+#define DELTA_BLOCK_MAX		(128 * 1024)
+#define DELTA_DATA_MAX		(1024 * 1024)		// Max literal data per op.
+
+enum DELTA_OP_TYPE {
+	DELTA_OP_COPY = 1,		// Blocks [arg, arg + count) of the base.
+	DELTA_OP_DATA,			// arg bytes of literal data follow.
+	DELTA_OP_END			// arg: length of the new version.
+};
+
+struct delta_sig {
+	uint32_t weak;
+	uint8_t strong[DELTA_STRONG_LEN];
+};
+
+struct delta_op {
+	uint32_t type;
+	uint32_t count;
+	uint64_t arg;
+};
+
+struct delta_index {
+	const struct delta_sig *sigs;
+	size_t nsigs;
+	size_t block_size;
+	int64_t base_len;
+	int bits;					// Buckets: 1 << bits
+	int32_t *heads;				// First signature of each bucket, -1 if empty.
+	int32_t *next;				// Next signature of the same bucket.
+};
+
+/**
+ * @brief Block size for a base of flen bytes. About sqrt(flen), so that
+ * the signatures and the precision grow together.
+ */
+size_t delta_block_size(int64_t flen);
+
+/**
+ * @brief Signature of a block. The last block of the base may be short.
+ */
+void delta_signature(const uint8_t *block, size_t len, struct delta_sig *sig);
+
+void delta_sig_hton(struct delta_sig *sig);
+void delta_sig_ntoh(struct delta_sig *sig);
+void delta_op_hton(struct delta_op *op);
+void delta_op_ntoh(struct delta_op *op);
+
+/**
+ * @brief Index the signatures of the base for delta_encode().
+ * sigs must stay valid until the index is destructed.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+int init_delta_index(struct delta_index *idx, const struct delta_sig *sigs, size_t nsigs,
+		size_t block_size, int64_t base_len);
+void destruct_delta_index(struct delta_index *idx);
+
+/**
+ * @param data - Literal data of a DELTA_OP_DATA op. NULL for the others.
+ * @return - 0 to continue, negative to stop the encoding.
+ */
+typedef int (*delta_emit_fn)(void *arg, const struct delta_op *op, const uint8_t *data);
+
+/**
+ * @brief Encode data against the base as DELTA_OP_COPY and DELTA_OP_DATA
+ * ops in the order of data. Adjacent block references are merged.
+ * DELTA_OP_END is not emitted.
+ *
+ * @return - 0, or the negative value returned by emit.
+ */
+int delta_encode(const struct delta_index *idx, const uint8_t *data, int64_t len,
+		delta_emit_fn emit, void *arg);
+
+#endif // _DELTA_H_
@@ -0,0 +1,240 @@
+#include "fastcdc.h"
+
+#include <pthread.h>
+
+#define NORMALIZATION_LEVEL		2		// Mask bits added/removed around avg_size.
+
+/*
+ * Random value of each byte. The table is generated from a fixed seed, so
+ * the boundaries are the same on every run and the chunks stay shared.
+ * gear_ls is the table shifted left by one for the two-bytes step.
+ */
+static uint64_t gear[256];
+static uint64_t gear_ls[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+init_gear(void)
+{
+	uint64_t seed = 0x7473746f72616765ULL;
+	for (int i = 0; i < 256; i++) {
+		gear[i] = splitmix64(&seed);
+		gear_ls[i] = gear[i] << 1;
+	}
+}
+
+/*
+ * The high bits of the gear hash depend on the most bytes, so they are used.
+ * The top bit is left out, because the two-bytes step shifts the mask left
+ * by one and would lose it.
+ */
+static uint64_t
+high_mask(int bits)
+{
+	return ((1ULL << bits) - 1) << (63 - bits);
+}
+
+void
+init_fastcdc(struct fastcdc *cdc, size_t avg_size)
+{
+	pthread_once(&gear_once, init_gear);
+
+	int bits = 0;
+	while (((size_t)1 << (bits + 1)) <= avg_size)
+		bits++;
+	cdc->avg_size = (size_t)1 << bits;
+	cdc->min_size = cdc->avg_size / 4;
+	cdc->max_size = cdc->avg_size * 4;
+	cdc->mask_s = high_mask(bits + NORMALIZATION_LEVEL);
+	cdc->mask_l = high_mask(bits - NORMALIZATION_LEVEL);
+}
+
+/*
+ * Search a boundary in [i, end). The hash rolls two bytes per step. Shifting
+ * the hash and the mask left by one checks the first byte of the step
+ * without a separate shift.
+ */
+__attribute__((optimize("O3")))
+static size_t
+scan(const uint8_t *data, size_t i, size_t end, uint64_t mask, uint64_t *hash)
+{
+	uint64_t h = *hash;
+	uint64_t mask_ls = mask << 1;
+	for (; i + 1 < end; i += 2) {
+		h = (h << 2) + gear_ls[data[i]];
+		if (!(h & mask_ls)) {
+			*hash = h >> 1;
+			return i + 1;
+		}
+		h += gear[data[i + 1]];
+		if (!(h & mask)) {
+			*hash = h;
+			return i + 2;
+		}
+	}
+	if (i < end) {
+		h = (h << 1) + gear[data[i]];
+		if (!(h & mask)) {
+			*hash = h;
+			return i + 1;
+		}
+	}
+	*hash = h;
+	return 0;
+}
+
+__attribute__((optimize("O3")))
+size_t
+fastcdc_cut(const struct fastcdc *cdc, const uint8_t *data, size_t len)
+{
+	if (len <= cdc->min_size)
+		return len;
+	size_t end = (len < cdc->max_size) ? len : cdc->max_size;
+	size_t normal = (end < cdc->avg_size) ? end : cdc->avg_size;
+
+	uint64_t h = 0;
+	size_t cut = scan(data, cdc->min_size, normal, cdc->mask_s, &h);
+	if (cut > 0)
+		return cut;
+	cut = scan(data, normal, end, cdc->mask_l, &h);
+	if (cut > 0)
+		return cut;
+	return end;
+}
+
+// The test of chunkstore.c includes this file.
+#if defined(_UNIT_TEST_) && !defined(_CHUNKSTORE_H_)
+
+#include "../test/mk_ctest.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_AVG_SIZE		(8 * 1024)
+#define TEST_SAMPLE_LEN		(2 * 1024 * 1024)
+
+static uint8_t *g_sample = NULL;
+
+/*
+ * The plain gear hash, one byte per step.
+ */
+static size_t
+reference_cut(const struct fastcdc *cdc, const uint8_t *data, size_t len)
+{
+	if (len <= cdc->min_size)
+		return len;
+	size_t end = (len < cdc->max_size) ? len : cdc->max_size;
+	size_t normal = (end < cdc->avg_size) ? end : cdc->avg_size;
+	uint64_t h = 0;
+	for (size_t i = cdc->min_size; i < end; i++) {
+		h = (h << 1) + gear[data[i]];
+		if (!(h & ((i < normal) ? cdc->mask_s : cdc->mask_l)))
+			return i + 1;
+	}
+	return end;
+}
+
+/*
+ * @return - Number of the cut offsets written to cuts.
+ */
+static size_t
+cut_all(const struct fastcdc *cdc, const uint8_t *data, size_t len, size_t *cuts, size_t max)
+{
+	size_t n = 0;
+	for (size_t off = 0; off < len && n < max; n++) {
+		off += fastcdc_cut(cdc, data + off, len - off);
+		cuts[n] = off;
+	}
+	return n;
+}
+
+static int
+test_reference(int c)
+{
+	struct fastcdc cdc;
+	init_fastcdc(&cdc, TEST_AVG_SIZE);
+	size_t off = 0;
+	while (off < TEST_SAMPLE_LEN) {
+		size_t cut = fastcdc_cut(&cdc, g_sample + off, TEST_SAMPLE_LEN - off);
+		if (cut != reference_cut(&cdc, g_sample + off, TEST_SAMPLE_LEN - off))
+			return FAILED;
+		if (off + cut < TEST_SAMPLE_LEN && (cut < cdc.min_size || cut > cdc.max_size))
+			return FAILED;
+		off += cut;
+	}
+	return PASSED;
+}
+
+/*
+ * An inserted byte moves only the boundaries near it.
+ */
+static int
+test_resync(int c)
+{
+	struct fastcdc cdc;
+	init_fastcdc(&cdc, TEST_AVG_SIZE);
+	size_t max = TEST_SAMPLE_LEN / cdc.min_size + 1;
+	size_t *a = (size_t *) malloc(max * sizeof(size_t));
+	size_t *b = (size_t *) malloc(max * sizeof(size_t));
+	uint8_t *edited = (uint8_t *) malloc(TEST_SAMPLE_LEN + 1);
+	int result = (NULL == a || NULL == b || NULL == edited) ? ERR : PASSED;
+
+	for (int round = 0; PASSED == result && round < c; round++) {
+		size_t pos = rand() % TEST_SAMPLE_LEN;
+		memcpy(edited, g_sample, pos);
+		edited[pos] = rand() & 0xff;
+		memcpy(edited + pos + 1, g_sample + pos, TEST_SAMPLE_LEN - pos);
+		size_t na = cut_all(&cdc, g_sample, TEST_SAMPLE_LEN, a, max);
+		size_t nb = cut_all(&cdc, edited, TEST_SAMPLE_LEN + 1, b, max);
+
+		// The boundaries before the edit stay, and the ones a few chunks
+		// after it are shifted by the inserted byte.
+		size_t i = 0, j = 0;
+		for (; i < na && a[i] <= pos; i++, j++)
+			if (j >= nb || a[i] != b[j])
+				result = FAILED;
+		while (i < na && a[i] < pos + 2 * cdc.max_size)
+			i++;
+		for (; i < na; i++) {
+			while (j < nb && b[j] < a[i] + 1)
+				j++;
+			if (j >= nb || b[j] != a[i] + 1)
+				result = FAILED;
+		}
+	}
+	free(a);
+	free(b);
+	free(edited);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	srand(c);
+	g_sample = (uint8_t *) malloc(TEST_SAMPLE_LEN);
+	if (NULL == g_sample)
+		return 1;
+	for (int i = 0; i < TEST_SAMPLE_LEN; i++)
+		g_sample[i] = rand() & 0xff;
+
+	UNIT_TEST("cut", test_reference, c);
+	UNIT_TEST("resync", test_resync, c);
+
+	free(g_sample);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
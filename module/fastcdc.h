@@ -0,0 +1,36 @@
+/*
+ * Content-defined chunking with the gear rolling hash(FastCDC).
+ * Chunk boundaries depend only on the nearby bytes, so an insertion or a
+ * deletion changes only the chunks around it.
+ */
+
+#ifndef _FASTCDC_H_
+#define _FASTCDC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fastcdc {
+	size_t min_size;			// No boundary is searched before this.
+	size_t avg_size;
+	size_t max_size;			// A chunk is cut here without a boundary.
+	uint64_t mask_s;			// Harder to match. Used before avg_size.
+	uint64_t mask_l;			// Easier to match. Used after avg_size.
+};
+
+/**
+ * @brief Initialize the chunker. Chunks are in [avg / 4, avg * 4] bytes.
+ *
+ * @param avg_size - Expected chunk size. Must be a power of 2.
+ */
+void init_fastcdc(struct fastcdc *cdc, size_t avg_size);
+
+/**
+ * @brief Find the end of the first chunk of data.
+ *
+ * @return - Length of the chunk, len if data is shorter than max_size and has
+ * 			 no boundary.
+ */
+size_t fastcdc_cut(const struct fastcdc *cdc, const uint8_t *data, size_t len);
+
+#endif // _FASTCDC_H_
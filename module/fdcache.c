@@ -0,0 +1,408 @@
+#include "fdcache.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const char *
+fdc_errstr(enum ERR_FDCACHE err)
+{
+	if (ERR_FDCACHE_OPEN == err)
+		return "[fdcache] Failed to open the file";
+	else if (ERR_FDCACHE_INVAL_KEY == err)
+		return "[fdcache] Invalid key";
+	else
+		return "[fdcache] Undefined error";
+}
+
+int
+init_fd_cache(struct fd_cache *c, size_t capacity, size_t nkeys)
+{
+	c->capacity = capacity;
+	c->nkeys = nkeys;
+	c->index = (int *) malloc(nkeys * sizeof(int));
+	c->entries = (struct fdc_entry *) malloc(capacity * sizeof(struct fdc_entry));
+	if (NULL == c->index || NULL == c->entries) {
+		free(c->index);
+		free(c->entries);
+		return -1;
+	}
+	for (size_t i = 0; i < nkeys; i++)
+		c->index[i] = -1;
+
+	c->free_list = NULL;
+	for (size_t i = capacity; i > 0; i--) {
+		struct fdc_entry *e = &c->entries[i - 1];
+		e->key = -1;
+		e->fd = -1;
+		e->refcnt = 0;
+		e->stale = 0;
+		e->prev = NULL;
+		e->next = c->free_list;
+		c->free_list = e;
+	}
+	c->lru_head = NULL;
+	c->lru_tail = NULL;
+	c->ncached = 0;
+	c->hits = 0;
+	c->misses = 0;
+	pthread_mutex_init(&c->lock, NULL);
+	return 0;
+}
+
+static void
+unlink_lru(struct fd_cache *c, struct fdc_entry *e)
+{
+	if (NULL != e->prev)
+		e->prev->next = e->next;
+	else
+		c->lru_head = e->next;
+	if (NULL != e->next)
+		e->next->prev = e->prev;
+	else
+		c->lru_tail = e->prev;
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static void
+push_lru(struct fd_cache *c, struct fdc_entry *e)
+{
+	e->prev = NULL;
+	e->next = c->lru_head;
+	if (NULL != c->lru_head)
+		c->lru_head->prev = e;
+	else
+		c->lru_tail = e;
+	c->lru_head = e;
+}
+
+static void
+free_entry(struct fd_cache *c, struct fdc_entry *e)
+{
+	close(e->fd);
+	e->key = -1;
+	e->fd = -1;
+	e->stale = 0;
+	e->prev = NULL;
+	e->next = c->free_list;
+	c->free_list = e;
+}
+
+/*
+ * Take a free entry, or evict the least recently used entry nobody holds.
+ * Entries in use are skipped.
+ */
+static struct fdc_entry *
+alloc_entry(struct fd_cache *c)
+{
+	struct fdc_entry *e = c->free_list;
+	if (NULL != e) {
+		c->free_list = e->next;
+		e->next = NULL;
+		return e;
+	}
+	for (e = c->lru_tail; NULL != e; e = e->prev) {
+		if (e->refcnt > 0)
+			continue;
+		unlink_lru(c, e);
+		c->index[e->key] = -1;
+		c->ncached--;
+		close(e->fd);
+		return e;
+	}
+	return NULL;
+}
+
+/*
+ * The file is opened with the lock held. A fd opened before fdc_invalidate()
+ * is therefore always dropped by it, and never cached afterwards.
+ */
+int
+fdc_get(struct fd_cache *c, int key, const char *path, int *pslot)
+{
+	*pslot = -1;
+	if (key < 0 || (size_t)key >= c->nkeys)
+		return ERR_FDCACHE_INVAL_KEY;
+
+	pthread_mutex_lock(&c->lock);
+	int idx = c->index[key];
+	if (idx >= 0) {
+		struct fdc_entry *e = &c->entries[idx];
+		e->refcnt++;
+		unlink_lru(c, e);
+		push_lru(c, e);
+		c->hits++;
+		pthread_mutex_unlock(&c->lock);
+		*pslot = idx;
+		return e->fd;
+	}
+
+	c->misses++;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pthread_mutex_unlock(&c->lock);
+		return ERR_FDCACHE_OPEN;
+	}
+	// All the entries are in use. The caller gets a private fd.
+	struct fdc_entry *e = alloc_entry(c);
+	if (NULL == e) {
+		pthread_mutex_unlock(&c->lock);
+		return fd;
+	}
+	e->key = key;
+	e->fd = fd;
+	e->refcnt = 1;
+	e->stale = 0;
+	push_lru(c, e);
+	c->ncached++;
+	idx = (int)(e - c->entries);
+	c->index[key] = idx;
+	pthread_mutex_unlock(&c->lock);
+
+	*pslot = idx;
+	return fd;
+}
+
+void
+fdc_put(struct fd_cache *c, int slot, int fd)
+{
+	if (slot < 0) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&c->lock);
+	struct fdc_entry *e = &c->entries[slot];
+	e->refcnt--;
+	if (e->stale && 0 == e->refcnt)
+		free_entry(c, e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+fdc_invalidate(struct fd_cache *c, int key)
+{
+	if (key < 0 || (size_t)key >= c->nkeys)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	int idx = c->index[key];
+	if (idx >= 0) {
+		struct fdc_entry *e = &c->entries[idx];
+		c->index[key] = -1;
+		unlink_lru(c, e);
+		c->ncached--;
+		if (0 == e->refcnt)
+			free_entry(c, e);
+		else
+			e->stale = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+fdc_stat(struct fd_cache *c, unsigned long *hits, unsigned long *misses)
+{
+	pthread_mutex_lock(&c->lock);
+	*hits = c->hits;
+	*misses = c->misses;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * No fd may be in use.
+ */
+void
+destruct_fd_cache(struct fd_cache *c)
+{
+	for (size_t i = 0; i < c->capacity; i++)
+		if (c->entries[i].fd >= 0)
+			close(c->entries[i].fd);
+	free(c->entries);
+	free(c->index);
+	pthread_mutex_destroy(&c->lock);
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define TEST_CAPACITY		4
+
+static char g_dir[] = "/tmp/fdcache_test.XXXXXX";
+
+static void
+test_path(int key, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%d", g_dir, key);
+}
+
+/*
+ * Replace the file of key with a new one holding c.
+ */
+static int
+write_version(int key, char c)
+{
+	char path[64];
+	char tmppath[72];
+	test_path(key, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	int fd = open(tmppath, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	int result = (1 == write(fd, &c, 1)) ? 0 : -1;
+	close(fd);
+	return (0 == result) ? rename(tmppath, path) : -1;
+}
+
+static char
+read_version(int fd)
+{
+	char c = 0;
+	return (1 == pread(fd, &c, 1, 0)) ? c : 0;
+}
+
+static int
+fd_open(int fd)
+{
+	return -1 != fcntl(fd, F_GETFD) || EBADF != errno;
+}
+
+static int
+test_hit(int c)
+{
+	struct fd_cache cache;
+	char path[64];
+	int s1 = -1, s2 = -1;
+	if (init_fd_cache(&cache, TEST_CAPACITY, c) < 0)
+		return ERR;
+	test_path(0, path, sizeof(path));
+
+	int result = PASSED;
+	int fd1 = fdc_get(&cache, 0, path, &s1);
+	int fd2 = fdc_get(&cache, 0, path, &s2);
+	if (fd1 < 0 || fd1 != fd2 || s1 != s2 || 1 != cache.hits || 1 != cache.misses)
+		result = FAILED;
+	fdc_put(&cache, s1, fd1);
+	fdc_put(&cache, s2, fd2);
+	// A cached fd stays open without users.
+	if (!fd_open(fd1) || ERR_FDCACHE_INVAL_KEY != fdc_get(&cache, c, path, &s1))
+		result = FAILED;
+	destruct_fd_cache(&cache);
+	return result;
+}
+
+/*
+ * The least recently used idle fd is closed first. When all of them are in
+ * use, the caller gets a private fd.
+ */
+static int
+test_lru(int c)
+{
+	struct fd_cache cache;
+	char path[64];
+	int slots[TEST_CAPACITY];
+	int fds[TEST_CAPACITY];
+	if (init_fd_cache(&cache, TEST_CAPACITY, c) < 0)
+		return ERR;
+
+	int result = PASSED;
+	test_path(0, path, sizeof(path));
+	fds[0] = fdc_get(&cache, 0, path, &slots[0]);
+	for (int key = 1; key < c && PASSED == result; key++) {
+		int slot = -1;
+		test_path(key, path, sizeof(path));
+		int fd = fdc_get(&cache, key, path, &slot);
+		if (fd < 0 || slot < 0 || (char)('0' + key % 10) != read_version(fd))
+			result = FAILED;
+		fdc_put(&cache, slot, fd);
+		if (cache.ncached > TEST_CAPACITY || cache.index[0] != slots[0])
+			result = FAILED;
+	}
+	for (int key = 1; key < TEST_CAPACITY; key++) {
+		test_path(key, path, sizeof(path));
+		fds[key] = fdc_get(&cache, key, path, &slots[key]);
+	}
+	int slot = 0;
+	test_path(TEST_CAPACITY, path, sizeof(path));
+	int fd = fdc_get(&cache, TEST_CAPACITY, path, &slot);
+	if (fd < 0 || -1 != slot)
+		result = FAILED;
+	fdc_put(&cache, slot, fd);
+	if (fd_open(fd))
+		result = FAILED;
+	for (int i = 0; i < TEST_CAPACITY; i++)
+		fdc_put(&cache, slots[i], fds[i]);
+	destruct_fd_cache(&cache);
+	return result;
+}
+
+/*
+ * A replaced file keeps its fd open for its user, and the next user opens
+ * the new file.
+ */
+static int
+test_deferred_invalidation(int c)
+{
+	struct fd_cache cache;
+	char path[64];
+	int s1 = -1, s2 = -1;
+	if (init_fd_cache(&cache, TEST_CAPACITY, c) < 0)
+		return ERR;
+	test_path(0, path, sizeof(path));
+
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		char v = 'a' + i % 26;
+		char next = 'a' + (i + 1) % 26;
+		if (write_version(0, v) < 0)
+			return ERR;
+		int old_fd = fdc_get(&cache, 0, path, &s1);
+		if (write_version(0, next) < 0)
+			return ERR;
+		fdc_invalidate(&cache, 0);
+		int new_fd = fdc_get(&cache, 0, path, &s2);
+		if (v != read_version(old_fd) || next != read_version(new_fd) || s1 == s2)
+			result = FAILED;
+		fdc_put(&cache, s1, old_fd);
+		if (fd_open(old_fd))
+			result = FAILED;
+		fdc_put(&cache, s2, new_fd);
+		fdc_invalidate(&cache, 0);
+		if (0 != cache.ncached)
+			result = FAILED;
+	}
+	destruct_fd_cache(&cache);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	if (NULL == mkdtemp(g_dir))
+		return 1;
+	for (int key = 0; key <= c; key++)
+		if (write_version(key, '0' + key % 10) < 0)
+			return 1;
+
+	UNIT_TEST("hit", test_hit, c);
+	UNIT_TEST("lru", test_lru, c);
+	UNIT_TEST("deferred invalidation", test_deferred_invalidation, c);
+
+	char path[64];
+	for (int key = 0; key <= c; key++) {
+		test_path(key, path, sizeof(path));
+		unlink(path);
+	}
+	rmdir(g_dir);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
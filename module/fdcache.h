@@ -0,0 +1,77 @@
+/*
+ * LRU cache of read-only file descriptors keyed by a small integer id.
+ * An entry in use is never closed. Eviction and invalidation of a busy entry
+ * are deferred until its last user releases it.
+ */
+
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+enum ERR_FDCACHE {
+	ERR_FDCACHE_OPEN = -1,
+	ERR_FDCACHE_INVAL_KEY = -2
+};
+
+struct fdc_entry {
+	int key;						// -1 if the entry is free.
+	int fd;
+	int refcnt;						// Users holding fd.
+	int stale;						// Detached. Closed on the last release.
+	struct fdc_entry *prev;			// LRU list. Most recently used first.
+	struct fdc_entry *next;
+};
+
+struct fd_cache {
+	pthread_mutex_t lock;
+	size_t capacity;
+	size_t nkeys;
+	int *index;						// key -> entries[] index, -1 if not cached.
+	struct fdc_entry *entries;
+	struct fdc_entry *lru_head;
+	struct fdc_entry *lru_tail;
+	struct fdc_entry *free_list;	// Linked by next.
+	size_t ncached;					// Entries in the LRU list.
+	// Statistics
+	unsigned long hits;
+	unsigned long misses;
+};
+
+const char *fdc_errstr(enum ERR_FDCACHE err);
+
+/**
+ * @brief Initialize the cache.
+ *
+ * @param capacity - Max number of open file descriptors.
+ * @param nkeys - Keys are in [0, nkeys).
+ * @return - Success: 0, Fail: -1
+ */
+int init_fd_cache(struct fd_cache *c, size_t capacity, size_t nkeys);
+
+/**
+ * @brief Open path read-only, or reuse the cached file descriptor of key.
+ * The returned fd is shared. Read it with explicit offsets only(pread,
+ * sendfile with an offset) and hand it back with fdc_put().
+ *
+ * @param pslot - Handle for fdc_put(). -1 if the fd is not cached.
+ * @return - Success: fd, Fail: enum ERR_FDCACHE
+ */
+int fdc_get(struct fd_cache *c, int key, const char *path, int *pslot);
+
+/**
+ * @brief Release the fd returned by fdc_get().
+ */
+void fdc_put(struct fd_cache *c, int slot, int fd);
+
+/**
+ * @brief Drop the cached fd of key. Must be called after the file of key is
+ * replaced, renamed or removed.
+ */
+void fdc_invalidate(struct fd_cache *c, int key);
+
+void fdc_stat(struct fd_cache *c, unsigned long *hits, unsigned long *misses);
+void destruct_fd_cache(struct fd_cache *c);
+
+#endif // _FDCACHE_H_
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "fileutil.h"
 
 #include <stdlib.h>
@@ -6,6 +7,9 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 
 void 
 sprint_diskstat(const char *path, char *buf, size_t buflen)
@@ -42,6 +46,10 @@ futil_errstr(enum ERR_FUTIL err)
 		return "[futil] [remove]";
 	else if (ERR_FUTIL_RENAME == err)
 		return "[futil] [remove]";
+	else if (ERR_FUTIL_ALLOCATE == err)
+		return "[futil] Failed to allocate the disk space";
+	else if (ERR_FUTIL_PUBLISH == err)
+		return "[futil] Failed to publish the file";
 	else
 		return "[futil] Undefined error";
 }
@@ -141,6 +149,199 @@ create_file(const char *path, void *buf, int64_t flen)
     return 0;
 }
 
+/*
+ * Create(truncate) the file and open it to write the data incrementally.
+ *
+ * @return - Success: file descriptor
+ * 			 Fail: ERR_FUTIL_OPEN
+ */
+int
+create_file_fd(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0)
+		return ERR_FUTIL_OPEN;
+	return fd;
+}
+
+#define LINK_TEMP_RETRY 8
+
+/*
+ * Give oldpath a unique temporary name next to path and rename it over path.
+ * Readers of path see either the old file or the new one, never nothing.
+ *
+ * @param flags - linkat flags for oldpath.
+ * @return - Success: 0
+ * 			 Fail: ERR_FUTIL_PUBLISH
+ */
+static int
+link_over(const char *oldpath, int flags, const char *path)
+{
+	static unsigned int seq;
+	char tmppath[PATH_MAX];
+	const char *fname = strrchr(path, '/');
+	int dlen = fname ? fname - path + 1 : 0;
+	fname = fname ? fname + 1 : path;
+
+	for (int i = 0; i < LINK_TEMP_RETRY; i++) {
+		unsigned int n = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+		if (snprintf(tmppath, sizeof(tmppath), "%.*s.%s.%d.%u", 
+					dlen, path, fname, getpid(), n) >= (int)sizeof(tmppath))
+			return ERR_FUTIL_PUBLISH;
+		if (0 == linkat(AT_FDCWD, oldpath, AT_FDCWD, tmppath, flags))
+			break;
+		// A leftover of a crashed process may own the name.
+		if (EEXIST != errno || LINK_TEMP_RETRY - 1 == i)
+			return ERR_FUTIL_PUBLISH;
+	}
+	if (0 == rename(tmppath, path))
+		return 0;
+	unlink(tmppath);
+	return ERR_FUTIL_PUBLISH;
+}
+
+/*
+ * Create an unnamed file in the directory to be published later by
+ * publish_file(). Nobody can open a half-written file by its name.
+ * Fall back to a hidden temporary name if O_TMPFILE is not supported.
+ *
+ * @param tmppath - Empty for an unnamed file, the temporary path otherwise.
+ * @return - Success: file descriptor
+ * 			 Fail: ERR_FUTIL_OPEN
+ */
+int
+create_temp_file_fd(const char *dpath, const char *fname, char *tmppath, size_t pathlen)
+{
+	tmppath[0] = '\0';
+	int fd = open(dpath, O_TMPFILE | O_WRONLY, 0640);
+	if (fd >= 0)
+		return fd;
+
+	snprintf(tmppath, pathlen, "%s/.%s.XXXXXX", dpath, fname);
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		tmppath[0] = '\0';
+		return ERR_FUTIL_OPEN;
+	}
+	fchmod(fd, 0640);
+	return fd;
+}
+
+/*
+ * Give the complete file its name atomically. An existing file of the same
+ * name is replaced.
+ *
+ * @return - Success: 0, Fail: ERR_FUTIL_PUBLISH
+ */
+int
+publish_file(int fd, const char *tmppath, const char *path)
+{
+	if ('\0' != tmppath[0]) {
+		if (0 == rename(tmppath, path))
+			return 0;
+		return ERR_FUTIL_PUBLISH;
+	}
+
+	char procpath[32];
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+	if (0 == linkat(AT_FDCWD, procpath, AT_FDCWD, path, AT_SYMLINK_FOLLOW))
+		return 0;
+	// linkat doesn't replace. Link a temporary name and rename it over the stale file.
+	if (EEXIST == errno)
+		return link_over(procpath, AT_SYMLINK_FOLLOW, path);
+	return ERR_FUTIL_PUBLISH;
+}
+
+/*
+ * Close and remove the file which is not published.
+ */
+void
+discard_temp_file(int fd, const char *tmppath)
+{
+	if (fd >= 0)
+		close(fd);
+	if ('\0' != tmppath[0])
+		remove(tmppath);
+}
+
+/*
+ * Open the file to read.
+ *
+ * @return - Success: file descriptor
+ * 			 Fail: ERR_FUTIL_OPEN
+ */
+int
+open_file_fd(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ERR_FUTIL_OPEN;
+	return fd;
+}
+
+/*
+ * Reserve the disk space of the file and extend it to flen bytes, so that
+ * the data can be written at any offset without running out of the disk.
+ * Fall back to ftruncate if the filesystem can't allocate.
+ *
+ * @return - Success: 0, Fail: ERR_FUTIL_ALLOCATE
+ */
+int
+preallocate_file(int fd, int64_t flen)
+{
+	if (flen <= 0)
+		return 0;
+	int err = posix_fallocate(fd, 0, flen);
+	if (0 == err)
+		return 0;
+	if (EOPNOTSUPP == err || EINVAL == err) {
+		if (0 == ftruncate(fd, flen))
+			return 0;
+	}
+	return ERR_FUTIL_ALLOCATE;
+}
+
+/*
+ * Open the file of fd again for reading. Works for write-only and unnamed
+ * (O_TMPFILE) files too.
+ *
+ * @return - Success: file descriptor
+ * 			 Fail: ERR_FUTIL_OPEN
+ */
+int
+reopen_file_rdonly(int fd)
+{
+	char procpath[32];
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+	int rfd = open(procpath, O_RDONLY);
+	if (rfd < 0)
+		return ERR_FUTIL_OPEN;
+	return rfd;
+}
+
+/*
+ * Open the directory to flush its entries.
+ *
+ * @return - Success: file descriptor
+ * 			 Fail: ERR_FUTIL_OPEN
+ */
+int
+open_directory_fd(const char *dpath)
+{
+	int fd = open(dpath, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return ERR_FUTIL_OPEN;
+	return fd;
+}
+
+int
+close_file_fd(int fd)
+{
+	if (0 != close(fd))
+		return ERR_FUTIL_CLOSE;
+	return 0;
+}
+
 int
 delete_file(const char *path)
 {
@@ -156,6 +357,58 @@ rename_file(const char *path_before, const char *path_after)
         return 0;
 	return ERR_FUTIL_RENAME;
 }
+
+/*
+ * Make path another name of the file src. A stale file at path is replaced
+ * atomically.
+ */
+int
+link_file(const char *src, const char *path)
+{
+	if (0 == link(src, path))
+		return 0;
+	if (EEXIST == errno)
+		return link_over(src, 0, path);
+	return ERR_FUTIL_PUBLISH;
+}
+
+int
+write_file_at(int fd, const void *buf, int64_t len, int64_t offset)
+{
+	int64_t wlen = 0;
+	while (wlen < len) {
+		ssize_t n = pwrite(fd, (const char *)buf + wlen, len - wlen, offset + wlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return ERR_FUTIL_PARTIAL_WRITE;
+		wlen += n;
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes in the kernel without passing them through the user space.
+ * The filesystem may share the extents instead of copying.
+ *
+ * @return - Bytes copied. Less than len if the files don't support it.
+ */
+int64_t
+copy_file_data(int infd, int64_t offset, int outfd, int64_t dst, int64_t len)
+{
+	int64_t copied = 0;
+	while (copied < len) {
+		loff_t in = offset + copied;
+		loff_t out = dst + copied;
+		ssize_t n = copy_file_range(infd, &in, outfd, &out, len - copied, 0);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			break;
+		copied += n;
+	}
+	return copied;
+}
 	
 int
 create_directory_if_not_exists(const char *dpath)
@@ -21,7 +21,9 @@ enum ERR_FUTIL {
 	ERR_FUTIL_CLOSE = -8,
 	ERR_FUTIL_REMOVE = -9,
 	ERR_FUTIL_RENAME = -10,
-	ERR_FUTIL_MKDIR = -11
+	ERR_FUTIL_MKDIR = -11,
+	ERR_FUTIL_ALLOCATE = -12,
+	ERR_FUTIL_PUBLISH = -13
 };
 
 struct diskstat {
@@ -41,8 +43,20 @@ int diskstat(const char *path, struct diskstat *);
 int64_t sizeof_file(const char *path);
 int read_file(const char *path, void *buf, int64_t flen);
 int create_file(const char *path, void *buf, int64_t flen);
+int create_file_fd(const char *path);
+int create_temp_file_fd(const char *dpath, const char *fname, char *tmppath, size_t pathlen);
+int publish_file(int fd, const char *tmppath, const char *path);
+void discard_temp_file(int fd, const char *tmppath);
+int open_file_fd(const char *path);
+int reopen_file_rdonly(int fd);
+int open_directory_fd(const char *dpath);
+int preallocate_file(int fd, int64_t flen);
+int close_file_fd(int fd);
 int delete_file(const char *path);
 int rename_file(const char *path_before, const char *path_after);
+int link_file(const char *src, const char *path);
+int write_file_at(int fd, const void *buf, int64_t len, int64_t offset);
+int64_t copy_file_data(int infd, int64_t offset, int outfd, int64_t dst, int64_t len);
 int create_directory_if_not_exists(const char *dpath);
 
 #endif
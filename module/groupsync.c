@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "groupsync.h"
+
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+const char *
+gsync_errstr(enum ERR_GSYNC err)
+{
+	if (ERR_GSYNC_FLUSH == err)
+		return "[gsync] Failed to flush the file";
+	else if (ERR_GSYNC_STOPPED == err)
+		return "[gsync] Sync thread is not running";
+	else
+		return "[gsync] Undefined error";
+}
+
+/*
+ * A directory whose identity is unknown is never shared.
+ */
+static int
+same_directory(const struct sync_req *a, const struct sync_req *b)
+{
+	return a->dirfd >= 0 && b->dirfd >= 0 && 0 != a->dino
+		&& a->ddev == b->ddev && a->dino == b->dino;
+}
+
+/*
+ * Flush the files of the batch one by one, then each directory once.
+ */
+static void
+flush_files(struct sync_req *batch)
+{
+	for (struct sync_req *req = batch; NULL != req; req = req->next)
+		req->result = (0 == fdatasync(req->fd)) ? 0 : ERR_GSYNC_FLUSH;
+
+	for (struct sync_req *req = batch; NULL != req; req = req->next) {
+		if (req->dirfd < 0)
+			continue;
+		struct sync_req *prev = batch;
+		while (prev != req && !same_directory(prev, req))
+			prev = prev->next;
+		if (prev != req)
+			continue;	// Flushed with the earlier request.
+		if (0 == fsync(req->dirfd))
+			continue;
+		req->result = ERR_GSYNC_FLUSH;
+		for (struct sync_req *same = req->next; NULL != same; same = same->next)
+			if (same_directory(same, req))
+				same->result = ERR_GSYNC_FLUSH;
+	}
+}
+
+/*
+ * Flush a batch. A big batch is flushed with one syncfs(2) instead of a
+ * fdatasync(2) per file. All the files of the batch must be on the same
+ * filesystem.
+ */
+static void
+flush_batch(struct group_sync *gs, struct sync_req *batch)
+{
+	int n = 0;
+	for (struct sync_req *req = batch; NULL != req; req = req->next)
+		n++;
+
+	if (n >= gs->syncfs_min) {
+		int result = (0 == syncfs(batch->fd)) ? 0 : ERR_GSYNC_FLUSH;
+		for (struct sync_req *req = batch; NULL != req; req = req->next)
+			req->result = result;
+	} else {
+		flush_files(batch);
+	}
+
+	pthread_mutex_lock(&gs->lock);
+	for (struct sync_req *req = batch; NULL != req; req = req->next)
+		req->done = 1;
+	gs->nbatch++;
+	gs->nreq += n;
+	gs->last_batch = n;
+	pthread_cond_broadcast(&gs->done_cond);
+	pthread_mutex_unlock(&gs->lock);
+}
+
+static void *
+sync_routine(void *arg)
+{
+	struct group_sync *gs = (struct group_sync *)arg;
+
+	pthread_mutex_lock(&gs->lock);
+	while (gs->running) {
+		if (NULL == gs->pending) {
+			pthread_cond_wait(&gs->pending_cond, &gs->lock);
+			continue;
+		}
+		// Let the concurrent requests join the batch. A lone request on
+		// an idle server doesn't wait for company.
+		if (gs->window_usec > 0 && gs->last_batch > 1) {
+			pthread_mutex_unlock(&gs->lock);
+			usleep(gs->window_usec);
+			pthread_mutex_lock(&gs->lock);
+		}
+		struct sync_req *batch = gs->pending;
+		gs->pending = NULL;
+		pthread_mutex_unlock(&gs->lock);
+
+		flush_batch(gs, batch);
+
+		pthread_mutex_lock(&gs->lock);
+	}
+	pthread_mutex_unlock(&gs->lock);
+
+	return NULL;
+}
+
+int
+init_group_sync(struct group_sync *gs, unsigned int window_usec, int syncfs_min)
+{
+	pthread_mutex_init(&gs->lock, NULL);
+	pthread_cond_init(&gs->pending_cond, NULL);
+	pthread_cond_init(&gs->done_cond, NULL);
+	gs->pending = NULL;
+	gs->window_usec = window_usec;
+	gs->syncfs_min = (syncfs_min > 1) ? syncfs_min : 2;
+	gs->nbatch = 0;
+	gs->nreq = 0;
+	gs->last_batch = 0;
+	gs->running = 1;
+	if (0 != pthread_create(&gs->tid, NULL, sync_routine, gs)) {
+		gs->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int
+group_sync(struct group_sync *gs, int fd, int dirfd)
+{
+	struct sync_req req = { fd, dirfd, 0, 0, 0, 0, NULL };
+	struct stat st;
+
+	if (dirfd >= 0 && 0 == fstat(dirfd, &st)) {
+		req.ddev = st.st_dev;
+		req.dino = st.st_ino;
+	}
+
+	pthread_mutex_lock(&gs->lock);
+	if (!gs->running) {
+		pthread_mutex_unlock(&gs->lock);
+		return ERR_GSYNC_STOPPED;
+	}
+	req.next = gs->pending;
+	gs->pending = &req;
+	pthread_cond_signal(&gs->pending_cond);
+	while (!req.done)
+		pthread_cond_wait(&gs->done_cond, &gs->lock);
+	pthread_mutex_unlock(&gs->lock);
+
+	return req.result;
+}
+
+/*
+ * The pending requests are flushed before the thread stops.
+ */
+void
+destruct_group_sync(struct group_sync *gs)
+{
+	pthread_mutex_lock(&gs->lock);
+	if (!gs->running) {
+		pthread_mutex_unlock(&gs->lock);
+		return;
+	}
+	gs->running = 0;
+	pthread_cond_signal(&gs->pending_cond);
+	pthread_mutex_unlock(&gs->lock);
+	pthread_join(gs->tid, NULL);
+
+	if (NULL != gs->pending)
+		flush_batch(gs, gs->pending);
+	gs->pending = NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * Group commit. Concurrent callers that need their files on the disk share
+ * the flushes of a single sync thread.
+ */
+
+#ifndef _GROUPSYNC_H_
+#define _GROUPSYNC_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+enum ERR_GSYNC {
+	ERR_GSYNC_FLUSH = -1,
+	ERR_GSYNC_STOPPED = -2
+};
+
+struct sync_req {
+	int fd;
+	int dirfd;				// -1: No directory to flush.
+	dev_t ddev;				// Identity of the directory. Requests of the
+	ino_t dino;				// same directory share its flush.
+	int done;
+	int result;				// 0 or enum ERR_GSYNC
+	struct sync_req *next;
+};
+
+struct group_sync {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t pending_cond;	// A request is queued.
+	pthread_cond_t done_cond;		// A batch is flushed.
+	struct sync_req *pending;
+	unsigned int window_usec;		// Time to gather a batch under load.
+	int syncfs_min;					// A batch this big is flushed with one syncfs.
+	int last_batch;					// Size of the previous batch.
+	int running;
+	// Statistics
+	unsigned long nbatch;
+	unsigned long nreq;
+};
+
+const char *gsync_errstr(enum ERR_GSYNC err);
+
+/**
+ * @brief Start the sync thread.
+ *
+ * @param window_usec - The thread waits this long after the first request 
+ * 						of a batch so that more requests can join it. The wait
+ * 						is skipped while the requests come alone.
+ * @param syncfs_min - Smaller batches are flushed with fdatasync per file
+ * 					   and fsync per distinct directory.
+ * @return - Success: 0, Fail: -1
+ */
+int init_group_sync(struct group_sync *gs, unsigned int window_usec, int syncfs_min);
+
+/**
+ * @brief Block until the data of fd(and the directory entries of dirfd) are
+ * on the disk.
+ *
+ * @return - Success: 0, Fail: enum ERR_GSYNC
+ */
+int group_sync(struct group_sync *gs, int fd, int dirfd);
+
+void destruct_group_sync(struct group_sync *gs);
+
+#endif // _GROUPSYNC_H_
@@ -89,8 +89,10 @@ set(struct hashmap *map, const char *key, void *pdata, int opt)
 		}
 	// Overwrite
 	} else {
-		if (0 == opt)
+		if (0 == opt) {
+			pthread_rwlock_unlock(&map->buckets[h]->rwlock);
 			return -1;
+		}
 		item->ptr = pdata;
 	}
 
@@ -107,8 +109,10 @@ rm_item(struct hashmap *map, const char *key)
 	pthread_rwlock_wrlock(&map->buckets[h]->rwlock);
 
 	struct hm_item *item = search_item_by_key(map, key);
-	if (NULL == item)
+	if (NULL == item) {
+		pthread_rwlock_unlock(&map->buckets[h]->rwlock);
 		return;
+	}
 
 	rm_lnode(map->buckets[h], item);
 
@@ -134,6 +138,22 @@ find(struct hashmap *map, const char *key)
 	return item->ptr;
 }
 
+int
+find_copy(struct hashmap *map, const char *key, void *dst, size_t size)
+{
+	size_t h = hash(key, map->bucknum);
+
+	pthread_rwlock_rdlock(&map->buckets[h]->rwlock);
+
+	struct hm_item *item = search_item_by_key(map, key);
+	if (NULL != item)
+		memcpy(dst, item->ptr, size);
+
+	pthread_rwlock_unlock(&map->buckets[h]->rwlock);
+
+	return (NULL == item) ? -1 : 0;
+}
+
 size_t 
 count_item(struct hashmap *map)
 {
@@ -311,6 +331,40 @@ failed:
 	return FAILED;
 }
 
+static int
+test_find_copy(int c)
+{
+	struct hashmap *map = init_hashmap(TEST_BUCKET_NUM);
+	if (NULL == map)
+		return ERR;
+
+	struct mock m;
+
+	// Insert * c
+	for (int i = 0; i < c; i++) {
+		set(map, g_sample_keys[i], &g_mocks[i], 1);
+		memset(&m, 0x00, sizeof(struct mock));
+		if (0 != find_copy(map, g_sample_keys[i], &m, sizeof(struct mock)))
+			goto failed;
+		if (0 != memcmp(&m, &g_mocks[i], sizeof (struct mock)))
+			goto failed;
+	}
+
+	// Delete * c
+	for (int i = 0; i < c; i++) {
+		rm_item(map, g_sample_keys[i]);
+		if (-1 != find_copy(map, g_sample_keys[i], &m, sizeof(struct mock)))
+			goto failed;
+	}
+	destruct_hashmap(map);
+
+	return PASSED;
+
+failed:
+	destruct_hashmap(map);
+	return FAILED;
+}
+
 static int
 test_count_item(int c)
 {
@@ -413,6 +467,7 @@ main(int argc, const char *argv[])
 	UNIT_TEST("set", test_set, c);
 	UNIT_TEST("rm_item", test_rm_item, c);
 	UNIT_TEST("find", test_find, c);
+	UNIT_TEST("find_copy", test_find_copy, c);
 	UNIT_TEST("count_item", test_count_item, c);
 	UNIT_TEST("overwriting", test_overwriting, c);
 
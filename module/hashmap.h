@@ -28,6 +28,12 @@ struct hashmap * init_hashmap(size_t);
 int set(struct hashmap *, const char *, void *, int);
 void rm_item(struct hashmap *, const char *);
 void * find(struct hashmap *, const char *);
+/*
+ * Copy size bytes of the value under the lock of the bucket, so that the
+ * value can't be freed by a concurrent rm_item meanwhile.
+ * return -1 if no key-value exists.
+ */
+int find_copy(struct hashmap *, const char *, void *, size_t);
 size_t count_item(struct hashmap *);
 void destruct_hashmap(struct hashmap *);
 size_t count_collision(struct hashmap *);
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include "packfile.h"
+#include "fileutil.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+const char *
+pk_errstr(enum ERR_PACKFILE err)
+{
+	if (ERR_PACKFILE_MALLOC == err)
+		return "[packfile] Failed to allocate memory";
+	else if (ERR_PACKFILE_READ == err)
+		return "[packfile] Failed to read the file";
+	else if (ERR_PACKFILE_WRITE == err)
+		return "[packfile] Failed to write the file";
+	else if (ERR_PACKFILE_CORRUPTED == err)
+		return "[packfile] The pack is corrupted";
+	else
+		return "[packfile] Undefined error";
+}
+
+/*
+ * @return - Bytes read. Less than len at the end of the file, -1 on failure.
+ */
+static ssize_t
+read_at(int fd, void *buf, size_t len, int64_t offset)
+{
+	size_t rlen = 0;
+	while (rlen < len) {
+		ssize_t n = pread(fd, (char *)buf + rlen, len - rlen, offset + rlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n < 0)
+			return -1;
+		if (0 == n)
+			break;
+		rlen += n;
+	}
+	return rlen;
+}
+
+static size_t
+block_len(const struct pack_header *h, size_t block)
+{
+	int64_t rest = h->flen - (int64_t)block * h->block_size;
+	return (rest < (int64_t)h->block_size) ? (size_t)rest : h->block_size;
+}
+
+int
+pk_has_magic(const uint8_t *data, int64_t flen)
+{
+	return flen >= (int64_t)sizeof(PK_MAGIC) - 1 && 0 == memcmp(data, PK_MAGIC, sizeof(PK_MAGIC) - 1);
+}
+
+/*
+ * The frames are written after the space of the index, and the header and
+ * the index are written last.
+ */
+int
+pk_pack_data(const uint8_t *data, int64_t flen, int fd, struct cz_encoder *enc, int64_t *plen)
+{
+	struct pack_header h;
+	memset(&h, 0x00, sizeof(struct pack_header));
+	memcpy(h.magic, PK_MAGIC, sizeof(h.magic));
+	h.flen = flen;
+	h.block_size = PK_BLOCK_SIZE;
+	h.nblocks = (uint32_t)((flen + PK_BLOCK_SIZE - 1) / PK_BLOCK_SIZE);
+
+	size_t ilen = ((size_t)h.nblocks + 1) * sizeof(uint64_t);
+	uint64_t *index = (uint64_t *) malloc(ilen);
+	uint8_t *frame = (uint8_t *) malloc(CZ_FRAME_MAX);
+	int result = 0;
+	if (NULL == index || NULL == frame) {
+		result = ERR_PACKFILE_MALLOC;
+		goto out;
+	}
+
+	int64_t pos = sizeof(struct pack_header) + ilen;
+	for (size_t i = 0; i < h.nblocks; i++) {
+		size_t len = cz_encode(enc, data + i * PK_BLOCK_SIZE, block_len(&h, i), frame);
+		index[i] = pos;
+		if (write_file_at(fd, frame, len, pos) < 0) {
+			result = ERR_PACKFILE_WRITE;
+			goto out;
+		}
+		pos += len;
+	}
+	index[h.nblocks] = pos;
+	if (write_file_at(fd, &h, sizeof(struct pack_header), 0) < 0
+			|| write_file_at(fd, index, ilen, sizeof(struct pack_header)) < 0) {
+		result = ERR_PACKFILE_WRITE;
+		goto out;
+	}
+	*plen = pos;
+out:
+	free(index);
+	free(frame);
+	return result;
+}
+
+int
+pk_open_reader(struct pack_reader *r, int fd)
+{
+	memset(r, 0x00, sizeof(struct pack_reader));
+	r->fd = fd;
+	r->cached = -1;
+	ssize_t n = read_at(fd, &r->h, sizeof(struct pack_header), 0);
+	if (n < 0)
+		return ERR_PACKFILE_READ;
+	if (n < (ssize_t)sizeof(struct pack_header) || memcmp(r->h.magic, PK_MAGIC, sizeof(r->h.magic)))
+		return 0;
+
+	struct pack_header *h = &r->h;
+	if (0 == h->block_size || h->block_size > CZ_BLOCK_SIZE || h->flen < 0
+			|| (int64_t)h->nblocks != (h->flen + h->block_size - 1) / h->block_size)
+		return ERR_PACKFILE_CORRUPTED;
+	r->frame = (uint8_t *) malloc(CZ_FRAME_MAX);
+	r->block = (uint8_t *) malloc(h->block_size);
+	if (NULL == r->frame || NULL == r->block) {
+		pk_close_reader(r);
+		return ERR_PACKFILE_MALLOC;
+	}
+	return 1;
+}
+
+void
+pk_close_reader(struct pack_reader *r)
+{
+	free(r->frame);
+	free(r->block);
+	r->frame = NULL;
+	r->block = NULL;
+}
+
+/*
+ * Load the index entries from block if they are not loaded.
+ */
+static int
+load_index(struct pack_reader *r, size_t block)
+{
+	if (block >= r->ifirst && block < r->ifirst + r->icount)
+		return 0;
+	size_t count = r->h.nblocks - block;
+	if (count > PK_INDEX_BATCH)
+		count = PK_INDEX_BATCH;
+	size_t len = (count + 1) * sizeof(uint64_t);
+	r->icount = 0;
+	if (read_at(r->fd, r->index, len, sizeof(struct pack_header) + block * sizeof(uint64_t))
+			!= (ssize_t)len)
+		return ERR_PACKFILE_READ;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t flen = r->index[i + 1] - r->index[i];
+		if (r->index[i + 1] < r->index[i] || flen < sizeof(struct cz_frame) || flen > CZ_FRAME_MAX)
+			return ERR_PACKFILE_CORRUPTED;
+	}
+	r->ifirst = block;
+	r->icount = count;
+	return 0;
+}
+
+const uint8_t *
+pk_read_frame(struct pack_reader *r, size_t block, size_t *len)
+{
+	if (block >= r->h.nblocks || load_index(r, block) < 0)
+		return NULL;
+	uint64_t off = r->index[block - r->ifirst];
+	*len = r->index[block - r->ifirst + 1] - off;
+	if (read_at(r->fd, r->frame, *len, off) != (ssize_t)*len)
+		return NULL;
+	return r->frame;
+}
+
+static int
+decode_block(struct pack_reader *r, size_t block, uint8_t *dst)
+{
+	size_t len = 0;
+	const uint8_t *frame = pk_read_frame(r, block, &len);
+	if (NULL == frame)
+		return ERR_PACKFILE_READ;
+	struct cz_frame f;
+	memcpy(&f, frame, sizeof(struct cz_frame));
+	size_t blen = block_len(&r->h, block);
+	if (cz_frame_ntoh(&f) < 0 || f.rawlen != blen)
+		return ERR_PACKFILE_CORRUPTED;
+	const uint8_t *payload = frame + sizeof(struct cz_frame);
+	if (0 == f.zlen) {
+		if (len != sizeof(struct cz_frame) + blen)
+			return ERR_PACKFILE_CORRUPTED;
+		memcpy(dst, payload, blen);
+		return 0;
+	}
+	if (len != sizeof(struct cz_frame) + f.zlen || cz_decode(payload, f.zlen, dst, blen) < 0)
+		return ERR_PACKFILE_CORRUPTED;
+	return 0;
+}
+
+/*
+ * Whole blocks are decoded into buf directly. A partial block is decoded in
+ * r->block and kept for the next read.
+ */
+int64_t
+pk_pread(struct pack_reader *r, uint8_t *buf, int64_t len, int64_t offset)
+{
+	if (offset < 0 || len < 0 || offset > r->h.flen || len > r->h.flen - offset)
+		return ERR_PACKFILE_READ;
+	int64_t done = 0;
+	while (done < len) {
+		int64_t off = offset + done;
+		size_t block = off / r->h.block_size;
+		size_t boff = off - (int64_t)block * r->h.block_size;
+		size_t blen = block_len(&r->h, block);
+		size_t n = blen - boff;
+		if ((int64_t)n > len - done)
+			n = len - done;
+		int result = 0;
+		if ((int64_t)block == r->cached) {
+			memcpy(buf + done, r->block + boff, n);
+		} else if (0 == boff && n == blen) {
+			if ((result = decode_block(r, block, buf + done)) < 0)
+				return result;
+		} else {
+			r->cached = -1;
+			if ((result = decode_block(r, block, r->block)) < 0)
+				return result;
+			r->cached = block;
+			memcpy(buf + done, r->block + boff, n);
+		}
+		done += n;
+	}
+	return len;
+}
+
+#ifdef _UNIT_TEST_
+
+#include "../test/mk_ctest.h"
+#include "compress.c"
+#include "fileutil.c"
+
+#include <fcntl.h>
+
+// More blocks than an index batch, and a short last block.
+#define TEST_FILE_LEN		((PK_INDEX_BATCH + 6) * (int64_t)PK_BLOCK_SIZE + 1234)
+
+static char g_path[] = "/tmp/packfile_test.XXXXXX";
+static uint8_t *g_data = NULL;
+static uint32_t g_seed = 2463534242u;
+
+static uint32_t
+next_random(void)
+{
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 17;
+	g_seed ^= g_seed << 5;
+	return g_seed;
+}
+
+/*
+ * Every third block is random, so that both stored and compressed frames
+ * are in the pack.
+ */
+static void
+fill_data(uint8_t *p, int64_t len)
+{
+	for (int64_t i = 0; i < len; i++) {
+		if (1 == (i / PK_BLOCK_SIZE) % 3)
+			p[i] = (uint8_t)next_random();
+		else
+			p[i] = "pack of frames\n"[(i / 7) % 15];
+	}
+}
+
+/*
+ * @return - fd of the pack of flen bytes of g_data, -1 on failure.
+ */
+static int
+make_pack(int64_t flen, struct cz_encoder *enc)
+{
+	int fd = open(g_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	int64_t plen = 0;
+	struct stat st;
+	if (pk_pack_data(g_data, flen, fd, enc, &plen) < 0
+			|| fstat(fd, &st) < 0 || st.st_size != plen) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Random ranges are read back, within a block, across blocks and across
+ * the index batches.
+ */
+int
+test_pread(int c)
+{
+	struct cz_encoder enc;
+	struct pack_reader r;
+	uint8_t *buf = (uint8_t *) malloc(TEST_FILE_LEN);
+	if (NULL == buf || init_cz_encoder(&enc, COMPRESS_FAST) < 0) {
+		free(buf);
+		return ERR;
+	}
+	int fd = make_pack(TEST_FILE_LEN, &enc);
+	destruct_cz_encoder(&enc);
+	if (fd < 0 || 1 != pk_open_reader(&r, fd)) {
+		free(buf);
+		if (fd >= 0)
+			close(fd);
+		return ERR;
+	}
+
+	int result = PASSED;
+	if (TEST_FILE_LEN != pk_pread(&r, buf, TEST_FILE_LEN, 0) || memcmp(buf, g_data, TEST_FILE_LEN))
+		result = FAILED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int64_t offset = next_random() % TEST_FILE_LEN;
+		int64_t max = (i % 2) ? TEST_FILE_LEN - offset : PK_BLOCK_SIZE;
+		int64_t len = next_random() % (max + 1);
+		if (offset + len > TEST_FILE_LEN)
+			len = TEST_FILE_LEN - offset;
+		if (len != pk_pread(&r, buf, len, offset) || memcmp(buf, g_data + offset, len))
+			result = FAILED;
+	}
+	// Out of the file
+	if (ERR_PACKFILE_READ != pk_pread(&r, buf, 1, TEST_FILE_LEN)
+			|| ERR_PACKFILE_READ != pk_pread(&r, buf, INT64_MAX, 1)
+			|| ERR_PACKFILE_READ != pk_pread(&r, buf, 1, -1))
+		result = FAILED;
+	pk_close_reader(&r);
+	close(fd);
+	free(buf);
+	return result;
+}
+
+/*
+ * The stored frames are valid frames of the transfers.
+ */
+int
+test_frames(int c)
+{
+	struct cz_encoder enc;
+	struct pack_reader r;
+	uint8_t *block = (uint8_t *) malloc(PK_BLOCK_SIZE);
+	if (NULL == block || init_cz_encoder(&enc, COMPRESS_HIGH) < 0) {
+		free(block);
+		return ERR;
+	}
+	int fd = make_pack(TEST_FILE_LEN, &enc);
+	destruct_cz_encoder(&enc);
+	if (fd < 0 || 1 != pk_open_reader(&r, fd)) {
+		free(block);
+		if (fd >= 0)
+			close(fd);
+		return ERR;
+	}
+
+	int result = PASSED;
+	int stored = 0;
+	int compressed = 0;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		// Backwards first, so that the index is reloaded.
+		size_t b = (i <= (int)r.h.nblocks) ? r.h.nblocks - i : next_random() % (r.h.nblocks + 1);
+		size_t len = 0;
+		const uint8_t *frame = pk_read_frame(&r, b, &len);
+		if (b == r.h.nblocks) {
+			if (NULL != frame)
+				result = FAILED;
+			continue;
+		}
+		struct cz_frame f;
+		if (NULL == frame) {
+			result = FAILED;
+			break;
+		}
+		memcpy(&f, frame, sizeof(f));
+		size_t blen = block_len(&r.h, b);
+		if (cz_frame_ntoh(&f) < 0 || f.rawlen != blen)
+			result = FAILED;
+		else if (0 == f.zlen)
+			memcpy(block, frame + sizeof(f), blen);
+		else if (cz_decode(frame + sizeof(f), f.zlen, block, blen) != (int64_t)blen)
+			result = FAILED;
+		if (PASSED == result && memcmp(block, g_data + b * PK_BLOCK_SIZE, blen))
+			result = FAILED;
+		stored += (0 == f.zlen);
+		compressed += (0 != f.zlen);
+	}
+	if (c > 3 && (0 == stored || 0 == compressed))
+		result = FAILED;
+	pk_close_reader(&r);
+	close(fd);
+	free(block);
+	return result;
+}
+
+/*
+ * Empty and short files, and the files which are not packs.
+ */
+int
+test_small(int c)
+{
+	struct cz_encoder enc;
+	struct pack_reader r;
+	uint8_t buf[16];
+	int result = PASSED;
+	if (init_cz_encoder(&enc, COMPRESS_FAST) < 0)
+		return ERR;
+	(void)c;
+
+	int64_t lens[] = { 0, 1, PK_BLOCK_SIZE - 1, PK_BLOCK_SIZE, PK_BLOCK_SIZE + 1 };
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]) && PASSED == result; i++) {
+		int fd = make_pack(lens[i], &enc);
+		if (fd < 0) {
+			result = ERR;
+			break;
+		}
+		if (1 != pk_open_reader(&r, fd) || r.h.flen != lens[i]
+				|| 0 != pk_pread(&r, buf, 0, lens[i]))
+			result = FAILED;
+		if (lens[i] > 0 && (1 != pk_pread(&r, buf, 1, lens[i] - 1) || buf[0] != g_data[lens[i] - 1]))
+			result = FAILED;
+		pk_close_reader(&r);
+		close(fd);
+	}
+	destruct_cz_encoder(&enc);
+
+	// Not a pack
+	int fd = open(g_path, O_RDWR | O_TRUNC);
+	if (fd < 0)
+		return ERR;
+	if (0 != pk_open_reader(&r, fd))
+		result = FAILED;
+	pk_close_reader(&r);
+	if (write_file_at(fd, g_data, 100, 0) < 0 || 0 != pk_open_reader(&r, fd))
+		result = FAILED;
+	pk_close_reader(&r);
+	close(fd);
+	if (pk_has_magic(g_data, 100) || !pk_has_magic((const uint8_t *)PK_MAGIC, sizeof(PK_MAGIC) - 1))
+		result = FAILED;
+	return result;
+}
+
+/*
+ * A damaged header or index is reported, not read out of the frames.
+ */
+int
+test_corrupted(int c)
+{
+	struct cz_encoder enc;
+	struct pack_reader r;
+	uint8_t *buf = (uint8_t *) malloc(PK_BLOCK_SIZE);
+	if (NULL == buf || init_cz_encoder(&enc, COMPRESS_FAST) < 0) {
+		free(buf);
+		return ERR;
+	}
+	int result = PASSED;
+	for (int i = 0; i < c && PASSED == result; i++) {
+		int fd = make_pack(4 * PK_BLOCK_SIZE, &enc);
+		if (fd < 0) {
+			result = ERR;
+			break;
+		}
+		struct pack_header h;
+		uint64_t index[5];
+		read_at(fd, &h, sizeof(h), 0);
+		read_at(fd, index, sizeof(index), sizeof(h));
+		switch (i % 4) {
+		case 0:		// The blocks don't match the length.
+			h.nblocks++;
+			write_file_at(fd, &h, sizeof(h), 0);
+			if (ERR_PACKFILE_CORRUPTED != pk_open_reader(&r, fd))
+				result = FAILED;
+			break;
+		case 1:		// The frames overlap.
+			index[2] = index[1] - 1;
+			write_file_at(fd, index, sizeof(index), sizeof(h));
+			if (1 != pk_open_reader(&r, fd) || pk_pread(&r, buf, PK_BLOCK_SIZE, 0) >= 0)
+				result = FAILED;
+			break;
+		case 2:		// The pack is cut in the frames.
+			if (ftruncate(fd, index[4] - 1 - next_random() % (index[4] - index[3])) < 0)
+				result = ERR;
+			if (1 != pk_open_reader(&r, fd) || ERR_PACKFILE_READ != pk_pread(&r, buf, 1, 3 * PK_BLOCK_SIZE))
+				result = FAILED;
+			break;
+		default:	// A frame is damaged.
+			buf[0] = 0xff;
+			write_file_at(fd, buf, 1, index[0] + 2);
+			if (1 != pk_open_reader(&r, fd) || ERR_PACKFILE_CORRUPTED != pk_pread(&r, buf, 1, 0))
+				result = FAILED;
+			break;
+		}
+		pk_close_reader(&r);
+		close(fd);
+	}
+	destruct_cz_encoder(&enc);
+	free(buf);
+	return result;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c = 100;
+	if (2 == argc)
+		c = atoi(argv[1]);
+
+	int fd = mkstemp(g_path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+	g_data = (uint8_t *) malloc(TEST_FILE_LEN);
+	if (NULL == g_data) {
+		unlink(g_path);
+		return 1;
+	}
+	fill_data(g_data, TEST_FILE_LEN);
+
+	UNIT_TEST("pread", test_pread, c);
+	UNIT_TEST("frames", test_frames, c);
+	UNIT_TEST("small", test_small, c);
+	UNIT_TEST("corrupted", test_corrupted, c);
+
+	free(g_data);
+	unlink(g_path);
+	return 0;
+}
+
+#endif // _UNIT_TEST_
@@ -0,0 +1,88 @@
+/*
+ * Files compressed at rest(packs). The file is cut into blocks of a fixed
+ * size, and each block is stored as a compressed frame of compress.h, so a
+ * block can be decoded without the others. The block of an offset is found
+ * by division, and the index gives the position of its frame.
+ *
+ * Layout: struct pack_header, (nblocks + 1) frame offsets, frames.
+ * The header and the index are in the byte order of the host.
+ */
+
+#ifndef _PACKFILE_H_
+#define _PACKFILE_H_
+
+#include "compress.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PK_MAGIC			"TSPACK01"
+#define PK_BLOCK_SIZE		CZ_BLOCK_SIZE
+#define PK_INDEX_BATCH		64			// Index entries read at once.
+
+enum ERR_PACKFILE {
+	ERR_PACKFILE_MALLOC = -1,
+	ERR_PACKFILE_READ = -2,
+	ERR_PACKFILE_WRITE = -3,
+	ERR_PACKFILE_CORRUPTED = -4
+};
+
+struct pack_header {
+	char magic[8];
+	int64_t flen;					// Bytes of the original file.
+	uint32_t block_size;
+	uint32_t nblocks;
+};
+
+struct pack_reader {
+	int fd;
+	struct pack_header h;
+	uint64_t index[PK_INDEX_BATCH + 1];	// Frame offsets of the blocks from ifirst.
+	size_t ifirst;
+	size_t icount;					// Blocks whose frames are known. 0: Not loaded.
+	uint8_t *frame;					// CZ_FRAME_MAX bytes.
+	uint8_t *block;					// Decoded block.
+	int64_t cached;					// Block decoded in block, -1 if none.
+};
+
+const char *pk_errstr(enum ERR_PACKFILE err);
+
+/**
+ * @brief 1 if data begins like a pack. Such files must be stored packed, so
+ * that the magic identifies the packs.
+ */
+int pk_has_magic(const uint8_t *data, int64_t flen);
+
+/**
+ * @brief Write data to fd as a pack.
+ *
+ * @param plen - Bytes of the pack will be set.
+ * @return - Success: 0, Fail: enum ERR_PACKFILE
+ */
+int pk_pack_data(const uint8_t *data, int64_t flen, int fd, struct cz_encoder *enc, int64_t *plen);
+
+/**
+ * @brief Open a reader of fd if it is a pack. fd stays owned by the caller.
+ *
+ * @return - Pack: 1, Not a pack: 0, Fail: enum ERR_PACKFILE
+ */
+int pk_open_reader(struct pack_reader *r, int fd);
+void pk_close_reader(struct pack_reader *r);
+
+/**
+ * @brief Read the frame of a block as stored. It can be sent as a frame of
+ * the compressed transfers.
+ *
+ * @param len - Bytes of the frame will be set.
+ * @return - The frame(valid until the next call), NULL on failure.
+ */
+const uint8_t *pk_read_frame(struct pack_reader *r, size_t block, size_t *len);
+
+/**
+ * @brief Read len bytes of the original file at offset.
+ *
+ * @return - Success: len, Fail: enum ERR_PACKFILE
+ */
+int64_t pk_pread(struct pack_reader *r, uint8_t *buf, int64_t len, int64_t offset);
+
+#endif // _PACKFILE_H_
@@ -12,10 +12,16 @@
 #define TIMESTAMP_LEN			20
 #define TIMESTAMP_MS_LEN		24
 #define ERRSTR_LEN 				64
-#define SVC_TYPE_LEN			2
+#define SVC_TYPE_LEN			3
 #define REQ_ALV_LEN				2
 #define REQ_FLEN_LEN			20
 #define RESP_CODE_LEN			20
+#define SESSION_ID_LEN			17
+#define REQ_STRIPES_LEN			4
+#define REQ_DURABILITY_LEN		2
+#define REQ_COMPRESS_LEN		2
+#define LIST_CURSOR_LEN			32
+#define REQ_FILTER_LEN			2
 
 enum SERVICE_TYPE {
 	SVC_UPLOAD = 0,
@@ -23,6 +29,13 @@ enum SERVICE_TYPE {
 	SVC_RENAME,
 	SVC_DELETE,
 	SVC_INQUIRY,
+	SVC_UPLOAD_SESSION,		// Open or query a resumable upload session.
+	SVC_UPLOAD_CHUNK,		// Upload a chunk of the session's file.
+	SVC_DOWNLOAD_FOLLOW,	// Download a file while it is being uploaded.
+	SVC_UPLOAD_DELTA,		// Replace a file by sending only the changes.
+	SVC_LIST,				// A page of the live items.
+	SVC_CHANGES,			// Changes of the inventory after a version.
+	SVC_SUBSCRIBE,			// Stream of the changes of the inventory.
 	SVC_NUM
 };
 
@@ -37,6 +50,12 @@ enum RESPONSE_CODE {
 	RESP_MODIFYING,
 	RESP_DELETED,
 	RESP_ACCESS_DENIED,
+	RESP_NO_SUCH_SESSION,
+	RESP_INVALID_OFFSET,
+	RESP_INVALID_NAME,
+	RESP_CHECKSUM_MISMATCH,
+	RESP_VERSION_EXPIRED,		// The changes are not logged anymore.
+	RESP_TOO_MANY_SUBSCRIBERS,
 	// TODO
 };
 
@@ -45,6 +64,15 @@ enum ACCESS_LEVEL {
 	PRIVATE_ACCESS
 };
 
+// When the server acknowledges an upload.
+enum DURABILITY {
+	DURABILITY_DEFAULT = 0,		// Server's choice.
+	DURABILITY_RECEIVED,		// All the data is received.
+	DURABILITY_WRITTEN,			// The file is written and published.
+	DURABILITY_DURABLE,			// The file is flushed to the disk.
+	DURABILITY_NUM
+};
+
 enum ITEM_STAT {
 	ITEM_STAT_AVAILABLE,
 	ITEM_STAT_DELETED,
@@ -52,13 +80,74 @@ enum ITEM_STAT {
 	ITEM_STAT_MODIFYING
 };
 
+enum CHANGE_TYPE {
+	CHANGE_ADD = 1,
+	CHANGE_MODIFY,				// The item of the same fname is replaced.
+	CHANGE_REMOVE
+};
+
 struct svc_resp {
 	// enum SERVICE_TYPE svc_type;
 	char type[SVC_TYPE_LEN];
 	enum RESPONSE_CODE resp_code;
 	char code[RESP_CODE_LEN];
+	char sid[SESSION_ID_LEN];
+	// int64_t offset;
+	char offset[REQ_FLEN_LEN];
+	// int64_t flen;
+	char flen[REQ_FLEN_LEN];		// Length of the whole file.
+	// int stripes;
+	char stripes[REQ_STRIPES_LEN];
+	// enum COMPRESS_TYPE compress;
+	char compress[REQ_COMPRESS_LEN];	// Compression of the data chosen by the server.
+	char cursor[LIST_CURSOR_LEN];	// Position after the page. Empty after the last page.
 };
 
+/*
+ * SVC_DOWNLOAD : [offset, offset + flen) of the file. 
+ * 				  Empty flen means up to the end of the file.
+ * SVC_UPLOAD_SESSION : New session(empty sid) of the file split into stripes.
+ * 						Query(sid) the progress of the stripe containing offset.
+ * SVC_UPLOAD_CHUNK : flen bytes written at offset.
+ * SVC_RENAME : fname is renamed to new_fname.
+ * SVC_DOWNLOAD_FOLLOW : [offset, end of the file). The data is sent in frames
+ * 						 as it is uploaded. Each frame is a svc_resp(offset,
+ * 						 flen: length of the frame) followed by the data.
+ * 						 The last frame has no data. Its code is RESP_OK if
+ * 						 the upload is committed, RESP_DELETED otherwise.
+ * SVC_UPLOAD_DELTA : Replace the file of fname with a new version of flen bytes.
+ * 					  The server answers with the length of its version(flen)
+ * 					  and the block size(offset), followed by a struct delta_sig
+ * 					  per block. The client sends struct delta_op frames. The
+ * 					  last one(DELTA_OP_END) is followed by the SHA-256 of the
+ * 					  new version in 64 hex digits. The final svc_resp tells
+ * 					  the result(offset: bytes copied from the old version).
+ * SVC_LIST : At most flen items after cursor(empty: from the first item).
+ * 			  The server answers with the number of items(flen), the cursor
+ * 			  of the next page and the inventory version(offset), followed
+ * 			  by the items. Deleted items are not listed.
+ * SVC_CHANGES : At most flen changes after the inventory version offset.
+ * 				 The server answers with the number of changes(flen) and the
+ * 				 version after them(offset), followed by struct inven_change
+ * 				 per change. RESP_VERSION_EXPIRED asks for a new SVC_LIST.
+ * SVC_SUBSCRIBE : The changes after the version offset(0: from now) are
+ * 				   pushed as they happen. The server answers with the first
+ * 				   version(offset), and then sends responses like those of
+ * 				   SVC_CHANGES until the connection is closed. A subscriber
+ * 				   which falls behind the log gets RESP_VERSION_EXPIRED and
+ * 				   is disconnected.
+ *
+ * filter : SVC_LIST, SVC_CHANGES and SVC_SUBSCRIBE take the items of a
+ * 			struct list_filter.
+ * 			The changes of the other items are sent as CHANGE_REMOVE. Both
+ * 			of them, and SVC_INQUIRY, never show the PRIVATE_ACCESS items of
+ * 			the other clients.
+ *
+ * compress : The data of SVC_UPLOAD, SVC_UPLOAD_CHUNK, SVC_DOWNLOAD,
+ * 			  SVC_INQUIRY and SVC_LIST may be sent in compressed frames(see compress.h).
+ * 			  The client asks for a compression, and the server answers with
+ * 			  the one used for the transfer. COMPRESS_NONE sends raw bytes.
+ */
 struct svc_req {
 	// enum SERVICE_TYPE svc_type;
 	char type[SVC_TYPE_LEN];
@@ -67,6 +156,35 @@ struct svc_req {
 	char flen[REQ_FLEN_LEN];
 	//enum ACCESS_LEVEL alv;
 	char alv[REQ_ALV_LEN];
+	char sid[SESSION_ID_LEN];
+	// int64_t offset;
+	char offset[REQ_FLEN_LEN];
+	// int stripes;
+	char stripes[REQ_STRIPES_LEN];
+	// enum DURABILITY durability;
+	char durability[REQ_DURABILITY_LEN];
+	char new_fname[FILE_NAME_LEN];
+	// enum COMPRESS_TYPE compress;
+	char compress[REQ_COMPRESS_LEN];
+	char cursor[LIST_CURSOR_LEN];
+	// int filtered;
+	char filter[REQ_FILTER_LEN];	// 1: A struct list_filter follows the request.
+};
+
+/*
+ * Conditions of the listed items. Empty fields match any item. The
+ * timestamps are in the format of last_modified, and the ranges include
+ * both ends.
+ */
+struct list_filter {
+	char creator[IP_ADDRESS_LEN];
+	char pattern[FILE_NAME_LEN];		// Shell glob of fname, e.g. "abc*".
+	char min_flen[REQ_FLEN_LEN];
+	char max_flen[REQ_FLEN_LEN];
+	char modified_after[TIMESTAMP_LEN];
+	char modified_before[TIMESTAMP_LEN];
+	// enum ITEM_STAT status;
+	char status[2];
 };
 
 struct inven_item {
@@ -79,22 +197,72 @@ struct inven_item {
 	char flen[REQ_FLEN_LEN];
 };
 
+struct inven_change {
+	// enum CHANGE_TYPE type;
+	char type[2];
+	struct inven_item item;			// The item after the change.
+};
+
+/*
+ * Stripe i of the file split into n stripes is [*start, *start + *len).
+ */
+static inline void
+stripe_range(int64_t flen, int n, int i, int64_t *start, int64_t *len)
+{
+	int64_t slen = (flen + n - 1) / n;
+	*start = slen * i;
+	if (*start > flen)
+		*start = flen;
+	*len = (*start + slen > flen) ? flen - *start : slen;
+}
+
 /*
  * Not thread-safe.
  * Just for the client.
  */
 char *svc_errstr(void);
+int svc_errcode(void);
+void set_svc_compression(enum COMPRESS_TYPE);
+void set_inven_filter(const struct list_filter *);	// NULL: All the items.
 int client_upload_service(int, const char *, int64_t, enum ACCESS_LEVEL, struct trans_stat *);
+int client_resume_upload_service(int, const char *, int64_t, enum ACCESS_LEVEL, char *sid, struct trans_stat *);
+int client_striped_upload_service(int, const struct sockaddr_in *, const char *, int64_t, 
+		enum ACCESS_LEVEL, int nstripes, char *sid, struct trans_stat *);
 int client_inquiry_service(int, struct trans_stat *);
+int client_subscribe_service(int, int (*handler)(const struct inven_change *, void *), void *arg);
 int client_download_service(int, struct inven_item *item, struct trans_stat *);
+int client_parallel_download_service(int, const struct sockaddr_in *, struct inven_item *item, 
+		int nstreams, struct trans_stat *);
+int client_follow_download_service(int, struct inven_item *item, struct trans_stat *);
+int client_rename_service(int, const char *fname, const char *new_fname);
+int client_delete_service(int, const char *fname);
+int client_delta_upload_service(int, const char *, int64_t, struct trans_stat *);
 
 /*
  * Just for the server.
  */
+struct subscriber;
+
+int init_service_buffers(size_t);
+int init_service_durability(enum DURABILITY);
+int init_service_caches(size_t, int64_t);
+int init_service_follow(size_t);
+int init_service_storage(size_t, int, enum COMPRESS_TYPE);
+void attach_service_buffer(int);
 int server_upload_service(int, struct svc_req *);
+int server_upload_session_service(int, struct svc_req *);
+int server_upload_chunk_service(int, struct svc_req *);
 int server_download_service(int,struct svc_req *);
-int server_inquiry_service(int, size_t, struct svc_req *);
+int server_follow_service(int, struct svc_req *);
+int server_inquiry_service(int, struct svc_req *);
+int server_list_service(int, struct svc_req *);
+int server_changes_service(int, struct svc_req *);
+int init_service_subscriptions(void);
+int server_subscribe_service(int, struct svc_req *, struct subscriber **);
+int pump_subscriber(struct subscriber *);
+void close_subscriber(struct subscriber *);
 int server_rename_service(int, struct svc_req *);
 int server_delete_service(int, struct svc_req *);
+int server_delta_upload_service(int, struct svc_req *);
 
 #endif // _SERVICE_H_
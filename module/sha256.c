@@ -0,0 +1,283 @@
+#include "sha256.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA256_FD_BUF_SIZE		(256 * 1024)
+
+#define ROTR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)		(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x)			(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define EP1(x)			(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SIG0(x)			(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SIG1(x)			(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * The hash functions are optimized even in the debug build. Uploads are
+ * hashed at their full length.
+ */
+__attribute__((optimize("O2")))
+static void
+transform(uint32_t state[8], const uint8_t *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++)
+		w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+			| ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+	for (int i = 16; i < 64; i++)
+		w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + EP1(e) + CH(e, f, g) + K[i] + w[i];
+		uint32_t t2 = EP0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/*
+ * Compress the blocks with the SHA extensions of x86(SHA-NI).
+ */
+__attribute__((target("sha,sse4.1"), optimize("O2")))
+static void
+transform_shani(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	const __m128i shuf_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);				// CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);		// EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);	// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	// CDGH
+
+	while (nblocks-- > 0) {
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+		__m128i msg, msg0, msg1, msg2, msg3;
+
+		// Rounds 0-15 load the message.
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), shuf_mask);
+		msg = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i *)&K[0]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), shuf_mask);
+		msg = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i *)&K[4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), shuf_mask);
+		msg = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i *)&K[8]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), shuf_mask);
+		msg = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i *)&K[12]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		tmp = _mm_alignr_epi8(msg3, msg2, 4);
+		msg0 = _mm_add_epi32(msg0, tmp);
+		msg0 = _mm_sha256msg2_epu32(msg0, msg3);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+		// Rounds 16-63 schedule the message four words at a time.
+		for (int i = 16; i < 64; i += 16) {
+			msg = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i *)&K[i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			tmp = _mm_alignr_epi8(msg0, msg3, 4);
+			msg1 = _mm_add_epi32(msg1, tmp);
+			msg1 = _mm_sha256msg2_epu32(msg1, msg0);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+			msg = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i *)&K[i + 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			tmp = _mm_alignr_epi8(msg1, msg0, 4);
+			msg2 = _mm_add_epi32(msg2, tmp);
+			msg2 = _mm_sha256msg2_epu32(msg2, msg1);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+			msg = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i *)&K[i + 8]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			tmp = _mm_alignr_epi8(msg2, msg1, 4);
+			msg3 = _mm_add_epi32(msg3, tmp);
+			msg3 = _mm_sha256msg2_epu32(msg3, msg2);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+			msg = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i *)&K[i + 12]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			tmp = _mm_alignr_epi8(msg3, msg2, 4);
+			msg0 = _mm_add_epi32(msg0, tmp);
+			msg0 = _mm_sha256msg2_epu32(msg0, msg3);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);			// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);		// DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	// DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);		// ABEF
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+// 0: Unknown, 1: SHA-NI, -1: Portable
+static int g_shani = 0;
+
+static int
+has_shani(void)
+{
+	if (0 == g_shani) {
+		unsigned int eax, ebx, ecx, edx;
+		int sha = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29));
+		int sse41 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 19));
+		g_shani = (sha && sse41) ? 1 : -1;
+	}
+	return 1 == g_shani;
+}
+
+static void
+transform_blocks(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	if (has_shani()) {
+		transform_shani(state, data, nblocks);
+		return;
+	}
+	for (size_t i = 0; i < nblocks; i++)
+		transform(state, data + i * 64);
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->nbytes = 0;
+	ctx->blen = 0;
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	ctx->nbytes += len;
+
+	if (ctx->blen > 0) {
+		size_t n = 64 - ctx->blen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->block + ctx->blen, p, n);
+		ctx->blen += n;
+		p += n;
+		len -= n;
+		if (ctx->blen < 64)
+			return;
+		transform_blocks(ctx->state, ctx->block, 1);
+		ctx->blen = 0;
+	}
+	// Whole blocks are hashed in place.
+	if (len >= 64) {
+		transform_blocks(ctx->state, p, len / 64);
+		p += len - len % 64;
+		len %= 64;
+	}
+	memcpy(ctx->block, p, len);
+	ctx->blen = len;
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LEN])
+{
+	uint64_t nbits = ctx->nbytes * 8;
+	uint8_t pad[72];
+	size_t padlen = (ctx->blen < 56) ? 56 - ctx->blen : 120 - ctx->blen;
+	memset(pad, 0x00, sizeof(pad));
+	pad[0] = 0x80;
+	for (int i = 0; i < 8; i++)
+		pad[padlen + i] = (uint8_t)(nbits >> (56 - i * 8));
+	sha256_update(ctx, pad, padlen + 8);
+
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+	}
+}
+
+int
+sha256_fd(int fd, int64_t flen, char hex[SHA256_HEX_LEN])
+{
+	struct sha256_ctx ctx;
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char *buf = (char *) malloc(SHA256_FD_BUF_SIZE);
+	if (NULL == buf)
+		return -1;
+
+	sha256_init(&ctx);
+	int64_t off = 0;
+	while (off < flen) {
+		size_t n = (flen - off < SHA256_FD_BUF_SIZE) ? flen - off : SHA256_FD_BUF_SIZE;
+		ssize_t rlen = pread(fd, buf, n, off);
+		if (rlen < 0 && EINTR == errno)
+			continue;
+		if (rlen <= 0) {
+			free(buf);
+			return -1;
+		}
+		sha256_update(&ctx, buf, rlen);
+		off += rlen;
+	}
+	free(buf);
+	sha256_final(&ctx, digest);
+
+	for (int i = 0; i < SHA256_DIGEST_LEN; i++)
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * SHA-256(FIPS 180-4).
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN		32
+#define SHA256_HEX_LEN			(SHA256_DIGEST_LEN * 2 + 1)
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t nbytes;
+	uint8_t block[64];
+	size_t blen;				// Bytes in block.
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+/**
+ * @brief Hash flen bytes of fd from the beginning.
+ *
+ * @param hex - Lowercase hex digest will be set.
+ * @return - Success: 0, Fail: -1
+ */
+int sha256_fd(int fd, int64_t flen, char hex[SHA256_HEX_LEN]);
+
+#endif // _SHA256_H_
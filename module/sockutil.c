@@ -3,15 +3,19 @@
  * Socket utility module for t-storage program.
  */
 
+#define _GNU_SOURCE
 #include "sockutil.h"
 
 #define NONBLCOK_RETRY_LIMIT		10
+#define SPLICE_CHUNK_SIZE			(64 * 1024)
+#define SPLICE_SINK_SIZE			4096
 
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
 
 const char *
 sockutil_errstr(enum ERR_SOCKUTIL err) 
@@ -30,6 +34,14 @@ sockutil_errstr(enum ERR_SOCKUTIL err)
 		return "[send] [recv]";
 	else if(ERR_SOCKUTIL_SERVER_CLOSED == err)
 		return "[send] connection closed";
+	else if(ERR_SOCKUTIL_WRITE_FAILED == err)
+		return "[recv] [write]";
+	else if(ERR_SOCKUTIL_SPLICE_UNSUPPORTED == err)
+		return "[splice] unsupported";
+	else if(ERR_SOCKUTIL_READ_FAILED == err)
+		return "[send] [read]";
+	else if(ERR_SOCKUTIL_CORRUPTED == err)
+		return "[recv] Corrupted compressed data";
 	else
 		return "undefined error occured.";
 }
@@ -130,6 +142,48 @@ send_stream_nblock(int sockfd, void *data, int64_t dlen, struct trans_stat *rate
 	return sendcnt;
 }
 
+/*
+ * Zero-copy send routine. file -> socket with sendfile(2).
+ * Partial sends are resumed from where the kernel stopped.
+ *
+ * @param sockfd - Receiver.
+ * @param fd - File to send.
+ * @param offset - Position in the file to start sending from.
+ * @param dlen - Data length to send.
+ * @param rate - Transmission status in real-time.
+ * @return - Error : ERR_SOCKUTIL_SEND_FAILED, ERR_SOCKUTIL_PARTIAL_DATA(file shrunk).
+ *         - Success : The number of bytes sent(dlen).
+ */
+int64_t
+sendfile_stream(int sockfd, int fd, int64_t offset, int64_t dlen, struct trans_stat *rate)
+{
+	if (NULL != rate) {
+		rate->total = dlen;
+		rate->transmitted = 0;
+	}
+
+	off_t off = (off_t)offset;
+	int64_t slen = 0;
+
+	while (slen < dlen) {
+		ssize_t chunk = sendfile(sockfd, fd, &off, dlen - slen);
+		if (chunk < 0) {
+			if (EINTR == errno || EAGAIN == errno)
+				continue;
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_SEND_FAILED;
+		} else if (0 == chunk) {
+			// End of file before dlen.
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_PARTIAL_DATA;
+		}
+		slen += chunk;
+		update_trans_stat(rate, slen);
+	}
+
+	return slen;
+}
+
 void 
 set_sockaddr_in(const char *ip, int port, struct sockaddr_in *sa)
 {
@@ -206,3 +260,500 @@ recv_stream_nblock(int sockfd, void *buf, int64_t dlen, struct trans_stat *rate)
 	}
 }
 
+
+/*
+ * Receive routine that moves the data to the file(.fd) chunk by chunk.
+ * If writing to the file fails, the rest of the data is still drained from
+ * the socket so that the endpoint can read the response that follows.
+ *
+ * @param sockfd - Sender.
+ * @param fd - File to write the data to.
+ * @param offset - Position in the file to write at. Negative to use the file offset.
+ * @param dlen - Data length to receive.
+ * @param buf - Bounce buffer.
+ * @param buflen - Size of the bounce buffer.
+ * @param rate - Transmission status in real-time.
+ * @return - Error : ERR_SOCKUTIL_SERVER_CLOSED, ERR_SOCKUTIL_RECV_FAILED,
+ *                   ERR_SOCKUTIL_WRITE_FAILED.
+ *         - Success : The number of bytes received(dlen).
+ */
+int64_t
+recv_stream_to_fd(int sockfd, int fd, int64_t offset, int64_t dlen, void *buf, size_t buflen, struct trans_stat *rate)
+{
+	int64_t rlen = 0;
+	int write_failed = 0;
+	if (NULL != rate)
+		rate->total = dlen;
+
+	while (rlen < dlen) {
+		size_t want = (dlen - rlen < (int64_t)buflen) ? (size_t)(dlen - rlen) : buflen;
+		ssize_t chunk = recv(sockfd, buf, want, 0);
+		if (0 == chunk) {
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_SERVER_CLOSED;
+		} else if (chunk < 0) {
+			if (EINTR == errno)
+				continue;
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_RECV_FAILED;
+		}
+		rlen += chunk;
+
+		// Keep draining the socket after a write failure.
+		ssize_t wlen = 0;
+		while (!write_failed && wlen < chunk) {
+			ssize_t w = (offset < 0) ? write(fd, (char *)buf + wlen, chunk - wlen)
+				: pwrite(fd, (char *)buf + wlen, chunk - wlen, offset + rlen - chunk + wlen);
+			if (w < 0 && EINTR == errno)
+				continue;
+			if (w <= 0) {
+				write_failed = 1;
+				break;
+			}
+			wlen += w;
+		}
+		update_trans_stat(rate, rlen);
+	}
+
+	if (write_failed) {
+		update_trans_stat(rate, -1);
+		return ERR_SOCKUTIL_WRITE_FAILED;
+	}
+
+	return rlen;
+}
+
+/*
+ * Send dlen bytes of data as compressed frames.
+ *
+ * @param buf - Frame buffer of CZ_FRAME_MAX bytes.
+ * @return - Error : ERR_SOCKUTIL_SEND_FAILED.
+ *         - Success : The number of bytes of data sent(dlen).
+ */
+int64_t
+send_compressed_data(int sockfd, const void *data, int64_t dlen, struct cz_encoder *enc,
+		void *buf, struct trans_stat *rate)
+{
+	int64_t slen = 0;
+	while (slen < dlen) {
+		size_t n = (dlen - slen < CZ_BLOCK_SIZE) ? (size_t)(dlen - slen) : CZ_BLOCK_SIZE;
+		size_t flen = cz_encode(enc, (const uint8_t *)data + slen, n, buf);
+		if (send_stream(sockfd, buf, flen) < 0) {
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_SEND_FAILED;
+		}
+		slen += n;
+		update_trans_stat(rate, slen);
+	}
+	return slen;
+}
+
+/*
+ * Send dlen bytes of the file starting at offset as compressed frames.
+ *
+ * @param buf - At least CZ_STREAM_BUF_SIZE bytes. A block is read at the
+ * 				head of buf and encoded behind it.
+ * @return - Error : ERR_SOCKUTIL_SEND_FAILED, ERR_SOCKUTIL_READ_FAILED.
+ *         - Success : The number of bytes sent(dlen).
+ */
+int64_t
+send_compressed_stream(int sockfd, int fd, int64_t offset, int64_t dlen, struct cz_encoder *enc,
+		void *buf, struct trans_stat *rate)
+{
+	if (NULL != rate) {
+		rate->total = dlen;
+		rate->transmitted = 0;
+	}
+
+	uint8_t *block = (uint8_t *)buf;
+	uint8_t *frame = block + CZ_BLOCK_SIZE;
+	int64_t slen = 0;
+	while (slen < dlen) {
+		size_t n = (dlen - slen < CZ_BLOCK_SIZE) ? (size_t)(dlen - slen) : CZ_BLOCK_SIZE;
+		size_t rlen = 0;
+		while (rlen < n) {
+			ssize_t r = pread(fd, block + rlen, n - rlen, offset + slen + rlen);
+			if (r < 0 && EINTR == errno)
+				continue;
+			if (r <= 0) {
+				update_trans_stat(rate, -1);
+				return ERR_SOCKUTIL_READ_FAILED;
+			}
+			rlen += r;
+		}
+		size_t flen = cz_encode(enc, block, n, frame);
+		if (send_stream(sockfd, frame, flen) < 0) {
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_SEND_FAILED;
+		}
+		slen += n;
+		update_trans_stat(rate, slen);
+	}
+	return slen;
+}
+
+static int64_t
+recv_full(int sockfd, void *buf, size_t len)
+{
+	size_t rlen = 0;
+	while (rlen < len) {
+		ssize_t chunk = recv(sockfd, (char *)buf + rlen, len - rlen, 0);
+		if (0 == chunk)
+			return ERR_SOCKUTIL_SERVER_CLOSED;
+		if (chunk < 0) {
+			if (EINTR == errno)
+				continue;
+			return ERR_SOCKUTIL_RECV_FAILED;
+		}
+		rlen += chunk;
+	}
+	return rlen;
+}
+
+/*
+ * Receive a compressed frame and decode it to block.
+ *
+ * @param payload - Buffer of CZ_FRAME_MAX bytes for the compressed data.
+ * @param maxlen - The block must not be longer.
+ * @return - Success: Bytes of the block, Error: enum ERR_SOCKUTIL
+ */
+static int64_t
+recv_frame(int sockfd, uint8_t *block, int64_t maxlen, uint8_t *payload)
+{
+	struct cz_frame frame;
+	int64_t result = recv_full(sockfd, &frame, sizeof(struct cz_frame));
+	if (result < 0)
+		return result;
+	if (cz_frame_ntoh(&frame) < 0 || frame.rawlen > maxlen)
+		return ERR_SOCKUTIL_CORRUPTED;
+	if (0 == frame.zlen)
+		return recv_full(sockfd, block, frame.rawlen);
+	result = recv_full(sockfd, payload, frame.zlen);
+	if (result < 0)
+		return result;
+	if (cz_decode(payload, frame.zlen, block, frame.rawlen) < 0)
+		return ERR_SOCKUTIL_CORRUPTED;
+	return frame.rawlen;
+}
+
+/*
+ * Receive dlen bytes of data sent by send_compressed_data or
+ * send_compressed_stream.
+ *
+ * @param buf - Buffer of CZ_FRAME_MAX bytes.
+ * @return - Error : ERR_SOCKUTIL_SERVER_CLOSED, ERR_SOCKUTIL_RECV_FAILED,
+ *                   ERR_SOCKUTIL_CORRUPTED.
+ *         - Success : The number of bytes received(dlen).
+ */
+int64_t
+recv_compressed_data(int sockfd, void *data, int64_t dlen, void *buf, struct trans_stat *rate)
+{
+	if (NULL != rate)
+		rate->total = dlen;
+
+	int64_t rlen = 0;
+	while (rlen < dlen) {
+		int64_t n = recv_frame(sockfd, (uint8_t *)data + rlen, dlen - rlen, buf);
+		if (n < 0) {
+			update_trans_stat(rate, -1);
+			return n;
+		}
+		rlen += n;
+		update_trans_stat(rate, rlen);
+	}
+	return rlen;
+}
+
+/*
+ * Receive dlen bytes of compressed frames and write the data to the file like
+ * recv_stream_to_fd. The frames must not cross dlen, so the sender's and the
+ * receiver's steps must be multiples of CZ_BLOCK_SIZE except the last one.
+ *
+ * @param buf - At least CZ_STREAM_BUF_SIZE bytes.
+ * @return - Error : ERR_SOCKUTIL_SERVER_CLOSED, ERR_SOCKUTIL_RECV_FAILED,
+ *                   ERR_SOCKUTIL_CORRUPTED, ERR_SOCKUTIL_WRITE_FAILED.
+ *         - Success : The number of bytes received(dlen).
+ */
+int64_t
+recv_compressed_stream(int sockfd, int fd, int64_t offset, int64_t dlen, void *buf, struct trans_stat *rate)
+{
+	uint8_t *block = (uint8_t *)buf;
+	uint8_t *payload = block + CZ_BLOCK_SIZE;
+	int64_t rlen = 0;
+	int write_failed = 0;
+	if (NULL != rate)
+		rate->total = dlen;
+
+	while (rlen < dlen) {
+		int64_t n = recv_frame(sockfd, block, dlen - rlen, payload);
+		if (n < 0) {
+			update_trans_stat(rate, -1);
+			return n;
+		}
+		// Keep draining the socket after a write failure.
+		int64_t wlen = 0;
+		while (!write_failed && wlen < n) {
+			ssize_t w = (offset < 0) ? write(fd, block + wlen, n - wlen)
+				: pwrite(fd, block + wlen, n - wlen, offset + rlen + wlen);
+			if (w < 0 && EINTR == errno)
+				continue;
+			if (w <= 0) {
+				write_failed = 1;
+				break;
+			}
+			wlen += w;
+		}
+		rlen += n;
+		update_trans_stat(rate, rlen);
+	}
+
+	if (write_failed) {
+		update_trans_stat(rate, -1);
+		return ERR_SOCKUTIL_WRITE_FAILED;
+	}
+	return rlen;
+}
+
+// Writes of recv_stream_to_ring in flight. A slot is busy until its data is written.
+struct ring_slots {
+	struct uring *ring;
+	int file_idx;
+	int buf_idx;
+	uint64_t busy;
+	const char *buf[RING_MAX_SLOTS];		// Data not written yet
+	size_t len[RING_MAX_SLOTS];
+	int64_t offset[RING_MAX_SLOTS];
+	int write_failed;
+};
+
+static int
+submit_ring_slot(struct ring_slots *rs, int slot)
+{
+	if (uring_prep_write_fixed(rs->ring, rs->file_idx, rs->buf[slot], rs->len[slot], 
+				rs->offset[slot], rs->buf_idx, slot) < 0 || uring_submit(rs->ring, 0) < 0)
+		return -1;
+	rs->busy |= 1ULL << slot;
+	return 0;
+}
+
+/*
+ * Reap a completion of recv_stream_to_ring. The rest of a short write is
+ * submitted again at the advanced offset.
+ *
+ * @return - 0, -1 if the ring failed.
+ */
+static int
+reap_ring_slot(struct ring_slots *rs)
+{
+	uint64_t slot = 0;
+	int res = 0;
+	if (uring_wait_cqe(rs->ring, &slot, &res) < 0) {
+		// The buffers can't be reused safely.
+		rs->write_failed = 1;
+		return -1;
+	}
+	rs->busy &= ~(1ULL << slot);
+	if (res <= 0 || (size_t)res > rs->len[slot]) {
+		rs->write_failed = 1;
+		return 0;
+	}
+	if ((size_t)res == rs->len[slot])
+		return 0;
+	rs->buf[slot] += res;
+	rs->len[slot] -= res;
+	rs->offset[slot] += res;
+	if (submit_ring_slot(rs, slot) < 0)
+		rs->write_failed = 1;
+	return 0;
+}
+
+static void
+drain_ring(struct ring_slots *rs)
+{
+	while (0 != rs->busy) {
+		if (reap_ring_slot(rs) < 0)
+			break;
+	}
+}
+
+int64_t
+recv_stream_to_ring(int sockfd, struct uring *ring, int file_idx, int buf_idx, int64_t offset, 
+		int64_t dlen, void *buf, size_t buflen, int nslots, struct trans_stat *rate)
+{
+	struct ring_slots rs = { .ring = ring, .file_idx = file_idx, .buf_idx = buf_idx };
+	int64_t rlen = 0;
+	int slot = 0;
+	int64_t result = 0;
+
+	if (nslots > RING_MAX_SLOTS)
+		nslots = RING_MAX_SLOTS;
+	size_t sz = buflen / nslots;
+	if (NULL != rate)
+		rate->total = dlen;
+
+	while (rlen < dlen) {
+		// Wait until the slot is written.
+		while (rs.busy & (1ULL << slot)) {
+			if (reap_ring_slot(&rs) < 0) {
+				result = ERR_SOCKUTIL_WRITE_FAILED;
+				goto out;
+			}
+		}
+
+		char *p = (char *)buf + slot * sz;
+		size_t want = (dlen - rlen < (int64_t)sz) ? (size_t)(dlen - rlen) : sz;
+		size_t got = 0;
+		while (got < want) {
+			ssize_t chunk = recv(sockfd, p + got, want - got, 0);
+			if (0 == chunk) {
+				result = ERR_SOCKUTIL_SERVER_CLOSED;
+				goto out;
+			} else if (chunk < 0) {
+				if (EINTR == errno)
+					continue;
+				result = ERR_SOCKUTIL_RECV_FAILED;
+				goto out;
+			}
+			got += chunk;
+		}
+
+		// Keep draining the socket after a write failure.
+		if (!rs.write_failed) {
+			rs.buf[slot] = p;
+			rs.len[slot] = got;
+			rs.offset[slot] = offset + rlen;
+			if (submit_ring_slot(&rs, slot) < 0)
+				rs.write_failed = 1;
+		}
+		rlen += got;
+		update_trans_stat(rate, rlen);
+		slot = (slot + 1) % nslots;
+	}
+
+out:
+	// The slots must not be in use when returning.
+	drain_ring(&rs);
+	if (result < 0) {
+		update_trans_stat(rate, -1);
+		return result;
+	}
+	if (rs.write_failed) {
+		update_trans_stat(rate, -1);
+		return ERR_SOCKUTIL_WRITE_FAILED;
+	}
+	return rlen;
+}
+
+/*
+ * Move the data in the pipe(.pipefd) to the file(.fd) with read/write.
+ * Used when the file doesn't accept splice or the data must be discarded.
+ * The pipe is always emptied unless reading from it fails.
+ *
+ * @param fd - Destination. -1 to discard the data.
+ * @param offset - Position in the file. Negative to use the file offset.
+ * @return - Success: 0, Write failed: -1, Read failed: -2
+ */
+static int
+copy_pipe_out(int pipefd, int fd, int64_t offset, int64_t len)
+{
+	char sink[SPLICE_SINK_SIZE];
+	int ret = 0;
+	while (len > 0) {
+		ssize_t n = read(pipefd, sink, (len < SPLICE_SINK_SIZE) ? len : SPLICE_SINK_SIZE);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return -2;
+		len -= n;
+		ssize_t off = 0;
+		while (fd >= 0 && 0 == ret && off < n) {
+			ssize_t w = (offset < 0) ? write(fd, sink + off, n - off)
+				: pwrite(fd, sink + off, n - off, offset + off);
+			if (w < 0 && EINTR == errno)
+				continue;
+			if (w <= 0)
+				ret = -1;
+			else
+				off += w;
+		}
+		if (offset >= 0)
+			offset += n;
+	}
+	return ret;
+}
+
+/*
+ * Zero-copy receive routine. socket -> pipe -> file with splice(2).
+ * Same semantics as recv_stream_to_fd. If writing to the file fails, the rest
+ * of the data is drained from the socket and discarded.
+ *
+ * @param sockfd - Sender.
+ * @param fd - File to write the data to.
+ * @param offset - Position in the file to write at. Negative to use the file offset.
+ * @param dlen - Data length to receive.
+ * @param pipefd - Empty pipe. pipefd[0] read end, pipefd[1] write end.
+ * @param rate - Transmission status in real-time.
+ * @return - Error : ERR_SOCKUTIL_SPLICE_UNSUPPORTED, ERR_SOCKUTIL_SERVER_CLOSED,
+ *                   ERR_SOCKUTIL_RECV_FAILED, ERR_SOCKUTIL_WRITE_FAILED.
+ *         - Success : The number of bytes received(dlen).
+ */
+int64_t
+splice_stream_to_fd(int sockfd, int fd, int64_t offset, int64_t dlen, int pipefd[2], struct trans_stat *rate)
+{
+	loff_t off = (loff_t)offset;
+	loff_t *poff = (offset < 0) ? NULL : &off;
+	int64_t rlen = 0;
+	int write_failed = 0;
+	int copy_out = 0; 	// The file doesn't support splice.
+	if (NULL != rate)
+		rate->total = dlen;
+
+	while (rlen < dlen) {
+		size_t want = (dlen - rlen < SPLICE_CHUNK_SIZE) ? (size_t)(dlen - rlen) : SPLICE_CHUNK_SIZE;
+		ssize_t chunk = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (0 == chunk) {
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_SERVER_CLOSED;
+		} else if (chunk < 0) {
+			if (EINTR == errno)
+				continue;
+			if (0 == rlen && (EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno))
+				return ERR_SOCKUTIL_SPLICE_UNSUPPORTED;
+			update_trans_stat(rate, -1);
+			return ERR_SOCKUTIL_RECV_FAILED;
+		}
+		rlen += chunk;
+
+		// Empty the pipe before the next receive.
+		ssize_t moved = 0;
+		while (!write_failed && !copy_out && moved < chunk) {
+			ssize_t n = splice(pipefd[0], NULL, fd, poff, chunk - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && EINTR == errno)
+				continue;
+			if (n < 0 && EINVAL == errno)
+				copy_out = 1;
+			else if (n <= 0)
+				write_failed = 1;
+			else
+				moved += n;
+		}
+		if (moved < chunk) {
+			int result = copy_pipe_out(pipefd[0], write_failed ? -1 : fd,
+					(NULL == poff) ? -1 : off, chunk - moved);
+			off += chunk - moved;
+			if (-2 == result) {
+				update_trans_stat(rate, -1);
+				return ERR_SOCKUTIL_WRITE_FAILED;
+			} else if (-1 == result)
+				write_failed = 1;
+		}
+		update_trans_stat(rate, rlen);
+	}
+
+	if (write_failed) {
+		update_trans_stat(rate, -1);
+		return ERR_SOCKUTIL_WRITE_FAILED;
+	}
+
+	return rlen;
+}
@@ -10,6 +10,11 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 
+#include "uring.h"
+#include "compress.h"
+
+#define RING_MAX_SLOTS				64
+
 enum ERR_SOCKUTIL {
 	ERR_SOCKUTIL_RETRY_LIMIT = -1,
 	ERR_SOCKUTIL_PARTIAL_DATA = -2,
@@ -17,7 +22,11 @@ enum ERR_SOCKUTIL {
 	ERR_SOCKUTIL_SETSOCKOPT = -4,
 	ERR_SOCKUTIL_SEND_FAILED = -5,
 	ERR_SOCKUTIL_RECV_FAILED = -6,
-	ERR_SOCKUTIL_SERVER_CLOSED = -7
+	ERR_SOCKUTIL_SERVER_CLOSED = -7,
+	ERR_SOCKUTIL_WRITE_FAILED = -8,
+	ERR_SOCKUTIL_SPLICE_UNSUPPORTED = -9,
+	ERR_SOCKUTIL_READ_FAILED = -10,
+	ERR_SOCKUTIL_CORRUPTED = -11
 };
 
 struct trans_stat {
@@ -47,6 +56,15 @@ int64_t send_stream(int sockfd, void *data, int64_t dlen);
  */
 int64_t send_stream_nblock(int sockfd, void *data, int64_t dlen, struct trans_stat *rate);
 
+/**
+ * @brief Send dlen bytes of the file(.fd) starting at offset to the endpoint(.sockfd)
+ * with sendfile(2). The file offset of fd is not changed.
+ *
+ * @param rate - Transmission status in real-time.
+ * @return int64_t Success: The number of bytes sent. Error: enum ERR_SOCKUTIL
+ */
+int64_t sendfile_stream(int sockfd, int fd, int64_t offset, int64_t dlen, struct trans_stat *rate);
+
 void set_sockaddr_in(const char *ip, int port, struct sockaddr_in *sa);
 
 void set_sock_nonblock(int sockfd);
@@ -55,4 +73,73 @@ int set_socket_timeout(int, int);
 
 int recv_stream_nblock(int sockfd, void *buf, int64_t dlen, struct trans_stat *rate);
 
+/**
+ * @brief Receive dlen bytes from the endpoint(.sockfd) and write them to the file(.fd).
+ *
+ * @param offset - Position in the file to write at. Negative to use the file offset.
+ * @param buf - Bounce buffer reused for every chunk. Memory usage doesn't depend on dlen.
+ * @return int64_t Success: The number of bytes received. Error: enum ERR_SOCKUTIL
+ */
+int64_t recv_stream_to_fd(int sockfd, int fd, int64_t offset, int64_t dlen, void *buf, size_t buflen, struct trans_stat *rate);
+
+/**
+ * @brief Move dlen bytes from the endpoint(.sockfd) to the file(.fd) through the pipe
+ * without copying them to the user space.
+ *
+ * @param offset - Position in the file to write at. Negative to use the file offset.
+ * @param pipefd - Pipe used as the in-kernel buffer. Empty on return.
+ * @return int64_t Success: The number of bytes received.
+ * 				   Error: enum ERR_SOCKUTIL. ERR_SOCKUTIL_SPLICE_UNSUPPORTED means
+ * 				   no data has been consumed and the caller can fall back to recv_stream_to_fd.
+ */
+/**
+ * @brief Receive dlen bytes from the endpoint(.sockfd) and write them at offset
+ * of the registered file(.file_idx) through the ring. buf is split into nslots
+ * slots. A slot is written asynchronously while the next one is received.
+ *
+ * @param buf - Registered to the ring as buf_idx.
+ * @param nslots - At most RING_MAX_SLOTS and the ring entries.
+ * @return - Success: dlen, Error: enum ERR_SOCKUTIL
+ */
+int64_t recv_stream_to_ring(int sockfd, struct uring *ring, int file_idx, int buf_idx, int64_t offset, 
+		int64_t dlen, void *buf, size_t buflen, int nslots, struct trans_stat *rate);
+
+int64_t splice_stream_to_fd(int sockfd, int fd, int64_t offset, int64_t dlen, int pipefd[2], struct trans_stat *rate);
+
+/**
+ * @brief Send data in compressed frames of CZ_BLOCK_SIZE bytes each.
+ *
+ * @param buf - CZ_FRAME_MAX bytes.
+ * @return int64_t Success: dlen, Error: enum ERR_SOCKUTIL
+ */
+int64_t send_compressed_data(int sockfd, const void *data, int64_t dlen, struct cz_encoder *enc,
+		void *buf, struct trans_stat *rate);
+
+/**
+ * @brief Send dlen bytes of the file starting at offset in compressed frames.
+ *
+ * @param buf - CZ_STREAM_BUF_SIZE bytes.
+ * @return int64_t Success: dlen, Error: enum ERR_SOCKUTIL
+ */
+int64_t send_compressed_stream(int sockfd, int fd, int64_t offset, int64_t dlen, struct cz_encoder *enc,
+		void *buf, struct trans_stat *rate);
+
+/**
+ * @brief Receive dlen bytes of data from compressed frames.
+ *
+ * @param buf - CZ_FRAME_MAX bytes.
+ * @return int64_t Success: dlen, Error: enum ERR_SOCKUTIL
+ */
+int64_t recv_compressed_data(int sockfd, void *data, int64_t dlen, void *buf, struct trans_stat *rate);
+
+/**
+ * @brief Receive dlen bytes of data from compressed frames and write them to the file.
+ *
+ * @param offset - Position in the file to write at. Negative to use the file offset.
+ * @param buf - CZ_STREAM_BUF_SIZE bytes.
+ * @return int64_t Success: dlen, Error: enum ERR_SOCKUTIL
+ */
+int64_t recv_compressed_stream(int sockfd, int fd, int64_t offset, int64_t dlen, void *buf, 
+		struct trans_stat *rate);
+
 #endif // _SOCKUTIL_H_
@@ -322,14 +322,16 @@ load_download_screen(void)
 	char *alv = NULL;
 	int idx = 0;
 	for (int i = 0; i < g_client_status.dcontent.item_num; i++) {
-		if (atoi(g_items[i].status) != ITEM_STAT_AVAILABLE) {
+		int status = atoi(g_items[i].status);
+		if (status != ITEM_STAT_AVAILABLE && status != ITEM_STAT_MODIFYING) {
 			strncpy(g_client_status.dcontent.opt_items[idx], "", WIN_COLUMN_MAX);
 			continue;
 		}
+		// Files being uploaded are marked with '*' and followed.
 		if (atoi(g_items[i].alv) == PUBLIC_ACCES)
-			alv = "PUBLIC";
+			alv = (status == ITEM_STAT_MODIFYING) ? "PUBLIC*" : "PUBLIC";
 		else
-			alv = "PRIVATE";
+			alv = (status == ITEM_STAT_MODIFYING) ? "PRIVATE*" : "PRIVATE";
 		snprintf(g_client_status.dcontent.opt_items[idx],
 				WIN_COLUMN_MAX,
 				"%-*s %-*s %-*s %-*s",
@@ -0,0 +1,218 @@
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+const char *
+uring_errstr(enum ERR_URING err)
+{
+	if (ERR_URING_SETUP == err)
+		return "[uring] io_uring is not available";
+	else if (ERR_URING_MMAP == err)
+		return "[uring] [mmap]";
+	else if (ERR_URING_REGISTER == err)
+		return "[uring] [register]";
+	else if (ERR_URING_SQ_FULL == err)
+		return "[uring] Submission queue is full";
+	else if (ERR_URING_ENTER == err)
+		return "[uring] [io_uring_enter]";
+	else
+		return "[uring] Undefined error";
+}
+
+static int
+sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(r, 0x00, sizeof(struct uring));
+	memset(&p, 0x00, sizeof(struct io_uring_params));
+
+	r->fd = sys_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return ERR_URING_SETUP;
+	r->entries = p.sq_entries;
+
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	// Both rings share one mapping on the recent kernels.
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_sz > r->sq_sz)
+			r->sq_sz = r->cq_sz;
+		r->cq_sz = r->sq_sz;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == r->sq_ptr)
+		goto mmap_failed;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				r->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == r->cq_ptr) {
+			munmap(r->sq_ptr, r->sq_sz);
+			goto mmap_failed;
+		}
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == r->sqes) {
+		if (r->cq_ptr != r->sq_ptr)
+			munmap(r->cq_ptr, r->cq_sz);
+		munmap(r->sq_ptr, r->sq_sz);
+		goto mmap_failed;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+
+mmap_failed:
+	close(r->fd);
+	r->fd = -1;
+	return ERR_URING_MMAP;
+}
+
+void
+uring_exit(struct uring *r)
+{
+	if (r->fd < 0)
+		return;
+	munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_sz);
+	munmap(r->sq_ptr, r->sq_sz);
+	close(r->fd);
+	r->fd = -1;
+}
+
+int
+uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned n)
+{
+	if (sys_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+		return ERR_URING_REGISTER;
+	return 0;
+}
+
+int
+uring_register_files(struct uring *r, const int *fds, unsigned n)
+{
+	if (sys_uring_register(r->fd, IORING_REGISTER_FILES, fds, n) < 0)
+		return ERR_URING_REGISTER;
+	return 0;
+}
+
+int
+uring_update_file(struct uring *r, unsigned idx, int fd)
+{
+	struct io_uring_files_update up;
+	memset(&up, 0x00, sizeof(up));
+	up.offset = idx;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+	if (sys_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0)
+		return ERR_URING_REGISTER;
+	return 0;
+}
+
+static int
+prep_rw_fixed(struct uring *r, int op, int file_idx, const void *buf, unsigned len,
+		uint64_t off, int buf_idx, uint64_t user_data)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *r->sq_tail + r->sq_pending;
+	if (tail - head >= r->entries)
+		return ERR_URING_SQ_FULL;
+
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = file_idx;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = buf_idx;
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	r->sq_pending++;
+	return 0;
+}
+
+int
+uring_prep_write_fixed(struct uring *r, int file_idx, const void *buf, unsigned len,
+		uint64_t off, int buf_idx, uint64_t user_data)
+{
+	return prep_rw_fixed(r, IORING_OP_WRITE_FIXED, file_idx, buf, len, off, buf_idx, user_data);
+}
+
+int
+uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned n = r->sq_pending;
+	if (n > 0)
+		__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+	r->sq_pending = 0;
+	if (0 == n && 0 == wait_nr)
+		return 0;
+
+	int ret;
+	do {
+		ret = sys_uring_enter(r->fd, n, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && EINTR == errno);
+	if (ret < 0)
+		return ERR_URING_ENTER;
+	return ret;
+}
+
+int
+uring_peek_cqe(struct uring *r, uint64_t *user_data, int *res)
+{
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int
+uring_wait_cqe(struct uring *r, uint64_t *user_data, int *res)
+{
+	while (0 == uring_peek_cqe(r, user_data, res)) {
+		if (uring_submit(r, 1) < 0)
+			return ERR_URING_ENTER;
+	}
+	return 1;
+}
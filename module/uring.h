@@ -0,0 +1,89 @@
+/*
+ * Minimal io_uring file I/O engine on the raw system calls.
+ * A ring is used by one thread at a time.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+enum ERR_URING {
+	ERR_URING_SETUP = -1,		// io_uring is not available.
+	ERR_URING_MMAP = -2,
+	ERR_URING_REGISTER = -3,
+	ERR_URING_SQ_FULL = -4,
+	ERR_URING_ENTER = -5
+};
+
+struct uring {
+	int fd;
+	unsigned entries;
+	// Submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending;		// Prepared but not submitted.
+	// Completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	// Mappings
+	void *sq_ptr;
+	size_t sq_sz;
+	void *cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+};
+
+const char *uring_errstr(enum ERR_URING err);
+
+/**
+ * @brief Create a ring of entries submission slots.
+ *
+ * @return - Success: 0, Fail: enum ERR_URING
+ */
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+/*
+ * Registered buffers and files are pinned once instead of per I/O.
+ * A file slot of -1 is empty and can be filled by uring_update_file().
+ */
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned n);
+int uring_register_files(struct uring *r, const int *fds, unsigned n);
+int uring_update_file(struct uring *r, unsigned idx, int fd);
+
+/*
+ * Queue a write of len bytes at off of the registered file(file_idx) from
+ * the registered buffer(buf_idx). The I/O starts at uring_submit().
+ *
+ * @return - Success: 0, Fail: ERR_URING_SQ_FULL
+ */
+int uring_prep_write_fixed(struct uring *r, int file_idx, const void *buf, unsigned len, 
+		uint64_t off, int buf_idx, uint64_t user_data);
+
+/**
+ * @brief Submit the prepared requests in one system call and wait for
+ * wait_nr completions.
+ *
+ * @return - Success: The number of submitted requests, Fail: ERR_URING_ENTER
+ */
+int uring_submit(struct uring *r, unsigned wait_nr);
+
+/**
+ * @brief Reap a completion.
+ *
+ * @param res - The result of the I/O. Bytes or -errno.
+ * @return - 1: Reaped, 0: No completion(peek only)
+ */
+int uring_peek_cqe(struct uring *r, uint64_t *user_data, int *res);
+int uring_wait_cqe(struct uring *r, uint64_t *user_data, int *res);
+
+#endif // _URING_H_
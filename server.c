@@ -13,6 +13,7 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <signal.h>
 
 /*
  * Internal states.
@@ -30,9 +31,16 @@ static int listener_fd;
 static struct sockaddr_in serv_addr;
 static int g_epollfd;
 static int g_w2mpipe[2];
+static int g_change_efd;
+// Connections of SVC_SUBSCRIBE. Only the main thread uses them.
+static struct event *g_subscribers[MAX_SUBSCRIBERS];
+static int g_subscriber_count = 0;
+// Closed after the batch of epoll_wait. They count as subscribers until then.
+static struct event *g_dead_subscribers[MAX_SUBSCRIBERS];
+static int g_dead_count = 0;
 
 static void *session_worker_routine(void *);
-static int handle_request(int);
+static int handle_request(int, struct subscriber **);
 
 void
 timestamp(int msopt, const char *fmt, ...)
@@ -99,6 +107,35 @@ init_inven_cache(size_t max_item, size_t bnum)
 	}
 	for (int i = 0; i < max_item; i++)
 		pthread_rwlock_init(&g_inventory.ilock[i], NULL);
+	g_inventory.refs = (int *) calloc(max_item, sizeof(int));
+	if (NULL == g_inventory.refs) {
+		timestamp(MSEC, "Failed to initialize the item references.");
+		return -1;
+	}
+	g_inventory.writing = (char *) calloc(max_item, sizeof(char));
+	if (NULL == g_inventory.writing) {
+		timestamp(MSEC, "Failed to initialize the writer flags.");
+		return -1;
+	}
+
+	g_inventory.next = (int *) malloc(max_item * sizeof(int));
+	g_inventory.prev = (int *) malloc(max_item * sizeof(int));
+	g_inventory.serial = (uint64_t *) calloc(max_item, sizeof(uint64_t));
+	if (NULL == g_inventory.next || NULL == g_inventory.prev || NULL == g_inventory.serial) {
+		timestamp(MSEC, "Failed to initialize the live item list.");
+		return -1;
+	}
+	g_inventory.head = -1;
+	g_inventory.tail = -1;
+	g_inventory.last_serial = 0;
+	g_inventory.nlive = 0;
+	// Versions of an earlier run are always older than this run's.
+	if (init_change_log(&g_inventory.changes, CHANGE_LOG_SIZE, sizeof(struct inven_change),
+				(uint64_t)time(NULL) << 20) < 0) {
+		timestamp(MSEC, "Failed to initialize the change log.");
+		return -1;
+	}
+	pthread_mutex_init(&g_inventory.llock, NULL);
 
 	timestamp(MSEC, "[init_inven_cache] successed.");
 	return 0;
@@ -158,10 +195,39 @@ create_worker_failed:
 }
 
 static int
-init_server_instance(size_t max_item, size_t bucknum, size_t max_worker)
+init_server_instance(size_t max_item, size_t bucknum, size_t max_worker, 
+		enum DURABILITY durability, int64_t cache_budget, int chunking, enum COMPRESS_TYPE packing)
 {
 	g_running = 1;
 
+	// A client closing its connection during sendfile must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (init_service_buffers(max_worker) < 0) {
+		timestamp(MSEC, "Failed to initialize service buffers.");
+		return -1;
+	}
+	if (init_service_durability(durability) < 0) {
+		timestamp(MSEC, "Failed to start the group sync thread.");
+		return -1;
+	}
+	if (init_service_caches(max_item, cache_budget) < 0) {
+		timestamp(MSEC, "Failed to initialize the file caches.");
+		return -1;
+	}
+	if (init_service_follow(max_item) < 0) {
+		timestamp(MSEC, "Failed to initialize the upload frontiers.");
+		return -1;
+	}
+	if (init_service_storage(max_item, chunking, packing) < 0) {
+		timestamp(MSEC, "Failed to initialize the blob and chunk stores.");
+		return -1;
+	}
+	g_change_efd = init_service_subscriptions();
+	if (g_change_efd < 0) {
+		timestamp(MSEC, "Failed to create the change notifier.");
+		return -1;
+	}
 	if (init_session_workers(max_worker) < 0)
 		return -1;
 	if (init_inven_cache(max_item, bucknum) < 0) {
@@ -188,6 +254,61 @@ init_portno(int argc, const char **argv)
 	return portno;
 }
 
+/*
+ * Default durability of the uploads. The client may ask for another one.
+ */
+static enum DURABILITY
+init_durability(int argc, const char **argv)
+{
+	enum DURABILITY durability = DEFAULT_DURABILITY;
+	if (argc > CLI_ARGS_IDX_DURABILITY) {
+		int input = atoi(argv[CLI_ARGS_IDX_DURABILITY]);
+		if (input > DURABILITY_DEFAULT && input < DURABILITY_NUM)
+			durability = input;
+	}
+	return durability;
+}
+
+/*
+ * Memory of the small file cache in bytes.
+ */
+static int64_t
+init_cache_budget(int argc, const char **argv)
+{
+	int64_t mbytes = CONTENT_CACHE_MB;
+	if (argc > CLI_ARGS_IDX_CACHE_MB) {
+		int64_t input = strtoll(argv[CLI_ARGS_IDX_CACHE_MB], NULL, 10);
+		if (input >= 0)
+			mbytes = input;
+	}
+	return mbytes * 1024 * 1024;
+}
+
+/*
+ * 1 if the big files are stored as deduplicated chunks.
+ */
+static int
+init_chunking(int argc, const char **argv)
+{
+	if (argc > CLI_ARGS_IDX_CHUNKING)
+		return atoi(argv[CLI_ARGS_IDX_CHUNKING]) > 0;
+	return 0;
+}
+
+/*
+ * Compression of the stored files. COMPRESS_NONE stores them as uploaded.
+ */
+static enum COMPRESS_TYPE
+init_packing(int argc, const char **argv)
+{
+	if (argc > CLI_ARGS_IDX_PACKING) {
+		int input = atoi(argv[CLI_ARGS_IDX_PACKING]);
+		if (input > COMPRESS_NONE && input < COMPRESS_NUM)
+			return input;
+	}
+	return COMPRESS_NONE;
+}
+
 static int 
 register_event(int sockfd, enum EVENT_TYPE ch, uint32_t events)
 {
@@ -196,6 +317,8 @@ register_event(int sockfd, enum EVENT_TYPE ch, uint32_t events)
 		return ERR_MALLOC;
 	event->sockfd = sockfd;
 	event->type = ch;
+	event->sub = NULL;
+	event->dead = 0;
 
 	struct epoll_event ev;
 	ev.events = events;
@@ -208,7 +331,7 @@ register_event(int sockfd, enum EVENT_TYPE ch, uint32_t events)
 static int 
 remove_event(struct event *event)
 {
-	if (epoll_ctl(g_epollfd, EPOLL_CTL_DEL, event->sockfd, NULL) < 0)
+	if (!event->dead && epoll_ctl(g_epollfd, EPOLL_CTL_DEL, event->sockfd, NULL) < 0)
 		return ERR_EPOLL_CTL;
 
 	free(event);
@@ -279,13 +402,106 @@ assign_worker(struct event *event)
 	return 0;
 }
 
+static void
+unlist_subscriber(struct event *event)
+{
+	for (int i = 0; i < g_subscriber_count; i++) {
+		if (g_subscribers[i] != event)
+			continue;
+		g_subscribers[i] = g_subscribers[--g_subscriber_count];
+		break;
+	}
+}
+
+static void
+end_subscription(struct event *event)
+{
+	unlist_subscriber(event);
+	close_subscriber(event->sub);
+	event->sub = NULL;
+}
+
+static int
+destruct_session(struct event *event)
+{
+	g_session_count--;
+	timestamp(MSEC, "[disconnected (%d/%d)] [client (%d)]", 
+			g_session_count, MAX_CONNECTIONS, event->sockfd);
+	if (EVENT_SUBSCRIBER == event->type)
+		end_subscription(event);
+	close(event->sockfd);
+	remove_event(event);
+	return 0;
+}
+
+/*
+ * The batch of epoll_wait() may still have an event of the subscriber, so
+ * it stops getting events now, and is closed after the batch. Its fd is
+ * kept open until then, so that the number is not reused meanwhile.
+ */
+static void
+kill_subscriber(struct event *event)
+{
+	event->dead = 1;
+	epoll_ctl(g_epollfd, EPOLL_CTL_DEL, event->sockfd, NULL);
+	unlist_subscriber(event);
+	g_dead_subscribers[g_dead_count++] = event;
+}
+
+static void
+reap_dead_subscribers(void)
+{
+	while (g_dead_count > 0)
+		destruct_session(g_dead_subscribers[--g_dead_count]);
+}
+
+/*
+ * Send the changes to the subscriber, and wait for the socket only if it is
+ * full.
+ */
+static void
+update_subscriber(struct event *event)
+{
+	int state = pump_subscriber(event->sub);
+	if (state < 0) {
+		kill_subscriber(event);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLRDHUP | EPOLLHUP | ((SUBSCRIBER_BLOCKED == state) ? EPOLLOUT : 0);
+	ev.data.ptr = event;
+	epoll_ctl(g_epollfd, EPOLL_CTL_MOD, event->sockfd, &ev);
+}
+
+static void
+start_subscription(struct event *event, struct subscriber *sub)
+{
+	event->type = EVENT_SUBSCRIBER;
+	event->sub = sub;
+	g_subscribers[g_subscriber_count++] = event;
+	update_subscriber(event);
+}
+
+static void
+notify_subscribers(struct event *event)
+{
+	uint64_t count;
+	read(event->sockfd, &count, sizeof(count));
+	// A subscriber may be removed during the loop.
+	for (int i = g_subscriber_count - 1; i >= 0; i--)
+		update_subscriber(g_subscribers[i]);
+}
+
 static int
 reap_worker(struct event *event)
 {
 	struct task_cmpl_msg msg;
 	read(event->sockfd, &msg, sizeof(struct task_cmpl_msg));
 
-	reactivate_oneshot_event(g_sworker_pool[msg.wid].event);
+	if (NULL != msg.sub)
+		start_subscription(g_sworker_pool[msg.wid].event, msg.sub);
+	else
+		reactivate_oneshot_event(g_sworker_pool[msg.wid].event);
 
 	if (enqueue(g_sworkerid_queue, &msg.wid) < 0) {
 		timestamp(MSEC, "[reap_worker] [enqueue] overflow");
@@ -297,17 +513,6 @@ reap_worker(struct event *event)
 	return 0;
 }
 
-static int
-destruct_session(struct event *event)
-{
-	g_session_count--;
-	timestamp(MSEC, "[disconnected (%d/%d)] [client (%d)]", 
-			g_session_count, MAX_CONNECTIONS, event->sockfd);
-	close(event->sockfd);
-	remove_event(event);
-	return 0;
-}
-
 static void *
 session_worker_routine(void *p)
 {
@@ -317,6 +522,8 @@ session_worker_routine(void *p)
 	int clsock = 0;
 	int result = 0;
 
+	attach_service_buffer(winfo->wid);
+
 	while(g_running) {
 		ssize_t nbytes = read(readpipe, &clsock, sizeof(int));
 		// Pipe closed.
@@ -328,10 +535,11 @@ session_worker_routine(void *p)
 		} else { 
 			timestamp(MSEC, "[session_worker_routine] [worker (%d)] [pipe (%d)] [client (%d)]",
 					winfo->wid, winfo->pipefd[0], clsock);
-			handle_request(clsock);
 			struct task_cmpl_msg msg;
 			msg.wid = winfo->wid;
 			msg.clsock = clsock;
+			msg.sub = NULL;
+			handle_request(clsock, &msg.sub);
 			write(g_w2mpipe[1], &msg, sizeof(struct task_cmpl_msg));
 		}
 	}
@@ -340,12 +548,12 @@ session_worker_routine(void *p)
 
 // TODO
 static int
-handle_request(int clsock)
+handle_request(int clsock, struct subscriber **sub)
 {
 	struct svc_req req;
 
 	// Receive svc_req
-	if (recv(clsock, &req, sizeof(struct svc_req), 0) < 0) {
+	if (recv(clsock, &req, sizeof(struct svc_req), MSG_WAITALL) != sizeof(struct svc_req)) {
 		timestamp(MSEC, "[handle_request] [recv] [client (%d)] failed", clsock);
 		return -1;
 	}
@@ -353,9 +561,27 @@ handle_request(int clsock)
 	if (SVC_UPLOAD == atoi(req.type))
 		return server_upload_service(clsock, &req);
 	else if (SVC_INQUIRY == atoi(req.type))
-		return server_inquiry_service(clsock, MAX_FILE_ITEMS, &req);
+		return server_inquiry_service(clsock, &req);
 	else if (SVC_DOWNLOAD == atoi(req.type))
 		return server_download_service(clsock, &req);
+	else if (SVC_UPLOAD_SESSION == atoi(req.type))
+		return server_upload_session_service(clsock, &req);
+	else if (SVC_UPLOAD_CHUNK == atoi(req.type))
+		return server_upload_chunk_service(clsock, &req);
+	else if (SVC_DOWNLOAD_FOLLOW == atoi(req.type))
+		return server_follow_service(clsock, &req);
+	else if (SVC_RENAME == atoi(req.type))
+		return server_rename_service(clsock, &req);
+	else if (SVC_DELETE == atoi(req.type))
+		return server_delete_service(clsock, &req);
+	else if (SVC_UPLOAD_DELTA == atoi(req.type))
+		return server_delta_upload_service(clsock, &req);
+	else if (SVC_LIST == atoi(req.type))
+		return server_list_service(clsock, &req);
+	else if (SVC_CHANGES == atoi(req.type))
+		return server_changes_service(clsock, &req);
+	else if (SVC_SUBSCRIBE == atoi(req.type))
+		return server_subscribe_service(clsock, &req, sub);
 
 	return 0;
 }
@@ -409,6 +635,8 @@ handle_events()
 		}
 		for (int i = 0; i < nready; i++) {
 			event = (struct event *) events[i].data.ptr;
+			if (event->dead)
+				continue;
 			event_type = event->type;
 			// 연결 종료.
 			if (events[i].events & EPOLLRDHUP) {
@@ -424,8 +652,15 @@ handle_events()
 			} else if (EVENT_WORKER_MSG == event_type) {
 				// worker thread와의 통신.
 				reap_worker(event);
+			} else if (EVENT_CHANGE_NOTIFY == event_type) {
+				// 인벤토리 변경을 구독자들에게 전달.
+				notify_subscribers(event);
+			} else if (EVENT_SUBSCRIBER == event_type) {
+				// 구독자 소켓에 여유가 생김.
+				update_subscriber(event);
 			}
 		}
+		reap_dead_subscribers();
 	}
 
 	return 0;
@@ -441,8 +676,13 @@ int
 main (int argc, const char *argv[])
 {
 	int portno = init_portno(argc, argv);
+	enum DURABILITY durability = init_durability(argc, argv);
+	int64_t cache_budget = init_cache_budget(argc, argv);
+	int chunking = init_chunking(argc, argv);
+	enum COMPRESS_TYPE packing = init_packing(argc, argv);
 
-	if (init_server_instance(MAX_FILE_ITEMS, HASHMAP_BUCKET_NUM, SESSION_WORKER_NUM) < 0) 
+	if (init_server_instance(MAX_FILE_ITEMS, HASHMAP_BUCKET_NUM, SESSION_WORKER_NUM, 
+				durability, cache_budget, chunking, packing) < 0) 
 		return 1;
 
 	if (init_server_socket(portno) < 0)
@@ -457,6 +697,7 @@ main (int argc, const char *argv[])
 	register_event(listener_fd, EVENT_NEW_CONNECTION, 
 			EPOLLIN | EPOLLRDHUP);
 	register_worker_events(SESSION_WORKER_NUM);
+	register_event(g_change_efd, EVENT_CHANGE_NOTIFY, EPOLLIN);
 
 	handle_events();
 
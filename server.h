@@ -3,8 +3,11 @@
 #include "module/hashmap.h"
 #include "module/queue.h"
 #include "module/service.h"
+#include "module/packfile.h"
+#include "module/changelog.h"
 
 #include <stdarg.h>
+#include <time.h>
 
 #define TIMESTAMP_MSEC_LEN			25
 #define TIMESTAMP_SEC_LEN			20
@@ -12,16 +15,72 @@
 #define MAX_CONNECTIONS				1000
 #define SESSION_WORKER_NUM			500
 #define CLI_ARGS_IDX_PORTNO			1
+#define CLI_ARGS_IDX_DURABILITY		2
+#define CLI_ARGS_IDX_CACHE_MB		3
+#define CLI_ARGS_IDX_CHUNKING		4
+#define CLI_ARGS_IDX_PACKING		5
 #define DEFAULT_SERVER_PORT			23455
 #define HASHMAP_BUCKET_NUM			100
+#define SVC_IOBUF_SIZE				(256 * 1024)	// Per-worker transfer buffer.
+#define DEFAULT_UPLOAD_MODE			UPLOAD_MODE_URING
+#define URING_QUEUE_DEPTH			8			// Writes in flight per worker.
+#define MAX_UPLOAD_SESSIONS			1000
+#define SESSION_EXPIRE_SEC			3600		// Idle sessions are rolled back.
+#define SESSION_RECV_TIMEOUT		30			// A stalled chunk releases the session.
+#define SESSION_PROGRESS_STEP		(1024 * 1024)	// Progress is recorded per step.
+#define MAX_UPLOAD_STRIPES			16			// Max connections uploading a file.
+#define DISK_FREE_MARGIN			(64 * 1024 * 1024)	// Never handed out to uploads.
+#define DEFAULT_DURABILITY			DURABILITY_WRITTEN
+#define GROUP_SYNC_WINDOW_USEC		1000		// Durable uploads wait this long to share a flush.
+// syncfs also flushes the unrelated dirty data of the filesystem. Measured on
+// ext4 with 64KB files: fdatasync + directory fsync costs ~100us per file,
+// syncfs ~0.1ms on a clean filesystem but 3.5~6ms with 10MB of other dirty
+// data. Per-file flushing wins below ~60 files under upload load.
+#define GROUP_SYNCFS_MIN			64			// Bigger batches are flushed with one syncfs.
+#define FD_CACHE_CAPACITY			256			// Open files kept for downloads.
+#define CONTENT_CACHE_MB			64			// Memory for small files. 0 disables it.
+#define CONTENT_CACHE_MAX_OBJECT	(1024 * 1024)	// Bigger files are sent from the disk.
+#define CONTENT_CACHE_ENTRIES		4096
+#define BLOB_HOME_STR				".blobs"	// Bodies of the files by SHA-256.
+#define CHUNK_HOME_STR				".chunks"	// Chunks of the big files by SHA-256.
+#define CHUNK_AVG_SIZE				(64 * 1024)
+#define CHUNK_STORE_MIN_FILE		(4 * 1024 * 1024)	// Smaller files are stored whole.
+#define CHUNK_INDEX_CAPACITY		65536
+#define DELTA_SIG_BATCH				256		// Signatures per send.
+#define LIST_PAGE_MAX				1024	// Items per page of SVC_LIST.
+#define LIST_SCAN_MAX				(16 * LIST_PAGE_MAX)	// Items searched for a page.
+#define CHANGE_LOG_SIZE				4096	// Changes kept for SVC_CHANGES.
+#define CHANGE_PAGE_MAX				1024	// Changes per response of SVC_CHANGES.
+#define PACK_MIN_FILE				(4 * 1024)	// Smaller files are stored uncompressed.
+#define PACK_MIN_SAVING				16		// A pack must save 1/16 of the file to be kept.
+#define MAX_SUBSCRIBERS				64
+#define SUBSCRIBER_BUF_SIZE			(64 * 1024)	// Changes waiting for a slow subscriber.
 
 #define MSEC						1
+#define FS_PATH_MAX_LEN				256
 
 // 서버가 처리하는 이벤트 종류
 enum EVENT_TYPE {
 	EVENT_NEW_CONNECTION, 
 	EVENT_SERVICE_REQUEST,
-	EVENT_WORKER_MSG
+	EVENT_WORKER_MSG,
+	EVENT_CHANGE_NOTIFY,		// The inventory changed.
+	EVENT_SUBSCRIBER			// A connection of SVC_SUBSCRIBE can take more data.
+};
+
+// 업로드 데이터를 소켓에서 파일로 옮기는 방식
+enum UPLOAD_MODE {
+	UPLOAD_MODE_BUFFERED,		// recv -> worker buffer -> write
+	UPLOAD_MODE_SPLICE,			// socket -> pipe -> file (zero-copy)
+	UPLOAD_MODE_URING			// recv -> worker buffer -> io_uring (recv와 write 병행)
+};
+
+// 업로드 중인 파일의 상태. follow 다운로드가 참조한다.
+enum FRONTIER_STATE {
+	FRONTIER_NONE,				// Not uploaded since the server started.
+	FRONTIER_RUNNING,
+	FRONTIER_COMMITTED,
+	FRONTIER_ABORTED
 };
 
 enum ERR_CAUSE {
@@ -36,6 +95,8 @@ enum ERR_CAUSE {
 struct event {
 	int sockfd;
 	enum EVENT_TYPE type;
+	struct subscriber *sub;		// EVENT_SUBSCRIBER only.
+	int dead;					// Removed from epoll. Freed after the batch of epoll_wait.
 };
 
 struct worker {
@@ -49,6 +110,7 @@ struct worker {
 struct task_cmpl_msg {
 	int wid;
 	int clsock;
+	struct subscriber *sub;		// Not NULL if the client subscribed.
 };
 
 struct inventory {
@@ -57,6 +119,123 @@ struct inventory {
 	struct queue *fidq;			// items 배열의 빈 인덱스
 	struct hashmap *nametb;		// file name -> file id 매핑 정보
 	pthread_rwlock_t *ilock;	// items 보호
+	int *refs;					// nametb holds one while the item is named. Downloads hold the others.
+	char *writing;				// A delta upload is replacing the file. The item stays available.
+	// Live items in the order of their reservation. SVC_LIST walks them.
+	int head;					// -1 if empty.
+	int tail;
+	int *next;					// Indexed by fid. -1: The last item.
+	int *prev;
+	uint64_t *serial;			// Reservation number of each live item. 0 if not live.
+	uint64_t last_serial;
+	size_t nlive;
+	struct change_log changes;	// Changes of the items(struct inven_change).
+	pthread_mutex_t llock;		// 목록(head ~ serial)과 변경 기록 보호
+};
+
+/*
+ * struct list_filter in the host format. Empty fields are the widest ones.
+ */
+struct item_filter {
+	char creator[IP_ADDRESS_LEN + 1];
+	char pattern[FILE_NAME_LEN + 1];
+	int64_t min_flen;
+	int64_t max_flen;
+	char after[TIMESTAMP_LEN + 1];
+	char before[TIMESTAMP_LEN + 1];
+	int status;						// -1: Any.
+};
+
+/*
+ * A connection of SVC_SUBSCRIBE. The changes are taken from the change log
+ * as buf is sent, so a slow subscriber holds at most SUBSCRIBER_BUF_SIZE
+ * bytes, and is asked to resync when the log passes it.
+ */
+struct subscriber {
+	int sockfd;
+	char clip[IP_ADDRESS_LEN];
+	int filtered;
+	struct item_filter filter;
+	uint64_t version;			// The changes up to version are in buf or sent.
+	char *buf;
+	size_t head;				// buf[head, head + len) is not sent yet.
+	size_t len;
+	int expired;				// The connection ends after buf.
+};
+
+enum SUBSCRIBER_STATE {
+	SUBSCRIBER_IDLE = 0,		// All the changes are sent.
+	SUBSCRIBER_BLOCKED			// The socket is full.
+};
+
+struct snapshot_private {
+	size_t pos;					// Number of the shared items before it.
+	struct inven_item item;
+};
+
+/*
+ * SVC_INQUIRY data of a version of the inventory, shared by the senders.
+ * data has the live items in the list order except the PRIVATE_ACCESS
+ * ones, which are kept in privates for their creators.
+ */
+struct inven_snapshot {
+	uint64_t version;
+	int fd;						// memfd of data, for sendfile(2).
+	struct inven_item *data;	// Mapping of fd.
+	size_t cap;					// Size of the mapping.
+	size_t len;					// Size of the items in data.
+	struct snapshot_private *privates;
+	size_t nprivate;
+	int refs;					// Senders, and 1 while it is the latest one.
+};
+
+// 세션 파일의 일부분. 각 stripe는 서로 다른 연결로 동시에 업로드될 수 있다.
+struct upload_stripe {
+	int64_t start;
+	int64_t len;
+	int64_t done;					// Bytes [start, start + done) are on the disk.
+	int busy;						// A connection is writing a chunk.
+};
+
+// 이어받기 가능한 업로드 세션
+struct upload_session {
+	char sid[SESSION_ID_LEN];		// Empty if the slot is free.
+	int *fid;						// Value stored in g_inventory.nametb
+	char fname[FILE_NAME_LEN];
+	char fpath[FS_PATH_MAX_LEN];
+	char tmppath[FS_PATH_MAX_LEN];	// Empty if the file is unnamed(O_TMPFILE).
+	int fd;							// Written with pwrite only. Shared by stripes.
+	int64_t flen;
+	int64_t received;				// Sum of stripes[].done
+	int nstripes;
+	struct upload_stripe stripes[MAX_UPLOAD_STRIPES];
+	int nbusy;						// Number of busy stripes.
+	enum DURABILITY durability;
+	int committing;
+	time_t last_active;
+};
+
+// 업로드 중인 파일의 쓰기 경계. follow 다운로드는 경계까지 따라 읽는다.
+struct upload_frontier {
+	int fd;							// Read-only fd of the file while uploading. -1: None
+	int64_t flen;
+	int64_t frontier;				// [0, frontier) is on the file.
+	enum FRONTIER_STATE state;
+	unsigned long gen;				// Bumped by every upload of the fid.
+	pthread_cond_t cond;			// The frontier or the state changed.
+};
+
+struct chunk_manifest;
+
+// 게시된 파일을 읽는다. 일반 파일이면 fd, chunk로 저장된 파일이면 manifest를 사용한다.
+// 압축 저장된 파일(pack)은 fd에서 블록 단위로 풀어 읽는다.
+struct item_reader {
+	int fd;							// -1 if the file is chunked.
+	struct chunk_manifest *m;		// Reference held by the reader.
+	size_t chunk;					// Chunk open in cfd.
+	int cfd;						// -1: No chunk is open.
+	int packed;						// fd is a pack read through pack.
+	struct pack_reader pack;
 };
 
 /**
@@ -1,21 +1,177 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "module/service.h"
 #include "module/timeutil.h"
 #include "module/hashmap.h"
 #include "module/queue.h"
+#include "module/groupsync.h"
+#include "module/fdcache.h"
+#include "module/contcache.h"
+#include "module/sha256.h"
+#include "module/fastcdc.h"
+#include "module/chunkstore.h"
+#include "module/delta.h"
+#include "module/compress.h"
+#include "module/packfile.h"
 
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <fnmatch.h>
 
 #define FILE_EXISTS		1
 #define NO_SUCH_FILE	0
-#define FS_PATH_MAX_LEN	256
+// download_item() found the file replaced after it copied the item.
+#define DOWNLOAD_STALE	1
+#define STALE_RETRY		3
 
 extern struct inventory g_inventory;
 
+// Transfer buffers. Each session worker owns one slot of the pool.
+static char *g_iobuf_pool = NULL;
+static __thread char *t_iobuf = NULL;
+// Pipe for the zero-copy upload. Created on the first use.
+static __thread int t_pipefd[2] = { -1, -1 };
+// io_uring of the worker, created on its first upload. The worker buffer and
+// a file slot are registered, so a shared ring would need a copy per write.
+static __thread struct uring t_ring;
+static __thread int t_ring_state = 0;	// 0: Not created, 1: Ready, -1: Unusable
+static __thread struct cz_encoder t_czenc;	// Created on the first compressed download.
+// Upload path of the worker. A worker falls back alone when its path fails.
+static __thread enum UPLOAD_MODE t_upload_mode = DEFAULT_UPLOAD_MODE;
+// Resumable upload sessions. A slot is free if sid is empty.
+static struct upload_session g_usessions[MAX_UPLOAD_SESSIONS];
+static pthread_mutex_t g_usession_lock = PTHREAD_MUTEX_INITIALIZER;
+// Bytes promised to uploads which are not allocated on the disk yet.
+static int64_t g_reserved_disk = 0;
+static pthread_mutex_t g_disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum DURABILITY g_durability = DEFAULT_DURABILITY;
+// Durable uploads share the flushes of this thread.
+static struct group_sync g_gsync;
+// Open files of the available items, keyed by fid.
+static struct fd_cache g_fdcache;
+// Contents of the small available items, keyed by fid.
+static struct content_cache g_contcache;
+// Frontiers of the uploads, indexed by fid. Followed by SVC_DOWNLOAD_FOLLOW.
+static struct upload_frontier *g_frontiers = NULL;
+static pthread_mutex_t g_frontier_lock = PTHREAD_MUTEX_INITIALIZER;
+// Blob of each item, indexed by fid. Empty if the file is not in the blob store.
+// A blob is referenced by its hard links, so its link count is the reference count.
+static char (*g_blob_ids)[SHA256_HEX_LEN] = NULL;
+static pthread_mutex_t g_blob_lock = PTHREAD_MUTEX_INITIALIZER;
+// Big files are stored as chunks if g_chunking is set. Manifests are indexed by fid.
+static int g_chunking = 0;
+static struct fastcdc g_cdc;
+static struct chunk_store g_chunkstore;
+static struct chunk_manifest **g_manifests = NULL;
+// New blobs are stored as packs compressed with g_packing unless it is COMPRESS_NONE.
+static enum COMPRESS_TYPE g_packing = COMPRESS_NONE;
+// Written on each change while anyone subscribes.
+static int g_change_efd = -1;
+static int g_nsubscribers = 0;
+// Latest snapshot of SVC_INQUIRY.
+static struct inven_snapshot *g_snapshot = NULL;
+static pthread_mutex_t g_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+init_service_buffers(size_t nworkers)
+{
+	g_iobuf_pool = (char *) malloc(nworkers * SVC_IOBUF_SIZE);
+	if (NULL == g_iobuf_pool)
+		return -1;
+	return 0;
+}
+
+/*
+ * @param durability - Used when the client doesn't choose one.
+ */
+int
+init_service_durability(enum DURABILITY durability)
+{
+	if (durability > DURABILITY_DEFAULT && durability < DURABILITY_NUM)
+		g_durability = durability;
+	return init_group_sync(&g_gsync, GROUP_SYNC_WINDOW_USEC, GROUP_SYNCFS_MIN);
+}
+
+/*
+ * @param nitems - Capacity of the inventory.
+ * @param budget - Bytes of the small files kept in memory. 0 disables it.
+ */
+int
+init_service_caches(size_t nitems, int64_t budget)
+{
+	if (init_fd_cache(&g_fdcache, FD_CACHE_CAPACITY, nitems) < 0)
+		return -1;
+	if (init_content_cache(&g_contcache, budget, CONTENT_CACHE_MAX_OBJECT, 
+				CONTENT_CACHE_ENTRIES, nitems) < 0) {
+		destruct_fd_cache(&g_fdcache);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Must be called whenever the file of the item is replaced, renamed or removed.
+ */
+static void
+invalidate_item_caches(int fid)
+{
+	fdc_invalidate(&g_fdcache, fid);
+	cc_invalidate(&g_contcache, fid);
+}
+
+static enum DURABILITY
+req_durability(struct svc_req *req)
+{
+	int durability = atoi(req->durability);
+	if (durability <= DURABILITY_DEFAULT || durability >= DURABILITY_NUM)
+		return g_durability;
+	return durability;
+}
+
+/*
+ * The compression of the transfer. COMPRESS_NONE if the client didn't ask or
+ * the worker can't compress.
+ */
+static enum COMPRESS_TYPE
+req_compression(struct svc_req *req, struct svc_resp *resp)
+{
+	int type = atoi(req->compress);
+	if (type <= COMPRESS_NONE || type >= COMPRESS_NUM)
+		type = COMPRESS_NONE;
+	snprintf(resp->compress, REQ_COMPRESS_LEN, "%d", type);
+	return type;
+}
+
+/*
+ * @return - The encoder of the worker for type, NULL if it can't be created.
+ */
+static struct cz_encoder *
+get_encoder(enum COMPRESS_TYPE type)
+{
+	if (NULL != t_czenc.head && type == t_czenc.type)
+		return &t_czenc;
+	destruct_cz_encoder(&t_czenc);
+	if (init_cz_encoder(&t_czenc, type) < 0) {
+		timestamp(MSEC, "[get_encoder] Out of memory.");
+		return NULL;
+	}
+	return &t_czenc;
+}
+
+void
+attach_service_buffer(int wid)
+{
+	t_iobuf = g_iobuf_pool + (size_t)wid * SVC_IOBUF_SIZE;
+}
+
 /*
  * 1: File exists.
  * 0: No such file exists.
@@ -64,288 +220,3000 @@ get_client_ipaddr(int sockfd, char *buf, size_t buflen)
     return 0;
 }
 
-static void	
-rollback_inventory(int* fid, struct svc_req *req)
+int
+init_service_follow(size_t nitems)
 {
-	snprintf(g_inventory.items[*fid].status, sizeof(g_inventory.items[*fid].status), "%d", ITEM_STAT_DELETED);
-	enqueue(g_inventory.fidq, (void *)fid);
-	rm_item(g_inventory.nametb, req->fname);
-	free(fid);
+	g_frontiers = (struct upload_frontier *) calloc(nitems, sizeof(struct upload_frontier));
+	if (NULL == g_frontiers)
+		return -1;
+	for (size_t i = 0; i < nitems; i++) {
+		g_frontiers[i].fd = -1;
+		g_frontiers[i].state = FRONTIER_NONE;
+		pthread_cond_init(&g_frontiers[i].cond, NULL);
+	}
+	return 0;
 }
 
-int 
-server_upload_service(int clsock, struct svc_req *req)
+/*
+ * @param chunking - Store the big files as deduplicated chunks.
+ * @param packing - Compression of the files stored as blobs.
+ */
+int
+init_service_storage(size_t nitems, int chunking, enum COMPRESS_TYPE packing)
 {
-	int result = 0;
-	char tstamp_ms[TIMESTAMP_MS_LEN];
-	char tstamp[TIMESTAMP_LEN];
-	struct svc_resp resp;
-	set_resp_type(&resp, SVC_UPLOAD);
+	if (create_directory_if_not_exists(BLOB_HOME_STR) < 0)
+		return -1;
+	g_blob_ids = calloc(nitems, SHA256_HEX_LEN);
+	g_manifests = (struct chunk_manifest **) calloc(nitems, sizeof(struct chunk_manifest *));
+	if (NULL == g_blob_ids || NULL == g_manifests)
+		return -1;
+	g_packing = packing;
+	if (!chunking)
+		return 0;
+	if (create_directory_if_not_exists(CHUNK_HOME_STR) < 0)
+		return -1;
+	if (init_chunk_store(&g_chunkstore, CHUNK_HOME_STR, CHUNK_INDEX_CAPACITY) < 0)
+		return -1;
+	init_fastcdc(&g_cdc, CHUNK_AVG_SIZE);
+	g_chunking = 1;
+	return 0;
+}
 
-	int64_t flen = strtoll(req->flen, NULL, 10);
-	enum ACCESS_LEVEL alv = atoi(req->alv);
-	int *fid = (int *)malloc(sizeof(int));
-	*fid = -1;
+/*
+ * Let the downloads follow the upload of the item. The file is opened again
+ * for reading because fd may be write-only.
+ */
+static void
+begin_frontier(int fid, int fd, int64_t flen)
+{
+	int rfd = reopen_file_rdonly(fd);
+	if (rfd < 0)
+		timestamp(MSEC, "[begin_frontier] %s (fid %d)", futil_errstr(rfd), fid);
 
-	timestamp(MSEC, "[request] [client (%d)] %s %uB (%d)", 
-			clsock, req->fname, flen, alv);
+	struct upload_frontier *f = &g_frontiers[fid];
+	pthread_mutex_lock(&g_frontier_lock);
+	f->fd = rfd;
+	f->flen = flen;
+	f->frontier = 0;
+	f->state = (rfd < 0) ? FRONTIER_NONE : FRONTIER_RUNNING;
+	f->gen++;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&g_frontier_lock);
+}
 
-	// 서버 메모리 확인
-	void *buf = NULL;
-	buf = malloc(flen);
-	if (NULL == buf) {
-		timestamp(MSEC, "[server_upload_service] [refuse] [client (%d)] [malloc]", clsock);
-		set_resp_code(&resp, RESP_OUT_OF_MEMORY);
-		goto refuse_svc;
-	}
-	// 파일 이름 사용 가능하면 일단 nametb 선점
-	if (set(g_inventory.nametb, req->fname, (void *)fid, 0) < 0) {
-		timestamp(MSEC, "[server_upload_service] [refuse] file already exists(%s)", req->fname);
-		set_resp_code(&resp, RESP_DUPLICATED);
-		goto refuse_svc;
-	}
-	// g_inventory.items에 빈 공간이 있는지 확인
-	if (dequeue(g_inventory.fidq, fid) < 0) {
-		timestamp(MSEC, "[server_upload_service] [refuse] fidq");
-		rm_item(g_inventory.nametb, req->fname); // rollback
-		set_resp_code(&resp, RESP_INVENTORY_FULL);
-		goto refuse_svc;
+static void
+advance_frontier(int fid, int64_t frontier)
+{
+	struct upload_frontier *f = &g_frontiers[fid];
+	pthread_mutex_lock(&g_frontier_lock);
+	if (FRONTIER_RUNNING == f->state && frontier > f->frontier) {
+		f->frontier = frontier;
+		pthread_cond_broadcast(&f->cond);
 	}
-	set(g_inventory.nametb, req->fname, (void *)fid, 1);
-	// TODO 서버 disk  용량 검사
+	pthread_mutex_unlock(&g_frontier_lock);
+}
 
-	// Send response
-	snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_OK);
-	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0) {
-		timestamp(MSEC, "[server_upload_service] [send]");
-		return -1;
+/*
+ * @param state - FRONTIER_COMMITTED or FRONTIER_ABORTED
+ */
+static void
+end_frontier(int fid, enum FRONTIER_STATE state)
+{
+	struct upload_frontier *f = &g_frontiers[fid];
+	pthread_mutex_lock(&g_frontier_lock);
+	if (FRONTIER_RUNNING == f->state) {
+		close(f->fd);
+		f->fd = -1;
+		f->state = state;
+		pthread_cond_broadcast(&f->cond);
 	}
+	pthread_mutex_unlock(&g_frontier_lock);
+}
 
-	// g_inventory.items 배열 업데이트 (commit)
-	char clientip[IP_ADDRESS_LEN];
-	char ts[TIMESTAMP_LEN];
-	tstamp_sec(ts, TIMESTAMP_LEN);
-	get_client_ipaddr(clsock, clientip, IP_ADDRESS_LEN);
-	strncpy(g_inventory.items[*fid].creator, clientip, sizeof(g_inventory.items[*fid].creator));
-	strncpy(g_inventory.items[*fid].fname, req->fname, sizeof(g_inventory.items[*fid].fname));
-	strncpy(g_inventory.items[*fid].alv, req->alv, sizeof(g_inventory.items[*fid].alv));
-	strncpy(g_inventory.items[*fid].last_modified, ts, sizeof(g_inventory.items[*fid].last_modified));
-	snprintf(g_inventory.items[*fid].flen, sizeof(g_inventory.items[*fid].flen), "%s", req->flen);
-	
-	// Receive file data.
-	ssize_t rlen = 0;
-	int cnt = 0;
-	while (rlen < flen) {
-		cnt++;
-		ssize_t chunk = recv(clsock, buf + rlen, flen - rlen, 0);
-		if (0 == chunk){
-			timestamp(MSEC, "[client (%d)] socket closed\n", clsock);
-			break;
-		} else if (chunk < 0) {
-			rollback_inventory(fid, req);
-			timestamp(MSEC, "[server_upload_service] [recv] [client (%d)] %s", clsock, strerror(errno));
-			return -1;
-		}
-		rlen += (ssize_t)chunk;
-	}
-	if (rlen == flen)
-		timestamp(MSEC, "[client (%d)] Transmission complete(%d). (%ldB/%ldB)", 
-				clsock, cnt, rlen, flen);
-	// Transmission failed. Rollback g_inventory.
-	else {
-		rollback_inventory(fid, req);
-		timestamp(MSEC, "[server_upload_service] [client (%d)] partially transmitted (%d/%d)", clsock, rlen, flen);
-		free(buf);
-		return -1;
-	}
+/*
+ * Append the reserved item to the live item list.
+ */
+static void
+link_live_item(int fid)
+{
+	pthread_mutex_lock(&g_inventory.llock);
+	g_inventory.serial[fid] = ++g_inventory.last_serial;
+	g_inventory.next[fid] = -1;
+	g_inventory.prev[fid] = g_inventory.tail;
+	if (g_inventory.tail >= 0)
+		g_inventory.next[g_inventory.tail] = fid;
+	else
+		g_inventory.head = fid;
+	g_inventory.tail = fid;
+	g_inventory.nlive++;
+	pthread_mutex_unlock(&g_inventory.llock);
+}
 
-	// Create new file
-	if (create_directory_if_not_exists(g_inventory.items[*fid].creator) < 0) {
-		rollback_inventory(fid, req);
-		timestamp(MSEC, "[client (%d)] Failed to create new directory.", clsock);
-		goto disk_failure;
-	}
-	char fpath[FS_PATH_MAX_LEN];
-	memset(fpath, '\0', FS_PATH_MAX_LEN);
-	snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s",
-			g_inventory.items[*fid].creator, req->fname);
+static void
+unlink_live_item(int fid)
+{
+	pthread_mutex_lock(&g_inventory.llock);
+	if (g_inventory.prev[fid] >= 0)
+		g_inventory.next[g_inventory.prev[fid]] = g_inventory.next[fid];
+	else
+		g_inventory.head = g_inventory.next[fid];
+	if (g_inventory.next[fid] >= 0)
+		g_inventory.prev[g_inventory.next[fid]] = g_inventory.prev[fid];
+	else
+		g_inventory.tail = g_inventory.prev[fid];
+	g_inventory.serial[fid] = 0;
+	g_inventory.nlive--;
+	pthread_mutex_unlock(&g_inventory.llock);
+}
 
-	result = create_file(fpath, buf, flen);
-	if (result < 0) {
-		rollback_inventory(fid, req);
-		timestamp(MSEC, "[client (%d)] [create_file] Failed to create new file. %s", clsock, futil_errstr(result));
-		goto disk_failure;
-	}
+/*
+ * Log the item of fid as the next version of the inventory. The oldest
+ * change is overwritten when the log is full.
+ *
+ * @param fname - Name of the change, NULL for the name of the item.
+ */
+static void
+record_change(int fid, enum CHANGE_TYPE type, const char *fname)
+{
+	pthread_mutex_lock(&g_inventory.llock);
+	struct inven_change *c = (struct inven_change *)log_change(&g_inventory.changes);
+	snprintf(c->type, sizeof(c->type), "%d", type);
+	c->item = g_inventory.items[fid];
+	if (NULL != fname)
+		strncpy(c->item.fname, fname, sizeof(c->item.fname));
+	pthread_mutex_unlock(&g_inventory.llock);
 
-	snprintf(g_inventory.items[*fid].status, sizeof(g_inventory.items[*fid].status), "%d", ITEM_STAT_AVAILABLE);
+	uint64_t one = 1;
+	if (__atomic_load_n(&g_nsubscribers, __ATOMIC_RELAXED) > 0)
+		write(g_change_efd, &one, sizeof(one));
+}
 
-	timestamp(MSEC, "[client (%d)] Finished to create the file.", clsock);
+/*
+ * The fields of an item are written under its ilock, so that the snapshots
+ * never see a half-written item.
+ */
+static void
+release_item(int fid, enum ITEM_STAT status)
+{
+	pthread_rwlock_wrlock(&g_inventory.ilock[fid]);
+	snprintf(g_inventory.items[fid].status, sizeof(g_inventory.items[fid].status), "%d", status);
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	record_change(fid, CHANGE_MODIFY, NULL);
+}
 
-	set_resp_code(&resp, RESP_OK);
+/*
+ * Update the item of fid for its new name or content.
+ *
+ * @param fname, flen - NULL if not changed.
+ */
+static void
+touch_item(int fid, const char *fname, const char *flen)
+{
+	char ts[TIMESTAMP_LEN];
+	struct inven_item *item = &g_inventory.items[fid];
+	tstamp_sec(ts, TIMESTAMP_LEN);
+	pthread_rwlock_wrlock(&g_inventory.ilock[fid]);
+	if (NULL != fname)
+		strncpy(item->fname, fname, sizeof(item->fname));
+	if (NULL != flen)
+		snprintf(item->flen, sizeof(item->flen), "%s", flen);
+	strncpy(item->last_modified, ts, sizeof(item->last_modified));
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+}
 
-	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
-		timestamp(MSEC, "[server_upload_service] [send]");
-	
-	free(buf);
+/*
+ * Take a reference of the item named fname. The fid is copied from nametb
+ * under the lock of its bucket, and the name and the status are checked
+ * again under the ilock, since a concurrent delete may have freed the name
+ * meanwhile. The fid is not reused until put_item().
+ *
+ * @param item - A copy of the item will be set.
+ * @return - fid, -1 if no item is named fname.
+ */
+static int
+get_item(const char *fname, struct inven_item *item)
+{
+	int fid = -1;
+	if (find_copy(g_inventory.nametb, fname, &fid, sizeof(int)) < 0 || fid < 0)
+		return -1;
 
-	return 0;
+	pthread_rwlock_rdlock(&g_inventory.ilock[fid]);
+	*item = g_inventory.items[fid];
+	int named = (ITEM_STAT_DELETED != atoi(item->status)
+			&& 0 == strncmp(item->fname, fname, sizeof(item->fname)));
+	// DELETED is set under the wrlock before nametb drops its reference.
+	if (named)
+		__atomic_add_fetch(&g_inventory.refs[fid], 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	return named ? fid : -1;
+}
 
-disk_failure:
-	set_resp_code(&resp, RESP_OUT_OF_DISK);
-refuse_svc:
-	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
-		timestamp(MSEC, "[server_upload_service] [send]");
-	if (NULL != buf)
-		free(buf);
-	return -1;
+/*
+ * The fid of a deleted item goes back to fidq with the last reference.
+ */
+static void
+put_item(int fid)
+{
+	if (__atomic_sub_fetch(&g_inventory.refs[fid], 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	// A download holding the item may have cached it after the delete.
+	invalidate_item_caches(fid);
+	enqueue(g_inventory.fidq, (void *)&fid);
 }
 
-// client_service에도 존재. -> 공통 모듈로 분리
-static int
-send_file(int sockfd, const char *path, int64_t flen, struct trans_stat *rate)
+static void	
+rollback_inventory(int* fid, const char *fname)
 {
-	int64_t dlen = 0;// Size of data to send in bytes.
-	int64_t slen = 0;// Size of data sent in bytes.
+	int id = *fid;
+	end_frontier(id, FRONTIER_ABORTED);
+	unlink_live_item(id);
+	pthread_rwlock_wrlock(&g_inventory.ilock[id]);
+	snprintf(g_inventory.items[id].status, sizeof(g_inventory.items[id].status), "%d", ITEM_STAT_DELETED);
+	pthread_rwlock_unlock(&g_inventory.ilock[id]);
+	record_change(id, CHANGE_REMOVE, fname);
+	// Nobody can find fid after rm_item. find_copy() copies it under the lock.
+	rm_item(g_inventory.nametb, fname);
+	free(fid);
+	put_item(id);
+}
 
-	void *data = malloc(flen);
-	if (NULL == data) {
-		timestamp(MSEC, "[send_file] [malloc]");
-		 return -1;
+/*
+ * Reserve the file name and an empty slot of g_inventory.items.
+ *
+ * @param pfid - The reserved fid(also stored in nametb) will be set.
+ * @return - RESP_OK or the reason of the refusal.
+ */
+static enum RESPONSE_CODE
+reserve_item(const char *fname, int **pfid)
+{
+	int *fid = (int *)malloc(sizeof(int));
+	if (NULL == fid) {
+		timestamp(MSEC, "[reserve_item] [refuse] [malloc]");
+		return RESP_OUT_OF_MEMORY;
 	}
+	*fid = -1;
 
-	dlen = read_file(path, data, flen);
-	if (dlen < 0) {
-		timestamp(MSEC, "[send_file] [read_file]");
-		goto futil_err;
+	// 파일 이름 사용 가능하면 일단 nametb 선점
+	int result = set(g_inventory.nametb, fname, (void *)fid, 0);
+	if (-1 == result) {
+		timestamp(MSEC, "[reserve_item] [refuse] file already exists(%s)", fname);
+		free(fid);
+		return RESP_DUPLICATED;
+	} else if (result < 0) {
+		timestamp(MSEC, "[reserve_item] [refuse] [set] (%s)", fname);
+		free(fid);
+		return RESP_OUT_OF_MEMORY;
 	}
-
-	slen = send_stream_nblock(sockfd, data, flen, rate);
-	if (slen < 0) {
-		timestamp(MSEC, "[send_file] %s", sockutil_errstr(slen));
-		goto sockutil_err;
+	// g_inventory.items에 빈 공간이 있는지 확인
+	if (dequeue(g_inventory.fidq, fid) < 0) {
+		timestamp(MSEC, "[reserve_item] [refuse] fidq");
+		rm_item(g_inventory.nametb, fname); // rollback
+		free(fid);
+		return RESP_INVENTORY_FULL;
 	}
+	set(g_inventory.nametb, fname, (void *)fid, 1);
+	pthread_rwlock_wrlock(&g_inventory.ilock[*fid]);
+	__atomic_store_n(&g_inventory.refs[*fid], 1, __ATOMIC_RELAXED);
+	strncpy(g_inventory.items[*fid].fname, fname, sizeof(g_inventory.items[*fid].fname));
+	snprintf(g_inventory.items[*fid].status, sizeof(g_inventory.items[*fid].status), "%d", ITEM_STAT_MODIFYING);
+	pthread_rwlock_unlock(&g_inventory.ilock[*fid]);
+	link_live_item(*fid);
 
-	free(data);
-
-	return 0;
+	*pfid = fid;
+	return RESP_OK;
+}
 
-futil_err:
-	free(data);
-	return -1;
+/*
+ * Admission control. Reserve flen bytes of the free space so that concurrent
+ * uploads can't oversubscribe the disk. The reservation is held until the
+ * file is allocated.
+ *
+ * @return - RESP_OK or RESP_OUT_OF_DISK
+ */
+static enum RESPONSE_CODE
+reserve_disk_space(int64_t flen)
+{
+	struct diskstat ds;
+	enum RESPONSE_CODE code = RESP_OK;
 
-sockutil_err:
-	free(data);
-	return -1;
+	pthread_mutex_lock(&g_disk_lock);
+	if (diskstat(".", &ds) < 0) {
+		// Let fallocate decide.
+		timestamp(MSEC, "[reserve_disk_space] %s", futil_errstr(ERR_FUTIL_STATVFS));
+		g_reserved_disk += flen;
+		pthread_mutex_unlock(&g_disk_lock);
+		return RESP_OK;
+	}
+	int64_t avail = (int64_t)ds.bavail * ds.bsize - DISK_FREE_MARGIN - g_reserved_disk;
+	if (0 == ds.iavail || flen > avail) {
+		timestamp(MSEC, "[reserve_disk_space] [refuse] %ldB (available: %ldB, reserved: %ldB, inodes: %lu)",
+				flen, avail, g_reserved_disk, (unsigned long)ds.iavail);
+		code = RESP_OUT_OF_DISK;
+	} else {
+		g_reserved_disk += flen;
+	}
+	pthread_mutex_unlock(&g_disk_lock);
+	return code;
 }
 
-int 
-server_download_service(int sockfd, struct svc_req *req)
+static void
+release_disk_space(int64_t flen)
 {
-	timestamp(MSEC, "[server_download_service] [client (%d)] [%s]",
-			sockfd, req->fname);
-	struct svc_resp resp;
-	char fpath[IP_ADDRESS_LEN + FILE_NAME_LEN];
-	int64_t flen = 0;
-	char clip[IP_ADDRESS_LEN];
-	int *fid = NULL;
-	int alv = -1;
-	int result = 0;
+	pthread_mutex_lock(&g_disk_lock);
+	g_reserved_disk -= flen;
+	pthread_mutex_unlock(&g_disk_lock);
+}
 
-	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
-	fid = (int *) find(g_inventory.nametb, req->fname);
+/*
+ * Create the destination file of flen bytes under the client's directory.
+ * The disk space is reserved and allocated before any data is accepted.
+ * The file has no name until publish_file() so that nobody can see it
+ * half-written.
+ *
+ * @param clientip - The client's ip address will be set.
+ * @param fpath - The file path will be set. FS_PATH_MAX_LEN bytes.
+ * @param tmppath - The temporary path(empty if unnamed) will be set. FS_PATH_MAX_LEN bytes.
+ * @return - Success: file descriptor, Error: -1
+ */
+static int
+open_item_file(int clsock, const char *fname, int64_t flen, char *clientip, char *fpath, char *tmppath)
+{
+	memset(fpath, '\0', FS_PATH_MAX_LEN);
+	tmppath[0] = '\0';
+	if (RESP_OK != reserve_disk_space(flen))
+		return -1;
 
-	// Check if the file is deleted.
-	if (NULL == fid) {
-		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_DELETED);
-		goto refuse_svc;
+	int fd = -1;
+	get_client_ipaddr(clsock, clientip, IP_ADDRESS_LEN);
+	if (create_directory_if_not_exists(clientip) < 0) {
+		timestamp(MSEC, "[client (%d)] Failed to create new directory.", clsock);
+		goto out;
+	}
+	snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s", clientip, fname);
+	fd = create_temp_file_fd(clientip, fname, tmppath, FS_PATH_MAX_LEN);
+	if (fd < 0) {
+		timestamp(MSEC, "[client (%d)] [create_temp_file_fd] %s", clsock, futil_errstr(fd));
+		fd = -1;
+		goto out;
+	}
+	// The filesystem accounts for the space from now on.
+	int result = preallocate_file(fd, flen);
+	if (result < 0) {
+		timestamp(MSEC, "[client (%d)] [preallocate_file] %s %ldB", clsock, futil_errstr(result), flen);
+		discard_temp_file(fd, tmppath);
+		fd = -1;
 	}
 
-	alv = atoi(g_inventory.items[*fid].alv);
-	flen = strtoll(g_inventory.items[*fid].flen, NULL, 10);
+out:
+	release_disk_space(flen);
+	return fd;
+}
 
-	// Check access level.
-	if ((alv == PRIVATE_ACCESS) && (strcmp(clip, g_inventory.items[*fid].creator))) {
-		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_ACCESS_DENIED);
-		goto refuse_svc;
-	}
+/*
+ * g_inventory.items 배열 업데이트 (commit)
+ */
+static void
+register_item(int fid, const char *clientip, struct svc_req *req)
+{
+	char ts[TIMESTAMP_LEN];
+	tstamp_sec(ts, TIMESTAMP_LEN);
+	pthread_rwlock_wrlock(&g_inventory.ilock[fid]);
+	strncpy(g_inventory.items[fid].creator, clientip, sizeof(g_inventory.items[fid].creator));
+	strncpy(g_inventory.items[fid].fname, req->fname, sizeof(g_inventory.items[fid].fname));
+	strncpy(g_inventory.items[fid].alv, req->alv, sizeof(g_inventory.items[fid].alv));
+	strncpy(g_inventory.items[fid].last_modified, ts, sizeof(g_inventory.items[fid].last_modified));
+	snprintf(g_inventory.items[fid].flen, sizeof(g_inventory.items[fid].flen), "%s", req->flen);
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	record_change(fid, CHANGE_ADD, NULL);
+}
 
-	if (0 == pthread_rwlock_tryrdlock(&g_inventory.ilock[*fid])) {
-		snprintf(fpath, IP_ADDRESS_LEN + FILE_NAME_LEN, "%s/%s",
-				g_inventory.items[*fid].creator, req->fname);
-		// Check file exists.
-		if (access(fpath, F_OK) < 0) {
-			timestamp(MSEC, "[server_download_service] [client (%d)] [Miss (%s)]", sockfd, fpath);
-			snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_NO_SUCH_FILE);
-			pthread_rwlock_unlock(&g_inventory.ilock[*fid]);
-			goto refuse_svc;
-		}
-		// Send OK response.
-		timestamp(MSEC, "[server_download_service] [client (%d)] OK",
-				sockfd);
-		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_OK);
-		result = send_stream(sockfd, &resp, sizeof(struct svc_resp));
-		if(result < 0) {
-			timestamp(MSEC, "%s", sockutil_errstr(result));
-			pthread_rwlock_unlock(&g_inventory.ilock[*fid]);
-			return -1;
-		}
-		// Send the file.
-		if (send_file(sockfd, fpath, flen, NULL) < 0) {
-			timestamp(MSEC, "%s", sockutil_errstr(result));
-			pthread_rwlock_unlock(&g_inventory.ilock[*fid]);
-			timestamp(MSEC, "[server_download_service] [client (%d)] Download successed.",
-				sockfd);
-			return -1;
-		}
-		timestamp(MSEC, "[server_download_service] [client (%d)] File sended.", sockfd);
-		pthread_rwlock_unlock(&g_inventory.ilock[*fid]);
+static int
+open_splice_pipe(void)
+{
+	if (t_pipefd[0] >= 0)
 		return 0;
-	} else {
-		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_MODIFYING);
-		goto refuse_svc;
-	}
-
-refuse_svc:
-	if(send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
-		timestamp(MSEC, "%s", sockutil_errstr(result));
+	if (pipe(t_pipefd) < 0) {
+		t_pipefd[0] = -1;
+		t_pipefd[1] = -1;
 		return -1;
 	}
 	return 0;
 }
 
-int 
-server_inquiry_service(int sockfd, size_t max_item, struct svc_req *req)
+static void
+close_splice_pipe(void)
 {
-	struct svc_resp resp;
-	int result = 0;
-	int dlen = max_item * sizeof(struct inven_item);
+	close(t_pipefd[0]);
+	close(t_pipefd[1]);
+	t_pipefd[0] = -1;
+	t_pipefd[1] = -1;
+}
+
+/*
+ * Create the ring on the first use. The worker buffer is registered as the
+ * fixed buffer 0 and the file slot 0 is filled per upload.
+ */
+static int
+open_upload_ring(void)
+{
+	if (0 != t_ring_state)
+		return (1 == t_ring_state) ? 0 : -1;
+
+	int fds[1] = { -1 };
+	struct iovec iov = { t_iobuf, SVC_IOBUF_SIZE };
+	int result = uring_init(&t_ring, URING_QUEUE_DEPTH);
+	if (result < 0)
+		goto ring_failed;
+	result = uring_register_buffers(&t_ring, &iov, 1);
+	if (0 == result)
+		result = uring_register_files(&t_ring, fds, 1);
+	if (result < 0) {
+		uring_exit(&t_ring);
+		goto ring_failed;
+	}
+	t_ring_state = 1;
+	return 0;
+
+ring_failed:
+	timestamp(MSEC, "[open_upload_ring] %s", uring_errstr(result));
+	t_ring_state = -1;
+	return -1;
+}
+
+/*
+ * Receive flen bytes of the file data from the client and write them to fd
+ * at offset(negative: the file offset).
+ * Use io_uring or splice if possible, fall back to the buffered path otherwise.
+ * Compressed data is decoded in the buffer.
+ *
+ * @return - Success: flen, Error: enum ERR_SOCKUTIL
+ */
+static int64_t
+recv_file_data(int clsock, int fd, int64_t offset, int64_t flen, enum COMPRESS_TYPE compress)
+{
+	if (COMPRESS_NONE != compress)
+		return recv_compressed_stream(clsock, fd, offset, flen, t_iobuf, NULL);
+	if (UPLOAD_MODE_URING == t_upload_mode && offset >= 0) {
+		if (0 == open_upload_ring() && 0 == uring_update_file(&t_ring, 0, fd)) {
+			int64_t rlen = recv_stream_to_ring(clsock, &t_ring, 0, 0, offset, flen, 
+					t_iobuf, SVC_IOBUF_SIZE, URING_QUEUE_DEPTH, NULL);
+			// Don't keep the file alive in the ring.
+			uring_update_file(&t_ring, 0, -1);
+			return rlen;
+		}
+		timestamp(MSEC, "[recv_file_data] io_uring is unusable. Fall back to splice.");
+		t_upload_mode = UPLOAD_MODE_SPLICE;
+	}
+	if ((UPLOAD_MODE_SPLICE == t_upload_mode || UPLOAD_MODE_URING == t_upload_mode)
+			&& 0 == open_splice_pipe()) {
+		int64_t rlen = splice_stream_to_fd(clsock, fd, offset, flen, t_pipefd, NULL);
+		if (ERR_SOCKUTIL_SPLICE_UNSUPPORTED != rlen) {
+			// Data may be left in the pipe.
+			if (rlen < 0)
+				close_splice_pipe();
+			return rlen;
+		}
+		timestamp(MSEC, "[recv_file_data] %s. Fall back to the buffered path.",
+				sockutil_errstr(rlen));
+		t_upload_mode = UPLOAD_MODE_BUFFERED;
+	}
+	return recv_stream_to_fd(clsock, fd, offset, flen, t_iobuf, SVC_IOBUF_SIZE, NULL);
+}
+
+/*
+ * Remove the unpublished file and rollback g_inventory.
+ */
+static void
+abort_upload(int *fid, const char *fname, int fd, const char *tmppath)
+{
+	discard_temp_file(fd, tmppath);
+	rollback_inventory(fid, fname);
+}
+
+/*
+ * Flush the file and its directory entry through the group sync thread.
+ */
+static int
+sync_item_file(int fd, const char *fpath)
+{
+	char dpath[FS_PATH_MAX_LEN];
+	strncpy(dpath, fpath, FS_PATH_MAX_LEN - 1);
+	dpath[FS_PATH_MAX_LEN - 1] = '\0';
+	char *slash = strrchr(dpath, '/');
+	if (NULL != slash)
+		*slash = '\0';
+	else
+		strcpy(dpath, ".");
+
+	int dirfd = open_directory_fd(dpath);
+	if (dirfd < 0) {
+		timestamp(MSEC, "[sync_item_file] %s %s", futil_errstr(dirfd), dpath);
+		return -1;
+	}
+	int result = group_sync(&g_gsync, fd, dirfd);
+	close(dirfd);
+	if (result < 0) {
+		timestamp(MSEC, "[sync_item_file] %s %s", gsync_errstr(result), fpath);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Hash the complete file.
+ *
+ * @return - Success: 0, Fail: -1
+ */
+static int
+hash_item_file(int fd, char *hex)
+{
+	int rfd = reopen_file_rdonly(fd);
+	if (rfd < 0)
+		return -1;
+	struct stat st;
+	int result = fstat(rfd, &st);
+	if (0 == result)
+		result = sha256_fd(rfd, st.st_size, hex);
+	close(rfd);
+	return result;
+}
+
+/*
+ * Replace the complete file with its pack if it saves enough space. Files
+ * beginning with PK_MAGIC are always packed, because the magic tells the
+ * readers that a file is a pack.
+ *
+ * @param pfd, tmppath - The file. Replaced with the pack if it is packed.
+ * @return - Success: 0, Error: -1 (The file must not be published raw.)
+ */
+static int
+pack_item_file(int *pfd, char *tmppath, const char *fpath)
+{
+	char dpath[FS_PATH_MAX_LEN];
+	char ptmppath[FS_PATH_MAX_LEN];
+	char magic[sizeof(PK_MAGIC) - 1];
+	struct stat st;
+
+	int rfd = reopen_file_rdonly(*pfd);
+	if (rfd < 0 || fstat(rfd, &st) < 0) {
+		if (rfd >= 0)
+			close(rfd);
+		return (COMPRESS_NONE == g_packing) ? 0 : -1;
+	}
+	int64_t flen = st.st_size;
+	int forced = (pread(rfd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)
+			&& pk_has_magic((uint8_t *)magic, sizeof(magic)));
+	if (!forced && (COMPRESS_NONE == g_packing || flen < PACK_MIN_FILE)) {
+		close(rfd);
+		return 0;
+	}
+	uint8_t *data = mmap(NULL, flen, PROT_READ, MAP_PRIVATE, rfd, 0);
+	close(rfd);
+	if (MAP_FAILED == data) {
+		timestamp(MSEC, "[pack_item_file] [mmap] %s", fpath);
+		return forced ? -1 : 0;
+	}
+	madvise(data, flen, MADV_SEQUENTIAL);
+
+	strncpy(dpath, fpath, FS_PATH_MAX_LEN - 1);
+	dpath[FS_PATH_MAX_LEN - 1] = '\0';
+	char *slash = strrchr(dpath, '/');
+	const char *fname = (NULL != slash) ? fpath + (slash - dpath) + 1 : fpath;
+	if (NULL != slash)
+		*slash = '\0';
+	else
+		strcpy(dpath, ".");
+
+	int64_t plen = 0;
+	int result = -1;
+	struct cz_encoder *enc = get_encoder((COMPRESS_NONE == g_packing) ? COMPRESS_FAST : g_packing);
+	int fd = create_temp_file_fd(dpath, fname, ptmppath, FS_PATH_MAX_LEN);
+	if (fd < 0) {
+		timestamp(MSEC, "[pack_item_file] %s %s", futil_errstr(fd), fpath);
+	} else if (NULL != enc && (result = pk_pack_data(data, flen, fd, enc, &plen)) < 0) {
+		timestamp(MSEC, "[pack_item_file] %s %s", pk_errstr(result), fpath);
+	}
+	munmap(data, flen);
+	if (fd >= 0 && (result < 0 || (!forced && plen > flen - flen / PACK_MIN_SAVING))) {
+		discard_temp_file(fd, ptmppath);
+		fd = -1;
+	}
+	if (fd < 0)
+		return (forced && result < 0) ? -1 : 0;
+
+	discard_temp_file(*pfd, tmppath);
+	*pfd = fd;
+	strcpy(tmppath, ptmppath);
+	timestamp(MSEC, "[pack_item_file] %s is packed. (%ldB -> %ldB)", fpath, flen, plen);
+	return 0;
+}
+
+/*
+ * Link fpath to the blob of the file. The first upload of the content becomes
+ * the blob, and the later ones are discarded.
+ *
+ * @param dedup - 1 will be set if the blob already existed.
+ * @return - Success: 0, Error: -1
+ */
+static int
+link_item_blob(int fd, const char *tmppath, const char *fpath, const char *bpath, int *dedup)
+{
+	int result = 0;
+	*dedup = 0;
+	pthread_mutex_lock(&g_blob_lock);
+	if (0 == link_file(bpath, fpath)) {
+		*dedup = 1;
+		goto out;
+	}
+	result = publish_file(fd, tmppath, bpath);
+	if (result < 0) {
+		timestamp(MSEC, "[link_item_blob] %s %s", futil_errstr(result), bpath);
+		goto out;
+	}
+	result = link_file(bpath, fpath);
+	if (result < 0) {
+		timestamp(MSEC, "[link_item_blob] %s %s", futil_errstr(result), fpath);
+		delete_file(bpath);
+	}
+out:
+	pthread_mutex_unlock(&g_blob_lock);
+	return (result < 0) ? -1 : 0;
+}
+
+/*
+ * Remove fpath, and the blob if nothing links to it anymore.
+ *
+ * @param fpath - NULL to release the blob of a replaced file.
+ */
+static int
+release_blob_file(const char *fpath, const char *blobid)
+{
+	char bpath[FS_PATH_MAX_LEN];
+	struct stat bst;
+
+	pthread_mutex_lock(&g_blob_lock);
+	int result = (NULL != fpath) ? delete_file(fpath) : 0;
+	if ('\0' != blobid[0]) {
+		snprintf(bpath, FS_PATH_MAX_LEN, "%s/%s", BLOB_HOME_STR, blobid);
+		if (0 == stat(bpath, &bst) && 1 == bst.st_nlink)
+			delete_file(bpath);
+	}
+	pthread_mutex_unlock(&g_blob_lock);
+	return result;
+}
+
+/*
+ * Publish the complete file under fpath atomically and close it. The body is
+ * stored once per content in BLOB_HOME_STR and fpath is a hard link to it.
+ * New bodies are packed before they are stored if packing is enabled.
+ * A durable file is flushed before returning. The file is removed on failure.
+ *
+ * @param blobid - Hash of the content will be set. Empty if the file is
+ * 				   published without the blob store.
+ * @param hex - Hash of the content if it is already known, NULL otherwise.
+ * @return - Success: 0, Error: -1
+ */
+static int
+publish_blob_file(int fd, const char *tmppath, const char *fpath, enum DURABILITY durability, 
+		char *blobid, const char *hex)
+{
+	char bpath[FS_PATH_MAX_LEN];
+	char tpath[FS_PATH_MAX_LEN];
+	int dedup = 0;
+	int result = 0;
+
+	snprintf(tpath, FS_PATH_MAX_LEN, "%s", tmppath);
+	blobid[0] = '\0';
+	bpath[0] = '\0';
+	if (NULL != hex)
+		snprintf(blobid, SHA256_HEX_LEN, "%s", hex);
+	if ('\0' == blobid[0] && hash_item_file(fd, blobid) < 0) {
+		timestamp(MSEC, "[publish_blob_file] Failed to hash %s", fpath);
+		blobid[0] = '\0';
+	} else {
+		snprintf(bpath, FS_PATH_MAX_LEN, "%s/%s", BLOB_HOME_STR, blobid);
+	}
+	// A duplicate is linked to the existing blob, so only new bodies are packed.
+	if (('\0' == bpath[0] || 0 != access(bpath, F_OK)) && pack_item_file(&fd, tpath, fpath) < 0)
+		result = -1;
+	else if ('\0' == blobid[0])
+		result = publish_file(fd, tpath, fpath);
+	else
+		result = link_item_blob(fd, tpath, fpath, bpath, &dedup);
+	if (result < 0) {
+		timestamp(MSEC, "[publish_blob_file] Failed to publish %s", fpath);
+		discard_temp_file(fd, tpath);
+		blobid[0] = '\0';
+		return -1;
+	}
+
+	// The upload is a duplicate. Only the new name has to be flushed.
+	if (dedup) {
+		discard_temp_file(fd, tpath);
+		timestamp(MSEC, "[publish_blob_file] %s is deduplicated. (%s)", fpath, blobid);
+		if (DURABILITY_DURABLE != durability)
+			return 0;
+		fd = open_file_fd(bpath);
+		if (fd < 0) {
+			release_blob_file(fpath, blobid);
+			return -1;
+		}
+	} else if (DURABILITY_DURABLE == durability && '\0' != blobid[0] 
+			&& sync_item_file(fd, bpath) < 0) {
+		close(fd);
+		release_blob_file(fpath, blobid);
+		return -1;
+	}
+	if (DURABILITY_DURABLE == durability && sync_item_file(fd, fpath) < 0) {
+		close(fd);
+		release_blob_file(fpath, blobid);
+		return -1;
+	}
+	result = close_file_fd(fd);
+	if (result < 0) {
+		timestamp(MSEC, "[publish_blob_file] %s %s", futil_errstr(result), fpath);
+		release_blob_file(fpath, blobid);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the manifest of a chunked file under fpath atomically.
+ *
+ * @return - Success: 0, Error: -1
+ */
+static int
+write_manifest_file(const struct chunk_manifest *m, const char *fpath, enum DURABILITY durability)
+{
+	char dpath[FS_PATH_MAX_LEN];
+	char tmppath[FS_PATH_MAX_LEN];
+	strncpy(dpath, fpath, FS_PATH_MAX_LEN - 1);
+	dpath[FS_PATH_MAX_LEN - 1] = '\0';
+	char *slash = strrchr(dpath, '/');
+	const char *fname = (NULL != slash) ? fpath + (slash - dpath) + 1 : fpath;
+	if (NULL != slash)
+		*slash = '\0';
+	else
+		strcpy(dpath, ".");
+
+	int fd = create_temp_file_fd(dpath, fname, tmppath, FS_PATH_MAX_LEN);
+	if (fd < 0) {
+		timestamp(MSEC, "[write_manifest_file] %s %s", futil_errstr(fd), fpath);
+		return -1;
+	}
+	int result = cs_write_manifest(m, fd);
+	if (result < 0) {
+		timestamp(MSEC, "[write_manifest_file] %s %s", cs_errstr(result), fpath);
+		discard_temp_file(fd, tmppath);
+		return -1;
+	}
+	result = publish_file(fd, tmppath, fpath);
+	if (result < 0) {
+		timestamp(MSEC, "[write_manifest_file] %s %s", futil_errstr(result), fpath);
+		discard_temp_file(fd, tmppath);
+		return -1;
+	}
+	if (DURABILITY_DURABLE == durability && sync_item_file(fd, fpath) < 0) {
+		close(fd);
+		delete_file(fpath);
+		return -1;
+	}
+	result = close_file_fd(fd);
+	if (result < 0) {
+		timestamp(MSEC, "[write_manifest_file] %s %s", futil_errstr(result), fpath);
+		delete_file(fpath);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Split the complete file into chunks and store the new ones. fpath gets
+ * the manifest of the file, and the uploaded file is discarded.
+ *
+ * @param pm - The manifest will be set.
+ * @return - Success: 0, Error: -1
+ */
+static int
+publish_chunked_file(int fd, const char *tmppath, const char *fpath, int64_t flen,
+		enum DURABILITY durability, struct chunk_manifest **pm)
+{
+	int rfd = reopen_file_rdonly(fd);
+	discard_temp_file(fd, tmppath);
+	if (rfd < 0) {
+		timestamp(MSEC, "[publish_chunked_file] %s %s", futil_errstr(rfd), fpath);
+		return -1;
+	}
+	uint8_t *data = mmap(NULL, flen, PROT_READ, MAP_PRIVATE, rfd, 0);
+	close(rfd);
+	if (MAP_FAILED == data) {
+		timestamp(MSEC, "[publish_chunked_file] [mmap] %s", fpath);
+		return -1;
+	}
+	madvise(data, flen, MADV_SEQUENTIAL);
+
+	struct chunk_manifest *m = NULL;
+	int result = cs_store_data(&g_chunkstore, &g_cdc, data, flen, &m);
+	munmap(data, flen);
+	if (result < 0) {
+		timestamp(MSEC, "[publish_chunked_file] %s %s", cs_errstr(result), fpath);
+		return -1;
+	}
+	// The chunks must be on the disk before the manifest refers to them.
+	if (DURABILITY_DURABLE == durability && (result = cs_sync(&g_chunkstore)) < 0) {
+		timestamp(MSEC, "[publish_chunked_file] %s %s", cs_errstr(result), fpath);
+		cs_put_manifest(&g_chunkstore, m);
+		return -1;
+	}
+	if (write_manifest_file(m, fpath, durability) < 0) {
+		cs_put_manifest(&g_chunkstore, m);
+		return -1;
+	}
+
+	size_t nchunks = 0;
+	int64_t stored = 0, referenced = 0;
+	cs_stat(&g_chunkstore, &nchunks, &stored, &referenced);
+	timestamp(MSEC, "[publish_chunked_file] %s: %zu chunks (chunk store: %zu chunks, %ldB for %ldB)",
+			fpath, m->nchunks, nchunks, stored, referenced);
+	*pm = m;
+	return 0;
+}
+
+/*
+ * Publish the complete upload of the item. Big files are stored as chunks
+ * if chunking is enabled, and the others as blobs. The previous version of
+ * a replaced file is released. On failure, it is left to the caller.
+ *
+ * @param hex - SHA-256 of the file if it is already known, NULL otherwise.
+ * @return - Success: 0, Error: -1
+ */
+static int
+publish_item_file(int fid, int fd, const char *tmppath, const char *fpath, 
+		enum DURABILITY durability, const char *hex)
+{
+	char old_blobid[SHA256_HEX_LEN];
+	struct stat st;
+	int result = 0;
+
+	strncpy(old_blobid, g_blob_ids[fid], SHA256_HEX_LEN);
+	g_blob_ids[fid][0] = '\0';
+	if (g_chunking && 0 == fstat(fd, &st) && st.st_size >= CHUNK_STORE_MIN_FILE) {
+		struct chunk_manifest *m = NULL;
+		result = publish_chunked_file(fd, tmppath, fpath, st.st_size, durability, &m);
+		if (0 == result)
+			cs_attach_manifest(&g_chunkstore, &g_manifests[fid], m);
+	} else {
+		result = publish_blob_file(fd, tmppath, fpath, durability, g_blob_ids[fid], hex);
+		if (0 == result && g_chunking)
+			cs_detach_manifest(&g_chunkstore, &g_manifests[fid]);
+	}
+	if (result < 0) {
+		strncpy(g_blob_ids[fid], old_blobid, SHA256_HEX_LEN);
+		return -1;
+	}
+	if ('\0' != old_blobid[0] && strcmp(old_blobid, g_blob_ids[fid]))
+		release_blob_file(NULL, old_blobid);
+	return 0;
+}
+
+/*
+ * Remove the file of the item with its blob or chunks. Downloads holding
+ * the manifest keep the chunks until they finish.
+ */
+static int
+release_item_file(int fid, const char *fpath)
+{
+	int result = release_blob_file(fpath, g_blob_ids[fid]);
+	g_blob_ids[fid][0] = '\0';
+	if (g_chunking)
+		cs_detach_manifest(&g_chunkstore, &g_manifests[fid]);
+	return result;
+}
+
+int 
+server_upload_service(int clsock, struct svc_req *req)
+{
+	int result = 0;
+	int fd = -1;
+	int *fid = NULL;
+	struct svc_resp resp;
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_UPLOAD);
+
+	int64_t flen = strtoll(req->flen, NULL, 10);
+	enum ACCESS_LEVEL alv = atoi(req->alv);
+
+	timestamp(MSEC, "[request] [client (%d)] %s %ldB (%d)", 
+			clsock, req->fname, flen, alv);
+
+	enum RESPONSE_CODE code = reserve_item(req->fname, &fid);
+	if (RESP_OK != code) {
+		set_resp_code(&resp, code);
+		goto refuse_svc;
+	}
+
+	// Open the destination file before accepting the data.
+	char clientip[IP_ADDRESS_LEN];
+	char fpath[FS_PATH_MAX_LEN];
+	char tmppath[FS_PATH_MAX_LEN];
+	fd = open_item_file(clsock, req->fname, flen, clientip, fpath, tmppath);
+	if (fd < 0) {
+		rollback_inventory(fid, req->fname);
+		set_resp_code(&resp, RESP_OUT_OF_DISK);
+		goto refuse_svc;
+	}
+
+	// Send response
+	enum COMPRESS_TYPE compress = req_compression(req, &resp);
+	set_resp_code(&resp, RESP_OK);
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0) {
+		timestamp(MSEC, "[server_upload_service] [send]");
+		abort_upload(fid, req->fname, fd, tmppath);
+		return -1;
+	}
+
+	register_item(*fid, clientip, req);
+	begin_frontier(*fid, fd, flen);
+	
+	// Receive file data. The progress is published per step for the followers.
+	int64_t rlen = 0;
+	int64_t received = 0;
+	while (received < flen) {
+		int64_t step = (flen - received < SESSION_PROGRESS_STEP) ? flen - received : SESSION_PROGRESS_STEP;
+		rlen = recv_file_data(clsock, fd, received, step, compress);
+		if (rlen < 0)
+			break;
+		received += step;
+		advance_frontier(*fid, received);
+	}
+	if (rlen >= 0)
+		rlen = received;
+	if (ERR_SOCKUTIL_WRITE_FAILED == rlen) {
+		abort_upload(fid, req->fname, fd, tmppath);
+		timestamp(MSEC, "[client (%d)] Failed to write the file. %s", clsock, sockutil_errstr(rlen));
+		goto disk_failure;
+	} else if (rlen < 0) {
+		// Transmission failed. Rollback g_inventory.
+		abort_upload(fid, req->fname, fd, tmppath);
+		timestamp(MSEC, "[server_upload_service] [client (%d)] partially transmitted. %s",
+				clsock, sockutil_errstr(rlen));
+		return -1;
+	}
+	timestamp(MSEC, "[client (%d)] Transmission complete. (%ldB/%ldB)", 
+			clsock, rlen, flen);
+
+	// Acknowledge before the file is published if the client doesn't wait.
+	enum DURABILITY durability = req_durability(req);
+	set_resp_code(&resp, RESP_OK);
+	if (DURABILITY_RECEIVED == durability && send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
+		timestamp(MSEC, "[server_upload_service] [send]");
+
+	result = publish_item_file(*fid, fd, tmppath, fpath, durability, NULL);
+	fd = -1;
+	if (result < 0) {
+		rollback_inventory(fid, req->fname);
+		timestamp(MSEC, "[client (%d)] [publish_item_file] Failed to create new file.", clsock);
+		if (DURABILITY_RECEIVED == durability)
+			return -1;
+		goto disk_failure;
+	}
+
+	invalidate_item_caches(*fid);
+	release_item(*fid, ITEM_STAT_AVAILABLE);
+	end_frontier(*fid, FRONTIER_COMMITTED);
+
+	timestamp(MSEC, "[client (%d)] Finished to create the file. (durability %d)", clsock, durability);
+
+	if (DURABILITY_RECEIVED != durability && send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
+		timestamp(MSEC, "[server_upload_service] [send]");
+
+	return 0;
+
+disk_failure:
+	set_resp_code(&resp, RESP_OUT_OF_DISK);
+refuse_svc:
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
+		timestamp(MSEC, "[server_upload_service] [send]");
+	return -1;
+}
+
+static void
+generate_session_id(char *sid)
+{
+	static uint64_t seq = 0;
+	uint64_t r = 0;
+	if (getrandom(&r, sizeof(r), 0) != sizeof(r))
+		r = ((uint64_t)time(NULL) << 20) ^ (uint64_t)pthread_self();
+	r ^= __sync_add_and_fetch(&seq, 1);
+	snprintf(sid, SESSION_ID_LEN, "%016lx", r);
+}
+
+/*
+ * Roll back the sessions that have not been used for SESSION_EXPIRE_SEC.
+ * g_usession_lock must be held.
+ */
+static void
+expire_upload_sessions(void)
+{
+	time_t now = time(NULL);
+	for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+		struct upload_session *s = &g_usessions[i];
+		if ('\0' == s->sid[0] || s->nbusy > 0 || s->committing)
+			continue;
+		if (now - s->last_active < SESSION_EXPIRE_SEC)
+			continue;
+		timestamp(MSEC, "[expire_upload_sessions] [%s] %s (%ld/%ld)",
+				s->sid, s->fname, s->received, s->flen);
+		abort_upload(s->fid, s->fname, s->fd, s->tmppath);
+		memset(s, 0x00, sizeof(struct upload_session));
+	}
+}
+
+/*
+ * g_usession_lock must be held.
+ */
+static struct upload_session *
+find_upload_session(const char *sid)
+{
+	if ('\0' == sid[0])
+		return NULL;
+	for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+		struct upload_session *s = &g_usessions[i];
+		if (0 == strncmp(s->sid, sid, SESSION_ID_LEN) && !s->committing)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * @return - Index of the stripe containing offset. The end of the file belongs
+ * 			 to the last stripe.
+ */
+static int
+find_stripe(struct upload_session *s, int64_t offset)
+{
+	for (int i = 0; i < s->nstripes; i++) {
+		if (offset < s->stripes[i].start + s->stripes[i].len)
+			return i;
+	}
+	return s->nstripes - 1;
+}
+
+/*
+ * Find the session and the stripe containing offset, and mark the stripe busy
+ * so that only one connection writes to it.
+ *
+ * @return - RESP_OK: *ps, *pstripe are set. RESP_NO_SUCH_SESSION, RESP_MODIFYING(busy).
+ */
+static enum RESPONSE_CODE
+acquire_upload_stripe(const char *sid, int64_t offset, struct upload_session **ps, int *pstripe)
+{
+	enum RESPONSE_CODE code = RESP_NO_SUCH_SESSION;
+	pthread_mutex_lock(&g_usession_lock);
+	struct upload_session *s = find_upload_session(sid);
+	if (NULL != s) {
+		int i = find_stripe(s, offset);
+		if (s->stripes[i].busy) {
+			code = RESP_MODIFYING;
+		} else {
+			s->stripes[i].busy = 1;
+			s->nbusy++;
+			*ps = s;
+			*pstripe = i;
+			code = RESP_OK;
+		}
+	}
+	pthread_mutex_unlock(&g_usession_lock);
+	return code;
+}
+
+/*
+ * Release the stripe. Only the last connection to finish commits the session.
+ *
+ * @return - 1 if the caller has to commit the session.
+ */
+static int
+release_upload_stripe(struct upload_session *s, int stripe)
+{
+	int commit = 0;
+	pthread_mutex_lock(&g_usession_lock);
+	s->stripes[stripe].busy = 0;
+	s->nbusy--;
+	s->last_active = time(NULL);
+	if (s->received == s->flen && 0 == s->nbusy && !s->committing) {
+		s->committing = 1;
+		commit = 1;
+	}
+	pthread_mutex_unlock(&g_usession_lock);
+	return commit;
+}
+
+static void
+add_stripe_progress(struct upload_session *s, int stripe, int64_t done)
+{
+	// Followers can read up to the end of the contiguous prefix.
+	int64_t frontier = 0;
+	pthread_mutex_lock(&g_usession_lock);
+	if (done > s->stripes[stripe].done) {
+		s->received += done - s->stripes[stripe].done;
+		s->stripes[stripe].done = done;
+	}
+	for (int i = 0; i < s->nstripes; i++) {
+		frontier = s->stripes[i].start + s->stripes[i].done;
+		if (s->stripes[i].done < s->stripes[i].len)
+			break;
+	}
+	int fid = *s->fid;
+	pthread_mutex_unlock(&g_usession_lock);
+	advance_frontier(fid, frontier);
+}
+
+/*
+ * Reserve the item and create a new session for it. The file is preallocated
+ * so that the stripes can be written at their offsets.
+ */
+static enum RESPONSE_CODE
+create_upload_session(int clsock, struct svc_req *req, struct upload_session *copy)
+{
+	struct upload_session *s = NULL;
+	char clientip[IP_ADDRESS_LEN];
+
+	pthread_mutex_lock(&g_usession_lock);
+	expire_upload_sessions();
+	for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+		if ('\0' == g_usessions[i].sid[0]) {
+			s = &g_usessions[i];
+			break;
+		}
+	}
+	if (NULL == s) {
+		pthread_mutex_unlock(&g_usession_lock);
+		timestamp(MSEC, "[create_upload_session] [refuse] session table is full");
+		return RESP_OUT_OF_MEMORY;
+	}
+
+	enum RESPONSE_CODE code = reserve_item(req->fname, &s->fid);
+	if (RESP_OK != code) {
+		pthread_mutex_unlock(&g_usession_lock);
+		return code;
+	}
+	s->flen = strtoll(req->flen, NULL, 10);
+	s->fd = open_item_file(clsock, req->fname, s->flen, clientip, s->fpath, s->tmppath);
+	if (s->fd < 0) {
+		rollback_inventory(s->fid, req->fname);
+		memset(s, 0x00, sizeof(struct upload_session));
+		pthread_mutex_unlock(&g_usession_lock);
+		return RESP_OUT_OF_DISK;
+	}
+	register_item(*s->fid, clientip, req);
+	begin_frontier(*s->fid, s->fd, s->flen);
+
+	// The client chooses the number of stripes. The server limits it.
+	s->nstripes = atoi(req->stripes);
+	if (s->nstripes < 1)
+		s->nstripes = 1;
+	else if (s->nstripes > MAX_UPLOAD_STRIPES)
+		s->nstripes = MAX_UPLOAD_STRIPES;
+	for (int i = 0; i < s->nstripes; i++)
+		stripe_range(s->flen, s->nstripes, i, &s->stripes[i].start, &s->stripes[i].len);
+
+	strncpy(s->fname, req->fname, FILE_NAME_LEN);
+	s->durability = req_durability(req);
+	s->received = 0;
+	s->last_active = time(NULL);
+	generate_session_id(s->sid);
+	*copy = *s;
+	pthread_mutex_unlock(&g_usession_lock);
+
+	return RESP_OK;
+}
+
+/*
+ * Publish the file of the completed session and free the slot.
+ */
+static int
+commit_upload_session(struct upload_session *s)
+{
+	int result = publish_item_file(*s->fid, s->fd, s->tmppath, s->fpath, s->durability, NULL);
+	s->fd = -1;
+
+	pthread_mutex_lock(&g_usession_lock);
+	if (result < 0) {
+		rollback_inventory(s->fid, s->fname);
+	} else {
+		invalidate_item_caches(*s->fid);
+		release_item(*s->fid, ITEM_STAT_AVAILABLE);
+		end_frontier(*s->fid, FRONTIER_COMMITTED);
+	}
+	memset(s, 0x00, sizeof(struct upload_session));
+	pthread_mutex_unlock(&g_usession_lock);
+
+	return result;
+}
+
+/*
+ * @param resume - Offset the client should continue from.
+ */
+static void
+set_resp_session(struct svc_resp *resp, const char *sid, int nstripes, int64_t resume)
+{
+	strncpy(resp->sid, sid, SESSION_ID_LEN);
+	snprintf(resp->stripes, REQ_STRIPES_LEN, "%d", nstripes);
+	snprintf(resp->offset, REQ_FLEN_LEN, "%ld", resume);
+}
+
+/*
+ * Open a new resumable upload session(req->sid is empty) or query the progress
+ * of an existing one. A new session splits the file into req->stripes stripes
+ * (at most MAX_UPLOAD_STRIPES) which can be uploaded over separate connections.
+ * A query returns where the client should continue the stripe containing
+ * req->offset. The client sends the data with SVC_UPLOAD_CHUNK requests.
+ */
+int
+server_upload_session_service(int clsock, struct svc_req *req)
+{
+	struct upload_session copy;
+	enum RESPONSE_CODE code;
+	struct svc_resp resp;
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_UPLOAD_SESSION);
+
+	if ('\0' == req->sid[0]) {
+		timestamp(MSEC, "[server_upload_session_service] [client (%d)] new session %s %sB (%s)",
+				clsock, req->fname, req->flen, req->stripes);
+		code = create_upload_session(clsock, req, &copy);
+		if (RESP_OK == code) {
+			set_resp_session(&resp, copy.sid, copy.nstripes, 0);
+			timestamp(MSEC, "[server_upload_session_service] [client (%d)] [%s] %s stripes(%d)",
+					clsock, copy.sid, copy.fname, copy.nstripes);
+		}
+	} else {
+		int64_t offset = strtoll(req->offset, NULL, 10);
+		pthread_mutex_lock(&g_usession_lock);
+		struct upload_session *s = find_upload_session(req->sid);
+		if (NULL == s) {
+			code = RESP_NO_SUCH_SESSION;
+		} else {
+			struct upload_stripe *st = &s->stripes[find_stripe(s, offset)];
+			code = RESP_OK;
+			set_resp_session(&resp, s->sid, s->nstripes, st->start + st->done);
+			timestamp(MSEC, "[server_upload_session_service] [client (%d)] [%s] %s (%ld/%ld)",
+					clsock, s->sid, s->fname, s->received, s->flen);
+		}
+		pthread_mutex_unlock(&g_usession_lock);
+	}
+
+	set_resp_code(&resp, code);
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0) {
+		timestamp(MSEC, "[server_upload_session_service] [send]");
+		return -1;
+	}
+	return (RESP_OK == code) ? 0 : -1;
+}
+
+/*
+ * Receive req->flen bytes to be written at req->offset of the session's file.
+ * The chunk must lie in one stripe and can't start beyond the bytes the server
+ * already has for the stripe. Progress is recorded every SESSION_PROGRESS_STEP
+ * bytes so that a dropped connection loses at most one step. The file is
+ * published when all the stripes are complete.
+ */
+int
+server_upload_chunk_service(int clsock, struct svc_req *req)
+{
+	struct upload_session *s = NULL;
+	int stripe = 0;
+	struct svc_resp resp;
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_UPLOAD_CHUNK);
+
+	int64_t offset = strtoll(req->offset, NULL, 10);
+	int64_t clen = strtoll(req->flen, NULL, 10);
+
+	enum RESPONSE_CODE code = acquire_upload_stripe(req->sid, offset, &s, &stripe);
+	if (RESP_OK != code) {
+		set_resp_code(&resp, code);
+		goto refuse_svc;
+	}
+	struct upload_stripe *st = &s->stripes[stripe];
+	if (offset < st->start || clen < 0 || offset > st->start + st->done 
+			|| clen > st->start + st->len - offset) {
+		timestamp(MSEC, "[server_upload_chunk_service] [client (%d)] [%s] invalid chunk %ld+%ld (%ld+%ld/%ld)",
+				clsock, s->sid, offset, clen, st->start, st->done, st->len);
+		set_resp_code(&resp, RESP_INVALID_OFFSET);
+		set_resp_session(&resp, s->sid, s->nstripes, st->start + st->done);
+		release_upload_stripe(s, stripe);
+		goto refuse_svc;
+	}
+
+	enum COMPRESS_TYPE compress = req_compression(req, &resp);
+	set_resp_code(&resp, RESP_OK);
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0) {
+		timestamp(MSEC, "[server_upload_chunk_service] [send]");
+		release_upload_stripe(s, stripe);
+		return -1;
+	}
+
+	// Don't hold the stripe forever on a half-open connection.
+	set_socket_timeout(clsock, SESSION_RECV_TIMEOUT);
+	int64_t rlen = 0;
+	while (clen > 0) {
+		int64_t step = (clen < SESSION_PROGRESS_STEP) ? clen : SESSION_PROGRESS_STEP;
+		rlen = recv_file_data(clsock, s->fd, offset, step, compress);
+		if (rlen < 0)
+			break;
+		offset += step;
+		clen -= step;
+		add_stripe_progress(s, stripe, offset - st->start);
+	}
+	set_socket_timeout(clsock, 0);
+
+	set_resp_session(&resp, s->sid, s->nstripes, st->start + st->done);
+	if (rlen < 0) {
+		timestamp(MSEC, "[server_upload_chunk_service] [client (%d)] [%s] %s (%ld/%ld)",
+				clsock, s->sid, sockutil_errstr(rlen), s->received, s->flen);
+		if (release_upload_stripe(s, stripe))
+			commit_upload_session(s);
+		if (ERR_SOCKUTIL_WRITE_FAILED != rlen)
+			return -1;
+		set_resp_code(&resp, RESP_OUT_OF_DISK);
+		goto refuse_svc;
+	}
+
+	if (release_upload_stripe(s, stripe)) {
+		timestamp(MSEC, "[server_upload_chunk_service] [client (%d)] [%s] Transmission complete. (%ldB)",
+				clsock, s->sid, s->flen);
+		// Acknowledge before the file is published if the client doesn't wait.
+		if (DURABILITY_RECEIVED == s->durability) {
+			if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
+				timestamp(MSEC, "[server_upload_chunk_service] [send]");
+			return commit_upload_session(s);
+		}
+		if (commit_upload_session(s) < 0)
+			set_resp_code(&resp, RESP_OUT_OF_DISK);
+	}
+
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0) {
+		timestamp(MSEC, "[server_upload_chunk_service] [send]");
+		return -1;
+	}
+	return 0;
+
+refuse_svc:
+	if (send(clsock, &resp, sizeof(struct svc_resp), 0) < 0)
+		timestamp(MSEC, "[server_upload_chunk_service] [send]");
+	return -1;
+}
+
+/*
+ * Open the published file of the item for reading. Chunked files are read
+ * from the chunks of the manifest, and packs are decoded.
+ *
+ * @return - Success: 0, Error: -1
+ */
+static int
+open_item_reader(int fid, const char *fpath, struct item_reader *r)
+{
+	r->fd = -1;
+	r->m = g_chunking ? cs_get_manifest(&g_chunkstore, &g_manifests[fid]) : NULL;
+	r->chunk = 0;
+	r->cfd = -1;
+	r->packed = 0;
+	if (NULL != r->m)
+		return 0;
+	r->fd = open_file_fd(fpath);
+	if (r->fd < 0) {
+		timestamp(MSEC, "[open_item_reader] %s %s", futil_errstr(r->fd), fpath);
+		r->fd = -1;
+		return -1;
+	}
+	r->packed = pk_open_reader(&r->pack, r->fd);
+	if (r->packed < 0) {
+		timestamp(MSEC, "[open_item_reader] %s %s", pk_errstr(r->packed), fpath);
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read len bytes at offset. The chunk being read is kept open for the next
+ * read, which is usually in the same chunk.
+ *
+ * @return - Success: len, Error: -1
+ */
+static int64_t
+pread_item(struct item_reader *r, char *buf, int64_t len, int64_t offset)
+{
+	char cpath[FS_PATH_MAX_LEN];
+	int64_t rlen = 0;
+	if (r->packed)
+		return (pk_pread(&r->pack, (uint8_t *)buf, len, offset) < 0) ? -1 : len;
+	while (rlen < len) {
+		int fd = r->fd;
+		int64_t off = offset + rlen;
+		int64_t n = len - rlen;
+		if (NULL != r->m) {
+			if (off >= r->m->flen)
+				return -1;
+			size_t i = cs_find_chunk(r->m, off);
+			if (r->cfd < 0 || r->chunk != i) {
+				if (r->cfd >= 0)
+					close(r->cfd);
+				cs_chunk_path(&g_chunkstore, r->m->chunks[i].digest, cpath, sizeof(cpath));
+				r->cfd = open_file_fd(cpath);
+				if (r->cfd < 0) {
+					timestamp(MSEC, "[pread_item] %s %s", futil_errstr(r->cfd), cpath);
+					r->cfd = -1;
+					return -1;
+				}
+				r->chunk = i;
+			}
+			fd = r->cfd;
+			off -= r->m->offsets[i];
+			if (n > r->m->chunks[i].len - off)
+				n = r->m->chunks[i].len - off;
+		}
+		ssize_t result = pread(fd, buf + rlen, n, off);
+		if (result < 0 && EINTR == errno)
+			continue;
+		if (result <= 0)
+			return -1;
+		rlen += result;
+	}
+	return rlen;
+}
+
+static void
+close_item_reader(struct item_reader *r)
+{
+	if (r->cfd >= 0)
+		close(r->cfd);
+	if (r->packed)
+		pk_close_reader(&r->pack);
+	if (r->fd >= 0)
+		close(r->fd);
+	if (NULL != r->m)
+		cs_put_manifest(&g_chunkstore, r->m);
+}
+
+/*
+ * Send [offset, offset + len) of a chunked file from its chunks.
+ *
+ * @return - Success: len, Error: enum ERR_SOCKUTIL
+ */
+static int64_t
+send_chunked_file(int sockfd, const struct chunk_manifest *m, int64_t offset, int64_t len)
+{
+	char cpath[FS_PATH_MAX_LEN];
+	int64_t sent = 0;
+	for (size_t i = cs_find_chunk(m, offset); sent < len; i++) {
+		int64_t coff = offset + sent - m->offsets[i];
+		int64_t clen = m->chunks[i].len - coff;
+		if (clen > len - sent)
+			clen = len - sent;
+		cs_chunk_path(&g_chunkstore, m->chunks[i].digest, cpath, sizeof(cpath));
+		int fd = open_file_fd(cpath);
+		if (fd < 0) {
+			timestamp(MSEC, "[send_chunked_file] %s %s", futil_errstr(fd), cpath);
+			return ERR_SOCKUTIL_PARTIAL_DATA;
+		}
+		int64_t result = sendfile_stream(sockfd, fd, coff, clen, NULL);
+		close(fd);
+		if (result < 0)
+			return result;
+		sent += clen;
+	}
+	return sent;
+}
+
+/*
+ * Send [offset, offset + len) of a chunked file in compressed frames. The
+ * blocks are read across the chunks so that the frames are CZ_BLOCK_SIZE.
+ *
+ * @return - Success: len, Error: enum ERR_SOCKUTIL
+ */
+static int64_t
+send_compressed_chunks(int sockfd, struct chunk_manifest *m, int64_t offset, int64_t len,
+		struct cz_encoder *enc)
+{
+	struct item_reader r = { .fd = -1, .m = m, .chunk = 0, .cfd = -1, .packed = 0 };
+	int64_t sent = 0;
+	while (sent < len) {
+		int64_t n = (len - sent < CZ_BLOCK_SIZE) ? len - sent : CZ_BLOCK_SIZE;
+		if (pread_item(&r, t_iobuf, n, offset + sent) < 0) {
+			sent = ERR_SOCKUTIL_READ_FAILED;
+			break;
+		}
+		int64_t result = send_compressed_data(sockfd, t_iobuf, n, enc, t_iobuf + CZ_BLOCK_SIZE, NULL);
+		if (result < 0) {
+			sent = result;
+			break;
+		}
+		sent += n;
+	}
+	if (r.cfd >= 0)
+		close(r.cfd);
+	return sent;
+}
+
+/*
+ * Send [offset, offset + len) of a pack. If the transfer is compressed, the
+ * whole blocks are sent as they are stored without decoding them.
+ *
+ * @return - Success: len, Error: enum ERR_SOCKUTIL
+ */
+static int64_t
+send_packed_file(int sockfd, struct pack_reader *pack, int64_t offset, int64_t len,
+		struct cz_encoder *enc)
+{
+	int64_t bs = pack->h.block_size;
+	int64_t sent = 0;
+	while (sent < len) {
+		int64_t off = offset + sent;
+		int64_t n = (NULL != enc) ? bs - off % bs : SVC_IOBUF_SIZE;
+		if (n > len - sent)
+			n = len - sent;
+		int64_t result = 0;
+		size_t flen = 0;
+		if (NULL != enc && 0 == off % bs && (bs == n || pack->h.flen == off + n)) {
+			const uint8_t *frame = pk_read_frame(pack, off / bs, &flen);
+			if (NULL == frame)
+				return ERR_SOCKUTIL_READ_FAILED;
+			result = send_stream(sockfd, (void *)frame, flen);
+			enc->raw += n;
+			enc->wire += flen;
+		} else if (pk_pread(pack, (uint8_t *)t_iobuf, n, off) < 0) {
+			return ERR_SOCKUTIL_READ_FAILED;
+		} else if (NULL != enc) {
+			result = send_compressed_data(sockfd, t_iobuf, n, enc, t_iobuf + CZ_BLOCK_SIZE, NULL);
+		} else {
+			result = send_stream(sockfd, t_iobuf, n);
+		}
+		if (result < 0)
+			return result;
+		sent += n;
+	}
+	return sent;
+}
+
+static int
+read_packed_file(void *pack, char *buf, int64_t len)
+{
+	return (pk_pread((struct pack_reader *)pack, (uint8_t *)buf, len, 0) < 0) ? -1 : 0;
+}
+
+/*
+ * A delta upload replaces the file of an available item before it updates
+ * flen, so the file opened may be of another version than the item copied.
+ * Nothing is sent then, and the caller copies the item again.
+ *
+ * @param fid - The item of req->fname referenced by the caller. -1 if none.
+ * @param item - Copy of the item taken with the reference.
+ * @param last - Refuse with RESP_MODIFYING instead of DOWNLOAD_STALE.
+ * @return - 0, -1 if the connection failed, or DOWNLOAD_STALE.
+ */
+static int
+download_item(int sockfd, struct svc_req *req, int fid, const struct inven_item *item, int last)
+{
+	struct svc_resp resp;
+	char fpath[IP_ADDRESS_LEN + FILE_NAME_LEN];
+	int64_t flen = 0;
+	int64_t offset = strtoll(req->offset, NULL, 10);
+	int64_t dlen = 0;
+	char clip[IP_ADDRESS_LEN];
+	int alv = -1;
+	int result = 0;
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_DOWNLOAD);
+
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+
+	// Check if the file is deleted.
+	if (fid < 0) {
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_DELETED);
+		goto refuse_svc;
+	}
+
+	alv = atoi(item->alv);
+	flen = strtoll(item->flen, NULL, 10);
+
+	// The file is being uploaded.
+	if (ITEM_STAT_AVAILABLE != atoi(item->status)) {
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_MODIFYING);
+		goto refuse_svc;
+	}
+
+	// Check access level.
+	if ((alv == PRIVATE_ACCESS) && (strcmp(clip, item->creator))) {
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_ACCESS_DENIED);
+		goto refuse_svc;
+	}
+
+	// Byte range. A range beyond the end of the file is truncated.
+	if (offset < 0 || offset > flen) {
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_INVALID_OFFSET);
+		goto refuse_svc;
+	}
+	dlen = flen - offset;
+	if ('\0' != req->flen[0] && strtoll(req->flen, NULL, 10) < dlen)
+		dlen = strtoll(req->flen, NULL, 10);
+	if (dlen < 0) {
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_INVALID_OFFSET);
+		goto refuse_svc;
+	}
+	snprintf(resp.offset, REQ_FLEN_LEN, "%ld", offset);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%ld", flen);
+	struct cz_encoder *enc = NULL;
+	if (COMPRESS_NONE != req_compression(req, &resp) && NULL == (enc = get_encoder(atoi(req->compress))))
+		snprintf(resp.compress, REQ_COMPRESS_LEN, "%d", COMPRESS_NONE);
+	int64_t zraw = (NULL != enc) ? enc->raw : 0;
+	int64_t zwire = (NULL != enc) ? enc->wire : 0;
+
+	// Chunked files are reassembled from the chunk store.
+	struct chunk_manifest *m = g_chunking ? cs_get_manifest(&g_chunkstore, &g_manifests[fid]) : NULL;
+	if (NULL != m && m->flen != flen) {
+		cs_put_manifest(&g_chunkstore, m);
+		goto stale;
+	}
+	if (NULL != m) {
+		size_t nchunks = m->nchunks;
+		snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_OK);
+		int64_t slen = send_stream(sockfd, &resp, sizeof(struct svc_resp));
+		if (slen >= 0 && NULL != enc)
+			slen = send_compressed_chunks(sockfd, m, offset, dlen, enc);
+		else if (slen >= 0)
+			slen = send_chunked_file(sockfd, m, offset, dlen);
+		cs_put_manifest(&g_chunkstore, m);
+		if (slen < 0) {
+			timestamp(MSEC, "[server_download_service] [client (%d)] %s", sockfd, sockutil_errstr(slen));
+			return -1;
+		}
+		timestamp(MSEC, "[server_download_service] [client (%d)] File sended. (%zu chunks)", 
+				sockfd, nchunks);
+		return 0;
+	}
+
+	// Small files are served from memory without touching the filesystem.
+	// Concurrent downloads missing the cache share a single read of the file.
+	int64_t clen = 0;
+	int cslot = -1;
+	const char *data = cc_get(&g_contcache, fid, flen, &clen, &cslot);
+	if (NULL != data && clen != flen) {
+		cc_put(&g_contcache, cslot);
+		goto stale;
+	}
+
+	// Uploads are published complete and never modified in place, so the open
+	// file is consistent even if it is replaced or deleted meanwhile. The fd
+	// is shared with other downloads of the file and read at explicit offsets.
+	// Packs are decoded on the fly, and cached decoded.
+	int slot = -1;
+	int fd = -1;
+	struct pack_reader pack;
+	int packed = 0;
+	if (NULL == data) {
+		snprintf(fpath, IP_ADDRESS_LEN + FILE_NAME_LEN, "%s/%s",
+				item->creator, req->fname);
+		fd = fdc_get(&g_fdcache, fid, fpath, &slot);
+		if (fd >= 0 && (packed = pk_open_reader(&pack, fd)) < 0) {
+			timestamp(MSEC, "[server_download_service] [client (%d)] %s", sockfd, pk_errstr(packed));
+			fdc_put(&g_fdcache, slot, fd);
+			fd = -1;
+		}
+		if (fd < 0) {
+			cc_put(&g_contcache, cslot);
+			timestamp(MSEC, "[server_download_service] [client (%d)] [Miss (%s)]", sockfd, fpath);
+			snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_NO_SUCH_FILE);
+			goto refuse_svc;
+		}
+		struct stat st;
+		int64_t srclen = packed ? pack.h.flen : (fstat(fd, &st) < 0 ? -1 : st.st_size);
+		if (srclen != flen) {
+			if (packed)
+				pk_close_reader(&pack);
+			fdc_put(&g_fdcache, slot, fd);
+			cc_put(&g_contcache, cslot);
+			goto stale;
+		}
+		// Load the file for the downloads waiting for it. Send it from the
+		// disk if this fails.
+		if (cslot >= 0) {
+			if (packed)
+				data = cc_fill_with(&g_contcache, cslot, read_packed_file, &pack);
+			else
+				data = cc_fill(&g_contcache, cslot, fd);
+			if (NULL == data) {
+				cc_put(&g_contcache, cslot);
+				cslot = -1;
+			} else {
+				if (packed)
+					pk_close_reader(&pack);
+				packed = 0;
+				fdc_put(&g_fdcache, slot, fd);
+				fd = -1;
+			}
+		}
+	}
+	// Send OK response.
+	unsigned long hits = 0, misses = 0;
+	unsigned long chits = 0, cmisses = 0, cshared = 0;
+	int64_t cused = 0;
+	fdc_stat(&g_fdcache, &hits, &misses);
+	cc_stat(&g_contcache, &chits, &cmisses, &cshared, &cused);
+	timestamp(MSEC, "[server_download_service] [client (%d)] OK (fd cache hit %lu, miss %lu) "
+			"(content cache hit %lu, miss %lu, shared %lu, %ldB)",
+			sockfd, hits, misses, chits, cmisses, cshared, cused);
+	snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_OK);
+	result = send_stream(sockfd, &resp, sizeof(struct svc_resp));
+	// Send the file.
+	int64_t slen = result;
+	if (result >= 0 && NULL != data && NULL != enc)
+		slen = send_compressed_data(sockfd, data + offset, dlen, enc, t_iobuf, NULL);
+	else if (result >= 0 && NULL != data)
+		slen = send_stream(sockfd, (void *)(data + offset), dlen);
+	else if (result >= 0 && packed)
+		slen = send_packed_file(sockfd, &pack, offset, dlen, enc);
+	else if (result >= 0 && NULL != enc)
+		slen = send_compressed_stream(sockfd, fd, offset, dlen, enc, t_iobuf, NULL);
+	else if (result >= 0)
+		slen = sendfile_stream(sockfd, fd, offset, dlen, NULL);
+	if (packed)
+		pk_close_reader(&pack);
+	if (NULL != data)
+		cc_put(&g_contcache, cslot);
+	else
+		fdc_put(&g_fdcache, slot, fd);
+	if (slen < 0) {
+		timestamp(MSEC, "[server_download_service] [client (%d)] %s", sockfd, sockutil_errstr(slen));
+		return -1;
+	}
+	if (NULL != enc)
+		timestamp(MSEC, "[server_download_service] [client (%d)] File sended. (compressed %ldB -> %ldB)", 
+				sockfd, enc->raw - zraw, enc->wire - zwire);
+	else
+		timestamp(MSEC, "[server_download_service] [client (%d)] File sended.", sockfd);
+	return 0;
+
+stale:
+	if (!last)
+		return DOWNLOAD_STALE;
+	timestamp(MSEC, "[server_download_service] [client (%d)] The file is being replaced.", sockfd);
+	snprintf(resp.code, RESP_CODE_LEN, "%d", RESP_MODIFYING);
+refuse_svc:
+	if(send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "%s", sockutil_errstr(result));
+		return -1;
+	}
+	return 0;
+}
+
+int 
+server_download_service(int sockfd, struct svc_req *req)
+{
+	timestamp(MSEC, "[server_download_service] [client (%d)] [%s] [%s+%s]",
+			sockfd, req->fname, req->offset, req->flen);
+	struct inven_item item;
+	int result = DOWNLOAD_STALE;
+	for (int i = 1; DOWNLOAD_STALE == result; i++) {
+		int fid = get_item(req->fname, &item);
+		result = download_item(sockfd, req, fid, &item, i == STALE_RETRY);
+		if (fid >= 0)
+			put_item(fid);
+	}
+	return result;
+}
+
+/*
+ * Send [offset, offset + len) of the file as a frame of SVC_DOWNLOAD_FOLLOW.
+ * The data is read from m or pack if it is not NULL, and from fd otherwise.
+ * A frame without data ends the download with code.
+ */
+static int
+send_follow_frame(int sockfd, int fd, const struct chunk_manifest *m, struct pack_reader *pack,
+		int64_t offset, int64_t len, enum RESPONSE_CODE code)
+{
+	struct svc_resp resp;
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_DOWNLOAD_FOLLOW);
+	set_resp_code(&resp, code);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%ld", offset);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%ld", len);
+	int64_t result = send_stream(sockfd, &resp, sizeof(struct svc_resp));
+	if (result >= 0 && len > 0 && NULL != m)
+		result = send_chunked_file(sockfd, m, offset, len);
+	else if (result >= 0 && len > 0 && NULL != pack)
+		result = send_packed_file(sockfd, pack, offset, len, NULL);
+	else if (result >= 0 && len > 0)
+		result = sendfile_stream(sockfd, fd, offset, len, NULL);
+	if (result < 0) {
+		timestamp(MSEC, "[send_follow_frame] [client (%d)] %s", sockfd, sockutil_errstr(result));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Download a file which may be still uploading. The data is sent as soon as
+ * it is on the file, and the download ends when the upload is committed or
+ * rolled back.
+ *
+ * @param fid - The item of req->fname referenced by the caller. -1 if none.
+ * @param item - Copy of the item taken with the reference.
+ */
+static int
+follow_item(int sockfd, struct svc_req *req, int fid, struct inven_item *item)
+{
+	struct svc_resp resp;
+	char clip[IP_ADDRESS_LEN];
+	char fpath[FS_PATH_MAX_LEN];
+	int64_t offset = strtoll(req->offset, NULL, 10);
+	int64_t flen = 0;
+	int fd = -1;
+	int slot = -1;
+	struct chunk_manifest *m = NULL;
+	struct pack_reader pack;
+	int packed = 0;
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_DOWNLOAD_FOLLOW);
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+	timestamp(MSEC, "[server_follow_service] [client (%d)] [%s] [%ld]", sockfd, req->fname, offset);
+
+	if (fid < 0) {
+		set_resp_code(&resp, RESP_DELETED);
+		goto refuse_svc;
+	}
+	if (PRIVATE_ACCESS == atoi(item->alv) && strcmp(clip, item->creator)) {
+		set_resp_code(&resp, RESP_ACCESS_DENIED);
+		goto refuse_svc;
+	}
+
+	// Attach to the upload, or read the file if it is already available.
+	struct upload_frontier *f = &g_frontiers[fid];
+	unsigned long gen = 0;
+	int following = 0;
+	pthread_mutex_lock(&g_frontier_lock);
+	if (FRONTIER_RUNNING == f->state) {
+		following = 1;
+		gen = f->gen;
+		flen = f->flen;
+		fd = dup(f->fd);
+	}
+	pthread_mutex_unlock(&g_frontier_lock);
+	// The upload may have been committed since the item was copied.
+	if (fd < 0) {
+		pthread_rwlock_rdlock(&g_inventory.ilock[fid]);
+		*item = g_inventory.items[fid];
+		pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	}
+	if (fd < 0 && ITEM_STAT_AVAILABLE == atoi(item->status)) {
+		flen = strtoll(item->flen, NULL, 10);
+		snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s", item->creator, req->fname);
+		if (g_chunking)
+			m = cs_get_manifest(&g_chunkstore, &g_manifests[fid]);
+		if (NULL == m)
+			fd = fdc_get(&g_fdcache, fid, fpath, &slot);
+		if (fd >= 0 && (packed = pk_open_reader(&pack, fd)) < 0) {
+			timestamp(MSEC, "[server_follow_service] %s %s", pk_errstr(packed), fpath);
+			fdc_put(&g_fdcache, slot, fd);
+			fd = -1;
+			packed = 0;
+		}
+		if (NULL == m && fd < 0) {
+			set_resp_code(&resp, RESP_NO_SUCH_FILE);
+			goto refuse_svc;
+		}
+	} else if (fd < 0) {
+		set_resp_code(&resp, RESP_MODIFYING);
+		goto refuse_svc;
+	}
+	if (offset < 0 || offset > flen) {
+		set_resp_code(&resp, RESP_INVALID_OFFSET);
+		goto close_file;
+	}
+
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%ld", offset);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%ld", flen);
+	if (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "[server_follow_service] [send]");
+		goto failed;
+	}
+
+	// An available file is sent at once.
+	if (!following) {
+		if (send_follow_frame(sockfd, fd, m, packed ? &pack : NULL, offset, flen - offset, RESP_OK) < 0)
+			goto failed;
+		if (NULL != m)
+			cs_put_manifest(&g_chunkstore, m);
+		else
+			fdc_put(&g_fdcache, slot, fd);
+		if (packed)
+			pk_close_reader(&pack);
+		return send_follow_frame(sockfd, -1, NULL, NULL, flen, 0, RESP_OK);
+	}
+
+	// Follow the frontier until the upload ends.
+	enum RESPONSE_CODE code = RESP_OK;
+	int64_t sent = offset;
+	pthread_mutex_lock(&g_frontier_lock);
+	while (1) {
+		while (f->gen == gen && FRONTIER_RUNNING == f->state && f->frontier <= sent)
+			pthread_cond_wait(&f->cond, &g_frontier_lock);
+		if (f->gen != gen || FRONTIER_ABORTED == f->state) {
+			code = RESP_DELETED;
+			break;
+		}
+		int64_t frontier = (FRONTIER_COMMITTED == f->state) ? flen : f->frontier;
+		if (sent >= flen && FRONTIER_COMMITTED == f->state)
+			break;
+		pthread_mutex_unlock(&g_frontier_lock);
+		if (send_follow_frame(sockfd, fd, NULL, NULL, sent, frontier - sent, RESP_OK) < 0)
+			goto failed;
+		sent = frontier;
+		pthread_mutex_lock(&g_frontier_lock);
+	}
+	pthread_mutex_unlock(&g_frontier_lock);
+	close(fd);
+
+	timestamp(MSEC, "[server_follow_service] [client (%d)] [%s] %s (%ld/%ld)", sockfd, req->fname,
+			(RESP_OK == code) ? "committed" : "rolled back", sent, flen);
+	return send_follow_frame(sockfd, -1, NULL, NULL, sent, 0, code);
+
+close_file:
+	if (following)
+		close(fd);
+	else if (NULL != m)
+		cs_put_manifest(&g_chunkstore, m);
+	else
+		fdc_put(&g_fdcache, slot, fd);
+	if (packed)
+		pk_close_reader(&pack);
+refuse_svc:
+	if (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "[server_follow_service] [send]");
+		return -1;
+	}
+	return 0;
+
+failed:
+	if (following)
+		close(fd);
+	else if (NULL != m)
+		cs_put_manifest(&g_chunkstore, m);
+	else
+		fdc_put(&g_fdcache, slot, fd);
+	if (packed)
+		pk_close_reader(&pack);
+	return -1;
+}
+
+int
+server_follow_service(int sockfd, struct svc_req *req)
+{
+	struct inven_item item;
+	int fid = get_item(req->fname, &item);
+	int result = follow_item(sockfd, req, fid, &item);
+	if (fid >= 0)
+		put_item(fid);
+	return result;
+}
+
+/*
+ * Only the creator can see a PRIVATE_ACCESS item.
+ */
+static int
+item_visible(const struct inven_item *item, const char *clip)
+{
+	return PRIVATE_ACCESS != atoi(item->alv) || 0 == strncmp(clip, item->creator, IP_ADDRESS_LEN);
+}
+
+static void
+free_snapshot(struct inven_snapshot *snap)
+{
+	if (NULL != snap->data)
+		munmap(snap->data, snap->cap);
+	if (snap->fd >= 0)
+		close(snap->fd);
+	free(snap->privates);
+	free(snap);
+}
+
+static void
+put_snapshot(struct inven_snapshot *snap)
+{
+	pthread_mutex_lock(&g_snapshot_lock);
+	int refs = --snap->refs;
+	pthread_mutex_unlock(&g_snapshot_lock);
+	if (0 == refs)
+		free_snapshot(snap);
+}
+
+/*
+ * Map room for nitems items in the memfd of the snapshot. The previous
+ * mapping is dropped.
+ */
+static int
+map_snapshot(struct inven_snapshot *snap, size_t nitems)
+{
+	size_t len = (nitems > 0 ? nitems : 1) * sizeof(struct inven_item);
+	if (NULL != snap->data)
+		munmap(snap->data, snap->cap);
+	snap->data = NULL;
+	snap->cap = 0;
+	if (ftruncate(snap->fd, len) < 0)
+		return -1;
+	void *data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, snap->fd, 0);
+	if (MAP_FAILED == data)
+		return -1;
+	snap->data = (struct inven_item *)data;
+	snap->cap = len;
+	return 0;
+}
+
+/*
+ * Copy the live items into a memfd in the list order, so the size follows
+ * the number of the items rather than the capacity. Each item is copied
+ * under its ilock.
+ *
+ * @return - Snapshot(refs 0), NULL on failure.
+ */
+static struct inven_snapshot *
+build_snapshot(uint64_t version)
+{
+	size_t cap = 0;
+	size_t n = 0;
+	struct inven_snapshot *snap = (struct inven_snapshot *) calloc(1, sizeof(struct inven_snapshot));
+	if (NULL == snap)
+		return NULL;
+	snap->version = version;
+	snap->fd = memfd_create("inventory", MFD_CLOEXEC);
+	if (snap->fd < 0)
+		goto error;
+
+	pthread_mutex_lock(&g_inventory.llock);
+	// Map outside the lock until the live items fit.
+	while (g_inventory.nlive * sizeof(struct inven_item) > snap->cap) {
+		size_t nlive = g_inventory.nlive;
+		pthread_mutex_unlock(&g_inventory.llock);
+		if (map_snapshot(snap, nlive + nlive / 8) < 0)
+			goto error;
+		pthread_mutex_lock(&g_inventory.llock);
+	}
+	for (int fid = g_inventory.head; fid >= 0; fid = g_inventory.next[fid]) {
+		struct inven_item *item = &snap->data[n];
+		pthread_rwlock_rdlock(&g_inventory.ilock[fid]);
+		*item = g_inventory.items[fid];
+		pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+		if (PRIVATE_ACCESS != atoi(item->alv)) {
+			n++;
+			continue;
+		}
+		if (snap->nprivate == cap) {
+			cap = (0 == cap) ? 64 : cap * 2;
+			struct snapshot_private *p = (struct snapshot_private *) realloc(snap->privates, 
+					cap * sizeof(struct snapshot_private));
+			if (NULL == p) {
+				pthread_mutex_unlock(&g_inventory.llock);
+				goto error;
+			}
+			snap->privates = p;
+		}
+		snap->privates[snap->nprivate].pos = n;
+		snap->privates[snap->nprivate++].item = *item;
+	}
+	pthread_mutex_unlock(&g_inventory.llock);
+	snap->len = n * sizeof(struct inven_item);
+	return snap;
+
+error:
+	free_snapshot(snap);
+	return NULL;
+}
+
+/*
+ * The snapshot of the current version. It is rebuilt after the inventory
+ * changes, and the concurrent inquiries wait for one build.
+ *
+ * @return - Snapshot(put_snapshot() by the caller), NULL on failure.
+ */
+static struct inven_snapshot *
+get_snapshot(void)
+{
+	pthread_mutex_lock(&g_inventory.llock);
+	uint64_t version = g_inventory.changes.version;
+	pthread_mutex_unlock(&g_inventory.llock);
+
+	pthread_mutex_lock(&g_snapshot_lock);
+	if (NULL == g_snapshot || g_snapshot->version != version) {
+		struct inven_snapshot *snap = build_snapshot(version);
+		if (NULL == snap) {
+			pthread_mutex_unlock(&g_snapshot_lock);
+			return NULL;
+		}
+		timestamp(MSEC, "[get_snapshot] Built version %llu (%zuB, %zu private items)", 
+				(unsigned long long)version, snap->len, snap->nprivate);
+		snap->refs = 1;
+		if (NULL != g_snapshot && 0 == --g_snapshot->refs)
+			free_snapshot(g_snapshot);
+		g_snapshot = snap;
+	}
+	struct inven_snapshot *snap = g_snapshot;
+	snap->refs++;
+	pthread_mutex_unlock(&g_snapshot_lock);
+	return snap;
+}
+
+/*
+ * Bytes of the snapshot for clip, with its private items.
+ */
+static size_t
+snapshot_len(const struct inven_snapshot *snap, const char *clip)
+{
+	size_t len = snap->len;
+	for (size_t i = 0; i < snap->nprivate; i++)
+		if (0 == strncmp(clip, snap->privates[i].item.creator, IP_ADDRESS_LEN))
+			len += sizeof(struct inven_item);
+	return len;
+}
+
+/*
+ * Send the snapshot with the private items of clip put back. The parts
+ * between them are sent with sendfile(2), or compressed from the mapping.
+ */
+static int64_t
+send_snapshot(int sockfd, struct inven_snapshot *snap, const char *clip, struct cz_encoder *enc)
+{
+	const size_t isize = sizeof(struct inven_item);
+	// The items are copied behind the frame buffer of the compression.
+	struct inven_item *items = (struct inven_item *)(t_iobuf + CZ_FRAME_MAX);
+	size_t step = (SVC_IOBUF_SIZE - CZ_FRAME_MAX) / isize;
+	size_t nitems = snap->len / isize;
+	size_t next = 0;
+	size_t n = 0;
+	int64_t slen = 0;
+
+	if (NULL == enc) {
+		size_t off = 0;
+		for (size_t i = 0; i < snap->nprivate && slen >= 0; i++) {
+			struct snapshot_private *p = &snap->privates[i];
+			if (strncmp(clip, p->item.creator, IP_ADDRESS_LEN))
+				continue;
+			if (p->pos * isize > off)
+				slen = sendfile_stream(sockfd, snap->fd, off, p->pos * isize - off, NULL);
+			if (slen >= 0)
+				slen = send_stream(sockfd, &p->item, isize);
+			off = p->pos * isize;
+		}
+		if (slen >= 0 && off < snap->len)
+			slen = sendfile_stream(sockfd, snap->fd, off, snap->len - off, NULL);
+		return slen;
+	}
+
+	for (size_t i = 0; slen >= 0; ) {
+		while (next < snap->nprivate && strncmp(clip, snap->privates[next].item.creator, IP_ADDRESS_LEN))
+			next++;
+		int more = i < nitems || next < snap->nprivate;
+		if (n == step || (!more && n > 0)) {
+			slen = send_compressed_data(sockfd, items, n * isize, enc, t_iobuf, NULL);
+			n = 0;
+		}
+		if (!more)
+			break;
+		if (next < snap->nprivate && snap->privates[next].pos == i)
+			items[n++] = snap->privates[next++].item;
+		else
+			items[n++] = snap->data[i++];
+	}
+	return slen;
+}
+
+int 
+server_inquiry_service(int sockfd, struct svc_req *req)
+{
+	struct svc_resp resp;
+	char clip[IP_ADDRESS_LEN];
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+
+	struct inven_snapshot *snap = get_snapshot();
+	if (NULL == snap) {
+		timestamp(MSEC, "[server_inquiry_service] Failed to build the snapshot.");
+		return -1;
+	}
+	size_t dlen = snapshot_len(snap, clip);
 
 	// Send data size.
+	memset(&resp, 0x00, sizeof(struct svc_resp));
 	set_resp_type(&resp, SVC_INQUIRY);
-	snprintf(resp.code, RESP_CODE_LEN, "%d", dlen);
+	snprintf(resp.code, RESP_CODE_LEN, "%zu", dlen);
+	struct cz_encoder *enc = NULL;
+	if (COMPRESS_NONE != req_compression(req, &resp) && NULL == (enc = get_encoder(atoi(req->compress))))
+		snprintf(resp.compress, REQ_COMPRESS_LEN, "%d", COMPRESS_NONE);
 	if (send(sockfd, &resp, sizeof(struct svc_resp), 0) < 0) {
 		timestamp(MSEC, "[server_upload_service] [send]");
+		put_snapshot(snap);
+		return -1;
+	}
+
+	int64_t slen = send_snapshot(sockfd, snap, clip, enc);
+	unsigned long long version = snap->version;
+	put_snapshot(snap);
+	if (slen < 0) {
+		timestamp(MSEC, "[server_inquiry_service] %s", sockutil_errstr(slen));
+		return -1;
+	}
+
+	timestamp(MSEC, "[server_inquiry_service] Successed(%zuB, version %llu).", dlen, version);
+
+	return 0;
+}
+
+/*
+ * Receive the filter of the request if it has one.
+ *
+ * @return - Filter: 1, No filter: 0, Fail: -1
+ */
+static int
+recv_item_filter(int sockfd, struct svc_req *req, struct item_filter *f)
+{
+	struct list_filter lf;
+	if (1 != atoi(req->filter))
+		return 0;
+	if (recv(sockfd, &lf, sizeof(struct list_filter), MSG_WAITALL) != sizeof(struct list_filter))
+		return -1;
+
+	memset(f, 0x00, sizeof(struct item_filter));
+	strncpy(f->creator, lf.creator, IP_ADDRESS_LEN);
+	strncpy(f->pattern, lf.pattern, FILE_NAME_LEN);
+	strncpy(f->after, lf.modified_after, TIMESTAMP_LEN);
+	strncpy(f->before, lf.modified_before, TIMESTAMP_LEN);
+	f->min_flen = ('\0' != lf.min_flen[0]) ? strtoll(lf.min_flen, NULL, 10) : 0;
+	f->max_flen = ('\0' != lf.max_flen[0]) ? strtoll(lf.max_flen, NULL, 10) : INT64_MAX;
+	f->status = ('\0' != lf.status[0]) ? atoi(lf.status) : -1;
+	return 1;
+}
+
+/*
+ * The timestamps of the same format are compared as strings.
+ */
+static int
+match_filter(const struct inven_item *item, const struct item_filter *f)
+{
+	char fname[FILE_NAME_LEN + 1] = {0};
+	if (NULL == f)
+		return 1;
+	if ('\0' != f->creator[0] && strncmp(f->creator, item->creator, IP_ADDRESS_LEN))
+		return 0;
+	if (-1 != f->status && f->status != atoi(item->status))
+		return 0;
+	int64_t flen = strtoll(item->flen, NULL, 10);
+	if (flen < f->min_flen || flen > f->max_flen)
+		return 0;
+	if ('\0' != f->after[0] && strncmp(item->last_modified, f->after, TIMESTAMP_LEN) < 0)
+		return 0;
+	if ('\0' != f->before[0] && strncmp(item->last_modified, f->before, TIMESTAMP_LEN) > 0)
+		return 0;
+	strncpy(fname, item->fname, FILE_NAME_LEN);
+	return '\0' == f->pattern[0] || 0 == fnmatch(f->pattern, fname, 0);
+}
+
+/*
+ * The first live item after the cursor. A cursor is the serial and the fid
+ * of the last item of a page. If the item is gone, the list is searched for
+ * the first later serial.
+ *
+ * @return - fid, -1 if none, -2 if the cursor is invalid.
+ */
+static int
+find_list_start(const char *cursor)
+{
+	unsigned long long serial = 0;
+	int fid = -1;
+	if ('\0' == cursor[0])
+		return g_inventory.head;
+	if (2 != sscanf(cursor, "%llx.%d", &serial, &fid) || fid < 0 || (size_t)fid >= g_inventory.capacity)
+		return -2;
+	if (g_inventory.serial[fid] == serial)
+		return g_inventory.next[fid];
+	int i = g_inventory.head;
+	while (i >= 0 && g_inventory.serial[i] <= serial)
+		i = g_inventory.next[i];
+	return i;
+}
+
+/*
+ * Send a page of the live items. The cost is in proportion to the items
+ * sent, not to the capacity of the inventory.
+ */
+int
+server_list_service(int sockfd, struct svc_req *req)
+{
+	struct svc_resp resp;
+	char cursor[LIST_CURSOR_LEN];
+	char clip[IP_ADDRESS_LEN];
+	struct item_filter filter;
+	size_t limit = strtoul(req->flen, NULL, 10);
+	size_t n = 0;
+	size_t scanned = 0;
+	// The page is built behind the frame buffer of the compression.
+	struct inven_item *page = (struct inven_item *)(t_iobuf + CZ_FRAME_MAX);
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_LIST);
+	if (0 == limit || limit > LIST_PAGE_MAX)
+		limit = LIST_PAGE_MAX;
+	snprintf(cursor, LIST_CURSOR_LEN, "%s", req->cursor);
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+	int filtered = recv_item_filter(sockfd, req, &filter);
+	if (filtered < 0) {
+		timestamp(MSEC, "[server_list_service] [client (%d)] Failed to receive the filter.", sockfd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&g_inventory.llock);
+	// Changes after this version are not in the page yet.
+	snprintf(resp.offset, REQ_FLEN_LEN, "%llu", (unsigned long long)g_inventory.changes.version);
+	int fid = find_list_start(cursor);
+	if (-2 == fid) {
+		pthread_mutex_unlock(&g_inventory.llock);
+		set_resp_code(&resp, RESP_INVALID_OFFSET);
+		return (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) ? -1 : 0;
+	}
+	// The page ends early after LIST_SCAN_MAX items, so that a narrow filter
+	// doesn't hold the lock for the whole list.
+	int last = -1;
+	for (; fid >= 0 && n < limit && scanned < LIST_SCAN_MAX; fid = g_inventory.next[fid], scanned++) {
+		struct inven_item *item = &g_inventory.items[fid];
+		int status = atoi(item->status);
+		last = fid;
+		if (ITEM_STAT_AVAILABLE != status && ITEM_STAT_MODIFYING != status)
+			continue;
+		if (!item_visible(item, clip) || !match_filter(item, filtered ? &filter : NULL))
+			continue;
+		page[n++] = *item;
+	}
+	if (fid >= 0 && last >= 0)
+		snprintf(resp.cursor, LIST_CURSOR_LEN, "%llx.%d", 
+				(unsigned long long)g_inventory.serial[last], last);
+	pthread_mutex_unlock(&g_inventory.llock);
+
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%zu", n);
+	struct cz_encoder *enc = NULL;
+	if (COMPRESS_NONE != req_compression(req, &resp) && NULL == (enc = get_encoder(atoi(req->compress))))
+		snprintf(resp.compress, REQ_COMPRESS_LEN, "%d", COMPRESS_NONE);
+	int64_t slen = send_stream(sockfd, &resp, sizeof(struct svc_resp));
+	int64_t dlen = n * sizeof(struct inven_item);
+	if (slen >= 0 && dlen > 0)
+		slen = (NULL != enc)
+			? send_compressed_data(sockfd, page, dlen, enc, t_iobuf, NULL)
+			: send_stream(sockfd, page, dlen);
+	if (slen < 0) {
+		timestamp(MSEC, "[server_list_service] [client (%d)] %s", sockfd, sockutil_errstr(slen));
+		return -1;
+	}
+	timestamp(MSEC, "[server_list_service] [client (%d)] %zu of %zu items after [%s]", 
+			sockfd, n, scanned, cursor);
+	return 0;
+}
+
+/*
+ * Copy at most limit changes after *version into page, and advance *version
+ * past them. The changes of the items out of the filter are copied as
+ * removals, since the client may have them from before the change. Called
+ * with llock.
+ *
+ * @return - Number of the changes copied.
+ */
+static size_t
+copy_changes(uint64_t *version, const char *clip, const struct item_filter *f, 
+		struct inven_change *page, size_t limit)
+{
+	size_t n = 0;
+	for (; n < limit && *version < g_inventory.changes.version; (*version)++) {
+		struct inven_change *c = (struct inven_change *)change_at(&g_inventory.changes, *version + 1);
+		if (!item_visible(&c->item, clip))
+			continue;
+		page[n] = *c;
+		if (CHANGE_REMOVE != atoi(c->type) && !match_filter(&c->item, f))
+			snprintf(page[n].type, sizeof(page[n].type), "%d", CHANGE_REMOVE);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Send the changes after the version of the client.
+ */
+int
+server_changes_service(int sockfd, struct svc_req *req)
+{
+	struct svc_resp resp;
+	char clip[IP_ADDRESS_LEN];
+	struct item_filter filter;
+	unsigned long long from = strtoull(req->offset, NULL, 10);
+	uint64_t to = from;
+	size_t limit = strtoul(req->flen, NULL, 10);
+	struct inven_change *page = (struct inven_change *)(t_iobuf + CZ_FRAME_MAX);
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_CHANGES);
+	if (0 == limit || limit > CHANGE_PAGE_MAX)
+		limit = CHANGE_PAGE_MAX;
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+	int filtered = recv_item_filter(sockfd, req, &filter);
+	if (filtered < 0) {
+		timestamp(MSEC, "[server_changes_service] [client (%d)] Failed to receive the filter.", sockfd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&g_inventory.llock);
+	if (change_log_expired(&g_inventory.changes, from)) {
+		pthread_mutex_unlock(&g_inventory.llock);
+		timestamp(MSEC, "[server_changes_service] [client (%d)] version %llu expired", sockfd, from);
+		set_resp_code(&resp, RESP_VERSION_EXPIRED);
+		return (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) ? -1 : 0;
+	}
+	size_t n = copy_changes(&to, clip, filtered ? &filter : NULL, page, limit);
+	pthread_mutex_unlock(&g_inventory.llock);
+
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%zu", n);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%llu", (unsigned long long)to);
+	struct cz_encoder *enc = NULL;
+	if (COMPRESS_NONE != req_compression(req, &resp) && NULL == (enc = get_encoder(atoi(req->compress))))
+		snprintf(resp.compress, REQ_COMPRESS_LEN, "%d", COMPRESS_NONE);
+	int64_t slen = send_stream(sockfd, &resp, sizeof(struct svc_resp));
+	int64_t dlen = n * sizeof(struct inven_change);
+	if (slen >= 0 && dlen > 0)
+		slen = (NULL != enc)
+			? send_compressed_data(sockfd, page, dlen, enc, t_iobuf, NULL)
+			: send_stream(sockfd, page, dlen);
+	if (slen < 0) {
+		timestamp(MSEC, "[server_changes_service] [client (%d)] %s", sockfd, sockutil_errstr(slen));
 		return -1;
 	}
+	timestamp(MSEC, "[server_changes_service] [client (%d)] %zu changes after %llu", sockfd, n, from);
+	return 0;
+}
 
-	if(send_stream(sockfd, g_inventory.items, dlen) < 0) {
-		timestamp(MSEC, sockutil_errstr(result), result, dlen);
+/*
+ * @return - eventfd readable after the changes, -1 on failure.
+ */
+int
+init_service_subscriptions(void)
+{
+	g_change_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return g_change_efd;
+}
+
+void
+close_subscriber(struct subscriber *sub)
+{
+	__atomic_sub_fetch(&g_nsubscribers, 1, __ATOMIC_RELAXED);
+	free(sub->buf);
+	free(sub);
+}
+
+/*
+ * Check the subscription and answer it. The connection is handed to the
+ * event loop, which sends the changes with pump_subscriber().
+ *
+ * @param psub - The subscriber will be set if the client subscribed.
+ */
+int
+server_subscribe_service(int sockfd, struct svc_req *req, struct subscriber **psub)
+{
+	struct svc_resp resp;
+	unsigned long long from = strtoull(req->offset, NULL, 10);
+
+	*psub = NULL;
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_SUBSCRIBE);
+	struct subscriber *sub = (struct subscriber *) calloc(1, sizeof(struct subscriber));
+	if (NULL == sub)
+		return -1;
+	__atomic_add_fetch(&g_nsubscribers, 1, __ATOMIC_RELAXED);
+	sub->sockfd = sockfd;
+	get_client_ipaddr(sockfd, sub->clip, IP_ADDRESS_LEN);
+	sub->filtered = recv_item_filter(sockfd, req, &sub->filter);
+	sub->buf = (char *) malloc(SUBSCRIBER_BUF_SIZE);
+	if (sub->filtered < 0 || NULL == sub->buf) {
+		close_subscriber(sub);
 		return -1;
 	}
+	if (__atomic_load_n(&g_nsubscribers, __ATOMIC_RELAXED) > MAX_SUBSCRIBERS) {
+		set_resp_code(&resp, RESP_TOO_MANY_SUBSCRIBERS);
+		goto refuse;
+	}
 
-	timestamp(MSEC, "[server_inquiry_service] Successed(%lluB).", dlen);
+	pthread_mutex_lock(&g_inventory.llock);
+	if (0 == from)
+		from = g_inventory.changes.version;
+	int expired = change_log_expired(&g_inventory.changes, from);
+	pthread_mutex_unlock(&g_inventory.llock);
+	if (expired) {
+		set_resp_code(&resp, RESP_VERSION_EXPIRED);
+		goto refuse;
+	}
+	sub->version = from;
+	// The kernel must not queue more than a frame either.
+	int sndbuf = SUBSCRIBER_BUF_SIZE;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
 
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%llu", from);
+	if (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		close_subscriber(sub);
+		return -1;
+	}
+	timestamp(MSEC, "[server_subscribe_service] [client (%d)] Subscribed after %llu", sockfd, from);
+	*psub = sub;
 	return 0;
+
+refuse:
+	timestamp(MSEC, "[server_subscribe_service] [client (%d)] [refuse] %s", sockfd, resp.code);
+	close_subscriber(sub);
+	return (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) ? -1 : 0;
+}
+
+/*
+ * Send the pending changes without blocking. A frame is taken from the
+ * change log only after the previous one is sent.
+ *
+ * @return - enum SUBSCRIBER_STATE, -1 if the connection is over.
+ */
+int
+pump_subscriber(struct subscriber *sub)
+{
+	struct svc_resp *resp = (struct svc_resp *)sub->buf;
+	struct inven_change *page = (struct inven_change *)(sub->buf + sizeof(struct svc_resp));
+	size_t limit = (SUBSCRIBER_BUF_SIZE - sizeof(struct svc_resp)) / sizeof(struct inven_change);
+
+	while (1) {
+		while (sub->len > 0) {
+			ssize_t n = send(sub->sockfd, sub->buf + sub->head, sub->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0 && EINTR == errno)
+				continue;
+			if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+				return SUBSCRIBER_BLOCKED;
+			if (n <= 0)
+				return -1;
+			sub->head += n;
+			sub->len -= n;
+		}
+		if (sub->expired)
+			return -1;
+
+		memset(resp, 0x00, sizeof(struct svc_resp));
+		set_resp_type(resp, SVC_SUBSCRIBE);
+		sub->head = 0;
+		pthread_mutex_lock(&g_inventory.llock);
+		if (sub->version == g_inventory.changes.version) {
+			pthread_mutex_unlock(&g_inventory.llock);
+			return SUBSCRIBER_IDLE;
+		}
+		if (change_log_expired(&g_inventory.changes, sub->version)) {
+			pthread_mutex_unlock(&g_inventory.llock);
+			timestamp(MSEC, "[pump_subscriber] [client (%d)] Too slow. Version %llu expired", 
+					sub->sockfd, (unsigned long long)sub->version);
+			set_resp_code(resp, RESP_VERSION_EXPIRED);
+			sub->len = sizeof(struct svc_resp);
+			sub->expired = 1;
+			continue;
+		}
+		size_t n = copy_changes(&sub->version, sub->clip, sub->filtered ? &sub->filter : NULL, page, limit);
+		pthread_mutex_unlock(&g_inventory.llock);
+		if (0 == n)
+			continue;
+		// The field holds 19 digits. The subscriber starts over past them.
+		if (snprintf(resp->offset, REQ_FLEN_LEN, "%llu", (unsigned long long)sub->version) >= REQ_FLEN_LEN) {
+			memset(resp->offset, 0x00, REQ_FLEN_LEN);
+			set_resp_code(resp, RESP_VERSION_EXPIRED);
+			sub->len = sizeof(struct svc_resp);
+			sub->expired = 1;
+			continue;
+		}
+		set_resp_code(resp, RESP_OK);
+		snprintf(resp->flen, REQ_FLEN_LEN, "%u", (unsigned)n);	// n <= limit
+		sub->len = sizeof(struct svc_resp) + n * sizeof(struct inven_change);
+	}
+}
+
+/*
+ * Take the available item of fname for a rename, delete or delta upload.
+ * Only the creator may modify an item, and only one writer at a time.
+ * A rename or delete takes the item out of service. It stays
+ * ITEM_STAT_MODIFYING until the caller changes its status. A delta upload
+ * leaves the item available to the readers until release_writer().
+ *
+ * @param writer - 1 for a delta upload.
+ * @param pfid - The fid(stored in nametb) will be set.
+ * @return - RESP_OK or the reason of the refusal.
+ */
+static enum RESPONSE_CODE
+acquire_item(const char *fname, const char *clip, int writer, int **pfid)
+{
+	int fid = -1;
+	if (find_copy(g_inventory.nametb, fname, &fid, sizeof(int)) < 0 || fid < 0)
+		return RESP_NO_SUCH_FILE;
+
+	enum RESPONSE_CODE code = RESP_OK;
+	struct inven_item *item = &g_inventory.items[fid];
+	pthread_rwlock_wrlock(&g_inventory.ilock[fid]);
+	// fid may be deleted or reused for another name since it was copied.
+	if (ITEM_STAT_DELETED == atoi(item->status) || strncmp(item->fname, fname, sizeof(item->fname)))
+		code = RESP_NO_SUCH_FILE;
+	else if (ITEM_STAT_AVAILABLE != atoi(item->status) || g_inventory.writing[fid])
+		code = RESP_MODIFYING;
+	else if (strcmp(clip, item->creator))
+		code = RESP_ACCESS_DENIED;
+	else if (writer)
+		g_inventory.writing[fid] = 1;
+	else
+		snprintf(item->status, sizeof(item->status), "%d", ITEM_STAT_MODIFYING);
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	if (RESP_OK != code)
+		return code;
+	if (!writer)
+		record_change(fid, CHANGE_MODIFY, NULL);
+
+	// Nobody else frees the name while the item is acquired.
+	*pfid = (int *) find(g_inventory.nametb, fname);
+	return RESP_OK;
+}
+
+/*
+ * Let the other writers acquire the item again.
+ *
+ * @param changed - 1 if the new version was published.
+ */
+static void
+release_writer(int fid, int changed)
+{
+	pthread_rwlock_wrlock(&g_inventory.ilock[fid]);
+	g_inventory.writing[fid] = 0;
+	pthread_rwlock_unlock(&g_inventory.ilock[fid]);
+	if (changed)
+		record_change(fid, CHANGE_MODIFY, NULL);
 }
 
 int 
 server_rename_service(int sockfd, struct svc_req *req)
 {
-	;
+	struct svc_resp resp;
+	char clip[IP_ADDRESS_LEN];
+	char fname[FILE_NAME_LEN + 1] = {0};
+	char new_fname[FILE_NAME_LEN + 1] = {0};
+	char fpath[FS_PATH_MAX_LEN];
+	char new_fpath[FS_PATH_MAX_LEN];
+	int *fid = NULL;
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_RENAME);
+	strncpy(fname, req->fname, FILE_NAME_LEN);
+	strncpy(new_fname, req->new_fname, FILE_NAME_LEN);
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+	timestamp(MSEC, "[server_rename_service] [client (%d)] %s -> %s", sockfd, fname, new_fname);
+
+	if ('\0' == new_fname[0] || NULL != strchr(new_fname, '/') || 0 == strcmp(fname, new_fname)) {
+		set_resp_code(&resp, RESP_INVALID_NAME);
+		goto send_resp;
+	}
+	enum RESPONSE_CODE code = acquire_item(fname, clip, 0, &fid);
+	if (RESP_OK != code) {
+		set_resp_code(&resp, code);
+		goto send_resp;
+	}
+	// 새 이름 선점. fid는 두 이름이 공유한다.
+	int result = set(g_inventory.nametb, new_fname, (void *)fid, 0);
+	if (result < 0) {
+		// -1: The name is taken. -2: malloc failed.
+		timestamp(MSEC, "[server_rename_service] [set] %d (%s)", result, new_fname);
+		release_item(*fid, ITEM_STAT_AVAILABLE);
+		set_resp_code(&resp, (-1 == result) ? RESP_DUPLICATED : RESP_OUT_OF_MEMORY);
+		goto send_resp;
+	}
+
+	snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s", clip, fname);
+	snprintf(new_fpath, FS_PATH_MAX_LEN, "%s/%s", clip, new_fname);
+	result = rename_file(fpath, new_fpath);
+	if (result < 0) {
+		timestamp(MSEC, "[server_rename_service] %s %s", futil_errstr(result), fpath);
+		rm_item(g_inventory.nametb, new_fname);
+		release_item(*fid, ITEM_STAT_AVAILABLE);
+		set_resp_code(&resp, RESP_NO_SUCH_FILE);
+		goto send_resp;
+	}
+	rm_item(g_inventory.nametb, fname);
+	record_change(*fid, CHANGE_REMOVE, fname);
+	invalidate_item_caches(*fid);
+
+	touch_item(*fid, new_fname, NULL);
+	release_item(*fid, ITEM_STAT_AVAILABLE);
+	set_resp_code(&resp, RESP_OK);
+
+send_resp:
+	if (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "[server_rename_service] [send]");
+		return -1;
+	}
+	return 0;
 }
 
 int 
 server_delete_service(int sockfd, struct svc_req *req)
 {
-	;
+	struct svc_resp resp;
+	char clip[IP_ADDRESS_LEN];
+	char fname[FILE_NAME_LEN + 1] = {0};
+	char fpath[FS_PATH_MAX_LEN];
+	int *fid = NULL;
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_DELETE);
+	strncpy(fname, req->fname, FILE_NAME_LEN);
+	get_client_ipaddr(sockfd, clip, IP_ADDRESS_LEN);
+	timestamp(MSEC, "[server_delete_service] [client (%d)] %s", sockfd, fname);
+
+	enum RESPONSE_CODE code = acquire_item(fname, clip, 0, &fid);
+	if (RESP_OK != code) {
+		set_resp_code(&resp, code);
+		goto send_resp;
+	}
+	release_item(*fid, ITEM_STAT_DELETING);
+
+	// Downloads holding the file keep reading it until they finish.
+	snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s", clip, fname);
+	int result = release_item_file(*fid, fpath);
+	if (result < 0) {
+		timestamp(MSEC, "[server_delete_service] %s %s", futil_errstr(result), fpath);
+		release_item(*fid, ITEM_STAT_AVAILABLE);
+		set_resp_code(&resp, RESP_NO_SUCH_FILE);
+		goto send_resp;
+	}
+	invalidate_item_caches(*fid);
+	rollback_inventory(fid, fname);
+	set_resp_code(&resp, RESP_OK);
+
+send_resp:
+	if (send_stream(sockfd, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "[server_delete_service] [send]");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send the signature of each block of the base.
+ *
+ * @return - Success: 0, Error: -1
+ */
+static int
+send_delta_signatures(int clsock, struct item_reader *base, int64_t base_len, size_t bs)
+{
+	struct delta_sig sigs[DELTA_SIG_BATCH];
+	size_t nsigs = 0;
+	for (int64_t off = 0; off < base_len; off += bs) {
+		int64_t len = (base_len - off < (int64_t)bs) ? base_len - off : (int64_t)bs;
+		if (pread_item(base, t_iobuf, len, off) < 0)
+			return -1;
+		delta_signature((uint8_t *)t_iobuf, len, &sigs[nsigs]);
+		delta_sig_hton(&sigs[nsigs]);
+		if (++nsigs == DELTA_SIG_BATCH || off + len >= base_len) {
+			if (send_stream(clsock, sigs, nsigs * sizeof(struct delta_sig)) < 0)
+				return -1;
+			nsigs = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Copy [offset, offset + len) of the base to fd at dst. Plain files are
+ * copied in the kernel, which may share the extents on some filesystems.
+ *
+ * @return - Success: 0, Error: -1
+ */
+static int
+copy_base_range(struct item_reader *base, int fd, int64_t offset, int64_t len, int64_t dst)
+{
+	if (base->fd >= 0 && !base->packed) {
+		int64_t n = copy_file_data(base->fd, offset, fd, dst, len);
+		offset += n;
+		dst += n;
+		len -= n;
+	}
+	while (len > 0) {
+		int64_t n = (len < SVC_IOBUF_SIZE) ? len : SVC_IOBUF_SIZE;
+		if (pread_item(base, t_iobuf, n, offset) < 0)
+			return -1;
+		if (write_file_at(fd, t_iobuf, n, dst) < 0)
+			return -1;
+		offset += n;
+		dst += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Replace the file with a new version made of the blocks of the current
+ * version(base) and the data sent by the client. The new version is built
+ * in a temporary file and published as a whole, so the base is kept if the
+ * upload fails. The base stays available to the downloads meanwhile.
+ */
+int
+server_delta_upload_service(int clsock, struct svc_req *req)
+{
+	struct svc_resp resp;
+	struct item_reader base;
+	struct delta_op op;
+	char clip[IP_ADDRESS_LEN];
+	char fname[FILE_NAME_LEN + 1] = {0};
+	char fpath[FS_PATH_MAX_LEN];
+	char tmppath[FS_PATH_MAX_LEN];
+	char digest[SHA256_HEX_LEN] = {0};
+	char hex[SHA256_HEX_LEN];
+	int *fid = NULL;
+	int fd = -1;
+	int64_t flen = strtoll(req->flen, NULL, 10);
+	int64_t written = 0;
+	int64_t copied = 0;
+
+	memset(&resp, 0x00, sizeof(struct svc_resp));
+	set_resp_type(&resp, SVC_UPLOAD_DELTA);
+	strncpy(fname, req->fname, FILE_NAME_LEN);
+	get_client_ipaddr(clsock, clip, IP_ADDRESS_LEN);
+	timestamp(MSEC, "[server_delta_upload_service] [client (%d)] %s %ldB", clsock, fname, flen);
+
+	if (flen < 0) {
+		set_resp_code(&resp, RESP_INVALID_OFFSET);
+		goto send_resp;
+	}
+	enum RESPONSE_CODE code = acquire_item(fname, clip, 1, &fid);
+	if (RESP_OK != code) {
+		set_resp_code(&resp, code);
+		goto send_resp;
+	}
+	struct inven_item *item = &g_inventory.items[*fid];
+	int64_t base_len = strtoll(item->flen, NULL, 10);
+	size_t bs = delta_block_size(base_len);
+	size_t nblocks = (base_len + bs - 1) / bs;
+	snprintf(fpath, FS_PATH_MAX_LEN, "%s/%s", clip, fname);
+	if (open_item_reader(*fid, fpath, &base) < 0) {
+		release_writer(*fid, 0);
+		set_resp_code(&resp, RESP_NO_SUCH_FILE);
+		goto send_resp;
+	}
+	fd = open_item_file(clsock, fname, flen, clip, fpath, tmppath);
+	if (fd < 0) {
+		close_item_reader(&base);
+		release_writer(*fid, 0);
+		set_resp_code(&resp, RESP_OUT_OF_DISK);
+		goto send_resp;
+	}
+
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%ld", base_len);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%zu", bs);
+	if (send_stream(clsock, &resp, sizeof(struct svc_resp)) < 0
+			|| send_delta_signatures(clsock, &base, base_len, bs) < 0) {
+		timestamp(MSEC, "[server_delta_upload_service] [client (%d)] Failed to send the signatures.", clsock);
+		goto tx_failed;
+	}
+	begin_frontier(*fid, fd, flen);
+
+	// Rebuild the new version in order.
+	while (1) {
+		if (recv(clsock, &op, sizeof(op), MSG_WAITALL) != sizeof(op))
+			goto tx_failed;
+		delta_op_ntoh(&op);
+		if (DELTA_OP_END == op.type)
+			break;
+		if (DELTA_OP_COPY == op.type && op.count > 0 && op.arg < nblocks
+				&& op.count <= nblocks - op.arg) {
+			int64_t offset = op.arg * bs;
+			int64_t len = (int64_t)op.count * bs;
+			if (len > base_len - offset)
+				len = base_len - offset;
+			if (len > flen - written)
+				goto invalid_op;
+			if (copy_base_range(&base, fd, offset, len, written) < 0) {
+				timestamp(MSEC, "[server_delta_upload_service] [client (%d)] Failed to copy the base.", clsock);
+				goto disk_failure;
+			}
+			written += len;
+			copied += len;
+		} else if (DELTA_OP_DATA == op.type && op.arg > 0 && op.arg <= DELTA_DATA_MAX) {
+			if ((int64_t)op.arg > flen - written)
+				goto invalid_op;
+			int64_t rlen = recv_file_data(clsock, fd, written, op.arg, COMPRESS_NONE);
+			if (ERR_SOCKUTIL_WRITE_FAILED == rlen)
+				goto disk_failure;
+			if (rlen < 0)
+				goto tx_failed;
+			written += op.arg;
+		} else {
+			goto invalid_op;
+		}
+		advance_frontier(*fid, written);
+	}
+	if (recv(clsock, digest, SHA256_HEX_LEN - 1, MSG_WAITALL) != SHA256_HEX_LEN - 1)
+		goto tx_failed;
+	if ((int64_t)op.arg != flen || written != flen)
+		goto invalid_op;
+	close_item_reader(&base);
+
+	// The client's digest proves the reconstruction. The blob store reuses it.
+	if (hash_item_file(fd, hex) < 0 || strcmp(hex, digest)) {
+		timestamp(MSEC, "[server_delta_upload_service] [client (%d)] Checksum mismatch.", clsock);
+		discard_temp_file(fd, tmppath);
+		end_frontier(*fid, FRONTIER_ABORTED);
+		release_writer(*fid, 0);
+		set_resp_code(&resp, RESP_CHECKSUM_MISMATCH);
+		goto send_resp;
+	}
+	enum DURABILITY durability = req_durability(req);
+	if (publish_item_file(*fid, fd, tmppath, fpath, durability, hex) < 0) {
+		// The new version is discarded. The base stays as it was unless
+		// it was replaced before the flush failed.
+		timestamp(MSEC, "[client (%d)] [publish_item_file] Failed to replace the file.", clsock);
+		end_frontier(*fid, FRONTIER_ABORTED);
+		if (0 == access(fpath, F_OK)) {
+			release_writer(*fid, 0);
+		} else {
+			release_item_file(*fid, fpath);
+			invalidate_item_caches(*fid);
+			release_writer(*fid, 0);
+			rollback_inventory(fid, fname);
+		}
+		set_resp_code(&resp, RESP_OUT_OF_DISK);
+		goto send_resp;
+	}
+
+	char flenstr[REQ_FLEN_LEN];
+	snprintf(flenstr, REQ_FLEN_LEN, "%ld", flen);
+	touch_item(*fid, NULL, flenstr);
+	invalidate_item_caches(*fid);
+	release_writer(*fid, 1);
+	end_frontier(*fid, FRONTIER_COMMITTED);
+	timestamp(MSEC, "[server_delta_upload_service] [client (%d)] Replaced %s. (copied %ldB, received %ldB)",
+			clsock, fname, copied, flen - copied);
+	set_resp_code(&resp, RESP_OK);
+	snprintf(resp.flen, REQ_FLEN_LEN, "%ld", flen);
+	snprintf(resp.offset, REQ_FLEN_LEN, "%ld", copied);
+	goto send_resp;
+
+invalid_op:
+	// The rest of the stream can't be parsed. Drop it with the connection.
+	timestamp(MSEC, "[server_delta_upload_service] [client (%d)] Invalid op %u (%u, %lu) at %ldB.",
+			clsock, op.type, op.count, op.arg, written);
+	shutdown(clsock, SHUT_RD);
+	set_resp_code(&resp, RESP_INVALID_OFFSET);
+	goto abort_delta;
+disk_failure:
+	set_resp_code(&resp, RESP_OUT_OF_DISK);
+abort_delta:
+	close_item_reader(&base);
+	discard_temp_file(fd, tmppath);
+	end_frontier(*fid, FRONTIER_ABORTED);
+	release_writer(*fid, 0);
+send_resp:
+	if (send_stream(clsock, &resp, sizeof(struct svc_resp)) < 0) {
+		timestamp(MSEC, "[server_delta_upload_service] [send]");
+		return -1;
+	}
+	return 0;
+
+tx_failed:
+	close_item_reader(&base);
+	discard_temp_file(fd, tmppath);
+	end_frontier(*fid, FRONTIER_ABORTED);
+	release_writer(*fid, 0);
+	return -1;
 }
@@ -5,11 +5,21 @@ declare -A files
 files=( ["../module/queue.c"]="queue.unittest" \
 	["../module/list.c"]="list.unittest"\
 	["../module/hashmap.c"]="hashmap.unittest"\
+	["../module/fastcdc.c"]="fastcdc.unittest"\
+	["../module/chunkstore.c"]="chunkstore.unittest"\
+	["../module/contcache.c"]="contcache.unittest"\
+	["../module/fdcache.c"]="fdcache.unittest"\
+	["../module/delta.c"]="delta.unittest"\
+	["../module/compress.c"]="compress.unittest"\
+	["../module/changelog.c"]="changelog.unittest"\
+	["../module/packfile.c"]="packfile.unittest"\
 )
 
 COLUMN=48
 DIV_LINE=$(printf '=%.0s' $(seq 1 $COLUMN))
 
+failed=0
+
 # Compile and run each unit test.
 for src in "${!files[@]}"; do
     out=${files[$src]}
@@ -17,12 +27,15 @@ for src in "${!files[@]}"; do
     if [ $? -eq 0 ]; then
 		echo "$DIV_LINE"
         echo "$out"
-        ./"$out" $1
+        ./"$out" $1 | tee "$out.log"
+        grep -qE "FAILED|ERROR|UNDEFINED" "$out.log" && failed=1
     else
         echo "Failed to compile $src"
+        failed=1
     fi
 done
 
 echo
 
-rm *.unittest
+rm -f *.unittest *.unittest.log
+exit $failed